@@ -432,6 +432,12 @@ class Application (object):
         self._apply_pressure_mapping_settings()
         self._apply_button_mapping_settings()
         self._apply_autosave_settings()
+        self._apply_tile_compression_settings()
+        self._apply_tile_swap_settings()
+        self._apply_undo_history_settings()
+        self._apply_tile_dedup_settings()
+        self._apply_threaded_painting_settings()
+        self._apply_mipmap_sampling_settings()
         self.preferences_window.update_ui()
 
     def load_settings(self):
@@ -461,6 +467,7 @@ class Application (object):
             'saving.scrap_prefix': scrappre,
             'input.device_mode': 'screen',
             'input.global_pressure_mapping': [(0.0, 1.0), (1.0, 0.0)],
+            'input.motion_smoothing': 0.0,
             'view.default_zoom': 1.0,
             'view.real_alpha_checks': True,
             'ui.hide_menubar_in_fullscreen': True,
@@ -490,6 +497,29 @@ class Application (object):
             'document.autosave_backups': True,
             'document.autosave_interval': 10,
 
+            # Compress tiles in memory which have gone unused for this
+            # many seconds, once tiles use more than the budget in MiB.
+            'memory.tile_compression_idle_time': 120,
+            'memory.tile_compression_budget': 512,
+            # Swap out the least recently used tiles once tiles use more
+            # than this many MiB, compressed or not. 0 disables swapping.
+            'memory.tile_swap_budget': 4096,
+            # Compress the undo history's older tiles, and spill the
+            # oldest to disk once the history uses more than this many
+            # MiB. 0 means no limit.
+            'memory.undo_history_budget': 1024,
+            # Let identical tiles in different layers or snapshots
+            # share memory.
+            'memory.tile_dedup': True,
+            # Paint brushwork on a worker thread, so that slow brushes
+            # don't hold up input handling.
+            'ui.threaded_painting': False,
+            # Smudge samples bigger than this many pixels in radius are
+            # taken from mipmaps, approximately. 0 disables this. Off by
+            # default because it changes smudging results slightly;
+            # 64 speeds up big smudge brushes a lot.
+            'ui.mipmap_sampling_radius': 0,
+
             'display.colorspace': "srgb",
             # sRGB is a good default even for OS X since v10.6 / Snow
             # Leopard: http://support.apple.com/en-us/HT3712.
@@ -615,6 +645,41 @@ class Application (object):
         model.autosave_backups = active
         model.autosave_interval = interval
 
+    def _apply_tile_compression_settings(self):
+        idle_time = self.preferences["memory.tile_compression_idle_time"]
+        budget = self.preferences["memory.tile_compression_budget"]
+        logger.debug(
+            "Applying tile compression settings: idle_time=%r, budget=%r",
+            idle_time, budget,
+        )
+        lib.document.set_tile_compression(idle_time, budget)
+
+    def _apply_tile_swap_settings(self):
+        budget = self.preferences["memory.tile_swap_budget"]
+        logger.debug("Applying tile swap settings: budget=%r", budget)
+        lib.document.set_tile_swap(budget)
+
+    def _apply_undo_history_settings(self):
+        budget = self.preferences["memory.undo_history_budget"]
+        logger.debug("Applying undo history settings: budget=%r", budget)
+        self.doc.model.command_stack.memory_budget = budget
+
+    def _apply_tile_dedup_settings(self):
+        enabled = self.preferences["memory.tile_dedup"]
+        logger.debug("Applying tile dedup settings: enabled=%r", enabled)
+        lib.document.set_tile_dedup(enabled)
+
+    def _apply_threaded_painting_settings(self):
+        enabled = self.preferences["ui.threaded_painting"]
+        logger.debug("Applying threaded painting settings: enabled=%r",
+                     enabled)
+        self.doc.model.threaded_painting = enabled
+
+    def _apply_mipmap_sampling_settings(self):
+        radius = self.preferences["ui.mipmap_sampling_radius"]
+        logger.debug("Applying mipmap sampling settings: radius=%r", radius)
+        lib.document.set_mipmap_sampling(radius)
+
     def save_gui_config(self):
         Gtk.AccelMap.save(join(self.user_confpath, 'accelmap.conf'))
         workspace = self.workspace
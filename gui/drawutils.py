@@ -160,9 +160,9 @@ def render_brush_preview_pixbuf(brushinfo, max_edge_tiles=4):
         brush.reset()
         # Curve
         shape = _variable_pressure_scribble(width, height, size_in_tiles)
+        events = np.array(list(shape), dtype='float64')
         surface.begin_atomic()
-        for dt, x, y, p, xt, yt in shape:
-            brush.stroke_to(surface.backend, x, y, p, xt, yt, dt)
+        brush.stroke_to_many(surface.backend, events)
         surface.end_atomic()
         # Check rendered size
         tposs = surface.tiledict.keys()
@@ -14,7 +14,6 @@ from __future__ import division, print_function
 import math
 from lib.helpers import clamp
 import logging
-from collections import deque
 
 from gettext import gettext as _
 
@@ -25,7 +24,7 @@ from gi.repository import GLib
 import numpy as np
 
 import gui.mode
-from drawutils import spline_4p
+from lib import mypaintlib
 
 logger = logging.getLogger(__name__)
 
@@ -65,6 +64,12 @@ class FreehandMode (gui.mode.BrushworkModeMixin,
 
     MOTION_QUEUE_PRIORITY = GLib.PRIORITY_DEFAULT_IDLE
 
+    # Queued events are fed to the brush engine in batches of up to
+    # this many. Long strokes are only split between batches, so
+    # keep it modest.
+
+    MOTION_QUEUE_BATCH_SIZE = 32
+
     # The Right Thing To Do generally is to spend as little time as
     # possible directly handling each event received. Disconnecting
     # stroke rendering from event processing buys the user the ability
@@ -95,38 +100,26 @@ class FreehandMode (gui.mode.BrushworkModeMixin,
     class _DrawingState (object):
         """Per-canvas drawing state
 
-        Various kinds of queue for raw data capture or interpolation of
-        pressure and tilt.
+        Holds the queue for raw data capture, which also interpolates
+        pressure and tilt (see lib/motionqueue.hpp).
         """
 
-        def __init__(self):
+        def __init__(self, smoothing=0.0):
             object.__init__(self)
 
             self.last_event_had_pressure = False
 
-            # Raw data which was delivered with an identical timestamp
-            # to the previous one.  Happens on Windows due to differing
-            # clock granularities (at least, under GTK2).
-            self._zero_dtime_motions = []
-
             # Motion Queue
 
-            # Combined, cleaned-up motion data queued ready for
-            # interpolation of missing pressures and tilts, then
-            # subsequent rendering. Using a queue makes rendering
-            # independent of data gathering.
-            self.motion_queue = deque()
+            # Combined, cleaned-up motion data with missing pressures
+            # and tilts interpolated, queued ready for rendering. Using
+            # a queue makes rendering independent of data gathering.
+            # Events with identical timestamps to the previous one,
+            # which happen on Windows due to differing clock
+            # granularities, are cleaned up by the queue too.
+            self.motion_queue = mypaintlib.MotionQueue()
+            self.motion_queue.set_smoothing(smoothing)
             self.motion_processing_cbid = None
-            self._last_queued_event_time = 0
-
-            # Queued Event Handling
-
-            # Pressure and tilt interpolation for events which
-            # don't have pressure or tilt data.
-            self.interp = PressureAndTiltInterpolator()
-
-            # Time of the last-processed event
-            self.last_handled_event_time = 0
 
             # Debugging: number of events procesed each second,
             # average times.
@@ -154,51 +147,16 @@ class FreehandMode (gui.mode.BrushworkModeMixin,
             tilt values have the meaning assigned to them by GDK; if
             ```pressure`` is None, pressure and tilt values will be
             interpolated from surrounding defined values.
-
-            Zero-dtime events are detected and cleaned up here.
             """
             time, x, y, pressure, xtilt, ytilt = event_data
-            if time < self._last_queued_event_time:
+            if None in (pressure, xtilt, ytilt):
+                pressure = xtilt = ytilt = float("nan")
+            in_order = self.motion_queue.queue_motion(
+                time, x, y,
+                pressure, xtilt, ytilt,
+            )
+            if not in_order:
                 logger.warning('Time is running backwards! Corrected.')
-                time = self._last_queued_event_time
-
-            if time == self._last_queued_event_time:
-                # On Windows, GTK timestamps have a resolution around
-                # 15ms, but tablet events arrive every 8ms.
-                # https://gna.org/bugs/index.php?16569
-                zdata = (x, y, pressure, xtilt, ytilt)
-                self._zero_dtime_motions.append(zdata)
-            else:
-                # Queue any previous events that had identical
-                # timestamps, linearly interpolating their times.
-                if self._zero_dtime_motions:
-                    dtime = time - self._last_queued_event_time
-                    if dtime > 100:
-                        # Really old events; don't associate them with
-                        # the new one.
-                        zt = time - 100.0
-                        interval = 100.0
-                    else:
-                        zt = self._last_queued_event_time
-                        interval = dtime
-                    step = interval / (len(self._zero_dtime_motions) + 1)
-                    for zx, zy, zp, zxt, zyt in self._zero_dtime_motions:
-                        zt += step
-                        zevent_data = (zt, zx, zy, zp, zxt, zyt)
-                        self.motion_queue.append(zevent_data)
-                    # Reset the backlog buffer
-                    self._zero_dtime_motions = []
-                # Queue this event too
-                self.motion_queue.append(event_data)
-                # Update the timestamp used above
-                self._last_queued_event_time = time
-
-        def next_processing_events(self):
-            """Fetches zero or more events to process from the queue"""
-            if len(self.motion_queue) > 0:
-                event = self.motion_queue.popleft()
-                for ievent in self.interp.feed(*event):
-                    yield ievent
 
     def _reset_drawing_state(self):
         """Resets all per-TDW drawing state"""
@@ -207,7 +165,11 @@ class FreehandMode (gui.mode.BrushworkModeMixin,
     def _get_drawing_state(self, tdw):
         drawstate = self._drawing_state.get(tdw, None)
         if drawstate is None:
-            drawstate = self._DrawingState()
+            smoothing = 0.0
+            if tdw.app is not None:
+                prefs = tdw.app.preferences
+                smoothing = prefs.get("input.motion_smoothing", 0.0)
+            drawstate = self._DrawingState(smoothing)
             self._drawing_state[tdw] = drawstate
         return drawstate
 
@@ -470,69 +432,68 @@ class FreehandMode (gui.mode.BrushworkModeMixin,
     ## Motion queue processing
 
     def _motion_queue_idle_cb(self, tdw):
-        """Idle callback; processes each queued event"""
+        """Idle callback; processes a batch of queued events"""
         drawstate = self._get_drawing_state(tdw)
         # Stop if asked to stop
         if drawstate.motion_processing_cbid is None:
-            drawstate.motion_queue = deque()
+            drawstate.motion_queue.discard()
             return False
         # Forward one or more motion events to the canvas
-        for event in drawstate.next_processing_events():
-            self._process_queued_event(tdw, event)
+        events = drawstate.motion_queue.take_stroke_events(
+            self.MOTION_QUEUE_BATCH_SIZE,
+        )
+        self._process_queued_events(tdw, events)
         # Stop if the queue is now empty
-        if len(drawstate.motion_queue) == 0:
+        if drawstate.motion_queue.get_size() == 0:
             drawstate.motion_processing_cbid = None
             return False
         # Otherwise, continue being invoked
         return True
 
-    def _process_queued_event(self, tdw, event_data):
-        """Process one motion event from the motion queue"""
+    def _process_queued_events(self, tdw, events):
+        """Process a batch of motion events from the motion queue
+
+        :param tdw: The TiledDrawWidget the events are for
+        :param numpy.ndarray events: Nx6 array of (dtime, x, y,
+          pressure, xtilt, ytilt) rows, ready for the brush engine
+
+        """
+        if len(events) == 0:
+            return
         drawstate = self._get_drawing_state(tdw)
-        time, x, y, pressure, xtilt, ytilt = event_data
         model = tdw.doc
 
-        # Calculate time delta for the brush engine
-        last_event_time = drawstate.last_handled_event_time
-        drawstate.last_handled_event_time = time
-        if not last_event_time:
-            return
-        dtime = (time - last_event_time) / 1000.0
         if self._debug:
             cavg = drawstate.avgtime
-            if cavg is not None:
-                tavg, nevents = cavg
-                nevents += 1
-                tavg += (dtime - tavg) / nevents
-            else:
-                tavg = dtime
-                nevents = 1
-            if ((nevents * tavg) > 1.0) and nevents > 20:
-                logger.debug("Processing at %d events/s (t_avg=%0.3fs)",
-                             nevents, tavg)
-                drawstate.avgtime = None
-            else:
-                drawstate.avgtime = (tavg, nevents)
+            for dtime in events[:, 0]:
+                if cavg is not None:
+                    tavg, nevents = cavg
+                    nevents += 1
+                    tavg += (dtime - tavg) / nevents
+                else:
+                    tavg = dtime
+                    nevents = 1
+                if ((nevents * tavg) > 1.0) and nevents > 20:
+                    logger.debug("Processing at %d events/s (t_avg=%0.3fs)",
+                                 nevents, tavg)
+                    cavg = None
+                else:
+                    cavg = (tavg, nevents)
+            drawstate.avgtime = cavg
 
         current_layer = model._layers.current
         if not current_layer.get_paintable():
             return
 
-        # Feed data to the brush engine.  Pressure and tilt cleanup
-        # needs to be done here to catch all forwarded data after the
-        # earlier interpolations. The interpolation method used for
-        # filling in missing axis data is known to generate
-        # OverflowErrors for legitimate but pathological input streams.
-        # https://github.com/mypaint/mypaint/issues/344
-
-        pressure = clamp(pressure, 0.0, 1.0)
-        xtilt = clamp(xtilt, -1.0, 1.0)
-        ytilt = clamp(ytilt, -1.0, 1.0)
-        self.stroke_to(model, dtime, x, y, pressure, xtilt, ytilt)
+        # Feed data to the brush engine. Pressure and tilt have been
+        # interpolated and clamped by the motion queue already.
+        self.stroke_to_many(model, events)
 
         # Update the TDW's idea of where we last painted
         # FIXME: this should live in the model, not the view
-        if pressure:
+        painted = np.flatnonzero(events[:, 3])
+        if len(painted):
+            dtime, x, y = events[painted[-1], :3]
             tdw.set_last_painting_pos((x, y))
 
     ## Mode options
@@ -578,6 +539,9 @@ class PressureAndTiltInterpolator (object):
     directions. These transitions clear out just enough history to avoid
     hook-off and lead-in artefacts.
 
+    This wraps the native interpolator which the motion queue uses
+    (see lib/motionqueue.hpp), taking None for missing values.
+
     >>> interp = PressureAndTiltInterpolator()
     >>> raw_data = interp._TEST_DATA
     >>> any([t for t in raw_data if None in t[3:]])
@@ -643,90 +607,7 @@ class PressureAndTiltInterpolator (object):
     def __init__(self):
         """Instantiate with a clear internal state"""
         object.__init__(self)
-        # Events with all axis data present, forming control points
-        self._pt0_prev = None
-        self._pt0 = None
-        self._pt1 = None
-        self._pt1_next = None
-        # Null-axis event sequences
-        self._np = []
-        self._np_next = []
-
-    # Internals:
-
-    def _clear(self):
-        """Reset to the initial clean state"""
-        self._pt0_prev = None
-        self._pt0 = None
-        self._pt1 = None
-        self._pt1_next = None
-        self._np = []
-        self._np_next = []
-
-    def _step(self):
-        """Step the interpolation parameters forward"""
-        self._pt0_prev = self._pt0
-        self._pt0 = self._pt1
-        self._pt1 = self._pt1_next
-        self._pt1_next = None
-        self._np = self._np_next
-        self._np_next = []
-
-    def _interpolate_p0_p1(self):
-        """Interpolate between p0 and p1, but do not step or clear"""
-        pt0p, pt0 = self._pt0_prev, self._pt0
-        pt1, pt1n = self._pt1, self._pt1_next
-        can_interp = (pt0 is not None and pt1 is not None and
-                      len(self._np) > 0)
-        if can_interp:
-            if pt0p is None:
-                pt0p = pt0
-            if pt1n is None:
-                pt1n = pt1
-            t0 = pt0[0]
-            t1 = pt1[0]
-            dt = t1 - t0
-            can_interp = dt > 0
-        if can_interp:
-            for event in self._np:
-                t, x, y = event[0:3]
-                p, xt, yt = spline_4p(
-                    (t - t0) / dt,
-                    np.array(pt0p[3:]), np.array(pt0[3:]),
-                    np.array(pt1[3:]), np.array(pt1n[3:])
-                )
-                yield (t, x, y, p, xt, yt)
-        if pt1 is not None:
-            yield pt1
-
-    def _interpolate_and_step(self):
-        """Internal: interpolate & step forward or clear"""
-        for ievent in self._interpolate_p0_p1():
-            yield ievent
-        if ((self._pt1_next[3] > 0.0) and
-                (self._pt1 is not None) and
-                (self._pt1[3] <= 0.0)):
-            # Transitions from zero to nonzero pressure
-            # Clear history to avoid artefacts
-            self._pt0_prev = None   # ignore the current pt0
-            self._pt0 = self._pt1
-            self._pt1 = self._pt1_next
-            self._pt1_next = None
-            self._np = []           # drop the buffer we've built up too
-            self._np_next = []
-        elif ((self._pt1_next[3] <= 0.0) and
-              (self._pt1 is not None) and (self._pt1[3] > 0.0)):
-            # Transitions from nonzero to zero pressure
-            # Tail off neatly by doubling the zero-pressure event
-            self._step()
-            self._pt1_next = self._pt1
-            for ievent in self._interpolate_p0_p1():
-                yield ievent
-            # Then clear history
-            self._clear()
-        else:
-            # Normal forward of control points and event buffers
-            self._step()
+        self._interp = mypaintlib.PressureAndTiltInterpolator()
 
     # Public methods:
 
@@ -746,11 +627,10 @@ class PressureAndTiltInterpolator (object):
         Event tuples have the form (TIME, X, Y, PRESSURE, XTILT, YTILT).
         """
         if None in (pressure, xtilt, ytilt):
-            self._np_next.append((time, x, y, pressure, xtilt, ytilt))
-        else:
-            self._pt1_next = (time, x, y, pressure, xtilt, ytilt)
-            for t, x, y, p, xt, yt in self._interpolate_and_step():
-                yield (t, x, y, p, xt, yt)
+            pressure = xtilt = ytilt = float("nan")
+        if self._interp.feed(time, x, y, pressure, xtilt, ytilt):
+            for event in self._interp.take_events():
+                yield tuple(float(v) for v in event)
 
 
 ## Module tests
@@ -473,6 +473,7 @@ class InkingMode (gui.mode.ScrollableModeMixin,
         steps_d = dist_p1_p2 / self.INTERPOLATION_MAX_SLICE_DISTANCE
         steps = math.ceil(min(self.INTERPOLATION_MAX_SLICES,
                               max(2, steps_t, steps_d)))
+        events = np.empty((int(steps) + 1, 6), dtype='float64')
         for i in xrange(int(steps) + 1):
             t = i / steps
             point = gui.drawutils.spline_4p(t, p_1, p0, p1, p2)
@@ -482,11 +483,9 @@ class InkingMode (gui.mode.ScrollableModeMixin,
             ytilt = lib.helpers.clamp(ytilt, -1.0, 1.0)
             t_abs = max(last_t_abs, t_abs)
             dtime = t_abs - last_t_abs
-            self.stroke_to(
-                model, dtime, x, y, pressure, xtilt, ytilt,
-                auto_split=False,
-            )
+            events[i] = (dtime, x, y, pressure, xtilt, ytilt)
             last_t_abs = t_abs
+        self.stroke_to_many(model, events, auto_split=False)
         state["t_abs"] = last_t_abs
 
     def _queue_task(self, callback, *args, **kwargs):
@@ -771,6 +771,33 @@ class BrushworkModeMixin (InteractionMode):
         cmd.stroke_to(dtime, x, y, pressure, xtilt, ytilt)
         cmd.__last_pos = (x, y, xtilt, ytilt)
 
+    def stroke_to_many(self, model, events, auto_split=True):
+        """Feeds many stroke positions to the brush engine at once
+
+        :param lib.document.Document model: model on which to paint
+        :param numpy.ndarray events: Nx6 float64 array of
+          (dtime, x, y, pressure, xtilt, ytilt) rows
+        :param bool auto_split: Split ongoing brushwork if due
+
+        Like calling `stroke_to()` for each event, except that any due
+        split happens only before the whole batch.
+        """
+        if len(events) == 0:
+            return
+        cmd = self.__active_brushwork.get(model, None)
+        desc0 = None
+        if auto_split and cmd and cmd.split_due:
+            desc0 = cmd.description  # retain for the next cmd
+            self.brushwork_commit(model, abrupt=False)
+            assert model not in self.__active_brushwork
+            cmd = None
+        if not cmd:
+            self.brushwork_begin(model, description=desc0, abrupt=False)
+            cmd = self.__active_brushwork[model]
+        cmd.stroke_to_many(events)
+        dtime, x, y, pressure, xtilt, ytilt = events[-1]
+        cmd.__last_pos = (x, y, xtilt, ytilt)
+
     def leave(self, **kwds):
         """Leave mode, committing outstanding brushwork as necessary
 
@@ -165,9 +165,44 @@ class TiledDrawWidget (Gtk.EventBox):
 
         forwarder = self._announce_transformation_updated
         self.renderer.transformation_updated += forwarder
+        self._tile_prefetch_src_id = None
 
     def _announce_transformation_updated(self, *args):
         self.transformation_updated()
+        self._queue_tile_prefetch()
+
+    def _queue_tile_prefetch(self):
+        """Queues a prefetch of the tiles in and around the view"""
+        if self._tile_prefetch_src_id is not None:
+            return
+        self._tile_prefetch_src_id = GLib.idle_add(
+            self._tile_prefetch_idle_cb,
+            priority = GLib.PRIORITY_LOW,
+        )
+
+    def _tile_prefetch_idle_cb(self):
+        """Idle callback: prefetch the tiles the view is likely to need
+
+        Swapped out tiles are paged in for the visible area plus a
+        margin of half a view on each side, to make panning smoother.
+        Both mipmap levels the renderer might pick are covered.
+
+        """
+        self._tile_prefetch_src_id = None
+        if not self.get_realized():
+            return False
+        x, y, w, h = helpers.rotated_rectangle_bbox(
+            self.get_corners_model_coords(),
+        )
+        bbox = (x - w // 2, y - h // 2, w * 2, h * 2)
+        zoom_out = log(1 / self.scale, 2)
+        levels = set([
+            max(0, int(floor(zoom_out))),
+            max(0, int(ceil(zoom_out))),
+        ])
+        for level in levels:
+            tiledsurface.prefetch_tiles(bbox, mipmap_level=level)
+        return False
 
     @event
     def transformation_updated(self):
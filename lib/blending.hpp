@@ -38,16 +38,17 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeSourceOver>
     // Partial specialization for normal painting layers (svg:src-over),
     // working in premultiplied alpha for speed.
   public:
-    inline void operator() (const fix15_short_t * const src,
+    template <class SRC>
+    inline void operator() (const SRC * const src,
                             fix15_short_t * const dst,
                             const fix15_short_t opac) const
     {
         for (unsigned int i=0; i<BUFSIZE; i+=4) {
-            const fix15_t Sa = fix15_mul(src[i+3], opac);
+            const fix15_t Sa = fix15_mul(fix15_src(src[i+3]), opac);
             const fix15_t one_minus_Sa = fix15_one - Sa;
-            dst[i+0] = fix15_sumprods(src[i], opac, one_minus_Sa, dst[i]);
-            dst[i+1] = fix15_sumprods(src[i+1], opac, one_minus_Sa, dst[i+1]);
-            dst[i+2] = fix15_sumprods(src[i+2], opac, one_minus_Sa, dst[i+2]);
+            dst[i+0] = fix15_sumprods(fix15_src(src[i]), opac, one_minus_Sa, dst[i]);
+            dst[i+1] = fix15_sumprods(fix15_src(src[i+1]), opac, one_minus_Sa, dst[i+1]);
+            dst[i+2] = fix15_sumprods(fix15_src(src[i+2]), opac, one_minus_Sa, dst[i+2]);
             if (DSTALPHA) {
                 dst[i+3] = fix15_short_clamp(Sa + fix15_mul(dst[i+3], one_minus_Sa));
             }
@@ -61,12 +62,13 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeDestinationIn>
     // Partial specialization for svg:dst-in layers,
     // working in premultiplied alpha for speed.
   public:
-    inline void operator() (const fix15_short_t * const src,
+    template <class SRC>
+    inline void operator() (const SRC * const src,
                             fix15_short_t * const dst,
                             const fix15_short_t opac) const
     {
         for (unsigned int i=0; i<BUFSIZE; i+=4) {
-            const fix15_t Sa = fix15_mul(src[i+3], opac);
+            const fix15_t Sa = fix15_mul(fix15_src(src[i+3]), opac);
             dst[i+0] = fix15_mul(dst[i+0], Sa);
             dst[i+1] = fix15_mul(dst[i+1], Sa);
             dst[i+2] = fix15_mul(dst[i+2], Sa);
@@ -83,12 +85,13 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeDestinationOut
     // Partial specialization for svg:dst-out layers,
     // working in premultiplied alpha for speed.
   public:
-    inline void operator() (const fix15_short_t * const src,
+    template <class SRC>
+    inline void operator() (const SRC * const src,
                             fix15_short_t * const dst,
                             const fix15_short_t opac) const
     {
         for (unsigned int i=0; i<BUFSIZE; i+=4) {
-            const fix15_t one_minus_Sa = fix15_one-fix15_mul(src[i+3], opac);
+            const fix15_t one_minus_Sa = fix15_one-fix15_mul(fix15_src(src[i+3]), opac);
             dst[i+0] = fix15_mul(dst[i+0], one_minus_Sa);
             dst[i+1] = fix15_mul(dst[i+1], one_minus_Sa);
             dst[i+2] = fix15_mul(dst[i+2], one_minus_Sa);
@@ -106,12 +109,13 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeSourceAtop>
     // Partial specialization for svg:src-atop layers,
     // working in premultiplied alpha for speed.
   public:
-    inline void operator() (const fix15_short_t * const src,
+    template <class SRC>
+    inline void operator() (const SRC * const src,
                             fix15_short_t * const dst,
                             const fix15_short_t opac) const
     {
         for (unsigned int i=0; i<BUFSIZE; i+=4) {
-            const fix15_t as = fix15_mul(src[i+3], opac);
+            const fix15_t as = fix15_mul(fix15_src(src[i+3]), opac);
             const fix15_t ab = dst[i+3];
             const fix15_t one_minus_as = fix15_one - as;
             // W3C spec:
@@ -119,11 +123,11 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeSourceAtop>
             // where
             //   src[n] = as*Cs    -- premultiplied
             //   dst[n] = ab*Cb    -- premultiplied
-            dst[i+0] = fix15_sumprods(fix15_mul(src[i+0], opac), ab,
+            dst[i+0] = fix15_sumprods(fix15_mul(fix15_src(src[i+0]), opac), ab,
                                       dst[i+0], one_minus_as);
-            dst[i+1] = fix15_sumprods(fix15_mul(src[i+1], opac), ab,
+            dst[i+1] = fix15_sumprods(fix15_mul(fix15_src(src[i+1]), opac), ab,
                                       dst[i+1], one_minus_as);
-            dst[i+2] = fix15_sumprods(fix15_mul(src[i+2], opac), ab,
+            dst[i+2] = fix15_sumprods(fix15_mul(fix15_src(src[i+2]), opac), ab,
                                       dst[i+2], one_minus_as);
             // W3C spec:
             //   ao = as*ab + ab*(1-as)
@@ -139,12 +143,13 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeDestinationAto
     // Partial specialization for svg:dst-atop layers,
     // working in premultiplied alpha for speed.
   public:
-    inline void operator() (const fix15_short_t * const src,
+    template <class SRC>
+    inline void operator() (const SRC * const src,
                             fix15_short_t * const dst,
                             const fix15_short_t opac) const
     {
         for (unsigned int i=0; i<BUFSIZE; i+=4) {
-            const fix15_t as = fix15_mul(src[i+3], opac);
+            const fix15_t as = fix15_mul(fix15_src(src[i+3]), opac);
             const fix15_t ab = dst[i+3];
             const fix15_t one_minus_ab = fix15_one - ab;
             // W3C Spec:
@@ -152,11 +157,11 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeDestinationAto
             // where
             //   src[n] = as*Cs    -- premultiplied
             //   dst[n] = ab*Cb    -- premultiplied
-            dst[i+0] = fix15_sumprods(fix15_mul(src[i+0], opac), one_minus_ab,
+            dst[i+0] = fix15_sumprods(fix15_mul(fix15_src(src[i+0]), opac), one_minus_ab,
                                       dst[i+0], as);
-            dst[i+1] = fix15_sumprods(fix15_mul(src[i+1], opac), one_minus_ab,
+            dst[i+1] = fix15_sumprods(fix15_mul(fix15_src(src[i+1]), opac), one_minus_ab,
                                       dst[i+1], as);
-            dst[i+2] = fix15_sumprods(fix15_mul(src[i+2], opac), one_minus_ab,
+            dst[i+2] = fix15_sumprods(fix15_mul(fix15_src(src[i+2]), opac), one_minus_ab,
                                       dst[i+2], as);
             // W3C spec:
             //   ao = as*(1-ab) + ab*as
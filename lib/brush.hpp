@@ -52,6 +52,18 @@ public:
       mypaint_brush_set_mapping_point(c_brush, (MyPaintBrushSetting)id, (MyPaintBrushInput)input, index, x, y);
   }
 
+  float get_base_value (int id) {
+      return mypaint_brush_get_base_value(c_brush, (MyPaintBrushSetting)id);
+  }
+
+  int get_mapping_n (int id, int input) {
+      return mypaint_brush_get_mapping_n(c_brush, (MyPaintBrushSetting)id, (MyPaintBrushInput)input);
+  }
+
+  void get_mapping_point (int id, int input, int index, float *x, float *y) {
+      mypaint_brush_get_mapping_point(c_brush, (MyPaintBrushSetting)id, (MyPaintBrushInput)input, index, x, y);
+  }
+
   float get_state (int i)
   {
       return mypaint_brush_get_state(c_brush, (MyPaintBrushState)i);
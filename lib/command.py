@@ -10,7 +10,12 @@
 ## Imports
 from __future__ import division, print_function
 
+import numpy as np
+
 import lib.layer
+import lib.tiledsurface
+import lib.mypaintlib
+import lib.paintingthread
 import helpers
 from observable import event
 import lib.stroke
@@ -18,6 +23,7 @@ from warnings import warn
 
 from copy import deepcopy
 import weakref
+import threading
 from gettext import gettext as _
 from logging import getLogger
 logger = getLogger(__name__)
@@ -31,10 +37,17 @@ class CommandStack (object):
 
     MAXLEN = 30   # FIXME: dynamic size (psutil)?
 
+    #: Commands further than this from the present have their tiles
+    #: compressed by reduce_memory_use()
+    COMPRESS_DISTANCE = 5
+
     def __init__(self, **kwargs):
         super(CommandStack, self).__init__()
         self.undo_stack = []
         self.redo_stack = []
+        #: Memory in MiB the history's tiles may use before the oldest
+        #: are spilled to disk by reduce_memory_use(). 0 means no limit.
+        self.memory_budget = 0
         self.stack_updated()
 
     def __repr__(self):
@@ -108,6 +121,76 @@ class CommandStack (object):
             if steps == self.MAXLEN:  # and memory > ...
                 break
 
+    def _tag_history(self):
+        """Tags the tiles of each command's snapshots with its recency
+
+        :returns: All commands, nearest to the present first
+        :rtype: list
+
+        Commands are tagged in turn from the undo and the redo stacks,
+        so undo and redo steps the same distance away count the same.
+
+        """
+        undo = list(reversed(self.undo_stack))
+        redo = list(reversed(self.redo_stack))
+        commands = []
+        for i in xrange(max(len(undo), len(redo))):
+            commands.extend(s[i] for s in (undo, redo) if i < len(s))
+        for i, command in enumerate(commands):
+            owner = len(commands) - i
+            for sshot in command.iter_surface_snapshots():
+                sshot.set_history_owner(owner)
+        return commands
+
+    def get_memory_use(self):
+        """Returns the memory used by each command's own tiles
+
+        :returns: (command, bytes) pairs, nearest to the present first
+        :rtype: list
+
+        A command is charged for the tiles which no nearer command or
+        layer shares. Discarding it and all further commands would free
+        that memory. Compressed tiles count with their compressed size,
+        and spilled tiles don't count.
+
+        """
+        commands = self._tag_history()
+        usage = lib.mypaintlib.tile_history_usage()
+        n = len(commands)
+        return [(c, usage.get(n - i, 0)) for i, c in enumerate(commands)]
+
+    def reduce_memory_use(self):
+        """Compresses and spills the tiles of older commands
+
+        Tiles which only commands further away than COMPRESS_DISTANCE use
+        are compressed. If the history still uses more memory than
+        memory_budget, the tiles of the furthest commands are spilled to
+        the tile swap file in the working document's cache folder. They
+        are read back when needed, so no history is lost.
+
+        """
+        commands = self._tag_history()
+        n = len(commands)
+        if n > self.COMPRESS_DISTANCE:
+            packed = lib.mypaintlib.tile_history_compress(
+                n - self.COMPRESS_DISTANCE,
+            )
+            if packed:
+                logger.debug("Compressed %d undo history tiles", packed)
+        if not self.memory_budget:
+            return
+        budget = self.memory_budget * 1024 * 1024
+        usage = lib.mypaintlib.tile_history_usage()
+        total = 0
+        for i in xrange(n):
+            owner = n - i
+            total += usage.get(owner, 0)
+            if total > budget:
+                spilled = lib.mypaintlib.tile_history_spill(owner)
+                if spilled:
+                    logger.debug("Spilled %d undo history tiles", spilled)
+                break
+
     def get_last_command(self):
         """Returns the most recently performed command"""
         if not self.undo_stack:
@@ -193,6 +276,17 @@ class Command (object):
         """
         raise NotImplementedError
 
+    def iter_surface_snapshots(self):
+        """Iterates over the surface snapshots kept for undo and redo
+
+        The default implementation finds the layer snapshots among the
+        command's attributes. See CommandStack.get_memory_use().
+        """
+        for value in self.__dict__.values():
+            if isinstance(value, lib.layer.LayerBaseSnapshot):
+                for sshot in value.iter_surface_snapshots():
+                    yield sshot
+
     def update(self, **kwargs):
         """In-place update on the tip of the undo stack.
 
@@ -227,6 +321,9 @@ class Command (object):
 class Brushwork (Command):
     """Some seconds of painting on the current layer"""
 
+    #: Tiles within this many model pixels of the brush are prefetched
+    PREFETCH_RADIUS = 256
+
     def __init__(self, doc, layer_path, description=None, abrupt_start=False,
                  **kwds):
         """Initializes as an active brushwork command
@@ -259,8 +356,22 @@ class Brushwork (Command):
         # State vars
         self._recording_started = False
         self._recording_finished = False
-        self.split_due = False
+        self._split_due = threading.Event()
         self._sshot_after_applied = False
+        # The painting thread's own brush, see _get_painting_brush()
+        self._painting_brush = None
+        self._painting_brush_settings = None
+        self._painting_brush_states = None
+
+    @property
+    def split_due(self):
+        """Whether the brush engine asked for a split (bool, read-only)
+
+        See `stroke_to()`. This is safe to read while the painting
+        thread is working, but it may become true at any time then.
+
+        """
+        return self._split_due.is_set()
 
     def __repr__(self):
         time = 0.0
@@ -387,22 +498,163 @@ class Brushwork (Command):
         if layer is None:
             return  # wasn't suitable for painting
         # Reset initial brush state if requested.
-        brush = model.brush
-        if self._abrupt_start and not self._abrupt_start_done:
-            brush.reset()
-            layer.stroke_to(brush, x, y, 0.0, xtilt, ytilt, 10.0)
-            self._abrupt_start_done = True
+        reset = self._abrupt_start and not self._abrupt_start_done
+        self._abrupt_start_done = True
         # Record and paint this position
         self._stroke_seq.record_event(
             dtime,
             x, y, pressure,
             xtilt, ytilt,
         )
-        self.split_due = layer.stroke_to(
+        args = (reset, x, y, pressure, xtilt, ytilt, dtime)
+        painter = model.painting_thread
+        if painter is not None:
+            snapshot = self._get_brush_snapshot(model.brush)
+            painter.submit(self._paint_snapshot, layer, snapshot, *args)
+        else:
+            self._paint(layer, model.brush, *args)
+        r = self.PREFETCH_RADIUS
+        lib.tiledsurface.prefetch_tiles((x - r, y - r, 2 * r, 2 * r))
+
+    def _paint(self, layer, brush, reset,
+               x, y, pressure, xtilt, ytilt, dtime):
+        """Paints one position: stroke_to()'s part for the painting thread"""
+        if reset:
+            brush.reset()
+            layer.stroke_to(brush, x, y, 0.0, xtilt, ytilt, 10.0)
+        split = layer.stroke_to(
             brush,
             x, y, pressure,
             xtilt, ytilt, dtime,
         )
+        self._update_split_due(split)
+
+    def _paint_snapshot(self, layer, snapshot, *args):
+        """Paints one position with a brush snapshot (painting thread)"""
+        brush = self._get_painting_brush(snapshot)
+        self._paint(layer, brush, *args)
+
+    def stroke_to_many(self, events):
+        """Painting: forward many stroke position updates at once
+
+        :param numpy.ndarray events: Nx6 float64 array of
+          (dtime, x, y, pressure, xtilt, ytilt) rows, with the same
+          meanings as `stroke_to()`'s args
+
+        This is equivalent to calling `stroke_to()` for each row, but
+        the whole array is recorded and painted in one go. Afterwards,
+        `split_due` is true if any of the events asked for a split.
+
+        """
+        self._check_recording_started()
+        model = self.doc
+        layer = self._stroke_target_layer
+        if layer is None or len(events) == 0:
+            return
+        reset = self._abrupt_start and not self._abrupt_start_done
+        self._abrupt_start_done = True
+        self._stroke_seq.record_events(events)
+        painter = model.painting_thread
+        if painter is not None:
+            snapshot = self._get_brush_snapshot(model.brush)
+            painter.submit(self._paint_many_snapshot, layer, snapshot,
+                           reset, events)
+        else:
+            self._paint_many(layer, model.brush, reset, events)
+        r = self.PREFETCH_RADIUS
+        x0, y0 = events[:, 1:3].min(axis=0)
+        x1, y1 = events[:, 1:3].max(axis=0)
+        lib.tiledsurface.prefetch_tiles(
+            (x0 - r, y0 - r, x1 - x0 + 2 * r, y1 - y0 + 2 * r),
+        )
+
+    def _paint_many(self, layer, brush, reset, events):
+        """Paints an event array: stroke_to_many()'s part for the thread"""
+        if reset:
+            dtime, x, y, pressure, xtilt, ytilt = events[0]
+            brush.reset()
+            layer.stroke_to(brush, x, y, 0.0, xtilt, ytilt, 10.0)
+        n, split = layer.stroke_to_many(brush, events)
+        self._update_split_due(split)
+
+    def _paint_many_snapshot(self, layer, snapshot, *args):
+        """Paints an event array with a brush snapshot (painting thread)"""
+        brush = self._get_painting_brush(snapshot)
+        self._paint_many(layer, brush, *args)
+
+    def _update_split_due(self, split):
+        """Records whether the brush engine asked for a split
+
+        On the painting thread, `split_due` only ever becomes true, so
+        that a split can't be lost before the UI thread gets to see it.
+
+        """
+        if split:
+            self._split_due.set()
+        elif lib.paintingthread.get_current() is None:
+            self._split_due.clear()
+
+    ## Brush snapshots for the painting thread
+
+    def _get_brush_snapshot(self, brush):
+        """Snapshots the brush's settings and states (UI thread)
+
+        :param lib.brush.Brush brush: the document's brush
+        :returns: opaque snapshot for _get_painting_brush()
+
+        The document's brush can be changed by the UI at any time, so
+        the painting thread never uses it directly. Instead, each
+        submitted segment carries a copy of its settings and states.
+
+        """
+        settings = brush.get_all_as_blob()
+        states = brush.get_states_as_array().tostring()
+        return (settings, states)
+
+    def _get_painting_brush(self, snapshot):
+        """Updates the painting thread's brush from a snapshot
+
+        :param tuple snapshot: from _get_brush_snapshot()
+        :returns: the brush to paint the segment with
+        :rtype: lib.mypaintlib.PythonBrush
+
+        Settings are applied whenever they change. The painting
+        thread's brush advances its own states as it paints, and the
+        document's brush doesn't during recording, so its states are
+        only applied when the UI changed them, e.g. by a reset().
+
+        """
+        settings, states = snapshot
+        brush = self._painting_brush
+        if brush is None:
+            brush = lib.mypaintlib.PythonBrush()
+            self._painting_brush = brush
+        if settings != self._painting_brush_settings:
+            brush.set_all_from_blob(settings)
+            self._painting_brush_settings = settings
+        if states != self._painting_brush_states:
+            brush.set_states_from_array(np.fromstring(states, 'float32'))
+            self._painting_brush_states = states
+        return brush
+
+    def _finish_painting_brush(self, brush):
+        """Hands the painting thread's brush states back (UI thread)
+
+        :param lib.brush.Brush brush: the document's brush
+
+        The next brushwork carries on from where this one left off,
+        unless the UI changed the document brush's states since the
+        last snapshot.
+
+        """
+        painting_brush = self._painting_brush
+        if painting_brush is None:
+            return
+        states = brush.get_states_as_array().tostring()
+        if states == self._painting_brush_states:
+            brush.set_states_from_array(
+                painting_brush.get_states_as_array(),
+            )
 
     def stop_recording(self, revert=False):
         """Ends the recording phase
@@ -428,6 +680,10 @@ class Brushwork (Command):
 
         """
         self._check_recording_started()
+        painter = self.doc.painting_thread
+        if painter is not None:
+            painter.sync()
+        self._finish_painting_brush(self.doc.brush)
         layer = self._stroke_target_layer
         self._stroke_target_layer = None  # prevent potential leak
         self._recording_finished = True
@@ -440,7 +696,7 @@ class Brushwork (Command):
                 "Please report this glitch if you can reliably reproduce it."
             )
             return False  # nothing recorded, so nothing changed
-        self._stroke_seq.stop_recording()
+        self._stroke_seq.stop_recording(self._painting_brush)
         if layer is None:
             return False  # wasn't suitable for painting, thus nothing changed
         if revert:
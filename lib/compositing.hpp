@@ -66,11 +66,33 @@ class CompositeFunc
 };
 
 
+// Source channel reading for the buffer combiners
+//
+// Source buffers normally hold 15-bit fix15_short_t data, but tiles which
+// are only ever displayed may be stored with 8 bits per channel instead.
+// Both are premultiplied, and 255 stands for fix15_one. The combiners read
+// every source channel through fix15_src(), so they can take either kind
+// without widening the 8-bit data into a temporary buffer first.
+
+static inline fix15_t
+fix15_src (const fix15_short_t v)
+{
+    return v;
+}
+
+static inline fix15_t
+fix15_src (const uint8_t v)
+{
+    return ((fix15_t)v * fix15_one + 127) / 255;
+}
+
+
 // Composable blend+composite functor for buffers
 //
 // The template parameters define whether the destination's alpha is used,
 // and supply the BlendFunc and CompositeFunc functor classes to use.  The
-// size of the buffers to be processed must also be specified.
+// size of the buffers to be processed must also be specified. The source
+// may be of fix15_short_t or uint8_t, see fix15_src().
 //
 // This is templated at the class level so that more optimal partial template
 // specializations can be written for more common code paths. The C++ spec
@@ -89,7 +111,8 @@ class BufferCombineFunc
     COMPOSITEFUNC compositefunc;
 
   public:
-    inline void operator() (const fix15_short_t * const src,
+    template <class SRC>
+    inline void operator() (const SRC * const src,
                             fix15_short_t * const dst,
                             const fix15_short_t src_opacity) const
     {
@@ -107,7 +130,7 @@ class BufferCombineFunc
         for (unsigned int i = 0; i < BUFSIZE; i += 4)
         {
             // Calculate unpremultiplied source RGB values
-            as = src[i+3];
+            as = fix15_src(src[i+3]);
             if (as == 0) {
 #ifndef HEAVY_DEBUG
                 // Skip pixel if it can't affect the backdrop pixel
@@ -120,9 +143,9 @@ class BufferCombineFunc
                 Rs = Gs = Bs = 0;
             }
             else {
-                Rs = fix15_short_clamp(fix15_div(src[i+0], as));
-                Gs = fix15_short_clamp(fix15_div(src[i+1], as));
-                Bs = fix15_short_clamp(fix15_div(src[i+2], as));
+                Rs = fix15_short_clamp(fix15_div(fix15_src(src[i+0]), as));
+                Gs = fix15_short_clamp(fix15_div(fix15_src(src[i+1]), as));
+                Bs = fix15_short_clamp(fix15_div(fix15_src(src[i+2]), as));
             }
 #ifdef HEAVY_DEBUG
             assert(Rs <= fix15_one); assert(Rs >= 0);
@@ -192,6 +215,10 @@ class TileDataCombineOp
                                fix15_short_t *dst_p,
                                const bool dst_has_alpha,
                                const float src_opacity) const = 0;
+    virtual void combine_data (const uint8_t *src_p,
+                               fix15_short_t *dst_p,
+                               const bool dst_has_alpha,
+                               const float src_opacity) const = 0;
     virtual const char* get_name() const = 0;
     virtual bool zero_alpha_has_effect() const = 0;
     virtual bool can_decrease_alpha() const = 0;
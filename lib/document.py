@@ -45,9 +45,10 @@ import lib.layer as layer
 import lib.brush as brush
 from lib.observable import event
 import lib.pixbuf
+import lib.surface
 from lib.errors import FileHandlingError
-from lib.errors import AllocationError
 import lib.idletask
+import lib.paintingthread
 from lib.gettext import C_
 import lib.xml
 import lib.glib
@@ -63,6 +64,7 @@ CACHE_APP_SUBDIR_NAME = u"mypaint"
 CACHE_DOC_SUBDIR_PREFIX = u"doc."
 CACHE_DOC_AUTOSAVE_SUBDIR = u"autosave"
 CACHE_ACTIVITY_FILE = u"active"
+CACHE_TILE_SWAP_FILE = u"tiles.swap"
 CACHE_UPDATE_INTERVAL = 10  # seconds
 
 # Logging and error reporting strings
@@ -274,6 +276,7 @@ class Document (object):
         self.brush.brushinfo.observers.append(self.brushsettings_changed_cb)
         self.stroke = None
         self.command_stack = command.CommandStack()
+        self._painting_thread = None
 
         # Cache and auto-saving to the cache
         self._painting_only = painting_only
@@ -356,6 +359,7 @@ class Document (object):
                 "A recent timestamp on this file indicates that\n"
                 "its containing cache subfolder is active.\n"
             )
+        _open_tile_swap(doc_cache_dir)
         self._start_cache_updater()
 
     def _cleanup_cache_dir(self):
@@ -389,6 +393,7 @@ class Document (object):
         This method is called by the main app's exit routine
         after confirmation.
         """
+        self.threaded_painting = False
         self._cleanup_cache_dir()
 
     ## Periodic cache updater
@@ -412,14 +417,74 @@ class Document (object):
         self._cache_updater_id = None
 
     def _cache_updater_cb(self):
-        """Payload: update canary file, start autosave countdown if dirty"""
+        """Payload: update canary file, start autosave countdown if dirty
+
+        This also limits the memory used by the undo history, compresses
+        tiles which haven't been used for a while, and swaps out the least
+        recently used ones if tiles are taking up too much memory. See
+        CommandStack.reduce_memory_use(), set_tile_compression(), and
+        set_tile_swap().
+
+        """
         assert not self._painting_only
         activity_file_path = os.path.join(self.cache_dir, CACHE_ACTIVITY_FILE)
         os.utime(activity_file_path, None)
         if self._autosave_dirty:
             self._start_autosave_countdown()
+        self.command_stack.reduce_memory_use()
+        n = mypaintlib.tile_compression_tick()
+        if n:
+            logger.debug("Compressed %d cold tiles", n)
+        n = mypaintlib.tile_swap_evict()
+        if n:
+            logger.debug("Swapped out %d tiles", n)
         return True
 
+    ## Painting on a worker thread
+
+    @property
+    def painting_thread(self):
+        """The lib.paintingthread.PaintingThread brushwork uses, or None
+
+        See `threaded_painting`.
+
+        """
+        return self._painting_thread
+
+    @property
+    def threaded_painting(self):
+        """Whether brushwork is painted on a worker thread (bool)
+
+        When this is false, the default, brushwork is painted straight
+        away by the thread recording it.
+
+        """
+        return self._painting_thread is not None
+
+    @threaded_painting.setter
+    def threaded_painting(self, enabled):
+        enabled = bool(enabled)
+        if enabled == self.threaded_painting:
+            return
+        if enabled:
+            self._painting_thread = lib.paintingthread.PaintingThread()
+        else:
+            painter = self._painting_thread
+            self._painting_thread = None
+            painter.stop()
+
+    def sync_painting(self):
+        """Finishes any brushwork still queued on the painting thread
+
+        Call this before snapshotting, freezing, or saving layer data
+        from the main thread. The painting thread holds writable tiles
+        while it works on a queued item, so a snapshot taken midway
+        would share tiles which are still being painted.
+
+        """
+        if self._painting_thread is not None:
+            self._painting_thread.sync()
+
     ## Autosave flag
 
     @property
@@ -505,6 +570,9 @@ class Document (object):
         assert not self._painting_only
         assert not self._autosave_processor.has_work()
         assert self._autosave_dirty
+        # The layers' tile files are updated from frozen tiles, and the
+        # thumbnail from a snapshot, so finish any pending brushwork.
+        self.sync_painting()
         oradir = os.path.join(self._cache_dir, CACHE_DOC_AUTOSAVE_SUBDIR)
         datadir = os.path.join(oradir, "data")
         if not os.path.exists(datadir):
@@ -962,7 +1030,11 @@ class Document (object):
         See: `lib.observable.event` for details of the signalling
         mechanism.
 
+        Any brushwork still queued on the painting thread is finished
+        before the observers are called.
+
         """
+        self.sync_painting()
 
     def undo(self):
         """Undo the most recently done command"""
@@ -1383,6 +1455,7 @@ class Document (object):
     def render_thumbnail(self, **kwargs):
         """Renders a thumbnail for the user bbox"""
         t0 = time.time()
+        self.sync_painting()
         bbox = self.get_user_bbox()
         if kwargs.get("alpha", None) is None:
             kwargs["alpha"] = not self.layer_stack.background_visible
@@ -1438,29 +1511,36 @@ class Document (object):
 
     @fileutils.via_tempfile
     def save_jpg(self, filename, quality=90, **kwargs):
+        """Save to a JPEG file, rendering one strip of tiles at a time"""
         x, y, w, h = self.get_user_bbox()
         if w == 0 or h == 0:
             x, y, w, h = 0, 0, N, N  # allow to save empty documents
-        try:
-            pixbuf = self.layer_stack.render_as_pixbuf(x, y, w, h, **kwargs)
-        except (AllocationError, MemoryError) as e:
-            hint_tmpl = C_(
-                "Document IO: hint templates for user-facing exceptions",
-                u"Unable to save as JPEG: {original_msg}\n\n"
-                u"Try saving in PNG format instead, "
-                u"if your machine doesn’t have a lot of memory. "
-                u"MyPaint’s PNG save function is more efficient."
-            )
-            raise AllocationError(hint_tmpl.format(
-                original_msg = str(e),
-            ))
-        lib.pixbuf.save(pixbuf, filename, 'jpeg', quality=str(quality))
+        lib.surface.save_as_jpeg(
+            self.layer_stack,
+            filename,
+            x, y, w, h,
+            quality=quality,
+            **kwargs
+        )
 
     save_jpeg = save_jpg
 
-    @fileutils.via_tempfile
     def save_ora(self, filename, options=None, **kwargs):
-        """Saves OpenRaster data to a file"""
+        """Saves OpenRaster data to a file
+
+        Layers which are unchanged since they were last loaded from or
+        saved to an OpenRaster file that still exists have their PNG
+        data copied from there, instead of encoding it all over again.
+
+        """
+        thumbnail = self._save_ora_via_tempfile(filename, options, **kwargs)
+        # Record where the layers' data now lives, for next time.
+        # The rename in via_tempfile() targets the real path.
+        self.layer_stack.commit_orazip_save(os.path.realpath(filename))
+        return thumbnail
+
+    @fileutils.via_tempfile
+    def _save_ora_via_tempfile(self, filename, options=None, **kwargs):
         logger.info('save_ora: %r (%r, %r)', filename, options, kwargs)
         t0 = time.time()
         thumbnail = _save_layers_to_new_orazip(
@@ -1724,6 +1804,83 @@ def _save_layers_to_new_orazip(root_stack, filename, bbox=None, xres=None, yres=
     return thumbnail
 
 
+def set_tile_compression(idle_time, budget):
+    """Sets how tiles which haven't been used for a while are compressed
+
+    :param float idle_time: Seconds a tile must go unused before it can
+        be compressed. Zero turns compression off.
+    :param float budget: Memory in MiB that uncompressed tiles may use
+        before any are compressed.
+
+    Tiles are compressed in memory until they're next used. Cold tiles
+    are looked for every CACHE_UPDATE_INTERVAL seconds, by the cache
+    updater of the working document.
+
+    """
+    idle_ticks = 0
+    if idle_time > 0:
+        idle_ticks = max(1, int(round(idle_time / CACHE_UPDATE_INTERVAL)))
+    mypaintlib.tile_compression_configure(idle_ticks, max(0.0, budget))
+
+
+def set_tile_swap(budget):
+    """Sets how much memory tiles may use before some are swapped out
+
+    :param float budget: Memory in MiB that tiles may use, compressed or
+        not. Zero turns swapping off.
+
+    The least recently used tiles are moved out to a swap file in the
+    working document's cache folder every CACHE_UPDATE_INTERVAL seconds
+    while tiles use more memory than this. They're read back in when
+    they're next used. See also lib.tiledsurface.prefetch_tiles().
+
+    """
+    mypaintlib.tile_swap_configure(max(0.0, budget))
+
+
+def set_tile_dedup(enabled):
+    """Sets whether identical tiles share their memory
+
+    :param bool enabled: Whether to look for identical tiles
+
+    Tiles are hashed when they can no longer change in place: when undo
+    snapshots share them, or when they're saved. Tiles found to be
+    identical to others, in any layer or snapshot, then share memory
+    until one of them is painted on. This helps with duplicated layers,
+    pasted content, and large fills. See lib.mypaintlib.tile_dedup_stats()
+    for how much it's helping.
+
+    """
+    mypaintlib.tile_dedup_configure(bool(enabled))
+
+
+def set_mipmap_sampling(radius):
+    """Sets the radius above which colors are sampled from mipmaps
+
+    :param float radius: Sample radius in pixels, or 0 to turn this off
+
+    Smudge brushes sample the color under a large area for every dab.
+    Over this radius, the samples come from a smaller mipmap level,
+    which is much faster, and within a few percent of the exact
+    average. See lib/pythontiledsurface.cpp.
+
+    """
+    mypaintlib.set_mipmap_sampling_radius(max(0.0, float(radius)))
+
+
+def _open_tile_swap(cache_dir):
+    """Opens the process's tile swap file in a cache dir, if not yet open
+
+    The file is unlinked as soon as it's open, so it never outlives the
+    process, and later cache dirs can be removed freely.
+
+    """
+    path = os.path.join(cache_dir, CACHE_TILE_SWAP_FILE)
+    path = path.encode(sys.getfilesystemencoding())
+    if not mypaintlib.tile_swap_open(path):
+        logger.info("Tile swap file unavailable: tried %r", path)
+
+
 def get_app_cache_root():
     """Get the app-specific cache root dir, creating it if needed.
 
@@ -0,0 +1,358 @@
+// Fast saving of JPEG files using scanlines
+// Copyright (C) 2017  by the MyPaint Development Team.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc., 51
+// Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+
+#include "fastjpeg.hpp"
+#ifdef _WIN32
+#ifndef __MINGW64_VERSION_MAJOR
+// include this before third party libs
+#include <windows.h>
+#endif
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include "jpeglib.h"
+#include "jerror.h"
+
+#include "common.hpp"
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#define NO_IMPORT_ARRAY
+#include <numpy/arrayobject.h>
+
+
+// libjpeg reports fatal errors through error_exit(), which must not
+// return. Ours sets a Python exception and jumps back into the method
+// which called libjpeg.
+
+struct jpeg_write_error_mgr
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jmpbuf;
+};
+
+
+static void
+jpeg_write_error_exit (j_common_ptr cinfo)
+{
+    jpeg_write_error_mgr *err = (jpeg_write_error_mgr *)cinfo->err;
+    if (!PyErr_Occurred()) {
+        if (err->pub.msg_code == JERR_FILE_WRITE) {
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+        else {
+            char msg[JMSG_LENGTH_MAX];
+            (*cinfo->err->format_message)(cinfo, msg);
+            PyErr_Format(PyExc_RuntimeError, "Error writing JPEG: %s", msg);
+        }
+    }
+    longjmp(err->jmpbuf, 1);
+}
+
+
+struct ProgressiveJPEGWriter::State
+{
+    int width;
+    int height;
+    struct jpeg_compress_struct cinfo;
+    jpeg_write_error_mgr jerr;
+    bool have_cinfo;
+    JSAMPLE *rgb_row;   // conversion buffer, if libjpeg can't read RGBX
+    int y;
+    PyObject *file;
+
+    State()
+        : width(0), height(0),
+          have_cinfo(false),
+          rgb_row(NULL),
+          y(0),
+          file(NULL)
+    { }
+
+    ~State() {
+        cleanup();
+    }
+
+    bool check_valid();
+
+    void cleanup() {
+        if (have_cinfo) {
+            jpeg_destroy_compress(&cinfo);
+            have_cinfo = false;
+        }
+        if (rgb_row) {
+            free(rgb_row);
+            rgb_row = NULL;
+        }
+        if (file) {
+            Py_DECREF(file);
+            file = NULL;
+        }
+    }
+};
+
+
+bool
+ProgressiveJPEGWriter::State::check_valid()
+{
+    bool valid = true;
+    if (! file) {
+        PyErr_SetString(
+            PyExc_RuntimeError,
+            "writer object's internal state is invalid (no file)"
+        );
+        valid = false;
+    }
+    if (! have_cinfo) {
+        PyErr_SetString(
+            PyExc_RuntimeError,
+            "writer object's internal state is invalid (no cinfo)"
+        );
+        valid = false;
+    }
+    return valid;
+}
+
+
+ProgressiveJPEGWriter::ProgressiveJPEGWriter(PyObject *file,
+                                             const int w, const int h,
+                                             const int quality,
+                                             const int subsampling)
+    : state(new ProgressiveJPEGWriter::State())
+{
+    state->width = w;
+    state->height = h;
+
+    int luma_h_samp = 2;
+    int luma_v_samp = 2;
+    switch (subsampling) {
+    case JPEG_SUBSAMPLING_444:
+        luma_h_samp = 1;
+        luma_v_samp = 1;
+        break;
+    case JPEG_SUBSAMPLING_422:
+        luma_h_samp = 2;
+        luma_v_samp = 1;
+        break;
+    case JPEG_SUBSAMPLING_420:
+        break;
+    default:
+        PyErr_SetString(
+            PyExc_ValueError,
+            "subsampling must be one of JPEG_SUBSAMPLING_444, "
+            "JPEG_SUBSAMPLING_422, or JPEG_SUBSAMPLING_420"
+        );
+        return;
+    }
+
+    if (! PyFile_Check(file)) {
+        PyErr_SetString(
+            PyExc_TypeError,
+            "file arg must be a builtin file object"
+        );
+        return;
+    }
+    state->file = file;
+    Py_INCREF(file);
+
+    FILE *fp = PyFile_AsFile(file);
+    if (!fp) {
+        PyErr_SetString(
+            PyExc_TypeError,
+            "file arg has no FILE* associated with it?"
+        );
+        state->cleanup();
+        return;
+    }
+
+    struct jpeg_compress_struct *cinfo = &state->cinfo;
+    cinfo->err = jpeg_std_error(&state->jerr.pub);
+    state->jerr.pub.error_exit = jpeg_write_error_exit;
+    if (setjmp(state->jerr.jmpbuf)) {
+        state->cleanup();
+        return;
+    }
+    jpeg_create_compress(cinfo);
+    state->have_cinfo = true;
+
+    jpeg_stdio_dest(cinfo, fp);
+
+    cinfo->image_width = w;
+    cinfo->image_height = h;
+#ifdef JCS_EXTENSIONS
+    // libjpeg-turbo can read our rgbu strips directly
+    cinfo->input_components = 4;
+    cinfo->in_color_space = JCS_EXT_RGBX;
+#else
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    state->rgb_row = (JSAMPLE *)malloc(w * 3 * sizeof(JSAMPLE));
+    if (! state->rgb_row) {
+        PyErr_SetString(PyExc_MemoryError, "can't allocate row buffer");
+        state->cleanup();
+        return;
+    }
+#endif
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+
+    // Huffman table optimization and progressive scans both make libjpeg
+    // buffer the whole image's coefficients, which would defeat the
+    // point of writing in strips. Keep to single-pass baseline output.
+    cinfo->optimize_coding = FALSE;
+    cinfo->comp_info[0].h_samp_factor = luma_h_samp;
+    cinfo->comp_info[0].v_samp_factor = luma_v_samp;
+    for (int c = 1; c < cinfo->num_components; c++) {
+        cinfo->comp_info[c].h_samp_factor = 1;
+        cinfo->comp_info[c].v_samp_factor = 1;
+    }
+
+    jpeg_start_compress(cinfo, TRUE);
+}
+
+
+PyObject *
+ProgressiveJPEGWriter::write(PyObject *arr_obj)
+{
+    PyArrayObject* arr = (PyArrayObject*)arr_obj;
+    int rowcount = 0;
+    int rowstride = 0;
+    JSAMPLE *row_p = NULL;
+    const char *err_text = NULL;
+    PyObject *err_type = PyExc_RuntimeError;
+
+    if (! state) {
+        err_type = PyExc_RuntimeError;
+        err_text = "writer object is not ready to write (internal state lost)";
+        goto errexit;
+    }
+    if (! state->check_valid()) {
+        state->cleanup();
+        return NULL;
+    }
+
+    if (!arr_obj || !PyArray_Check(arr_obj)) {
+        err_type = PyExc_TypeError;
+        err_text = "arg must be a numpy array (of HxWx4)";
+        goto errexit;
+    }
+    if (!PyArray_ISALIGNED(arr) || PyArray_NDIM(arr)!=3) {
+        err_type = PyExc_ValueError;
+        err_text = "arg must be an aligned HxWx4 numpy array";
+        goto errexit;
+    }
+    if (PyArray_DIM(arr, 1) != state->width) {
+        err_type = PyExc_ValueError;
+        err_text = "strip width must match writer width (must be HxWx4)";
+        goto errexit;
+    }
+    if (PyArray_DIM(arr, 2) != 4) {
+        err_type = PyExc_ValueError;
+        err_text = "strip must contain RGBA data (must be HxWx4)";
+        goto errexit;
+    }
+    if (PyArray_TYPE(arr) != NPY_UINT8) {
+        err_type = PyExc_ValueError;
+        err_text = "strip must contain uint8 RGBA only";
+        goto errexit;
+    }
+    assert(PyArray_STRIDE(arr, 1) == 4);
+    assert(PyArray_STRIDE(arr, 2) == 1);
+
+    rowcount = PyArray_DIM(arr, 0);
+    if (state->y + rowcount > state->height) {
+        err_type = PyExc_RuntimeError;
+        err_text = "too many pixel rows written";
+        goto errexit;
+    }
+    rowstride = PyArray_STRIDE(arr, 0);
+    row_p = (JSAMPLE *)PyArray_DATA(arr);
+
+    if (setjmp(state->jerr.jmpbuf)) {
+        state->cleanup();
+        return NULL;
+    }
+    for (int row=0; row<rowcount; row++) {
+        JSAMPROW rows[1];
+#ifdef JCS_EXTENSIONS
+        rows[0] = row_p;
+#else
+        // drop the 4th channel
+        const JSAMPLE *src = row_p;
+        JSAMPLE *dst = state->rgb_row;
+        for (int x=0; x<state->width; x++) {
+            *dst++ = *src++;
+            *dst++ = *src++;
+            *dst++ = *src++;
+            src++;
+        }
+        rows[0] = state->rgb_row;
+#endif
+        jpeg_write_scanlines(&state->cinfo, rows, 1);
+        row_p += rowstride;
+    }
+    state->y += rowcount;
+    Py_RETURN_NONE;
+
+  errexit:
+    if (state) {
+        state->cleanup();
+    }
+    if (err_text) {
+        PyErr_SetString(err_type, err_text);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+PyObject *
+ProgressiveJPEGWriter::close()
+{
+    if (! state) {
+        PyErr_SetString(
+            PyExc_RuntimeError,
+            "writer object is not ready to write (internal state lost)"
+        );
+        return NULL;
+    }
+    if (! state->check_valid()) {
+        state->cleanup();
+        return NULL;
+    }
+    if (state->y != state->height) {
+        state->cleanup();
+        PyErr_SetString(
+            PyExc_RuntimeError,
+            "too few pixel rows written"
+        );
+        return NULL;
+    }
+    if (setjmp(state->jerr.jmpbuf)) {
+        state->cleanup();
+        return NULL;
+    }
+    jpeg_finish_compress(&state->cinfo);
+    state->cleanup();
+    Py_RETURN_NONE;
+}
+
+
+ProgressiveJPEGWriter::~ProgressiveJPEGWriter()
+{
+    delete state;
+}
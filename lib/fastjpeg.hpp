@@ -0,0 +1,53 @@
+// Fast saving of JPEG files using scanlines
+// Copyright (C) 2017  by the MyPaint Development Team.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc., 51
+// Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef FASTJPEG_HPP
+#define FASTJPEG_HPP
+
+#include <Python.h>
+
+
+// Chroma subsampling modes for ProgressiveJPEGWriter, named after their
+// J:a:b notation.
+
+const int JPEG_SUBSAMPLING_444 = 444;  // full chroma resolution
+const int JPEG_SUBSAMPLING_422 = 422;  // half horizontal
+const int JPEG_SUBSAMPLING_420 = 420;  // half in both directions
+
+
+// Writes a baseline JPEG file progressively in strips.
+//
+// Strips are the same h*w*4 uint8 arrays that ProgressivePNGWriter
+// accepts. The 4th channel is ignored. Only a few scanlines are buffered
+// internally, so the caller's strip buffer bounds memory use.
+
+class ProgressiveJPEGWriter
+{
+public:
+    ProgressiveJPEGWriter(PyObject *file,
+                          const int w, const int h,
+                          const int quality,
+                          const int subsampling);
+    PyObject *write(PyObject *arr);  // write a h*w*4 uint8 numpy array
+    PyObject *close();   // finalize write
+    ~ProgressiveJPEGWriter();
+private:
+    struct State;
+    State *state;
+};
+
+#endif //FASTJPEG_HPP
@@ -11,13 +11,13 @@
 
 #include "common.hpp"
 #include "fix15.hpp"
+#include "tilesize.hpp"
 
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #define NO_IMPORT_ARRAY
 #include <numpy/arrayobject.h>
 
 #include <glib.h>
-#include <mypaint-tiled-surface.h>
 
 
 
@@ -128,16 +128,17 @@ typedef struct {
 } _floodfill_point;
 
 
-// Flood fill implementation
+// Flood fill implementation, for tiles of size N
 
-PyObject *
-tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
-                 PyObject *dst, /* output HxWx4 array of uint16 */
-                 PyObject *seeds, /* List of 2-tuples */
-                 int targ_r, int targ_g, int targ_b, int targ_a, //premult
-                 double fill_r, double fill_g, double fill_b,
-                 int min_x, int min_y, int max_x, int max_y,
-                 double tol) /* [0..1] */
+template <int N>
+static PyObject *
+_tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
+                  PyObject *dst, /* output HxWx4 array of uint16 */
+                  PyObject *seeds, /* List of 2-tuples */
+                  int targ_r, int targ_g, int targ_b, int targ_a, //premult
+                  double fill_r, double fill_g, double fill_b,
+                  int min_x, int min_y, int max_x, int max_y,
+                  double tol) /* [0..1] */
 {
     // Scale the fractional tolerance arg
     const fix15_t tolerance = (fix15_t)(  MIN(1.0, MAX(0.0, tol))
@@ -156,10 +157,10 @@ tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
 #ifdef HEAVY_DEBUG
     assert(PyArray_Check(src));
     assert(PyArray_Check(dst));
-    assert(PyArray_DIM(src_arr, 0) == MYPAINT_TILE_SIZE);
-    assert(PyArray_DIM(dst_arr, 0) == MYPAINT_TILE_SIZE);
-    assert(PyArray_DIM(src_arr, 1) == MYPAINT_TILE_SIZE);
-    assert(PyArray_DIM(dst_arr, 1) == MYPAINT_TILE_SIZE);
+    assert(PyArray_DIM(src_arr, 0) == N);
+    assert(PyArray_DIM(dst_arr, 0) == N);
+    assert(PyArray_DIM(src_arr, 1) == N);
+    assert(PyArray_DIM(dst_arr, 1) == N);
     assert(PyArray_DIM(src_arr, 2) == 4);
     assert(PyArray_DIM(dst_arr, 2) == 4);
     assert(PyArray_TYPE(src_arr) == NPY_UINT16);
@@ -170,8 +171,8 @@ tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
 #endif
     if (min_x < 0) min_x = 0;
     if (min_y < 0) min_y = 0;
-    if (max_x > MYPAINT_TILE_SIZE-1) max_x = MYPAINT_TILE_SIZE-1;
-    if (max_y > MYPAINT_TILE_SIZE-1) max_y = MYPAINT_TILE_SIZE-1;
+    if (max_x > N-1) max_x = N-1;
+    if (max_y > N-1) max_y = N-1;
     if (min_x > max_x || min_y > max_y) {
         return Py_BuildValue("[()()()()]");
     }
@@ -189,8 +190,8 @@ tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
             continue;
         }
         Py_DECREF(seed_tup);
-        x = MAX(0, MIN(x, MYPAINT_TILE_SIZE-1));
-        y = MAX(0, MIN(y, MYPAINT_TILE_SIZE-1));
+        x = MAX(0, MIN(x, N-1));
+        y = MAX(0, MIN(y, N-1));
         const fix15_short_t *src_pixel = _floodfill_getpixel(src_arr, x, y);
         const fix15_short_t *dst_pixel = _floodfill_getpixel(dst_arr, x, y);
         if (_floodfill_should_fill(src_pixel, dst_pixel, targ, tolerance)) {
@@ -284,14 +285,14 @@ tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
                 else {
                     // Overflow onto the tile to the North.
                     // Scanlining not possible here: pixel is over the border.
-                    PyObject *s = Py_BuildValue("ii", x, MYPAINT_TILE_SIZE-1);
+                    PyObject *s = Py_BuildValue("ii", x, N-1);
                     PyList_Append(result_n, s);
                     Py_DECREF(s);
 #ifdef HEAVY_DEBUG
                     assert(s->ob_refcnt == 1);
 #endif
                 }
-                if (y < MYPAINT_TILE_SIZE - 1) {
+                if (y < N - 1) {
                     fix15_short_t *src_pixel_below = _floodfill_getpixel(
                                                        src_arr, x, y+1
                                                      );
@@ -332,14 +333,14 @@ tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
                 // If the fill is now at the west or east extreme, we have
                 // overflowed there too.  Seed West and East tiles.
                 if (x == 0) {
-                    PyObject *s = Py_BuildValue("ii", MYPAINT_TILE_SIZE-1, y);
+                    PyObject *s = Py_BuildValue("ii", N-1, y);
                     PyList_Append(result_w, s);
                     Py_DECREF(s);
 #ifdef HEAVY_DEBUG
                     assert(s->ob_refcnt == 1);
 #endif
                 }
-                else if (x == MYPAINT_TILE_SIZE-1) {
+                else if (x == N-1) {
                     PyObject *s = Py_BuildValue("ii", 0, y);
                     PyList_Append(result_e, s);
                     Py_DECREF(s);
@@ -370,3 +371,20 @@ tile_flood_fill (PyObject *src, /* readonly HxWx4 array of uint16 */
     return result;
 }
 
+
+
+PyObject *
+tile_flood_fill (PyObject *src, PyObject *dst, PyObject *seeds,
+                 int targ_r, int targ_g, int targ_b, int targ_a,
+                 double fill_r, double fill_g, double fill_b,
+                 int min_x, int min_y, int max_x, int max_y,
+                 double tol)
+{
+    return _tile_flood_fill<MYPAINTLIB_TILE_SIZE>(
+        src, dst, seeds,
+        targ_r, targ_g, targ_b, targ_a,
+        fill_r, fill_g, fill_b,
+        min_x, min_y, max_x, max_y,
+        tol
+    );
+}
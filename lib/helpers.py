@@ -13,6 +13,7 @@ from itertools import izip_longest
 from math import floor, isnan
 import os
 import hashlib
+import struct
 import zipfile
 import colorsys
 import gc
@@ -461,6 +462,145 @@ def zipfile_writestr(z, arcname, data):
     z.writestr(zi, data)
 
 
+def zipfile_read_raw(z, name):
+    """Read a zipfile entry's data as stored, without decompressing it
+
+    :param zipfile.ZipFile z: A zip file open for read.
+    :param unicode name: Name of the entry to read.
+    :returns: the entry's ZipInfo, and its compressed data
+    :rtype: tuple
+    :raises KeyError: if there is no such entry
+    :raises zipfile.BadZipfile: if the entry can't be read as stored
+
+    """
+    info = z.getinfo(name)
+    if info.flag_bits & 0x01:
+        raise zipfile.BadZipfile("%r is encrypted" % (name,))
+    fp = z.fp
+    fp.seek(info.header_offset)
+    header = fp.read(zipfile.sizeFileHeader)
+    if len(header) != zipfile.sizeFileHeader:
+        raise zipfile.BadZipfile("Truncated file header")
+    header = struct.unpack(zipfile.structFileHeader, header)
+    if header[zipfile._FH_SIGNATURE] != zipfile.stringFileHeader:
+        raise zipfile.BadZipfile("Bad magic number for file header")
+    fp.seek(header[zipfile._FH_FILENAME_LENGTH]
+            + header[zipfile._FH_EXTRA_FIELD_LENGTH], os.SEEK_CUR)
+    data = fp.read(info.compress_size)
+    if len(data) != info.compress_size:
+        raise zipfile.BadZipfile("Truncated data for %r" % (name,))
+    return info, data
+
+
+def zipfile_copy_raw(src, name, dst, arcname):
+    """Copy an entry between zipfiles, without recompressing it
+
+    :param zipfile.ZipFile src: A zip file open for read.
+    :param unicode name: Name of the entry to copy.
+    :param zipfile.ZipFile dst: A zip file open for write.
+    :param unicode arcname: Name of the new entry.
+    :raises KeyError: if there is no such entry
+    :raises zipfile.BadZipfile: if the entry can't be read
+
+    The new entry has the original compression type, CRC, sizes and
+    timestamp. Permissions are set like zipfile_writestr() does. The
+    entry is read completely before anything is written, so a failure
+    leaves `dst` untouched.
+
+    The compressed data is copied as-is where _ZipRawWriter can do
+    that. Otherwise, the entry is decompressed and written with
+    `zipfile.ZipFile.writestr`, which compresses it again.
+
+    """
+    info = src.getinfo(name)
+    zi = zipfile.ZipInfo(arcname, date_time=info.date_time)
+    zi.external_attr = 0o644 << 16  # wider perms, should match z.write()
+    zi.external_attr |= 0o100000 << 16  # regular file
+    zi.compress_type = info.compress_type
+    writer = _ZipRawWriter(dst)
+    if writer.can_write(info):
+        info, data = zipfile_read_raw(src, name)
+        writer.write(zi, info, data)
+    else:
+        dst.writestr(zi, src.read(name))
+
+
+class _ZipRawWriter (object):
+    """Writes already-compressed entries into a zipfile
+
+    The standard zipfile module has no public way of doing this, so
+    this uses the same ZipFile internals as its writestr(). It only does
+    so for entries which can't need any Zip64 extensions, and when those
+    internals are all there. Check can_write() first, and write the
+    entry some other way if it says no.
+
+    """
+
+    _ZIPFILE_INTERNALS = ("fp", "filelist", "NameToInfo",
+                          "_writecheck", "_didModify")
+
+    def __init__(self, z):
+        super(_ZipRawWriter, self).__init__()
+        self._z = z
+
+    def can_write(self, info):
+        """True if info's data can be written as it's stored
+
+        :param zipfile.ZipInfo info: The entry in its source zipfile.
+        :rtype: bool
+
+        """
+        z = self._z
+        for attr in self._ZIPFILE_INTERNALS:
+            if getattr(z, attr, None) is None:
+                return False
+        if not callable(getattr(zipfile.ZipInfo, "FileHeader", None)):
+            return False
+        if getattr(z, "_writing", False) or z.mode not in ("w", "a"):
+            return False
+        if info.flag_bits & 0x01:  # encrypted
+            return False
+        limit = zipfile.ZIP64_LIMIT
+        return (info.file_size < limit and info.compress_size < limit
+                and self._tell() < limit)
+
+    def _tell(self):
+        """Internal: offset for the next entry"""
+        # Newer zipfiles track where the central directory is to go,
+        # and seek there before each write.
+        start_dir = getattr(self._z, "start_dir", None)
+        if start_dir is not None:
+            return start_dir
+        return self._z.fp.tell()
+
+    def write(self, zi, info, data):
+        """Writes a new entry with data copied from another
+
+        :param zipfile.ZipInfo zi: The new entry. Its name, timestamp,
+          and attributes are used.
+        :param zipfile.ZipInfo info: The source entry, see can_write().
+        :param bytes data: The source entry's data as stored, as
+          returned by zipfile_read_raw().
+
+        """
+        z = self._z
+        zi.compress_type = info.compress_type
+        zi.CRC = info.CRC
+        zi.compress_size = info.compress_size
+        zi.file_size = info.file_size
+        zi.header_offset = self._tell()
+        z._writecheck(zi)
+        z._didModify = True
+        z.fp.seek(zi.header_offset)
+        z.fp.write(zi.FileHeader())
+        z.fp.write(data)
+        z.fp.flush()
+        if getattr(z, "start_dir", None) is not None:
+            z.start_dir = z.fp.tell()
+        z.filelist.append(zi)
+        z.NameToInfo[zi.filename] = zi
+
+
 def run_garbage_collector():
     logger.info('MEM: garbage collector run, collected %d objects',
                 gc.collect())
@@ -1004,6 +1004,14 @@ class LayerBaseSnapshot (object):
         layer.visible = self.visible
         layer.locked = self.locked
 
+    def iter_surface_snapshots(self):
+        """Iterates over the surface snapshots this snapshot holds
+
+        These hold the bulk of an undo history's memory. The base
+        implementation holds none.
+        """
+        return iter(())
+
 
 class ExternallyEditable:
     """Interface for layers which can be edited in an external app"""
@@ -16,6 +16,7 @@ from __future__ import division, print_function
 import zlib
 import logging
 import os
+import sys
 from cStringIO import StringIO
 import time
 import zipfile
@@ -38,6 +39,7 @@ import core
 import lib.layer.error
 import lib.autosave
 import lib.xml
+import lib.tilefile
 
 
 ## Base classes
@@ -62,6 +64,16 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
     #: Substitute content if the layer cannot be loaded.
     FALLBACK_CONTENT = None
 
+    #: Decode PNGs from .ora files only when their tiles are first needed.
+    #: See _load_surface_from_orazip_member().
+    DEFER_ORAZIP_PNG_LOADS = True
+
+    #: Where deferred-load PNG files are kept, within the cache folder.
+    DEFERRED_LOADS_SUBDIR = u"deferred"
+
+    #: The kind of surface to keep the pixels in.
+    SURFACE_CLASS = tiledsurface.Surface
+
     ## Initialization
 
     def __init__(self, surface=None, **kwargs):
@@ -72,18 +84,29 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
 
         If `surface` is specified, content observers will not be attached, and
         the layer will not be cleared during construction. The default is to
-        instantiate and use a new, observed, `tiledsurface.Surface`.
+        instantiate and use a new, observed, `SURFACE_CLASS`.
         """
         super(SurfaceBackedLayer, self).__init__(**kwargs)
 
         # Pluggable surface implementation
         # Only connect observers if using the default tiled surface
         if surface is None:
-            self._surface = tiledsurface.Surface()
-            self._surface.observers.append(self._content_changed)
+            self._surface = self.SURFACE_CLASS()
+            self._surface.observers.append(self._surface_content_changed)
         else:
             self._surface = surface
 
+        # True if the last autosave copied a not-yet-loaded PNG
+        self._autosaved_deferred_png = False
+
+        # Data ids of the tiles in the autosaved tile file, by position
+        self._autosaved_tiles = None
+
+        # The .ora member holding exactly what's in the surface, if any,
+        # and the one being written by a save which hasn't finished yet.
+        self._orazip_member = None
+        self._orazip_member_pending = None
+
     @classmethod
     def new_from_surface_backed_layer(cls, src):
         """Clone from another SurfaceBackedLayer
@@ -180,13 +203,70 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         Intended strictly for override by subclasses which need to first
         extract and then keep the file around afterwards.
 
+        If DEFER_ORAZIP_PNG_LOADS is set, PNG members are extracted
+        into the document's cache folder without being decoded. The
+        surface decodes the extracted copy the first time its tiles are
+        needed, so hidden layers, and layers which are never drawn, are
+        never expanded into tile memory.
+
         """
+        if self.DEFER_ORAZIP_PNG_LOADS and cache_dir:
+            src_ext = os.path.splitext(src)[1].lower()
+            if src_ext == ".png":
+                bbox = self._load_surface_from_orazip_member_deferred(
+                    orazip, cache_dir, src, x, y,
+                )
+                if bbox is not None:
+                    self._orazip_member = _OraZipMember.new_for_zipfile(
+                        orazip, src, bbox,
+                    )
+                    return
         pixbuf = lib.pixbuf.load_from_zipfile(
             datazip=orazip,
             filename=src,
             feedback_cb=feedback_cb,
         )
         self.load_surface_from_pixbuf(pixbuf, x=x, y=y)
+        if os.path.splitext(src)[1].lower() == ".png":
+            rect = (x, y, pixbuf.get_width(), pixbuf.get_height())
+            self._orazip_member = _OraZipMember.new_for_zipfile(
+                orazip, src, rect,
+            )
+
+    def _load_surface_from_orazip_member_deferred(self, orazip, cache_dir,
+                                                  src, x, y):
+        """Extracts a PNG member, and arranges for it to be loaded later
+
+        :returns: the bbox that will be loaded, or None on failure
+        :rtype: tuple
+
+        If this returns None, nothing has changed, and the caller should
+        load the member immediately instead.
+
+        """
+        tmpdir = os.path.join(cache_dir, "tmp")
+        if not os.path.isdir(tmpdir):
+            os.makedirs(tmpdir)
+        deferred_dir = os.path.join(cache_dir, self.DEFERRED_LOADS_SUBDIR)
+        if not os.path.isdir(deferred_dir):
+            os.makedirs(deferred_dir)
+        tmp_filename = orazip.extract(src, path=tmpdir)
+        if not isinstance(tmp_filename, unicode):
+            tmp_filename = tmp_filename.decode(sys.getfilesystemencoding())
+        managed_file = _ManagedFile(
+            tmp_filename,
+            move=True,
+            dir=deferred_dir,
+        )
+        bbox = self._surface.load_from_png_deferred(
+            unicode(managed_file),
+            x, y,
+            keepalive=managed_file,
+            convert_to_srgb=False,
+        )
+        if bbox is None:
+            logger.debug("Cannot defer loading %r, loading it now", src)
+        return bbox
 
     def load_from_openraster_dir(self, oradir, elem, cache_dir, feedback_cb,
                                  x=0, y=0, **kwargs):
@@ -214,6 +294,13 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
             x, y,
             self.__class__.__name__,
             )
+        # Autosaved tile files. See _queue_autosave_tile_file().
+        if src_ext == lib.tilefile.SUFFIX:
+            self._surface.load_from_tile_file(
+                os.path.join(oradir, src),
+                x, y,
+            )
+            return
         suffixes = self.ALLOWED_SUFFIXES
         if ("" not in suffixes) and (src_ext not in suffixes):
             logger.debug(
@@ -270,7 +357,7 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
     def load_surface_from_pixbuf(self, pixbuf, x=0, y=0):
         """Loads the layer's surface from a GdkPixbuf"""
         arr = helpers.gdkpixbuf2numpy(pixbuf)
-        surface = tiledsurface.Surface()
+        surface = self.SURFACE_CLASS()
         bbox = surface.load_from_numpy(arr, x, y)
         self.load_from_surface(surface)
         return bbox
@@ -279,6 +366,12 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         """Clears the layer"""
         self._surface.clear()
 
+    def _surface_content_changed(self, *args):
+        """Internal: forget the matching .ora member, then notify"""
+        self._orazip_member = None
+        self._orazip_member_pending = None
+        self._content_changed(*args)
+
     ## Info methods
 
     @property
@@ -385,10 +478,24 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
     def save_to_openraster(self, orazip, tmpdir, path,
                            canvas_bbox, frame_bbox, **kwargs):
         """Saves the layer's data into an open OpenRaster ZipFile"""
-        rect = self.get_bbox()
+        rect = self._get_orazip_save_rect()
         return self._save_rect_to_ora(orazip, tmpdir, "layer", path,
                                       frame_bbox, rect, **kwargs)
 
+    def _get_orazip_save_rect(self):
+        """Internal: the rectangle which save_to_openraster() will write
+
+        This is normally the data bbox, but if the surface is unchanged
+        since it was last loaded from or saved to an .ora file, the
+        rectangle of that file's PNG is used so that its data can be
+        reused as-is.
+
+        """
+        member = self._orazip_member
+        if member is not None and member.is_current():
+            return member.rect
+        return tuple(self.get_bbox())
+
     def queue_autosave(self, oradir, taskproc, manifest, bbox, **kwargs):
         """Queues the layer for auto-saving"""
 
@@ -404,11 +511,37 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         # mypaint-specific attribute name. If/when OpenRaster
         # standardizes looped layer data, that code should be moved
         # here.
+        #
+        # Other layers whose data is loaded use a tile file instead,
+        # which can be updated with just the tiles that changed.
+
+        deferred = self._surface.deferred_load_source
+        if deferred is None and not self._surface.looped:
+            return self._queue_autosave_tile_file(
+                oradir, taskproc, manifest, bbox,
+            )
 
         png_basename = self.autosave_uuid + ".png"
         png_relpath = os.path.join("data", png_basename)
         png_path = os.path.join(oradir, png_relpath)
         png_bbox = self._surface.looped and bbox or tuple(self.get_bbox())
+
+        # Surfaces which haven't been loaded yet already have a PNG
+        # with exactly the right content, so just copy that. It has its
+        # own position and size though. Remember that it was used,
+        # because the bbox after loading will be different.
+        if deferred is not None:
+            src_path, png_bbox = deferred
+            if self.autosave_dirty or not os.path.exists(png_path):
+                tmp_path = png_path + ".tmp"
+                shutil.copyfile(src_path, tmp_path)
+                lib.fileutils.replace(tmp_path, png_path)
+                self.autosave_dirty = False
+            self._autosaved_deferred_png = True
+        elif self._autosaved_deferred_png:
+            self._autosaved_deferred_png = False
+            self.autosave_dirty = True
+
         if self.autosave_dirty or not os.path.exists(png_path):
             task = tiledsurface.PNGFileUpdateTask(
                 surface = self._surface,
@@ -431,6 +564,38 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         elem.attrib["src"] = png_relpath
         return elem
 
+    def _queue_autosave_tile_file(self, oradir, taskproc, manifest, bbox):
+        """Internal: queues an autosave of the surface as a tile file
+
+        Only the tiles which changed since the last autosave are
+        written, so this costs time in proportion to how much was
+        painted. The tile file is an append-only journal of those
+        changes, compacted when it gets too big. See lib.tilefile.
+
+        """
+        tiles_basename = self.autosave_uuid + lib.tilefile.SUFFIX
+        tiles_relpath = os.path.join("data", tiles_basename)
+        tiles_path = os.path.join(oradir, tiles_relpath)
+        if self._autosaved_deferred_png:
+            self._autosaved_deferred_png = False
+            self.autosave_dirty = True
+        if self.autosave_dirty or not os.path.exists(tiles_path):
+            task = tiledsurface.TileFileUpdateTask(
+                surface = self._surface,
+                filename = tiles_path,
+                written_tiles = self._autosaved_tiles,
+                tile_journal = self._surface.take_tile_journal(),
+            )
+            taskproc.add_work(task)
+            self._autosaved_tiles = task.written_tiles
+            self.autosave_dirty = False
+        # Tile coordinates in the file are absolute.
+        manifest.add(tiles_relpath)
+        ref_x, ref_y = bbox[0:2]
+        elem = self._get_stackxml_element("layer", -ref_x, -ref_y)
+        elem.attrib["src"] = tiles_relpath
+        return elem
+
     @staticmethod
     def _make_refname(prefix, path, suffix, sep='-'):
         """Internal: standardized filename for something wiith a path"""
@@ -442,20 +607,39 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
 
     def _save_rect_to_ora(self, orazip, tmpdir, prefix, path,
                           frame_bbox, rect, **kwargs):
-        """Internal: saves a rectangle of the surface to an ORA zip"""
-        # Write PNG data via a tempfile
+        """Internal: saves a rectangle of the surface to an ORA zip
+
+        If the surface hasn't changed since it was last loaded from or
+        saved to an .ora file which is still on disk, and the same
+        rectangle is being saved, the PNG data is copied from that file
+        instead of being encoded again.
+
+        """
         pngname = self._make_refname(prefix, path, ".png")
-        pngpath = os.path.join(tmpdir, pngname)
-        t0 = time.time()
-        self._surface.save_as_png(pngpath, *rect, **kwargs)
-        t1 = time.time()
-        logger.debug('%.3fs surface saving %r', t1-t0, pngname)
-        # Archive and remove
         storepath = "data/%s" % (pngname,)
-        orazip.write(pngpath, storepath)
-        os.remove(pngpath)
-        # Return details
         png_bbox = tuple(rect)
+        t0 = time.time()
+        member = self._orazip_member
+        if member is not None and member.rect == png_bbox:
+            reused = member.copy_to_zipfile(orazip, storepath)
+        else:
+            reused = False
+        if reused:
+            t1 = time.time()
+            logger.debug('%.3fs surface reusing %r', t1-t0, pngname)
+        else:
+            # Write PNG data via a tempfile
+            pngpath = os.path.join(tmpdir, pngname)
+            self._surface.save_as_png(pngpath, *rect, **kwargs)
+            t1 = time.time()
+            logger.debug('%.3fs surface saving %r', t1-t0, pngname)
+            # Archive and remove
+            orazip.write(pngpath, storepath)
+            os.remove(pngpath)
+        # The file being written only becomes reusable if the save
+        # succeeds. See commit_orazip_save().
+        self._orazip_member_pending = (storepath, png_bbox)
+        # Return details
         png_x, png_y = png_bbox[0:2]
         ref_x, ref_y = frame_bbox[0:2]
         x = png_x - ref_x
@@ -465,6 +649,23 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         elem.attrib["src"] = storepath
         return elem
 
+    def commit_orazip_save(self, filename):
+        """Notes that a save to an OpenRaster file has completed
+
+        :param unicode filename: The file's final location on disk.
+
+        The PNG data written by the most recent save_to_openraster()
+        call can then be reused by the next save, if the layer's surface
+        doesn't change in the meantime.
+
+        """
+        pending = self._orazip_member_pending
+        self._orazip_member_pending = None
+        if pending is None or not os.path.isfile(filename):
+            return
+        storepath, rect = pending
+        self._orazip_member = _OraZipMember(filename, storepath, rect)
+
     ## Painting symmetry axis
 
     def set_symmetry_state(self, active, center_x, center_y, symmetry_type, rot_symmetry_lines):
@@ -546,6 +747,9 @@ class SurfaceBackedLayerSnapshot (core.LayerBaseSnapshot):
         super(SurfaceBackedLayerSnapshot, self).restore_to_layer(layer)
         layer._surface.load_snapshot(self.surface_sshot)
 
+    def iter_surface_snapshots(self):
+        yield self.surface_sshot
+
 
 class FileBackedLayer (SurfaceBackedLayer, core.ExternallyEditable):
     """A layer with primarily file-based storage
@@ -566,6 +770,9 @@ class FileBackedLayer (SurfaceBackedLayer, core.ExternallyEditable):
     ALLOWED_SUFFIXES = []
     REVISIONS_SUBDIR = u"revisions"
 
+    # The surface only shows a rendering of the file: 8 bits are plenty.
+    SURFACE_CLASS = tiledsurface.Surface8
+
     ## Construction
 
     def __init__(self, x=0, y=0, **kwargs):
@@ -953,6 +1160,94 @@ class _ManagedFile (object):
                          file_path)
 
 
+class _OraZipMember (object):
+    """A PNG member of an .ora file on disk, matching a layer's surface
+
+    Layers keep one of these around for as long as their surface is
+    unchanged since it was loaded from or saved to an OpenRaster file.
+    When the document is saved again, the member's PNG data can be
+    copied verbatim into the new file instead of being re-encoded.
+
+    The file's size, modification time and inode are recorded too, so
+    that a file which has been rewritten by another program is not
+    trusted.
+
+    """
+
+    def __init__(self, filename, storepath, rect):
+        """Initialize, recording the state of an .ora file on disk
+
+        :param unicode filename: The .ora file
+        :param unicode storepath: Name of the PNG member within it
+        :param tuple rect: Where the PNG's pixels go: (x, y, w, h)
+
+        """
+        super(_OraZipMember, self).__init__()
+        self.filename = filename
+        self.storepath = storepath
+        self.rect = tuple(int(c) for c in rect)
+        self._stat = self._get_stat(filename)
+
+    @classmethod
+    def new_for_zipfile(cls, orazip, storepath, rect):
+        """Record a member of a zipfile open for reading
+
+        :returns: a new record, or None if the zip has no filename
+        :rtype: _OraZipMember
+
+        """
+        filename = orazip.filename
+        if not filename:
+            return None
+        if not isinstance(filename, unicode):
+            filename = filename.decode(sys.getfilesystemencoding())
+        filename = os.path.realpath(filename)
+        if not os.path.isfile(filename):
+            return None
+        return cls(filename, storepath, rect)
+
+    @staticmethod
+    def _get_stat(filename):
+        try:
+            st = os.stat(filename)
+        except OSError:
+            return None
+        return (st.st_size, st.st_mtime, st.st_ino)
+
+    def is_current(self):
+        """True if the file on disk is the one recorded"""
+        stat = self._get_stat(self.filename)
+        return (stat is not None) and (stat == self._stat)
+
+    def copy_to_zipfile(self, orazip, storepath):
+        """Copy the member's data into a zipfile open for writing
+
+        :param zipfile.ZipFile orazip: Destination
+        :param unicode storepath: Name for the new member
+        :returns: whether the data was copied
+        :rtype: bool
+
+        The compressed data is copied as stored where possible, without
+        being inflated and deflated again. Nothing is written if the file on disk has
+        changed or cannot be read, and the caller should save the layer
+        normally instead.
+
+        """
+        if not self.is_current():
+            return False
+        try:
+            with zipfile.ZipFile(self.filename) as srczip:
+                helpers.zipfile_copy_raw(srczip, self.storepath,
+                                         orazip, storepath)
+        except (IOError, OSError, KeyError, zipfile.BadZipfile) as err:
+            logger.warning(
+                "Cannot reuse %r from %r: %r",
+                self.storepath, self.filename, str(err),
+            )
+            return False
+        return True
+
+
 ## Data layer classes
 
 
@@ -996,6 +1291,8 @@ class BackgroundLayer (SurfaceBackedLayer):
         """Sets the surface from a tiledsurface.Background"""
         assert isinstance(surface, tiledsurface.Background)
         self.autosave_dirty = True
+        self._orazip_member = None
+        self._orazip_member_pending = None
         self._surface = surface
 
     def save_to_openraster(self, orazip, tmpdir, path,
@@ -1375,6 +1672,28 @@ class PaintingLayer (SurfaceBackedLayer, core.ExternallyEditable):
         self.autosave_dirty = True
         return split
 
+    def stroke_to_many(self, brush, events, stop_at_split=False):
+        """Render many parts of a stroke at once
+
+        :param brush: The brush to use for rendering dabs
+        :type brush: lib.brush.Brush
+        :param numpy.ndarray events: Nx6 float64 array of
+          (dtime, x, y, pressure, xtilt, ytilt) rows
+        :param bool stop_at_split: Stop after the first split
+        :returns: number of events rendered, and whether to split
+        :rtype: tuple
+
+        This is the same as calling `stroke_to()` for each event, but
+        the whole array is handled natively.
+        """
+        self._surface.begin_atomic()
+        n, split = brush.stroke_to_many(
+            self._surface.backend, events, stop_at_split,
+        )
+        self._surface.end_atomic()
+        self.autosave_dirty = True
+        return n, split
+
     def render_stroke(self, stroke):
         """Render a whole captured stroke to the canvas
 
@@ -1487,8 +1806,8 @@ class PaintingLayer (SurfaceBackedLayer, core.ExternallyEditable):
             orazip, tmpdir, path,
             canvas_bbox, frame_bbox, **kwargs
         )
-        # Store stroke shape data too
-        x, y, w, h = self.get_bbox()
+        # Store stroke shape data too, relative to the PNG's origin
+        x, y, w, h = self._orazip_member_pending[1]
         sio = StringIO()
         t0 = time.time()
         _write_strokemap(sio, self.strokes, -x, -y)
@@ -372,8 +372,7 @@ class LayerStack (core.LayerBase, lib.autosave.Autosaveable):
     def blit_tile_into(self, dst, dst_has_alpha, tx, ty, mipmap_level=0,
                        **kwargs):
         """Unconditionally copy one tile's data into an array"""
-        N = tiledsurface.N
-        tmp = np.zeros((N, N, 4), dtype='uint16')
+        tmp = lib.mypaintlib.tile_buffer_new_rgba16(None)
         for layer in reversed(self._layers):
             layer.composite_tile(tmp, True, tx, ty, mipmap_level,
                                  layers=None, **kwargs)
@@ -411,8 +410,7 @@ class LayerStack (core.LayerBase, lib.autosave.Autosaveable):
         if isolate and solo and self is not solo:
             isolate = False
         if isolate:
-            N = tiledsurface.N
-            tmp = np.zeros((N, N, 4), dtype='uint16')
+            tmp = lib.mypaintlib.tile_buffer_new_rgba16(None)
             for layer in reversed(self._layers):
                 p = (self is previewing) and layer or previewing
                 s = (self is solo) and layer or solo
@@ -566,6 +564,11 @@ class LayerStackSnapshot (core.LayerBaseSnapshot):
             child.load_snapshot(snap)
             layer._layers.append(child)
 
+    def iter_surface_snapshots(self):
+        for snap in self.layer_snaps:
+            for surface_sshot in snap.iter_surface_snapshots():
+                yield surface_sshot
+
 
 class LayerStackMove (object):
     """Move object wrapper for layer stacks"""
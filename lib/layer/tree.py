@@ -380,8 +380,6 @@ class RootLayerStack (group.LayerStack):
             background_surface = self._blank_bg_surface
         assert dst.shape[-1] == 4
 
-        N = tiledsurface.N
-
         cache_key = None
         cache_hit = False
         if dst.dtype == 'uint8':
@@ -397,7 +395,7 @@ class RootLayerStack (group.LayerStack):
                              render_background, id(opaque_base_tile))
                 dst = self._render_cache.get(cache_key)
             if dst is None:
-                dst = np.empty((N, N, 4), dtype='uint16')
+                dst = lib.mypaintlib.tile_buffer_empty_rgba16()
             else:
                 cache_hit = True
         else:
@@ -411,7 +409,7 @@ class RootLayerStack (group.LayerStack):
                     opaque_base_tile,
                     dst_over_opaque_base,
                 )
-                dst = np.empty((N, N, 4), dtype='uint16')
+                dst = lib.mypaintlib.tile_buffer_empty_rgba16()
 
             background_surface.blit_tile_into(dst, dst_has_alpha, tx, ty,
                                               mipmap_level)
@@ -1707,9 +1705,8 @@ class RootLayerStack (group.LayerStack):
         # Render loop
         logger.debug("Normalize: render using backdrop %r", backdrop_layers)
         dstsurf = dstlayer._surface
-        N = tiledsurface.N
         for tx, ty in tiles:
-            bd = np.zeros((N, N, 4), dtype='uint16')
+            bd = lib.mypaintlib.tile_buffer_new_rgba16(None)
             for layer in backdrop_layers:
                 if layer is self._background_layer:
                     surf = self._background_layer._surface
@@ -2078,6 +2075,22 @@ class RootLayerStack (group.LayerStack):
         stack_elem.append(bg_elem)
         return stack_elem
 
+    def commit_orazip_save(self, filename):
+        """Notes that save_to_openraster() wrote a complete file
+
+        :param unicode filename: Final location of the saved file
+
+        Call this once the file written by save_to_openraster() is in
+        its final place on disk. Layers which haven't changed by the
+        next save can then copy their data from it.
+
+        """
+        layers = [l for (p, l) in self.walk()]
+        layers.append(self.background_layer)
+        for layer in layers:
+            if isinstance(layer, data.SurfaceBackedLayer):
+                layer.commit_orazip_save(filename)
+
     def queue_autosave(self, oradir, taskproc, manifest, bbox, **kwargs):
         """Queues the layer for auto-saving"""
         stack_elem = super(RootLayerStack, self).queue_autosave(
@@ -2161,6 +2174,13 @@ class RootLayerStackSnapshot (group.LayerStackSnapshot):
         layer.background_visible = self.bg_visible
         layer.current_path = self.current_path
 
+    def iter_surface_snapshots(self):
+        sshots = super(RootLayerStackSnapshot, self).iter_surface_snapshots()
+        for surface_sshot in sshots:
+            yield surface_sshot
+        for surface_sshot in self.bg_sshot.iter_surface_snapshots():
+            yield surface_sshot
+
 
 ## Layer path tuple functions
 
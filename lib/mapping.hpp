@@ -20,13 +20,28 @@
 
 #include <mypaint-mapping.h>
 
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
 // user-defined mappings
 // (the curves you can edit in the brush settings)
+//
+// Curves are evaluated through a lookup table per input, compiled when
+// they're first used after a change. The table holds the curve's value
+// at LUT_SIZE + 1 evenly spaced points between its first and last
+// control points. Between the control points a curve is linear, so the
+// values in between are interpolated from the table. Table bins with a
+// control point inside, and inputs outside the table, are worked out
+// segment by segment like libmypaint does. Results match
+// mypaint_mapping_calculate() to within float rounding.
 class MappingWrapper {
 
 public:
   MappingWrapper(int inputs_) {
       c_mapping = mypaint_mapping_new(inputs_);
+      inputs = inputs_;
+      compiled = false;
   }
   ~MappingWrapper() {
       mypaint_mapping_free(c_mapping);
@@ -35,11 +50,13 @@ public:
   void set_n (int input, int n)
   {
       mypaint_mapping_set_n(c_mapping, input, n);
+      compiled = false;
   }
 
   void set_point (int input, int index, float x, float y)
   {
       mypaint_mapping_set_point(c_mapping, input, index, x, y);
+      compiled = false;
   }
 
   bool is_constant()
@@ -49,17 +66,154 @@ public:
 
   float calculate (float * data)
   {
-      return mypaint_mapping_calculate(c_mapping, data);
+      compile();
+      float result = base_value;
+      for (int j = 0; j < inputs; j++) {
+          if (curves[j].n) {
+              result += curves[j].evaluate(data[j]);
+          }
+      }
+      return result;
   }
 
   // used in python for the global pressure mapping
   float calculate_single_input (float input)
   {
-      return mypaint_mapping_calculate_single_input(c_mapping, input);
+      compile();
+      if (! curves[0].n) {
+          return base_value;
+      }
+      return base_value + curves[0].evaluate(input);
+  }
+
+  // Evaluates the mapping for many inputs at once. For a mapping with one
+  // input, takes an array of N inputs, otherwise an Nx(inputs) array.
+  // Returns an array of N float64 results.
+  PyObject *calculate_many (PyObject *data)
+  {
+      compile();
+      PyArrayObject *arr = (PyArrayObject *)PyArray_FROM_OTF(
+          data, NPY_FLOAT64, NPY_ARRAY_IN_ARRAY);
+      if (! arr) {
+        return NULL;
+      }
+      const bool shape_ok = (PyArray_NDIM(arr) == 1 && inputs == 1)
+                         || (PyArray_NDIM(arr) == 2
+                             && PyArray_DIM(arr, 1) == inputs);
+      if (! shape_ok) {
+        Py_DECREF(arr);
+        PyErr_SetString(PyExc_ValueError,
+                        "data must be an array of N rows of inputs");
+        return NULL;
+      }
+      npy_intp n = PyArray_DIM(arr, 0);
+      PyObject *result = PyArray_SimpleNew(1, &n, NPY_FLOAT64);
+      if (result) {
+        const double *in = (const double *)PyArray_DATA(arr);
+        double *out = (double *)PyArray_DATA((PyArrayObject *)result);
+        for (npy_intp i = 0; i < n; i++, in += inputs) {
+            float y = base_value;
+            for (int j = 0; j < inputs; j++) {
+                if (curves[j].n) {
+                    y += curves[j].evaluate(in[j]);
+                }
+            }
+            out[i] = y;
+        }
+      }
+      Py_DECREF(arr);
+      return result;
   }
+
 private:
+  static const int LUT_SIZE = 256;
+
+  struct Curve {
+      int n;
+      std::vector<float> xs;
+      std::vector<float> ys;
+      bool use_lut;
+      float x_lo;
+      float scale;    // table bins per input unit
+      float lut[LUT_SIZE + 1];
+      bool exact[LUT_SIZE];
+
+      // The same segment search and interpolation as libmypaint's
+      float evaluate_exact (float x) const {
+          float x0 = xs[0], y0 = ys[0];
+          float x1 = xs[1], y1 = ys[1];
+          for (int i = 2; i < n && x > x1; i++) {
+              x0 = x1; y0 = y1;
+              x1 = xs[i]; y1 = ys[i];
+          }
+          if (x0 == x1 || y0 == y1) {
+              return y0;
+          }
+          return (y1*(x - x0) + y0*(x1 - x)) / (x1 - x0);
+      }
+
+      float evaluate (float x) const {
+          const float t = (x - x_lo) * scale;
+          // also false for NaN
+          if (! (use_lut && t >= 0 && t < LUT_SIZE)) {
+              return evaluate_exact(x);
+          }
+          const int i = (int)t;
+          if (exact[i]) {
+              return evaluate_exact(x);
+          }
+          return lut[i] + (t - i) * (lut[i+1] - lut[i]);
+      }
+
+      void compile (MyPaintMapping *mapping, int input) {
+          n = mypaint_mapping_get_n(mapping, input);
+          xs.resize(n);
+          ys.resize(n);
+          for (int i = 0; i < n; i++) {
+              mypaint_mapping_get_point(mapping, input, i, &xs[i], &ys[i]);
+          }
+          use_lut = (n >= 2 && xs[n-1] > xs[0]);
+          if (! use_lut) {
+              return;
+          }
+          x_lo = xs[0];
+          scale = LUT_SIZE / (xs[n-1] - xs[0]);
+          for (int i = 0; i <= LUT_SIZE; i++) {
+              lut[i] = evaluate_exact(x_lo + i / scale);
+          }
+          // Bins where the slope may change, allowing for rounding
+          std::fill(exact, exact + LUT_SIZE, false);
+          for (int k = 1; k < n-1; k++) {
+              const float t = (xs[k] - x_lo) * scale;
+              const int lo = (int)floor(t - 0.01);
+              const int hi = (int)floor(t + 0.01);
+              for (int i = lo; i <= hi; i++) {
+                  if (i >= 0 && i < LUT_SIZE) {
+                      exact[i] = true;
+                  }
+              }
+          }
+      }
+  };
+
+  void compile ()
+  {
+      if (compiled) {
+          return;
+      }
+      base_value = mypaint_mapping_get_base_value(c_mapping);
+      curves.resize(inputs);
+      for (int j = 0; j < inputs; j++) {
+          curves[j].compile(c_mapping, j);
+      }
+      compiled = true;
+  }
+
   MyPaintMapping *c_mapping;
+  int inputs;
+  bool compiled;
+  float base_value;
+  std::vector<Curve> curves;
 };
 
 #endif //MAPPING_HPP
-
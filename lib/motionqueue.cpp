@@ -0,0 +1,340 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2017 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "motionqueue.hpp"
+
+#include "common.hpp"
+
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#define NO_IMPORT_ARRAY
+#include <numpy/arrayobject.h>
+
+#include <math.h>
+#include <algorithm>
+
+
+static const int MOTION_EVENT_FIELDS = 6;
+
+// Zero-dtime events older than this are spread over this much time only
+static const double ZERO_DTIME_MAX_INTERVAL = 100.0;
+
+
+static inline bool
+has_axes(const MotionEvent &e)
+{
+    return ! (isnan(e.pressure) || isnan(e.xtilt) || isnan(e.ytilt));
+}
+
+
+// Catmull-Rom spline between p0 and p1, like gui.drawutils.spline_4p()
+
+static inline double
+spline_4p(double t, double p_1, double p0, double p1, double p2)
+{
+    return (
+        t*((2-t)*t - 1) * p_1
+        + (t*t*(3*t - 5) + 2) * p0
+        + t*((4 - 3*t)*t + 1) * p1
+        + (t-1)*t*t * p2
+    ) / 2;
+}
+
+
+// Clamps, also mapping NaN to lo
+
+static inline double
+clamp_axis(double v, double lo, double hi)
+{
+    if (! (v >= lo)) {
+        return lo;
+    }
+    return (v > hi) ? hi : v;
+}
+
+
+static PyObject *
+events_to_array(const std::vector<MotionEvent> &events)
+{
+    npy_intp dims[2] = {(npy_intp)events.size(), MOTION_EVENT_FIELDS};
+    PyObject *result = PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    if (! result) {
+        return NULL;
+    }
+    double *out = (double *)PyArray_DATA((PyArrayObject *)result);
+    for (size_t i = 0; i < events.size(); i++, out += MOTION_EVENT_FIELDS) {
+        const MotionEvent &e = events[i];
+        out[0] = e.time;
+        out[1] = e.x;
+        out[2] = e.y;
+        out[3] = e.pressure;
+        out[4] = e.xtilt;
+        out[5] = e.ytilt;
+    }
+    return result;
+}
+
+
+// PressureAndTiltInterpolator
+
+PressureAndTiltInterpolator::PressureAndTiltInterpolator()
+{
+    clear();
+}
+
+
+void
+PressureAndTiltInterpolator::clear()
+{
+    has_pt0_prev = has_pt0 = has_pt1 = has_pt1_next = false;
+    np.clear();
+    np_next.clear();
+}
+
+
+void
+PressureAndTiltInterpolator::step()
+{
+    pt0_prev = pt0;
+    has_pt0_prev = has_pt0;
+    pt0 = pt1;
+    has_pt0 = has_pt1;
+    pt1 = pt1_next;
+    has_pt1 = has_pt1_next;
+    has_pt1_next = false;
+    np.swap(np_next);
+    np_next.clear();
+}
+
+
+// Interpolates between p0 and p1, but doesn't step or clear
+
+void
+PressureAndTiltInterpolator::interpolate_p0_p1(std::vector<MotionEvent> &out)
+{
+    if (has_pt0 && has_pt1 && ! np.empty()) {
+        const MotionEvent &p0p = has_pt0_prev ? pt0_prev : pt0;
+        const MotionEvent &p1n = has_pt1_next ? pt1_next : pt1;
+        const double t0 = pt0.time;
+        const double dt = pt1.time - t0;
+        if (dt > 0) {
+            for (size_t i = 0; i < np.size(); i++) {
+                MotionEvent e = np[i];
+                const double t = (e.time - t0) / dt;
+                e.pressure = spline_4p(t, p0p.pressure, pt0.pressure,
+                                       pt1.pressure, p1n.pressure);
+                e.xtilt = spline_4p(t, p0p.xtilt, pt0.xtilt,
+                                    pt1.xtilt, p1n.xtilt);
+                e.ytilt = spline_4p(t, p0p.ytilt, pt0.ytilt,
+                                    pt1.ytilt, p1n.ytilt);
+                out.push_back(e);
+            }
+        }
+    }
+    if (has_pt1) {
+        out.push_back(pt1);
+    }
+}
+
+
+void
+PressureAndTiltInterpolator::feed_event(const MotionEvent &event,
+                                        std::vector<MotionEvent> &out)
+{
+    if (! has_axes(event)) {
+        np_next.push_back(event);
+        return;
+    }
+    pt1_next = event;
+    has_pt1_next = true;
+    interpolate_p0_p1(out);
+    if (pt1_next.pressure > 0.0 && has_pt1 && pt1.pressure <= 0.0) {
+        // Transitions from zero to nonzero pressure
+        // Clear history to avoid artefacts
+        has_pt0_prev = false;   // ignore the current pt0
+        pt0 = pt1;
+        has_pt0 = true;
+        pt1 = pt1_next;
+        has_pt1_next = false;
+        np.clear();             // drop the buffer we've built up too
+        np_next.clear();
+    }
+    else if (pt1_next.pressure <= 0.0 && has_pt1 && pt1.pressure > 0.0) {
+        // Transitions from nonzero to zero pressure
+        // Tail off neatly by doubling the zero-pressure event
+        step();
+        pt1_next = pt1;
+        has_pt1_next = true;
+        interpolate_p0_p1(out);
+        // Then clear history
+        clear();
+    }
+    else {
+        // Normal forward of control points and event buffers
+        step();
+    }
+}
+
+
+int
+PressureAndTiltInterpolator::feed(double time, double x, double y,
+                                  double pressure, double xtilt, double ytilt)
+{
+    const MotionEvent e = {time, x, y, pressure, xtilt, ytilt};
+    feed_event(e, ready);
+    return ready.size();
+}
+
+
+PyObject *
+PressureAndTiltInterpolator::take_events()
+{
+    PyObject *result = events_to_array(ready);
+    ready.clear();
+    return result;
+}
+
+
+// MotionQueue
+
+MotionQueue::MotionQueue()
+    : last_queued_time(0)
+    , last_handled_time(0)
+    , smoothing(0)
+    , smoothed(false)
+    , smoothed_x(0)
+    , smoothed_y(0)
+    , smoothed_time(0)
+{
+}
+
+
+void
+MotionQueue::set_smoothing(double time_constant)
+{
+    smoothing = (time_constant > 0) ? time_constant : 0;
+}
+
+
+void
+MotionQueue::smooth(MotionEvent &e)
+{
+    if (smoothing > 0 && smoothed && e.pressure > 0) {
+        const double dt = std::max(e.time - smoothed_time, 0.0);
+        const double a = 1.0 - exp(-dt / smoothing);
+        smoothed_x += a * (e.x - smoothed_x);
+        smoothed_y += a * (e.y - smoothed_y);
+        e.x = smoothed_x;
+        e.y = smoothed_y;
+    }
+    else {
+        smoothed_x = e.x;
+        smoothed_y = e.y;
+    }
+    smoothed = true;
+    smoothed_time = e.time;
+}
+
+
+void
+MotionQueue::push(const MotionEvent &event)
+{
+    interp_out.clear();
+    interp.feed_event(event, interp_out);
+    for (size_t i = 0; i < interp_out.size(); i++) {
+        MotionEvent e = interp_out[i];
+        smooth(e);
+        ready.push_back(e);
+    }
+}
+
+
+bool
+MotionQueue::queue_motion(double time, double x, double y,
+                          double pressure, double xtilt, double ytilt)
+{
+    bool in_order = true;
+    if (time < last_queued_time) {
+        time = last_queued_time;
+        in_order = false;
+    }
+    if (time == last_queued_time) {
+        const MotionEvent e = {time, x, y, pressure, xtilt, ytilt};
+        zero_dtime_motions.push_back(e);
+        return in_order;
+    }
+    // Queue any previous events that had identical timestamps,
+    // linearly interpolating their times.
+    if (! zero_dtime_motions.empty()) {
+        const double dtime = time - last_queued_time;
+        double zt = last_queued_time;
+        double interval = dtime;
+        if (dtime > ZERO_DTIME_MAX_INTERVAL) {
+            // Really old events; don't associate them with the new one.
+            zt = time - ZERO_DTIME_MAX_INTERVAL;
+            interval = ZERO_DTIME_MAX_INTERVAL;
+        }
+        const double step = interval / (zero_dtime_motions.size() + 1);
+        for (size_t i = 0; i < zero_dtime_motions.size(); i++) {
+            MotionEvent e = zero_dtime_motions[i];
+            zt += step;
+            e.time = zt;
+            push(e);
+        }
+        zero_dtime_motions.clear();
+    }
+    const MotionEvent e = {time, x, y, pressure, xtilt, ytilt};
+    push(e);
+    last_queued_time = time;
+    return in_order;
+}
+
+
+int
+MotionQueue::get_size()
+{
+    return ready.size();
+}
+
+
+PyObject *
+MotionQueue::take_stroke_events(int max_events)
+{
+    size_t n = ready.size();
+    if (max_events > 0 && (size_t)max_events < n) {
+        n = max_events;
+    }
+    std::vector<MotionEvent> rows;
+    rows.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        const MotionEvent e = ready.front();
+        ready.pop_front();
+        const double last_time = last_handled_time;
+        last_handled_time = e.time;
+        if (! last_time) {
+            continue;
+        }
+        const MotionEvent row = {
+            (e.time - last_time) / 1000.0,
+            e.x,
+            e.y,
+            clamp_axis(e.pressure, 0.0, 1.0),
+            clamp_axis(e.xtilt, -1.0, 1.0),
+            clamp_axis(e.ytilt, -1.0, 1.0),
+        };
+        rows.push_back(row);
+    }
+    return events_to_array(rows);
+}
+
+
+void
+MotionQueue::discard()
+{
+    ready.clear();
+}
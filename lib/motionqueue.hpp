@@ -0,0 +1,140 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2017 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MOTIONQUEUE_HPP
+#define MOTIONQUEUE_HPP
+
+#include <Python.h>
+#include <deque>
+#include <vector>
+
+// Input event processing for freehand drawing (see gui/freehand.py).
+//
+// Events are (time, x, y, pressure, xtilt, ytilt). Times are in
+// milliseconds, and positions in model coordinates. Devices which don't
+// report pressure or tilt for every event send NaN for those instead.
+
+
+#ifndef SWIG
+struct MotionEvent {
+    double time;
+    double x;
+    double y;
+    double pressure;
+    double xtilt;
+    double ytilt;
+};
+#endif
+
+
+// Interpolates event sequences, filling in missing pressure and tilt.
+//
+// Events with pressure and tilt become control points. Missing values
+// in the events between two control points are interpolated along a
+// Catmull-Rom spline through the control points around them, once the
+// next control point is known. Events before the first control point
+// are dropped. Transitions between zero and nonzero pressure clear just
+// enough history to avoid hook-off and lead-in artefacts: feed in an
+// extra zero-pressure event at button-release time to get a clean
+// tailoff.
+
+class PressureAndTiltInterpolator
+{
+public:
+    PressureAndTiltInterpolator();
+
+    // Feeds in one event. Returns the number of events ready to take.
+    int feed(double time, double x, double y,
+             double pressure, double xtilt, double ytilt);
+
+    // Takes the events which are ready, as an Nx6 float64 array.
+    PyObject *take_events();
+
+    // Resets to the initial clean state.
+    void clear();
+
+#ifndef SWIG
+    // Feeds in one event, appending any events which are ready to out.
+    void feed_event(const MotionEvent &event,
+                    std::vector<MotionEvent> &out);
+#endif
+
+private:
+    void step();
+    void interpolate_p0_p1(std::vector<MotionEvent> &out);
+
+    // Events with all axis data present, forming control points
+    MotionEvent pt0_prev, pt0, pt1, pt1_next;
+    bool has_pt0_prev, has_pt0, has_pt1, has_pt1_next;
+    // Null-axis event sequences
+    std::vector<MotionEvent> np;
+    std::vector<MotionEvent> np_next;
+    // Output of feed(), for take_events()
+    std::vector<MotionEvent> ready;
+};
+
+
+// Queue of input events waiting to be painted.
+//
+// Raw events go in as they arrive. They are cleaned up, interpolated,
+// and optionally smoothed straight away, then wait here until the
+// painting code takes them as a batch for the brush engine.
+//
+// Events with the same timestamp as the previous one, which happens
+// with some platforms' coarse clocks, are spread out evenly over the
+// time since the previous timestamp once a later one arrives.
+
+class MotionQueue
+{
+public:
+    MotionQueue();
+
+    // Queues one raw event. Returns false if its time was earlier than
+    // the previous event's: then the previous time is used.
+    bool queue_motion(double time, double x, double y,
+                      double pressure, double xtilt, double ytilt);
+
+    // Position smoothing, as the time constant of an exponential moving
+    // average, in milliseconds. Only events with pressure are smoothed,
+    // so strokes start and end where the pen is. 0 turns it off, which
+    // is the default.
+    void set_smoothing(double time_constant);
+
+    // Number of events ready to be taken.
+    int get_size();
+
+    // Takes up to max_events of the ready events (all of them if
+    // max_events is 0) as an Nx6 float64 array of (dtime, x, y,
+    // pressure, xtilt, ytilt) rows, for PythonBrush::stroke_to_many().
+    // Times are in seconds since the previous event taken. Pressure is
+    // clamped to [0, 1] and tilts to [-1, 1]. The first event ever
+    // taken has no previous event, and is skipped.
+    PyObject *take_stroke_events(int max_events);
+
+    // Drops all ready events, e.g. when a stroke is cancelled.
+    void discard();
+
+private:
+    void push(const MotionEvent &event);
+    void smooth(MotionEvent &event);
+
+    PressureAndTiltInterpolator interp;
+    std::vector<MotionEvent> interp_out;
+    std::vector<MotionEvent> zero_dtime_motions;
+    std::deque<MotionEvent> ready;
+    double last_queued_time;
+    double last_handled_time;
+
+    double smoothing;
+    bool smoothed;
+    double smoothed_x, smoothed_y, smoothed_time;
+};
+
+
+#endif //MOTIONQUEUE_HPP
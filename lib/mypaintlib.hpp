@@ -15,6 +15,7 @@
 #include "brush.hpp"
 #include "python_brush.hpp"
 #include "helpers2.hpp"
+#include "tilestore.hpp"
 #include "tiledsurface.hpp"
 
 #include "pixops.hpp"
@@ -23,5 +24,8 @@
 #include "colorchanger_crossed_bowl.hpp"
 #include "gdkpixbuf2numpy.hpp"
 #include "fastpng.hpp"
+#include "fastjpeg.hpp"
 #include "fill.hpp"
+#include "strokecodec.hpp"
+#include "motionqueue.hpp"
 #include "brushsettings.hpp"
@@ -20,6 +20,8 @@ typedef struct { int x, y, w, h; } Rect;
 %include "mapping.hpp"
 
 %include "python_brush.hpp"
+%newobject TileStore::snapshot;
+%include "tilestore.hpp"
 %include "tiledsurface.hpp"
 
 %include "pixops.hpp"
@@ -27,7 +29,10 @@ typedef struct { int x, y, w, h; } Rect;
 %include "colorchanger_wash.hpp"
 %include "colorchanger_crossed_bowl.hpp"
 %include "fastpng.hpp"
+%include "fastjpeg.hpp"
 %include "fill.hpp"
+%include "strokecodec.hpp"
+%include "motionqueue.hpp"
 %include "brushsettings.hpp"
 
 %include "gdkpixbuf2numpy.hpp"
@@ -0,0 +1,177 @@
+# This file is part of MyPaint.
+# Copyright (C) 2017 by the MyPaint Development Team.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+
+"""Painting on a worker thread, away from the UI thread.
+
+Large or slow brushes can take longer to render than the time between
+input events. When painting happens on the UI thread, input events back
+up while dabs are rendered, and the canvas stops responding.
+
+A `PaintingThread` takes stroke segments from a bounded queue and
+renders them one after the other on its own thread. The brush engine
+runs with the GIL released (see lib/python_brush.hpp), so the UI thread
+can carry on collecting input meanwhile. Redraw notifications from the
+surfaces painted on are collected and delivered later on the UI thread.
+
+Submitted work mustn't share anything the UI thread can change. For
+instance, lib.command.Brushwork submits snapshots of the document's
+brush, not the brush itself. Call `PaintingThread.sync()` before
+snapshotting or saving anything the queued work is painting.
+
+"""
+
+from __future__ import division, print_function
+
+import threading
+import logging
+import Queue
+
+from gi.repository import GLib
+
+import lib.mypaintlib
+
+logger = logging.getLogger(__name__)
+
+
+## Module vars
+
+_current = threading.local()
+
+
+## Module funcs
+
+def get_current():
+    """Returns the PaintingThread running the calling code, if any
+
+    :returns: the painting thread, or None on other threads
+    :rtype: PaintingThread
+
+    """
+    return getattr(_current, "painter", None)
+
+
+## Class defs
+
+class PaintingThread (object):
+    """Renders queued stroke segments on a worker thread
+
+    Work is submitted from the UI thread as callables, which are run in
+    order. Until `sync()` returns, they may use the layers they paint on
+    while the UI thread does other things, so anything which reads or
+    replaces those layers' tiles must call `sync()` first. The document
+    does this before any command is done, undone or redone.
+
+    >>> painter = PaintingThread()
+    >>> painted = []
+    >>> def paint(n):
+    ...     painted.append(get_current() is painter)
+    >>> for i in range(3):
+    ...     painter.submit(paint, i)
+    >>> painter.sync()
+    >>> painted
+    [True, True, True]
+    >>> get_current() is None
+    True
+    >>> painter.stop()
+
+    """
+
+    #: Maximum number of queued items. Submitting more than this blocks
+    #: until the worker catches up, so the UI can't get too far ahead.
+    QUEUE_SIZE = 64
+
+    def __init__(self):
+        """Initializes, and starts the worker thread"""
+        super(PaintingThread, self).__init__()
+        self._queue = Queue.Queue(maxsize=self.QUEUE_SIZE)
+        self._notify_lock = threading.Lock()
+        self._notify_pending = []
+        self._notify_idle_id = None
+        self._thread = threading.Thread(
+            target=self._run,
+            name="PaintingThread",
+        )
+        self._thread.daemon = True
+        self._thread.start()
+
+    def submit(self, func, *args):
+        """Queues a callable to be run on the worker thread
+
+        :param func: callable, which paints
+        :param *args: passed to func
+
+        Blocks if the queue is full.
+
+        """
+        self._queue.put((func, args))
+
+    def sync(self):
+        """Waits for all queued work, and delivers its notifications
+
+        Must be called on the UI thread.
+
+        """
+        self._queue.join()
+        self._deliver_notifications()
+
+    def stop(self):
+        """Finishes queued work, then stops the worker thread"""
+        self.sync()
+        self._queue.put(None)
+        self._thread.join()
+
+    def post_notify(self, surface, bbox):
+        """Queues a redraw notification for delivery on the UI thread
+
+        :param lib.tiledsurface.MyPaintSurface surface: surface changed
+        :param tuple bbox: changed area, as (x, y, w, h)
+
+        This is called from the worker thread in place of the
+        surface's `notify_observers()`.
+
+        """
+        with self._notify_lock:
+            self._notify_pending.append((surface, bbox))
+            if self._notify_idle_id is None:
+                self._notify_idle_id = GLib.idle_add(self._notify_idle_cb)
+
+    def _notify_idle_cb(self):
+        with self._notify_lock:
+            self._notify_idle_id = None
+        self._deliver_notifications()
+        return False
+
+    def _deliver_notifications(self):
+        with self._notify_lock:
+            pending = self._notify_pending
+            self._notify_pending = []
+            if self._notify_idle_id is not None:
+                GLib.source_remove(self._notify_idle_id)
+                self._notify_idle_id = None
+        for surface, bbox in pending:
+            surface.notify_observers(*bbox)
+
+    def _run(self):
+        _current.painter = self
+        while True:
+            item = self._queue.get()
+            if item is None:
+                self._queue.task_done()
+                break
+            func, args = item
+            lib.mypaintlib.tile_painting_begin()
+            try:
+                func(*args)
+            except Exception:
+                logger.exception("Painting failed")
+            finally:
+                lib.mypaintlib.tile_painting_end()
+                self._queue.task_done()
+        # Hand this thread's spare tile buffers back before it exits.
+        lib.mypaintlib.tile_buffer_pool_release_thread()
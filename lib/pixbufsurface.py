@@ -151,10 +151,14 @@ class Surface (TileAccessible, TileBlittable):
     def blit_tile_into(self, dst, dst_has_alpha, tx, ty):
         # (used mainly for loading transparent PNGs)
         assert dst_has_alpha is True
-        assert dst.dtype == 'uint16', '16 bit dst expected'
+        assert dst.dtype in ('uint16', 'uint8'), '16 or 8 bit dst expected'
         src = self.tile_memory_dict[(tx, ty)]
         assert src.shape[2] == 4, 'alpha required'
-        mypaintlib.tile_convert_rgba8_to_rgba16(src, dst)
+        if dst.dtype == 'uint8':
+            # premultiplied, see lib.tiledsurface.Surface8
+            mypaintlib.tile_convert_rgba8_to_prgba8(src, dst)
+        else:
+            mypaintlib.tile_convert_rgba8_to_rgba16(src, dst)
 
 
 def render_as_pixbuf(surface, *rect, **kwargs):
@@ -12,8 +12,7 @@
 #include "common.hpp"
 #include "compositing.hpp"
 #include "blending.hpp"
-
-#include <mypaint-tiled-surface.h>
+#include "tilesize.hpp"
 
 #include <glib.h>
 
@@ -22,19 +21,23 @@
 #include <numpy/arrayobject.h>
 
 
-void
+// The kernels below are templates over the tile size, N. The functions
+// called from Python use the instances for MYPAINTLIB_TILE_SIZE.
+
+template <int N>
+static inline void
 tile_downscale_rgba16_c(const uint16_t *src, int src_strides, uint16_t *dst,
                         int dst_strides, int dst_x, int dst_y)
 {
-  for (int y=0; y<MYPAINT_TILE_SIZE/2; y++) {
+  for (int y=0; y<N/2; y++) {
     uint16_t * src_p = (uint16_t*)((char *)src + (2*y)*src_strides);
     uint16_t * dst_p = (uint16_t*)((char *)dst + (y+dst_y)*dst_strides);
     dst_p += 4*dst_x;
-    for(int x=0; x<MYPAINT_TILE_SIZE/2; x++) {
-      dst_p[0] = src_p[0]/4 + (src_p+4)[0]/4 + (src_p+4*MYPAINT_TILE_SIZE)[0]/4 + (src_p+4*MYPAINT_TILE_SIZE+4)[0]/4;
-      dst_p[1] = src_p[1]/4 + (src_p+4)[1]/4 + (src_p+4*MYPAINT_TILE_SIZE)[1]/4 + (src_p+4*MYPAINT_TILE_SIZE+4)[1]/4;
-      dst_p[2] = src_p[2]/4 + (src_p+4)[2]/4 + (src_p+4*MYPAINT_TILE_SIZE)[2]/4 + (src_p+4*MYPAINT_TILE_SIZE+4)[2]/4;
-      dst_p[3] = src_p[3]/4 + (src_p+4)[3]/4 + (src_p+4*MYPAINT_TILE_SIZE)[3]/4 + (src_p+4*MYPAINT_TILE_SIZE+4)[3]/4;
+    for(int x=0; x<N/2; x++) {
+      dst_p[0] = src_p[0]/4 + (src_p+4)[0]/4 + (src_p+4*N)[0]/4 + (src_p+4*N+4)[0]/4;
+      dst_p[1] = src_p[1]/4 + (src_p+4)[1]/4 + (src_p+4*N)[1]/4 + (src_p+4*N+4)[1]/4;
+      dst_p[2] = src_p[2]/4 + (src_p+4)[2]/4 + (src_p+4*N)[2]/4 + (src_p+4*N+4)[2]/4;
+      dst_p[3] = src_p[3]/4 + (src_p+4)[3]/4 + (src_p+4*N)[3]/4 + (src_p+4*N+4)[3]/4;
       src_p += 8;
       dst_p += 4;
     }
@@ -48,8 +51,8 @@ void tile_downscale_rgba16(PyObject *src, PyObject *dst, int dst_x, int dst_y) {
 
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(src));
-  assert(PyArray_DIM(src_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(src_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(src_arr, 2) == 4);
   assert(PyArray_TYPE(src_arr) == NPY_UINT16);
   assert(PyArray_ISCARRAY(src_arr));
@@ -60,15 +63,18 @@ void tile_downscale_rgba16(PyObject *src, PyObject *dst, int dst_x, int dst_y) {
   assert(PyArray_ISCARRAY(dst_arr));
 #endif
 
-  tile_downscale_rgba16_c((uint16_t*)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
-                          (uint16_t*)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0],
-                          dst_x, dst_y);
+  tile_downscale_rgba16_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t*)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
+      (uint16_t*)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0],
+      dst_x, dst_y);
 
 }
 
 
-void tile_copy_rgba16_into_rgba16_c(const uint16_t *src, uint16_t *dst) {
-  memcpy(dst, src, MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE*4*sizeof(uint16_t));
+template <int N>
+static inline void
+tile_copy_rgba16_into_rgba16_c(const uint16_t *src, uint16_t *dst) {
+  memcpy(dst, src, N*N*4*sizeof(uint16_t));
 }
 
 void tile_copy_rgba16_into_rgba16(PyObject * src, PyObject * dst) {
@@ -77,8 +83,8 @@ void tile_copy_rgba16_into_rgba16(PyObject * src, PyObject * dst) {
 
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(dst));
-  assert(PyArray_DIM(dst_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(dst_arr, 2) == 4);
   assert(PyArray_TYPE(dst_arr) == NPY_UINT16);
   assert(PyArray_ISCARRAY(dst_arr));
@@ -86,8 +92,8 @@ void tile_copy_rgba16_into_rgba16(PyObject * src, PyObject * dst) {
   assert(PyArray_STRIDES(dst_arr)[2] ==   sizeof(uint16_t));
 
   assert(PyArray_Check(src));
-  assert(PyArray_DIM(src_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(src_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(src_arr, 2) == 4);
   assert(PyArray_TYPE(src_arr) == NPY_UINT16);
   assert(PyArray_ISCARRAY(src_arr));
@@ -98,15 +104,25 @@ void tile_copy_rgba16_into_rgba16(PyObject * src, PyObject * dst) {
   /* the code below can be used if it is not ISCARRAY, but only ISBEHAVED:
   char * src_p = PyArray_DATA(src_arr);
   char * dst_p = PyArray_DATA(dst_arr);
-  for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
-    memcpy(dst_p, src_p, MYPAINT_TILE_SIZE*4);
+  for (int y=0; y<MYPAINTLIB_TILE_SIZE; y++) {
+    memcpy(dst_p, src_p, MYPAINTLIB_TILE_SIZE*4);
     src_p += src_arr->strides[0];
     dst_p += dst_arr->strides[0];
   }
   */
 
-  tile_copy_rgba16_into_rgba16_c((uint16_t *)PyArray_DATA(src_arr),
-                                 (uint16_t *)PyArray_DATA(dst_arr));
+  tile_copy_rgba16_into_rgba16_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t *)PyArray_DATA(src_arr),
+      (uint16_t *)PyArray_DATA(dst_arr));
+}
+
+template <int N>
+static inline void
+tile_clear_c(char *dst, const int dst_strides, const int pixel_bytes)
+{
+  for (int y=0; y<N; y++) {
+    memset(dst + y*dst_strides, 0, N*pixel_bytes);
+  }
 }
 
 void tile_clear_rgba8(PyObject * dst) {
@@ -114,18 +130,16 @@ void tile_clear_rgba8(PyObject * dst) {
 
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(dst));
-  assert(PyArray_DIM(dst_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_TYPE(dst_arr) == NPY_UINT8);
   assert(PyArray_ISBEHAVED(dst_arr));
   assert(PyArray_STRIDES(dst_arr)[1] <= 8);
 #endif
 
-  for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
-    uint8_t  * dst_p = (uint8_t*)((char *)PyArray_DATA(dst_arr) + y*PyArray_STRIDES(dst_arr)[0]);
-    memset(dst_p, 0, MYPAINT_TILE_SIZE*PyArray_STRIDES(dst_arr)[1]);
-    dst_p += PyArray_STRIDES(dst_arr)[0];
-  }
+  tile_clear_c<MYPAINTLIB_TILE_SIZE>((char *)PyArray_DATA(dst_arr),
+                                     PyArray_STRIDES(dst_arr)[0],
+                                     PyArray_STRIDES(dst_arr)[1]);
 }
 
 void tile_clear_rgba16(PyObject * dst) {
@@ -133,38 +147,46 @@ void tile_clear_rgba16(PyObject * dst) {
 
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(dst));
-  assert(PyArray_DIM(dst_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_TYPE(dst_arr) == NPY_UINT16);
   assert(PyArray_ISBEHAVED(dst_arr));
   assert(PyArray_STRIDES(dst_arr)[1] <= 8);
 #endif
 
-  for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
-    uint16_t  * dst_p = (uint16_t*)((char *)PyArray_DATA(dst_arr) + y*PyArray_STRIDES(dst_arr)[0]);
-    memset(dst_p, 0, MYPAINT_TILE_SIZE*PyArray_STRIDES(dst_arr)[1]);
-    dst_p += PyArray_STRIDES(dst_arr)[0];
-  }
+  tile_clear_c<MYPAINTLIB_TILE_SIZE>((char *)PyArray_DATA(dst_arr),
+                                     PyArray_STRIDES(dst_arr)[0],
+                                     PyArray_STRIDES(dst_arr)[1]);
 }
 
 
 // Noise used for dithering (the same for each tile).
 
-static const int dithering_noise_size = MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE*4;
-static uint16_t dithering_noise[dithering_noise_size];
-static void precalculate_dithering_noise_if_required()
+template <int N>
+struct DitheringNoise
+{
+  static const int size = N*N*4;
+  static uint16_t noise[size];
+  static void precalculate_if_required();
+};
+
+template <int N>
+uint16_t DitheringNoise<N>::noise[DitheringNoise<N>::size];
+
+template <int N>
+void DitheringNoise<N>::precalculate_if_required()
 {
   static bool have_noise = false;
   if (!have_noise) {
     // let's make some noise
-    for (int i=0; i<dithering_noise_size; i++) {
+    for (int i=0; i<size; i++) {
       // random number in range [0.03 .. 0.97] * (1<<15)
       //
       // We could use the full range, but like this it is much easier
       // to guarantee 8bpc load-save roundtrips don't alter the
       // image. With the full range we would have to pay a lot
       // attention to rounding converting 8bpc to our internal format.
-      dithering_noise[i] = (rand() % (1<<15)) * 240/256 + (1<<15) * 8/256;
+      noise[i] = (rand() % (1<<15)) * 240/256 + (1<<15) * 8/256;
     }
     have_noise = true;
   }
@@ -173,19 +195,22 @@ static void precalculate_dithering_noise_if_required()
 // Used for saving layers (transparent PNG), and for display when there
 // can be transparent areas in the output.
 
+template <int N>
 static inline void
 tile_convert_rgba16_to_rgba8_c (const uint16_t* const src,
                                 const int src_strides,
                                 const uint8_t* dst,
                                 const int dst_strides)
 {
-  precalculate_dithering_noise_if_required();
+  typedef DitheringNoise<N> Noise;
+  Noise::precalculate_if_required();
+  const uint16_t *dithering_noise = Noise::noise;
 
-  for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
-    int noise_idx = y*MYPAINT_TILE_SIZE*4;
+  for (int y=0; y<N; y++) {
+    int noise_idx = y*N*4;
     const uint16_t *src_p = (uint16_t*)((char *)src + y*src_strides);
     uint8_t *dst_p = (uint8_t*)((char *)dst + y*dst_strides);
-    for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
+    for (int x=0; x<N; x++) {
       uint32_t r, g, b, a;
       r = *src_p++;
       g = *src_p++;
@@ -254,7 +279,7 @@ tile_convert_rgba16_to_rgba8_c (const uint16_t* const src,
 #ifdef HEAVY_DEBUG
       assert(add_a < (1<<15));
       assert(add_a >= 0);
-      assert(noise_idx <= dithering_noise_size);
+      assert(noise_idx <= Noise::size);
 #endif
 
       *dst_p++ = (r * 255 + add_r) / (1<<15);
@@ -278,8 +303,8 @@ tile_convert_rgba16_to_rgba8 (PyObject *src,
 
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(dst));
-  assert(PyArray_DIM(dst_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(dst_arr, 2) == 4);
   assert(PyArray_TYPE(dst_arr) == NPY_UINT8);
   assert(PyArray_ISBEHAVED(dst_arr));
@@ -287,8 +312,8 @@ tile_convert_rgba16_to_rgba8 (PyObject *src,
   assert(PyArray_STRIDE(dst_arr, 2) == sizeof(uint8_t));
 
   assert(PyArray_Check(src));
-  assert(PyArray_DIM(src_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(src_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(src_arr, 2) == 4);
   assert(PyArray_TYPE(src_arr) == NPY_UINT16);
   assert(PyArray_ISBEHAVED(src_arr));
@@ -296,25 +321,27 @@ tile_convert_rgba16_to_rgba8 (PyObject *src,
   assert(PyArray_STRIDE(src_arr, 2) ==   sizeof(uint16_t));
 #endif
 
-  tile_convert_rgba16_to_rgba8_c((uint16_t*)PyArray_DATA(src_arr),
-                                 PyArray_STRIDES(src_arr)[0],
-                                 (uint8_t*)PyArray_DATA(dst_arr),
-                                 PyArray_STRIDES(dst_arr)[0]);
+  tile_convert_rgba16_to_rgba8_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t*)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
+      (uint8_t*)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0]);
 }
 
+template <int N>
 static inline void
 tile_convert_rgbu16_to_rgbu8_c(const uint16_t* const src,
                                const int src_strides,
                                const uint8_t* dst,
                                const int dst_strides)
 {
-  precalculate_dithering_noise_if_required();
+  typedef DitheringNoise<N> Noise;
+  Noise::precalculate_if_required();
+  const uint16_t *dithering_noise = Noise::noise;
 
-  for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
-    int noise_idx = y*MYPAINT_TILE_SIZE*4;
+  for (int y=0; y<N; y++) {
+    int noise_idx = y*N*4;
     const uint16_t *src_p = (uint16_t*)((char *)src + y*src_strides);
     uint8_t *dst_p = (uint8_t*)((char *)dst + y*dst_strides);
-    for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
+    for (int x=0; x<N; x++) {
       uint32_t r, g, b;
       r = *src_p++;
       g = *src_p++;
@@ -339,7 +366,7 @@ tile_convert_rgbu16_to_rgbu8_c(const uint16_t* const src,
       *dst_p++ = 255;
     }
 #ifdef HEAVY_DEBUG
-    assert(noise_idx <= dithering_noise_size);
+    assert(noise_idx <= Noise::size);
 #endif
     src_p += src_strides;
     dst_p += dst_strides;
@@ -353,8 +380,8 @@ void tile_convert_rgbu16_to_rgbu8(PyObject * src, PyObject * dst) {
 
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(dst));
-  assert(PyArray_DIM(dst_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(dst_arr, 2) == 4);
   assert(PyArray_TYPE(dst_arr) == NPY_UINT8);
   assert(PyArray_ISBEHAVED(dst_arr));
@@ -362,8 +389,8 @@ void tile_convert_rgbu16_to_rgbu8(PyObject * src, PyObject * dst) {
   assert(PyArray_STRIDE(dst_arr, 2) == sizeof(uint8_t));
 
   assert(PyArray_Check(src));
-  assert(PyArray_DIM(src_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(src_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(src_arr, 2) == 4);
   assert(PyArray_TYPE(src_arr) == NPY_UINT16);
   assert(PyArray_ISBEHAVED(src_arr));
@@ -371,8 +398,40 @@ void tile_convert_rgbu16_to_rgbu8(PyObject * src, PyObject * dst) {
   assert(PyArray_STRIDE(src_arr, 2) ==   sizeof(uint16_t));
 #endif
 
-  tile_convert_rgbu16_to_rgbu8_c((uint16_t*)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
-                                 (uint8_t*)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0]);
+  tile_convert_rgbu16_to_rgbu8_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t*)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
+      (uint8_t*)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0]);
+}
+
+
+template <int N>
+static inline void
+tile_convert_rgba8_to_rgba16_c(const uint8_t *src, const int src_strides,
+                               uint16_t *dst, const int dst_strides)
+{
+  for (int y=0; y<N; y++) {
+    uint8_t  * src_p = (uint8_t*)((char *)src + y*src_strides);
+    uint16_t * dst_p = (uint16_t*)((char *)dst + y*dst_strides);
+    for (int x=0; x<N; x++) {
+      uint32_t r, g, b, a;
+      r = *src_p++;
+      g = *src_p++;
+      b = *src_p++;
+      a = *src_p++;
+
+      // convert to fixed point (with rounding)
+      r = (r * (1<<15) + 255/2) / 255;
+      g = (g * (1<<15) + 255/2) / 255;
+      b = (b * (1<<15) + 255/2) / 255;
+      a = (a * (1<<15) + 255/2) / 255;
+
+      // premultiply alpha (with rounding), save back
+      *dst_p++ = (r * a + (1<<15)/2) / (1<<15);
+      *dst_p++ = (g * a + (1<<15)/2) / (1<<15);
+      *dst_p++ = (b * a + (1<<15)/2) / (1<<15);
+      *dst_p++ = a;
+    }
+  }
 }
 
 
@@ -383,8 +442,8 @@ void tile_convert_rgba8_to_rgba16(PyObject * src, PyObject * dst) {
 
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(dst));
-  assert(PyArray_DIM(dst_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(dst_arr, 2) == 4);
   assert(PyArray_TYPE(dst_arr) == NPY_UINT16);
   assert(PyArray_ISBEHAVED(dst_arr));
@@ -392,8 +451,8 @@ void tile_convert_rgba8_to_rgba16(PyObject * src, PyObject * dst) {
   assert(PyArray_STRIDES(dst_arr)[2] ==   sizeof(uint16_t));
 
   assert(PyArray_Check(src));
-  assert(PyArray_DIM(src_arr, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(src_arr, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(src_arr, 2) == 4);
   assert(PyArray_TYPE(src_arr) == NPY_UINT8);
   assert(PyArray_ISBEHAVED(src_arr));
@@ -401,55 +460,247 @@ void tile_convert_rgba8_to_rgba16(PyObject * src, PyObject * dst) {
   assert(PyArray_STRIDES(src_arr)[2] ==   sizeof(uint8_t));
 #endif
 
-  for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
-    uint8_t  * src_p = (uint8_t*)((char *)PyArray_DATA(src_arr) + y*PyArray_STRIDES(src_arr)[0]);
-    uint16_t * dst_p = (uint16_t*)((char *)PyArray_DATA(dst_arr) + y*PyArray_STRIDES(dst_arr)[0]);
-    for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
-      uint32_t r, g, b, a;
-      r = *src_p++;
-      g = *src_p++;
-      b = *src_p++;
-      a = *src_p++;
+  tile_convert_rgba8_to_rgba16_c<MYPAINTLIB_TILE_SIZE>(
+      (uint8_t *)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
+      (uint16_t *)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0]);
+}
 
-      // convert to fixed point (with rounding)
-      r = (r * (1<<15) + 255/2) / 255;
-      g = (g * (1<<15) + 255/2) / 255;
-      b = (b * (1<<15) + 255/2) / 255;
-      a = (a * (1<<15) + 255/2) / 255;
 
-      // premultiply alpha (with rounding), save back
-      *dst_p++ = (r * a + (1<<15)/2) / (1<<15);
-      *dst_p++ = (g * a + (1<<15)/2) / (1<<15);
-      *dst_p++ = (b * a + (1<<15)/2) / (1<<15);
+// Premultiplied 8-bit tiles ("prgba8"), for surfaces which are only
+// displayed. See lib.tiledsurface.Surface8.
+
+template <int N>
+static inline void
+tile_convert_rgba8_to_prgba8_c(const uint8_t *src, const int src_strides,
+                               uint8_t *dst, const int dst_strides)
+{
+  for (int y=0; y<N; y++) {
+    uint8_t * src_p = (uint8_t*)((char *)src + y*src_strides);
+    uint8_t * dst_p = (uint8_t*)((char *)dst + y*dst_strides);
+    for (int x=0; x<N; x++) {
+      const uint32_t a = src_p[3];
+      // premultiply alpha (with rounding)
+      *dst_p++ = (*src_p++ * a + 255/2) / 255;
+      *dst_p++ = (*src_p++ * a + 255/2) / 255;
+      *dst_p++ = (*src_p++ * a + 255/2) / 255;
       *dst_p++ = a;
+      src_p++;
     }
   }
 }
 
 
-void tile_rgba2flat(PyObject * dst_obj, PyObject * bg_obj) {
-  PyArrayObject* bg = ((PyArrayObject*)bg_obj);
-  PyArrayObject* dst = ((PyArrayObject*)dst_obj);
+void tile_convert_rgba8_to_prgba8(PyObject * src, PyObject * dst) {
+  PyArrayObject* src_arr = ((PyArrayObject*)src);
+  PyArrayObject* dst_arr = ((PyArrayObject*)dst);
 
 #ifdef HEAVY_DEBUG
-  assert(PyArray_Check(dst_obj));
-  assert(PyArray_DIM(dst, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst, 1) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst, 2) == 4);
-  assert(PyArray_TYPE(dst) == NPY_UINT16);
-  assert(PyArray_ISCARRAY(dst));
+  assert(PyArray_Check(dst));
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 2) == 4);
+  assert(PyArray_TYPE(dst_arr) == NPY_UINT8);
+  assert(PyArray_ISBEHAVED(dst_arr));
+  assert(PyArray_STRIDES(dst_arr)[1] == 4*sizeof(uint8_t));
+  assert(PyArray_STRIDES(dst_arr)[2] ==   sizeof(uint8_t));
 
-  assert(PyArray_Check(bg_obj));
-  assert(PyArray_DIM(bg, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(bg, 1) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(bg, 2) == 4);
-  assert(PyArray_TYPE(bg) == NPY_UINT16);
-  assert(PyArray_ISCARRAY(bg));
+  assert(PyArray_Check(src));
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 2) == 4);
+  assert(PyArray_TYPE(src_arr) == NPY_UINT8);
+  assert(PyArray_ISBEHAVED(src_arr));
+  assert(PyArray_STRIDES(src_arr)[1] == 4*sizeof(uint8_t));
+  assert(PyArray_STRIDES(src_arr)[2] ==   sizeof(uint8_t));
 #endif
 
-  uint16_t * dst_p  = (uint16_t*)PyArray_DATA(dst);
-  uint16_t * bg_p  = (uint16_t*)PyArray_DATA(bg);
-  for (int i=0; i<MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE; i++) {
+  tile_convert_rgba8_to_prgba8_c<MYPAINTLIB_TILE_SIZE>(
+      (uint8_t *)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
+      (uint8_t *)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0]);
+}
+
+
+template <int N>
+static inline void
+tile_convert_prgba8_to_rgba8_c(const uint8_t *src, const int src_strides,
+                               uint8_t *dst, const int dst_strides)
+{
+  for (int y=0; y<N; y++) {
+    uint8_t * src_p = (uint8_t*)((char *)src + y*src_strides);
+    uint8_t * dst_p = (uint8_t*)((char *)dst + y*dst_strides);
+    for (int x=0; x<N; x++) {
+      const uint32_t a = src_p[3];
+      // un-premultiply alpha (with rounding)
+      for (int c=0; c<3; c++) {
+        uint32_t v = 0;
+        if (a != 0) {
+          v = (src_p[c] * 255 + a/2) / a;
+        }
+        dst_p[c] = MIN(v, 255);
+      }
+      dst_p[3] = a;
+      src_p += 4;
+      dst_p += 4;
+    }
+  }
+}
+
+
+void tile_convert_prgba8_to_rgba8(PyObject * src, PyObject * dst) {
+  PyArrayObject* src_arr = ((PyArrayObject*)src);
+  PyArrayObject* dst_arr = ((PyArrayObject*)dst);
+
+#ifdef HEAVY_DEBUG
+  assert(PyArray_Check(dst));
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 2) == 4);
+  assert(PyArray_TYPE(dst_arr) == NPY_UINT8);
+  assert(PyArray_ISBEHAVED(dst_arr));
+  assert(PyArray_STRIDES(dst_arr)[1] == 4*sizeof(uint8_t));
+  assert(PyArray_STRIDES(dst_arr)[2] ==   sizeof(uint8_t));
+
+  assert(PyArray_Check(src));
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 2) == 4);
+  assert(PyArray_TYPE(src_arr) == NPY_UINT8);
+  assert(PyArray_ISCARRAY(src_arr));
+#endif
+
+  tile_convert_prgba8_to_rgba8_c<MYPAINTLIB_TILE_SIZE>(
+      (uint8_t *)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
+      (uint8_t *)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0]);
+}
+
+
+template <int N>
+static inline void
+tile_convert_prgba8_to_rgba16_c(const uint8_t *src_p, uint16_t *dst_p)
+{
+  for (int i=0; i<N*N*4; i++) {
+    dst_p[i] = fix15_src(src_p[i]);
+  }
+}
+
+
+void tile_convert_prgba8_to_rgba16(PyObject * src, PyObject * dst) {
+  PyArrayObject* src_arr = ((PyArrayObject*)src);
+  PyArrayObject* dst_arr = ((PyArrayObject*)dst);
+
+#ifdef HEAVY_DEBUG
+  assert(PyArray_Check(dst));
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 2) == 4);
+  assert(PyArray_TYPE(dst_arr) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(dst_arr));
+
+  assert(PyArray_Check(src));
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 2) == 4);
+  assert(PyArray_TYPE(src_arr) == NPY_UINT8);
+  assert(PyArray_ISCARRAY(src_arr));
+#endif
+
+  tile_convert_prgba8_to_rgba16_c<MYPAINTLIB_TILE_SIZE>(
+      (uint8_t *)PyArray_DATA(src_arr),
+      (uint16_t *)PyArray_DATA(dst_arr));
+}
+
+
+// Rounded, not dithered: the result stays premultiplied, and colour
+// channels mustn't end up bigger than alpha.
+
+template <int N>
+static inline void
+tile_convert_rgba16_to_prgba8_c(const uint16_t *src_p, uint8_t *dst_p)
+{
+  for (int i=0; i<N*N*4; i++) {
+    dst_p[i] = ((uint32_t)MIN(src_p[i], 1<<15) * 255 + (1<<15)/2) >> 15;
+  }
+}
+
+
+void tile_convert_rgba16_to_prgba8(PyObject * src, PyObject * dst) {
+  PyArrayObject* src_arr = ((PyArrayObject*)src);
+  PyArrayObject* dst_arr = ((PyArrayObject*)dst);
+
+#ifdef HEAVY_DEBUG
+  assert(PyArray_Check(dst));
+  assert(PyArray_DIM(dst_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst_arr, 2) == 4);
+  assert(PyArray_TYPE(dst_arr) == NPY_UINT8);
+  assert(PyArray_ISCARRAY(dst_arr));
+
+  assert(PyArray_Check(src));
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 2) == 4);
+  assert(PyArray_TYPE(src_arr) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(src_arr));
+#endif
+
+  tile_convert_rgba16_to_prgba8_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t *)PyArray_DATA(src_arr),
+      (uint8_t *)PyArray_DATA(dst_arr));
+}
+
+
+template <int N>
+static inline void
+tile_downscale_prgba8_c(const uint8_t *src, int src_strides, uint8_t *dst,
+                        int dst_strides, int dst_x, int dst_y)
+{
+  for (int y=0; y<N/2; y++) {
+    const uint8_t *src_p = (uint8_t*)((char *)src + (2*y)*src_strides);
+    uint8_t *dst_p = (uint8_t*)((char *)dst + (y+dst_y)*dst_strides);
+    dst_p += 4*dst_x;
+    for (int x=0; x<N/2; x++) {
+      for (int c=0; c<4; c++) {
+        dst_p[c] = (src_p[c] + (src_p+4)[c]
+                    + (src_p+src_strides)[c] + (src_p+src_strides+4)[c]
+                    + 2) / 4;
+      }
+      src_p += 8;
+      dst_p += 4;
+    }
+  }
+}
+
+
+void tile_downscale_prgba8(PyObject *src, PyObject *dst, int dst_x, int dst_y) {
+  PyArrayObject* src_arr = ((PyArrayObject*)src);
+  PyArrayObject* dst_arr = ((PyArrayObject*)dst);
+
+#ifdef HEAVY_DEBUG
+  assert(PyArray_Check(src));
+  assert(PyArray_DIM(src_arr, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(src_arr, 2) == 4);
+  assert(PyArray_TYPE(src_arr) == NPY_UINT8);
+  assert(PyArray_ISCARRAY(src_arr));
+
+  assert(PyArray_Check(dst));
+  assert(PyArray_DIM(dst_arr, 2) == 4);
+  assert(PyArray_TYPE(dst_arr) == NPY_UINT8);
+  assert(PyArray_ISCARRAY(dst_arr));
+#endif
+
+  tile_downscale_prgba8_c<MYPAINTLIB_TILE_SIZE>(
+      (uint8_t*)PyArray_DATA(src_arr), PyArray_STRIDES(src_arr)[0],
+      (uint8_t*)PyArray_DATA(dst_arr), PyArray_STRIDES(dst_arr)[0],
+      dst_x, dst_y);
+}
+
+
+template <int N>
+static inline void
+tile_rgba2flat_c(uint16_t *dst_p, const uint16_t *bg_p)
+{
+  for (int i=0; i<N*N; i++) {
     // resultAlpha = 1.0 (thus it does not matter if resultColor is premultiplied alpha or not)
     // resultColor = topColor + (1.0 - topAlpha) * bottomColor
     const uint32_t one_minus_top_alpha = (1<<15) - dst_p[3];
@@ -462,29 +713,37 @@ void tile_rgba2flat(PyObject * dst_obj, PyObject * bg_obj) {
 }
 
 
-void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj) {
+void tile_rgba2flat(PyObject * dst_obj, PyObject * bg_obj) {
+  PyArrayObject* bg = ((PyArrayObject*)bg_obj);
+  PyArrayObject* dst = ((PyArrayObject*)dst_obj);
 
-  PyArrayObject *dst = (PyArrayObject *)dst_obj;
-  PyArrayObject *bg = (PyArrayObject *)bg_obj;
 #ifdef HEAVY_DEBUG
   assert(PyArray_Check(dst_obj));
-  assert(PyArray_DIM(dst, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(dst, 2) == 4);
   assert(PyArray_TYPE(dst) == NPY_UINT16);
   assert(PyArray_ISCARRAY(dst));
 
   assert(PyArray_Check(bg_obj));
-  assert(PyArray_DIM(bg, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(bg, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(bg, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(bg, 1) == MYPAINTLIB_TILE_SIZE);
   assert(PyArray_DIM(bg, 2) == 4);
   assert(PyArray_TYPE(bg) == NPY_UINT16);
   assert(PyArray_ISCARRAY(bg));
 #endif
 
-  uint16_t * dst_p  = (uint16_t*)PyArray_DATA(dst);
-  uint16_t * bg_p  = (uint16_t*)PyArray_DATA(bg);
-  for (int i=0; i<MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE; i++) {
+  tile_rgba2flat_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t*)PyArray_DATA(dst),
+      (uint16_t*)PyArray_DATA(bg));
+}
+
+
+template <int N>
+static inline void
+tile_flat2rgba_c(uint16_t *dst_p, const uint16_t *bg_p)
+{
+  for (int i=0; i<N*N; i++) {
 
     // 1. calculate final dst.alpha
     uint16_t final_alpha = dst_p[3];
@@ -530,27 +789,39 @@ void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj) {
 }
 
 
-void tile_perceptual_change_strokemap(PyObject * a_obj, PyObject * b_obj, PyObject * res_obj) {
-
-  PyArrayObject *a = (PyArrayObject *)a_obj;
-  PyArrayObject *b = (PyArrayObject *)b_obj;
-  PyArrayObject *res = (PyArrayObject *)res_obj;
+void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj) {
 
+  PyArrayObject *dst = (PyArrayObject *)dst_obj;
+  PyArrayObject *bg = (PyArrayObject *)bg_obj;
 #ifdef HEAVY_DEBUG
-  assert(PyArray_TYPE(a) == NPY_UINT16);
-  assert(PyArray_TYPE(b) == NPY_UINT16);
-  assert(PyArray_TYPE(res) == NPY_UINT8);
-  assert(PyArray_ISCARRAY(a));
-  assert(PyArray_ISCARRAY(b));
-  assert(PyArray_ISCARRAY(res));
+  assert(PyArray_Check(dst_obj));
+  assert(PyArray_DIM(dst, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(dst, 2) == 4);
+  assert(PyArray_TYPE(dst) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(dst));
+
+  assert(PyArray_Check(bg_obj));
+  assert(PyArray_DIM(bg, 0) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(bg, 1) == MYPAINTLIB_TILE_SIZE);
+  assert(PyArray_DIM(bg, 2) == 4);
+  assert(PyArray_TYPE(bg) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(bg));
 #endif
 
-  uint16_t * a_p  = (uint16_t*)PyArray_DATA(a);
-  uint16_t * b_p  = (uint16_t*)PyArray_DATA(b);
-  uint8_t * res_p = (uint8_t*)PyArray_DATA(res);
+  tile_flat2rgba_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t*)PyArray_DATA(dst),
+      (uint16_t*)PyArray_DATA(bg));
+}
 
-  for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
-    for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
+
+template <int N>
+static inline void
+tile_perceptual_change_strokemap_c(const uint16_t *a_p, const uint16_t *b_p,
+                                   uint8_t *res_p)
+{
+  for (int y=0; y<N; y++) {
+    for (int x=0; x<N; x++) {
 
       int32_t color_change = 0;
       // We want to compare a.color with b.color, but we only know
@@ -596,20 +867,57 @@ void tile_perceptual_change_strokemap(PyObject * a_obj, PyObject * b_obj, PyObje
 }
 
 
+void tile_perceptual_change_strokemap(PyObject * a_obj, PyObject * b_obj, PyObject * res_obj) {
+
+  PyArrayObject *a = (PyArrayObject *)a_obj;
+  PyArrayObject *b = (PyArrayObject *)b_obj;
+  PyArrayObject *res = (PyArrayObject *)res_obj;
+
+#ifdef HEAVY_DEBUG
+  assert(PyArray_TYPE(a) == NPY_UINT16);
+  assert(PyArray_TYPE(b) == NPY_UINT16);
+  assert(PyArray_TYPE(res) == NPY_UINT8);
+  assert(PyArray_ISCARRAY(a));
+  assert(PyArray_ISCARRAY(b));
+  assert(PyArray_ISCARRAY(res));
+#endif
+
+  tile_perceptual_change_strokemap_c<MYPAINTLIB_TILE_SIZE>(
+      (uint16_t*)PyArray_DATA(a),
+      (uint16_t*)PyArray_DATA(b),
+      (uint8_t*)PyArray_DATA(res));
+}
+
+
 // A named tile combine operation: what the user sees as a "blend mode" or 
 // the "layer composite" modes in the application.
 
-template <class B, class C>
+template <class B, class C, int N=MYPAINTLIB_TILE_SIZE>
 class TileDataCombine : public TileDataCombineOp
 {
   private:
     // The canonical name for the combine mode
     const char *name;
     // Alpha/nonalpha functors; must be members to keep GCC4.6 builds happy
-    static const int bufsize = MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE*4;
+    static const int bufsize = N*N*4;
     BufferCombineFunc<true, bufsize, B, C> combine_dstalpha;
     BufferCombineFunc<false, bufsize, B, C> combine_dstnoalpha;
 
+    template <class SRC>
+    inline void combine (const SRC *src_p,
+                         fix15_short_t *dst_p,
+                         const bool dst_has_alpha,
+                         const float src_opacity) const
+    {
+        const fix15_short_t opac = fix15_short_clamp(src_opacity * fix15_one);
+        if (dst_has_alpha) {
+            combine_dstalpha(src_p, dst_p, opac);
+        }
+        else {
+            combine_dstnoalpha(src_p, dst_p, opac);
+        }
+    }
+
   public:
     TileDataCombine(const char *name) {
         this->name = name;
@@ -623,13 +931,16 @@ class TileDataCombine : public TileDataCombineOp
                        const bool dst_has_alpha,
                        const float src_opacity) const
     {
-        const fix15_short_t opac = fix15_short_clamp(src_opacity * fix15_one);
-        if (dst_has_alpha) {
-            combine_dstalpha(src_p, dst_p, opac);
-        }
-        else {
-            combine_dstnoalpha(src_p, dst_p, opac);
-        }
+        combine(src_p, dst_p, dst_has_alpha, src_opacity);
+    }
+
+    // The same, for a source buffer of premultiplied 8-bit RGBA data.
+    void combine_data (const uint8_t *src_p,
+                       fix15_short_t *dst_p,
+                       const bool dst_has_alpha,
+                       const float src_opacity) const
+    {
+        combine(src_p, dst_p, dst_has_alpha, src_opacity);
     }
 
     // True if a zero-alpha source pixel can ever affect a destination pixel
@@ -721,31 +1032,38 @@ tile_combine (enum CombineMode mode,
     PyArrayObject* dst = ((PyArrayObject*)dst_obj);
 #ifdef HEAVY_DEBUG
     assert(PyArray_Check(src_obj));
-    assert(PyArray_DIM(src, 0) == MYPAINT_TILE_SIZE);
-    assert(PyArray_DIM(src, 1) == MYPAINT_TILE_SIZE);
+    assert(PyArray_DIM(src, 0) == MYPAINTLIB_TILE_SIZE);
+    assert(PyArray_DIM(src, 1) == MYPAINTLIB_TILE_SIZE);
     assert(PyArray_DIM(src, 2) == 4);
-    assert(PyArray_TYPE(src) == NPY_UINT16);
+    assert(PyArray_TYPE(src) == NPY_UINT16 || PyArray_TYPE(src) == NPY_UINT8);
     assert(PyArray_ISCARRAY(src));
 
     assert(PyArray_Check(dst_obj));
-    assert(PyArray_DIM(dst, 0) == MYPAINT_TILE_SIZE);
-    assert(PyArray_DIM(dst, 1) == MYPAINT_TILE_SIZE);
+    assert(PyArray_DIM(dst, 0) == MYPAINTLIB_TILE_SIZE);
+    assert(PyArray_DIM(dst, 1) == MYPAINTLIB_TILE_SIZE);
     assert(PyArray_DIM(dst, 2) == 4);
     assert(PyArray_TYPE(dst) == NPY_UINT16);
     assert(PyArray_ISCARRAY(dst));
 
-    assert(PyArray_STRIDES(dst)[0] == 4*sizeof(fix15_short_t)*MYPAINT_TILE_SIZE);
+    assert(PyArray_STRIDES(dst)[0] == 4*sizeof(fix15_short_t)*MYPAINTLIB_TILE_SIZE);
     assert(PyArray_STRIDES(dst)[1] == 4*sizeof(fix15_short_t));
     assert(PyArray_STRIDES(dst)[2] ==   sizeof(fix15_short_t));
 #endif
 
-    const fix15_short_t* const src_p = (fix15_short_t *)PyArray_DATA(src);
-    fix15_short_t*       const dst_p = (fix15_short_t *)PyArray_DATA(dst);
+    fix15_short_t* const dst_p = (fix15_short_t *)PyArray_DATA(dst);
 
     if (mode >= NumCombineModes || mode < 0) {
         return;
     }
     const TileDataCombineOp *op = combine_mode_info[mode];
-    op->combine_data(src_p, dst_p, dst_has_alpha, src_opacity);
+    if (PyArray_TYPE(src) == NPY_UINT8) {
+        // Tiles stored with 8 bits per channel are read as they are
+        const uint8_t* const src_p = (uint8_t *)PyArray_DATA(src);
+        op->combine_data(src_p, dst_p, dst_has_alpha, src_opacity);
+    }
+    else {
+        const fix15_short_t* const src_p = (fix15_short_t *)PyArray_DATA(src);
+        op->combine_data(src_p, dst_p, dst_has_alpha, src_opacity);
+    }
 }
 
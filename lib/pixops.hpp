@@ -54,6 +54,23 @@ void tile_convert_rgbu16_to_rgbu8(PyObject *src, PyObject *dst);
 void tile_convert_rgba8_to_rgba16(PyObject *src, PyObject *dst);
 
 
+// Premultiplied 8bpp RGBA tiles ("prgba8"): see lib.tiledsurface.Surface8.
+// Straight 8bpp RGBA is premultiplied on loading, and un-premultiplied
+// when saving. Conversions to and from 15ish-bit tiles are rounded.
+
+void tile_convert_rgba8_to_prgba8(PyObject *src, PyObject *dst);
+
+void tile_convert_prgba8_to_rgba8(PyObject *src, PyObject *dst);
+
+void tile_convert_prgba8_to_rgba16(PyObject *src, PyObject *dst);
+
+void tile_convert_rgba16_to_prgba8(PyObject *src, PyObject *dst);
+
+// Like tile_downscale_rgba16(), for mipmaps of prgba8 tiles.
+
+void tile_downscale_prgba8(PyObject *src, PyObject *dst, int dst_x, int dst_y);
+
+
 // Flatten a premultiplied rgba layer, using "bg" as background.
 // (bg is assumed to be flat, bg.alpha is ignored)
 //
@@ -16,6 +16,9 @@
 
 #include <mypaint-brush-settings.h>
 
+#include <string.h>
+#include <vector>
+
 class PythonBrush : public Brush {
 
 public:
@@ -44,16 +47,182 @@ public:
     }
   }
 
+  // All settings (base values and input mappings) as a compact binary
+  // string, which set_all_from_blob() applies in one call. Used to replay
+  // recorded strokes without parsing their saved settings again.
+  //
+  // Layout: the uint16 counts of settings and inputs, then for each
+  // setting, its float32 base value and for each input, a uint8 count of
+  // mapping points followed by that many (x, y) float32 pairs. Numbers
+  // are in native byte order: blobs aren't meant to be saved.
+  PyObject * get_all_as_blob ()
+  {
+    std::vector<char> blob;
+    const uint16_t counts[2] = {MYPAINT_BRUSH_SETTINGS_COUNT,
+                                MYPAINT_BRUSH_INPUTS_COUNT};
+    blob_put(blob, counts, sizeof(counts));
+    for (int id=0; id<MYPAINT_BRUSH_SETTINGS_COUNT; id++) {
+      const float base = get_base_value(id);
+      blob_put(blob, &base, sizeof(base));
+      for (int input=0; input<MYPAINT_BRUSH_INPUTS_COUNT; input++) {
+        const uint8_t n = get_mapping_n(id, input);
+        blob_put(blob, &n, sizeof(n));
+        for (int i=0; i<n; i++) {
+          float xy[2];
+          get_mapping_point(id, input, i, &xy[0], &xy[1]);
+          blob_put(blob, xy, sizeof(xy));
+        }
+      }
+    }
+    return PyString_FromStringAndSize(&blob[0], blob.size());
+  }
+
+  // Applies a blob made by get_all_as_blob(). Raises ValueError if the
+  // blob is malformed or was made for a different set of settings, in
+  // which case the brush is left unchanged.
+  PyObject * set_all_from_blob (PyObject *obj)
+  {
+    char *data = NULL;
+    Py_ssize_t len = 0;
+    if (PyString_AsStringAndSize(obj, &data, &len) < 0) {
+      return NULL;
+    }
+    // Check the whole blob before changing anything
+    const char *p = data;
+    const char *end = data + len;
+    uint16_t counts[2];
+    bool ok = blob_get(p, end, counts, sizeof(counts))
+           && counts[0] == MYPAINT_BRUSH_SETTINGS_COUNT
+           && counts[1] == MYPAINT_BRUSH_INPUTS_COUNT;
+    for (int id=0; ok && id<MYPAINT_BRUSH_SETTINGS_COUNT; id++) {
+      p += sizeof(float);
+      for (int input=0; ok && input<MYPAINT_BRUSH_INPUTS_COUNT; input++) {
+        uint8_t n;
+        // libmypaint aborts on counts it can't make a mapping from
+        ok = blob_get(p, end, &n, sizeof(n))
+          && n != 1 && n <= BLOB_MAPPING_POINTS_MAX;
+        p += n * 2 * sizeof(float);
+      }
+    }
+    if (! ok || p != end) {
+      PyErr_SetString(PyExc_ValueError, "malformed brush settings blob");
+      return NULL;
+    }
+    p = data + sizeof(counts);
+    for (int id=0; id<MYPAINT_BRUSH_SETTINGS_COUNT; id++) {
+      float base;
+      blob_get(p, end, &base, sizeof(base));
+      set_base_value(id, base);
+      for (int input=0; input<MYPAINT_BRUSH_INPUTS_COUNT; input++) {
+        uint8_t n;
+        blob_get(p, end, &n, sizeof(n));
+        set_mapping_n(id, input, n);
+        for (int i=0; i<n; i++) {
+          float xy[2];
+          blob_get(p, end, xy, sizeof(xy));
+          set_mapping_point(id, input, i, xy[0], xy[1]);
+        }
+      }
+    }
+    Py_RETURN_NONE;
+  }
+
   // Same as Brush::stroke_to() but with minimal exception handling:
   // don't indicate that a split is pending should an exception happen
   // in the surface code (e.g. out-of-memory)
+  //
+  // The GIL is released while the brush engine runs if the surface
+  // allows it, so that other threads can carry on while big dabs are
+  // painted. See lib/paintingthread.py.
   bool stroke_to (Surface * surface, float x, float y, float pressure, float xtilt, float ytilt, double dtime)
   {
-    bool res = Brush::stroke_to (surface, x, y, pressure, xtilt, ytilt, dtime);
+    bool res;
+    if (surface->set_gil_released(true)) {
+      Py_BEGIN_ALLOW_THREADS
+      res = Brush::stroke_to (surface, x, y, pressure, xtilt, ytilt, dtime);
+      Py_END_ALLOW_THREADS
+      surface->set_gil_released(false);
+    }
+    else {
+      res = Brush::stroke_to (surface, x, y, pressure, xtilt, ytilt, dtime);
+    }
     if (PyErr_Occurred()) {
       res = false;
     }
     return res;
   }
 
+  // Paints a whole array of motion events in one call, like calling
+  // stroke_to() for each row of an Nx6 float64 array, whose columns are
+  // (dtime, x, y, pressure, xtilt, ytilt): the layout lib/stroke.py uses
+  // for its event data.
+  //
+  // Returns a tuple (count, split), where count is the number of events
+  // painted, and split tells whether any of them asked for a split. If
+  // stop_at_split is true, painting stops after the first event which
+  // asks for a split, so that the caller can start a new stroke before
+  // passing on the rest.
+  PyObject *
+  stroke_to_many (Surface * surface, PyObject *events, bool stop_at_split=false)
+  {
+    if (! PyArray_Check(events)) {
+      PyErr_SetString(PyExc_TypeError, "events must be a numpy array");
+      return NULL;
+    }
+    PyArrayObject *arr = (PyArrayObject *)events;
+    if (PyArray_NDIM(arr) != 2 || PyArray_DIM(arr, 1) != 6
+        || PyArray_TYPE(arr) != NPY_FLOAT64 || ! PyArray_ISCARRAY_RO(arr))
+    {
+      PyErr_SetString(PyExc_ValueError,
+                      "events must be a contiguous Nx6 float64 array");
+      return NULL;
+    }
+    const npy_intp n = PyArray_DIM(arr, 0);
+    const double *ev = (const double *)PyArray_DATA(arr);
+    npy_intp i = 0;
+    bool split = false;
+    const bool gil_released = surface->set_gil_released(true);
+    PyThreadState *thread_state = NULL;
+    if (gil_released) {
+      thread_state = PyEval_SaveThread();
+    }
+    for (; i < n; i++, ev += 6) {
+      if (Brush::stroke_to(surface, ev[1], ev[2], ev[3], ev[4], ev[5], ev[0])) {
+        split = true;
+        if (stop_at_split) {
+          i++;
+          break;
+        }
+      }
+    }
+    if (gil_released) {
+      PyEval_RestoreThread(thread_state);
+      surface->set_gil_released(false);
+    }
+    if (PyErr_Occurred()) {
+      split = false;
+    }
+    return Py_BuildValue("(nO)", (Py_ssize_t)i, split ? Py_True : Py_False);
+  }
+
+private:
+  // Most points an input mapping can have (see libmypaint's mapping.c)
+  static const int BLOB_MAPPING_POINTS_MAX = 8;
+
+  static void blob_put (std::vector<char> &blob, const void *src, size_t n)
+  {
+    const char *c = (const char *)src;
+    blob.insert(blob.end(), c, c + n);
+  }
+
+  static bool blob_get (const char *&p, const char *end, void *dst, size_t n)
+  {
+    if (p > end || (size_t)(end - p) < n) {
+      return false;
+    }
+    memcpy(dst, p, n);
+    p += n;
+    return true;
+  }
+
 };
@@ -8,51 +8,454 @@
  */
 
 #include "pythontiledsurface.h"
+#include "tilestore.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+
+// Tile request cache.
+//
+// libmypaint asks for the same tiles over and over during an atomic
+// section, from several threads at once when it processes tiles in
+// parallel. Each tile is looked up once per atomic section under the
+// critical section in tile_request_start(), and the answer is recorded
+// here. Later requests for it are answered without locking.
+//
+// Slots are only filled in by the thread holding the critical section,
+// and are cleared between atomic sections, when no requests are in
+// flight. A slot's position is written before its value is published,
+// and readers check the value first, so a reader which finds a value
+// also sees the position it belongs to. Anything else is a miss, which
+// just takes the locked path.
+
+static const int TILE_CACHE_SIZE = 1024;  // slots, a power of two
+static const int TILE_CACHE_MAX_USED = TILE_CACHE_SIZE / 2;
+static const uintptr_t TILE_CACHE_WRITABLE = 1;
+
+struct TileCacheSlot {
+    int tx;
+    int ty;
+    uintptr_t value;    // buffer address | TILE_CACHE_WRITABLE, or 0
+};
 
 struct MyPaintPythonTiledSurface {
     MyPaintTiledSurface parent;
     PyObject * py_obj;
+    TileStore * store;  // tile storage, owned by py_obj
+
+    // Request cache, only used between begin_atomic and end_atomic
+    TileCacheSlot *cache;
+    int cache_used;
+    bool cache_active;
+
+    // True while libmypaint runs without the GIL
+    bool gil_released;
+
+    // The next mipmap level, for sampling colors over large areas
+    MyPaintPythonTiledSurface *mipmap;
+
+    // Painting statistics, see get_paint_stats()
+    long stat_dabs;
+    long stat_tile_requests;
+    long stat_tile_misses;
+    int stat_peak_tiles;
+
+    // libmypaint's implementations, which ours wrap
+    MyPaintSurfaceBeginAtomicFunction parent_begin_atomic;
+    MyPaintSurfaceEndAtomicFunction parent_end_atomic;
+    MyPaintSurfaceGetColorFunction parent_get_color;
+    MyPaintSurfaceDrawDabFunction parent_draw_dab;
 };
 
+
+// Color sampling from mipmaps.
+//
+// Smudging with a big brush asks for the average color under a large
+// radius for every dab, and libmypaint reads every pixel under it. At or
+// above mipmap_sampling_radius, the sample is taken from the smallest
+// mipmap level where the radius still covers MIPMAP_SAMPLING_MIN_RADIUS
+// pixels instead. Each level is a 2x2 box filtered copy of the one
+// below, so flat areas sample exactly the same. Only the weighting of
+// detail near the edge of the sampled disc differs. This keeps results
+// within a few percent of full resolution sampling: tests/mypaintlib.py
+// checks for 0.05 per channel on busy content. Mipmap tiles are
+// regenerated from the tiles below when requested, but dabs still
+// queued in the current atomic section aren't seen.
+//
+// All color and alpha sampling goes through here, one sample at a time
+// or in batches (TiledSurface::get_colors()), so a sample gives the same
+// result either way. A radius of 0 turns this off. That is the default,
+// here and in the application's preferences.
+
+static float mipmap_sampling_radius = 0.0;
+static const float MIPMAP_SAMPLING_MIN_RADIUS = 16.0;
+
 // Forward declare
 void free_tiledsurf(MyPaintSurface *surface);
 
+
+static inline int
+tile_cache_index(int tx, int ty)
+{
+    const unsigned int h = ((unsigned int)tx * 73856093u)
+                         ^ ((unsigned int)ty * 19349663u);
+    return h & (TILE_CACHE_SIZE - 1);
+}
+
+
+// Looks up a tile without locking. Returns NULL on a miss.
+
+static inline uint16_t *
+tile_cache_lookup(const TileCacheSlot *cache, int tx, int ty, bool readonly)
+{
+    int i = tile_cache_index(tx, ty);
+    for (;;) {
+        const TileCacheSlot *slot = &cache[i];
+        const uintptr_t value = __atomic_load_n(&slot->value,
+                                                __ATOMIC_ACQUIRE);
+        if (! value) {
+            return NULL;
+        }
+        if (slot->tx == tx && slot->ty == ty) {
+            if (! readonly && ! (value & TILE_CACHE_WRITABLE)) {
+                return NULL;
+            }
+            return (uint16_t *)(value & ~TILE_CACHE_WRITABLE);
+        }
+        i = (i + 1) & (TILE_CACHE_SIZE - 1);
+    }
+}
+
+
+// Records the answer to a request. Must be called in the critical section.
+// Read-only answers never replace writable ones.
+
 static void
-tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request)
+tile_cache_store(MyPaintPythonTiledSurface *self, int tx, int ty,
+                 uint16_t *buffer, bool writable)
 {
-    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)tiled_surface;
+    const uintptr_t value = (uintptr_t)buffer
+                          | (writable ? TILE_CACHE_WRITABLE : 0);
+    int i = tile_cache_index(tx, ty);
+    for (;;) {
+        TileCacheSlot *slot = &self->cache[i];
+        if (! slot->value) {
+            // Keep at least half the slots free, so lookups stay short
+            if (self->cache_used >= TILE_CACHE_MAX_USED) {
+                return;
+            }
+            slot->tx = tx;
+            slot->ty = ty;
+            __atomic_store_n(&slot->value, value, __ATOMIC_RELEASE);
+            self->cache_used++;
+            return;
+        }
+        if (slot->tx == tx && slot->ty == ty) {
+            if (writable || ! (slot->value & TILE_CACHE_WRITABLE)) {
+                __atomic_store_n(&slot->value, value, __ATOMIC_RELEASE);
+            }
+            return;
+        }
+        i = (i + 1) & (TILE_CACHE_SIZE - 1);
+    }
+}
 
-    const gboolean readonly = request->readonly;
-    const int tx = request->tx;
-    const int ty = request->ty;
-    PyArrayObject* rgba = NULL;
 
+static void
+tile_cache_clear(MyPaintPythonTiledSurface *self)
+{
+    if (self->cache_used > 0) {
+        memset(self->cache, 0, TILE_CACHE_SIZE * sizeof(TileCacheSlot));
+        self->cache_used = 0;
+    }
+}
+
+
+static void
+tile_cache_begin(MyPaintPythonTiledSurface *self)
+{
+    // Only surfaces which get painted on or sampled pay for a cache
+    if (! self->cache) {
+        self->cache = (TileCacheSlot *)calloc(TILE_CACHE_SIZE,
+                                              sizeof(TileCacheSlot));
+    }
+    tile_cache_clear(self);
+    self->cache_active = (self->cache != NULL);
+}
+
+
+static void
+tile_cache_end(MyPaintPythonTiledSurface *self)
+{
+    self->cache_active = false;
+    if (self->cache_used > self->stat_peak_tiles) {
+        self->stat_peak_tiles = self->cache_used;
+    }
+    tile_cache_clear(self);
+}
+
+
+static void
+python_tiled_surface_begin_atomic(MyPaintSurface *surface)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
+    self->parent_begin_atomic(surface);
+    tile_cache_begin(self);
+}
+
+
+static void
+python_tiled_surface_end_atomic(MyPaintSurface *surface,
+                                MyPaintRectangle *roi)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
+    // libmypaint does most of its tile requests in here
+    self->parent_end_atomic(surface, roi);
+    // Buffers are only guaranteed to stay put until now
+    tile_cache_end(self);
+}
+
+
+static int
+python_tiled_surface_draw_dab(MyPaintSurface *surface,
+                              float x, float y, float radius,
+                              float color_r, float color_g, float color_b,
+                              float opaque, float hardness,
+                              float alpha_eraser,
+                              float aspect_ratio, float angle,
+                              float lock_alpha, float colorize)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
+    self->stat_dabs++;
+    return self->parent_draw_dab(surface, x, y, radius,
+                                 color_r, color_g, color_b,
+                                 opaque, hardness, alpha_eraser,
+                                 aspect_ratio, angle, lock_alpha, colorize);
+}
+
+
+static void
+python_tiled_surface_get_color(MyPaintSurface *surface,
+                               float x, float y, float radius,
+                               float *color_r, float *color_g,
+                               float *color_b, float *color_a)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
+    MyPaintPythonTiledSurface *level = self;
+    if (mipmap_sampling_radius > 0 && radius >= mipmap_sampling_radius) {
+        while (level->mipmap && radius / 2 >= MIPMAP_SAMPLING_MIN_RADIUS) {
+            level = level->mipmap;
+            x /= 2;
+            y /= 2;
+            radius /= 2;
+            // Regenerating mipmap tiles needs Python
+            level->gil_released = self->gil_released;
+        }
+    }
+    level->parent_get_color((MyPaintSurface *)level, x, y, radius,
+                            color_r, color_g, color_b, color_a);
+    if (level != self) {
+        for (MyPaintPythonTiledSurface *m = self->mipmap; ; m = m->mipmap) {
+            m->gil_released = false;
+            if (m == level) {
+                break;
+            }
+        }
+    }
+}
+
+
+// Batches of reads outside atomic sections can use the request cache
+// too, as long as the GIL is held throughout. Returns false if the
+// cache is in use already, in which case the batch must not end it.
+
+static bool
+python_tiled_surface_begin_reads(MyPaintPythonTiledSurface *self)
+{
+    if (self->cache_active) {
+        return false;
+    }
+    tile_cache_begin(self);
+    return true;
+}
+
+
+static void
+python_tiled_surface_end_reads(MyPaintPythonTiledSurface *self)
+{
+    tile_cache_end(self);
+}
+
+
+// Painting statistics, for benchmarking (see tests/brushbench.py).
+//
+// "dabs" counts the dabs libmypaint was asked to draw, and
+// "tile_requests" its tile requests. "tile_misses" counts the requests
+// made while the request cache was in use which it couldn't answer.
+// Requests outside atomic sections or batched reads don't use the
+// cache, and aren't counted as misses. "peak_tiles" is the
+// most tiles used in one atomic section, which is capped by the cache
+// size. Counts are since the surface was created, or since the last
+// reset.
+
+static PyObject *
+python_tiled_surface_get_paint_stats(MyPaintPythonTiledSurface *self)
+{
+    return Py_BuildValue(
+        "{s:l,s:l,s:l,s:i}",
+        "dabs", self->stat_dabs,
+        "tile_requests", __atomic_load_n(&self->stat_tile_requests,
+                                         __ATOMIC_RELAXED),
+        "tile_misses", self->stat_tile_misses,
+        "peak_tiles", self->stat_peak_tiles
+    );
+}
+
+
+static void
+python_tiled_surface_reset_paint_stats(MyPaintPythonTiledSurface *self)
+{
+    self->stat_dabs = 0;
+    self->stat_tile_requests = 0;
+    self->stat_tile_misses = 0;
+    self->stat_peak_tiles = 0;
+}
+
+
+// Answers a request from the request cache or the native tile store,
+// or returns NULL if neither can. Never runs Python, so threads holding
+// the GIL may wait here: the thread in the critical section won't need
+// the GIL to leave it.
+
+static uint16_t *
+tile_request_native(MyPaintPythonTiledSurface *self, int tx, int ty,
+                    bool readonly, bool use_cache, bool count_miss)
+{
+    uint16_t *buffer = NULL;
 #pragma omp critical
 {
-    rgba = (PyArrayObject*)PyObject_CallMethod(self->py_obj, "_get_tile_numpy", "(iii)", tx, ty, readonly);
-    if (rgba == NULL) {
-        request->buffer = NULL;
-        printf("Python exception during get_tile_numpy()!\n");
-        if (PyErr_Occurred()) {
-            PyErr_Print();
+    // Another thread may have asked for the same tile while we waited
+    if (use_cache) {
+        buffer = tile_cache_lookup(self->cache, tx, ty, readonly);
+        if (buffer == NULL && count_miss) {
+            self->stat_tile_misses++;
         }
-    } else {
+    }
+    // Most requests are answered by the native tile store without
+    // involving Python. It declines the few it can't handle, like tiles
+    // which haven't been loaded yet.
+    if (buffer == NULL && self->store) {
+        buffer = self->store->request(tx, ty, readonly);
+        if (buffer && use_cache) {
+            tile_cache_store(self, tx, ty, buffer, ! readonly);
+        }
+    }
+} // #end pragma opt critical
+    return buffer;
+}
+
+
+// Answers a request the native tile store declined, by asking Python.
+// Must be called with the GIL held.
+//
+// Python may let other threads take the GIL while it runs, at the check
+// interval or while it loads tile data from a file. So this must not be
+// called in the critical section above, where a thread which took the
+// GIL meanwhile could be waiting. Requests which need Python take turns
+// in a critical section of their own instead, which they wait for
+// without the GIL.
+
+static uint16_t *
+tile_request_python(MyPaintPythonTiledSurface *self, int tx, int ty,
+                    bool readonly, bool use_cache)
+{
+    uint16_t *buffer = NULL;
+    Py_BEGIN_ALLOW_THREADS
+#pragma omp critical(tile_request_python)
+{
+    Py_BLOCK_THREADS
+    // The thread before us may have loaded the tile already
+    buffer = tile_request_native(self, tx, ty, readonly, use_cache, false);
+    PyArrayObject *rgba = NULL;
+    if (buffer == NULL) {
+        rgba = (PyArrayObject*)PyObject_CallMethod(self->py_obj, "_get_tile_numpy", "(iii)", tx, ty, readonly);
+        if (rgba == NULL) {
+            printf("Python exception during get_tile_numpy()!\n");
+            if (PyErr_Occurred()) {
+                PyErr_Print();
+            }
+        }
+    }
+    if (rgba != NULL) {
 
 #ifdef HEAVY_DEBUG
         assert(PyArray_NDIM(rgba) == 3);
-        assert(PyArray_DIM(rgba, 0) == tiled_surface->tile_size);
-        assert(PyArray_DIM(rgba, 1) == tiled_surface->tile_size);
+        assert(PyArray_DIM(rgba, 0) == self->parent.tile_size);
+        assert(PyArray_DIM(rgba, 1) == self->parent.tile_size);
         assert(PyArray_DIM(rgba, 2) == 4);
         assert(PyArray_ISCARRAY(rgba));
         assert(PyArray_TYPE(rgba) == NPY_UINT16);
 #endif
+        // Let the store answer the next request for this tile itself
+        if (self->store) {
+            self->store->adopt_rgba(tx, ty, (PyObject *)rgba);
+        }
         // tiledsurface.py will keep a reference in its tiledict, at least until the final end_atomic()
         Py_DECREF((PyObject *)rgba);
-        request->buffer = (uint16_t*)PyArray_DATA(rgba);
+        buffer = (uint16_t*)PyArray_DATA(rgba);
+        if (use_cache) {
+#pragma omp critical
+            tile_cache_store(self, tx, ty, buffer, ! readonly);
+        }
     }
-} // #end pragma opt critical
+    Py_UNBLOCK_THREADS
+} // #end pragma omp critical(tile_request_python)
+    Py_END_ALLOW_THREADS
+    return buffer;
+}
+
 
+static void
+tile_request_start(MyPaintTiledSurface *tiled_surface, MyPaintTileRequest *request)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)tiled_surface;
 
+    const bool readonly = request->readonly;
+    const int tx = request->tx;
+    const int ty = request->ty;
+
+    // Requests come from several threads at once
+    __atomic_fetch_add(&self->stat_tile_requests, 1, __ATOMIC_RELAXED);
+
+    const bool use_cache = self->cache_active;
+    if (use_cache) {
+        request->buffer = tile_cache_lookup(self->cache, tx, ty, readonly);
+        if (request->buffer) {
+            return;
+        }
+    }
+
+    // The store and Python are only used with the GIL held. Lock order
+    // is GIL first, then the critical section. If libmypaint was called
+    // with the GIL held, that's the thread making the request: libmypaint
+    // only uses other threads in end_atomic(), which releases the GIL.
+    const bool take_gil = self->gil_released;
+    PyGILState_STATE gil_state = PyGILState_LOCKED;
+    if (take_gil) {
+        gil_state = PyGILState_Ensure();
+    }
+
+    request->buffer = tile_request_native(self, tx, ty, readonly,
+                                          use_cache, true);
+    if (request->buffer == NULL) {
+        request->buffer = tile_request_python(self, tx, ty, readonly,
+                                              use_cache);
+    }
+
+    if (take_gil) {
+        PyGILState_Release(gil_state);
+    }
 }
 
 static void
@@ -71,8 +474,24 @@ mypaint_python_tiled_surface_new(PyObject *py_object)
 
     // MyPaintSurface vfuncs
     self->parent.parent.destroy = free_tiledsurf;
+    self->parent_begin_atomic = self->parent.parent.begin_atomic;
+    self->parent_end_atomic = self->parent.parent.end_atomic;
+    self->parent_get_color = self->parent.parent.get_color;
+    self->parent_draw_dab = self->parent.parent.draw_dab;
+    self->parent.parent.begin_atomic = python_tiled_surface_begin_atomic;
+    self->parent.parent.end_atomic = python_tiled_surface_end_atomic;
+    self->parent.parent.get_color = python_tiled_surface_get_color;
+    self->parent.parent.draw_dab = python_tiled_surface_draw_dab;
 
     self->py_obj = py_object; // no need to incref
+    self->store = NULL;
+
+    self->cache = NULL;
+    self->cache_used = 0;
+    self->cache_active = false;
+    self->gil_released = false;
+    self->mipmap = NULL;
+    python_tiled_surface_reset_paint_stats(self);
 
     return self;
 }
@@ -81,5 +500,6 @@ void free_tiledsurf(MyPaintSurface *surface)
 {
     MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
     mypaint_tiled_surface_destroy(&self->parent);
+    free(self->cache);
     free(self);
 }
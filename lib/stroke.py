@@ -11,6 +11,7 @@ from __future__ import division, print_function
 import numpy as np
 
 import brush
+import lib.mypaintlib
 
 
 class Stroke (object):
@@ -39,6 +40,8 @@ class Stroke (object):
         bi = brush.brushinfo
         self.brush_settings = bi.save_to_string()
         self.brush_name = bi.get_string_property("parent_brush_name")
+        # Replays apply this instead of parsing brush_settings
+        self.brush_blob = brush.get_all_as_blob()
 
         states = brush.get_states_as_array()
         assert states.dtype == 'float32'
@@ -53,16 +56,33 @@ class Stroke (object):
         assert not self.finished
         self.tmp_event_list.append((dtime, x, y, pressure, xtilt, ytilt))
 
-    def stop_recording(self):
+    def record_events(self, events):
+        """Records many events at once
+
+        :param numpy.ndarray events: Nx6 array of event rows, with the
+          same columns as record_event()'s args
+
+        """
+        assert not self.finished
+        self.tmp_event_list.extend(events.tolist())
+
+    def stop_recording(self, brush=None):
+        """Finishes recording
+
+        :param brush: the brush which painted the stroke, if it wasn't
+          the one recording started with (see lib.command.Brushwork)
+
+        """
         if self.finished:
             return
-        # OPTIMIZE
-        # - for space: just gzip? use integer datatypes?
-        # - for time: maybe already use array storage while recording?
+        if brush is not None:
+            self.brush = brush
+        # Version 3 is the compact encoding in lib/strokecodec.hpp.
+        # Version 2, raw float64 rows, can still be read.
         data = np.array(self.tmp_event_list, dtype='float64')
-        data = data.tostring()
-        version = '2'
-        self.stroke_data = version + data
+        data = data.reshape((-1, 6))
+        version = '3'
+        self.stroke_data = version + lib.mypaintlib.stroke_events_encode(data)
 
         self.total_painting_time = self.brush.get_total_stroke_painting_time()
         #if not self.empty:
@@ -79,8 +99,8 @@ class Stroke (object):
     def render(self, surface):
         assert self.finished
 
-        # OPTIMIZE: check if parsing of settings is a performance bottleneck
-        b = brush.Brush(brush.BrushInfo(self.brush_settings))
+        b = lib.mypaintlib.PythonBrush()
+        b.set_all_from_blob(self.brush_blob)
 
         states = np.fromstring(self.brush_state, dtype='float32')
         b.set_states_from_array(states)
@@ -88,15 +108,25 @@ class Stroke (object):
         #b.set_print_inputs(1)
         #print 'replaying', len(self.stroke_data), 'bytes'
 
+        surface.begin_atomic()
+        b.stroke_to_many(surface.backend, self.get_events())
+        surface.end_atomic()
+
+    def get_events(self):
+        """Returns the recorded events
+
+        :returns: Nx6 array of (dtime, x, y, pressure, xtilt, ytilt) rows
+        :rtype: numpy.ndarray
+
+        """
+        assert self.finished
         version, data = self.stroke_data[0], self.stroke_data[1:]
+        if version == '3':
+            return lib.mypaintlib.stroke_events_decode(data)
         assert version == '2'
         data = np.fromstring(data, dtype='float64')
         data.shape = (len(data) // 6, 6)
-
-        surface.begin_atomic()
-        for dtime, x, y, pressure, xtilt, ytilt in data:
-            b.stroke_to(surface.backend, x, y, pressure, xtilt, ytilt, dtime)
-        surface.end_atomic()
+        return data
 
     def copy_using_different_brush(self, brushinfo):
         assert self.finished
@@ -106,6 +136,8 @@ class Stroke (object):
         # Except for the brush-specific stuff
         clone.brush_settings = brushinfo.save_to_string()
         clone.brush_name = brushinfo.get_string_property("parent_brush_name")
+        b = brush.Brush(brush.BrushInfo(clone.brush_settings))
+        clone.brush_blob = b.get_all_as_blob()
         # note: we keep self.brush_state intact, even if the new brush
         # has different meanings for the states. This should cause
         # fewer glitches than resetting the initial state to zero.
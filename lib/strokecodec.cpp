@@ -0,0 +1,155 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2017 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "strokecodec.hpp"
+
+#include "common.hpp"
+
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#define NO_IMPORT_ARRAY
+#include <numpy/arrayobject.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+
+static const int STROKE_EVENT_FIELDS = 6;
+
+
+// Float bits, as an unsigned integer which sorts like the float.
+
+static inline uint32_t
+float_to_ordered(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+static inline float
+ordered_to_float(uint32_t u)
+{
+    u = (u & 0x80000000u) ? (u & 0x7fffffffu) : ~u;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+
+static inline void
+put_varint(std::vector<unsigned char> &out, uint32_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((unsigned char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((unsigned char)v);
+}
+
+// Returns false if the data ends too soon, or the varint is too long.
+
+static inline bool
+get_varint(const unsigned char *&p, const unsigned char *end, uint32_t &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p >= end) {
+            return false;
+        }
+        const unsigned char b = *p++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (! (b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+PyObject *
+stroke_events_encode(PyObject *events)
+{
+    if (! PyArray_Check(events)) {
+        PyErr_SetString(PyExc_TypeError, "events must be a numpy array");
+        return NULL;
+    }
+    PyArrayObject *arr = (PyArrayObject *)events;
+    if (PyArray_NDIM(arr) != 2
+        || PyArray_DIM(arr, 1) != STROKE_EVENT_FIELDS
+        || PyArray_TYPE(arr) != NPY_FLOAT64
+        || ! PyArray_ISCARRAY_RO(arr))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "events must be a contiguous Nx6 float64 array");
+        return NULL;
+    }
+    const npy_intp n = PyArray_DIM(arr, 0);
+    if ((uint64_t)n > 0xffffffffu) {
+        PyErr_SetString(PyExc_ValueError, "too many events");
+        return NULL;
+    }
+    const double *ev = (const double *)PyArray_DATA(arr);
+
+    std::vector<unsigned char> out;
+    out.reserve(5 + n * STROKE_EVENT_FIELDS * 2);
+    put_varint(out, (uint32_t)n);
+    uint32_t prev[STROKE_EVENT_FIELDS] = {0};
+    for (npy_intp i = 0; i < n * STROKE_EVENT_FIELDS; i++) {
+        const int c = i % STROKE_EVENT_FIELDS;
+        const uint32_t u = float_to_ordered((float)ev[i]);
+        const int32_t delta = (int32_t)(u - prev[c]);
+        prev[c] = u;
+        // zigzag: small magnitudes of either sign become small numbers
+        put_varint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    }
+    return PyString_FromStringAndSize((const char *)&out[0], out.size());
+}
+
+
+PyObject *
+stroke_events_decode(PyObject *data)
+{
+    char *buf = NULL;
+    Py_ssize_t len = 0;
+    if (PyString_AsStringAndSize(data, &buf, &len) < 0) {
+        return NULL;
+    }
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+
+    uint32_t n = 0;
+    // Each event takes at least one byte per field
+    if (! get_varint(p, end, n)
+        || (uint64_t)n * STROKE_EVENT_FIELDS > (uint64_t)(end - p))
+    {
+        PyErr_SetString(PyExc_ValueError, "truncated stroke event data");
+        return NULL;
+    }
+    npy_intp dims[2] = {(npy_intp)n, STROKE_EVENT_FIELDS};
+    PyObject *result = PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    if (! result) {
+        return NULL;
+    }
+    double *ev = (double *)PyArray_DATA((PyArrayObject *)result);
+    uint32_t prev[STROKE_EVENT_FIELDS] = {0};
+    for (npy_intp i = 0; i < (npy_intp)n * STROKE_EVENT_FIELDS; i++) {
+        uint32_t z;
+        if (! get_varint(p, end, z)) {
+            Py_DECREF(result);
+            PyErr_SetString(PyExc_ValueError, "truncated stroke event data");
+            return NULL;
+        }
+        const int c = i % STROKE_EVENT_FIELDS;
+        const uint32_t delta = (z >> 1) ^ (0u - (z & 1));
+        prev[c] += delta;
+        ev[i] = ordered_to_float(prev[c]);
+    }
+    return result;
+}
@@ -0,0 +1,36 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2017 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STROKECODEC_HPP
+#define STROKECODEC_HPP
+
+#include <Python.h>
+
+// Compact encoding of recorded stroke events (see lib/stroke.py).
+//
+// Events are rows of (dtime, x, y, pressure, xtilt, ytilt). The brush
+// engine takes positions, pressure and tilt as floats, and steps through
+// time in floats too, so each value is rounded to float32 first: that
+// is the precision which round trips exactly. Each float's bits are
+// mapped to an integer which sorts like the float, and stored as the
+// zigzag varint of its difference from the previous event's.
+// Neighbouring events differ little, so most values take 1-3 bytes
+// instead of 8.
+
+// Encodes an Nx6 float64 array of events, returning a string.
+
+PyObject *stroke_events_encode(PyObject *events);
+
+// Decodes a string made by stroke_events_encode(), returning an Nx6
+// float64 array ready for PythonBrush::stroke_to_many().
+
+PyObject *stroke_events_decode(PyObject *data);
+
+
+#endif //STROKECODEC_HPP
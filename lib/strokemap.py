@@ -58,14 +58,8 @@ class StrokeShape (object):
         case, no StrokeShape should be recorded.
 
         """
-        before_dict = before.tiledict
-        after_dict = after.tiledict
-        before_tiles = set(before_dict.iteritems())
-        after_tiles = set(after_dict.iteritems())
-        changed_idxs = set(
-            pos for pos, data
-            in before_tiles.symmetric_difference(after_tiles)
-        )
+        # Snapshots share unchanged tiles, so this is quick.
+        changed_idxs = set(before.tiledict.changed_tiles(after.tiledict))
         if not changed_idxs:
             return None
         shape = cls()
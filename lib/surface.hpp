@@ -26,6 +26,11 @@ public:
 
   virtual ~Surface() {}
   virtual MyPaintSurface *get_surface_interface() = 0;
+
+  // Tells the surface whether libmypaint is about to run with the GIL
+  // released, or has finished. Returns false if the surface can't work
+  // without the GIL, in which case it must be kept.
+  virtual bool set_gil_released(bool released) { return false; }
 };
 
 #endif //SURFACE_HPP
@@ -157,7 +157,7 @@ class TileRequestWrapper (TileAccessible):
             raise ValueError("Only readonly tile requests are supported")
         tile = self._cache.get((tx, ty), None)
         if tile is None:
-            tile = np.zeros((N, N, 4), 'uint16')
+            tile = mypaintlib.tile_buffer_new_rgba16(None)
             self._cache[(tx, ty)] = tile
             self._obj.composite_tile(tile, True, tx, ty, **self._opts)
         yield tile
@@ -334,3 +334,90 @@ def save_as_png(surface, filename, *rect, **kwargs):
         # Other possible exceptions include TypeError, ValueError, but
         # those indicate incorrect coding usually; just raise them
         # normally.
+
+
+def save_as_jpeg(surface, filename, *rect, **kwargs):
+    """Saves a tile-blittable surface to a file in JPEG format
+
+    :param TileBlittable surface: Surface to save
+    :param unicode filename: The file to write
+    :param tuple \*rect: Rectangle (x, y, w, h) to save
+    :param int quality: JPEG quality, 1 to 100 (default 90)
+    :param int subsampling: One of the mypaintlib.JPEG_SUBSAMPLING_*
+        chroma subsampling modes (default 4:2:0)
+    :param callable feedback_cb: Called every TILES_PER_CALLBACK tiles.
+    :param bool single_tile_pattern: True if surface is a one tile only.
+    :param tuple \*\*kwargs: Passed to blit_tile_into (minus the above)
+
+    This works like `save_as_png()`, rendering and encoding one strip
+    of tiles at a time, so the full image is never held in memory.
+    The surface is always rendered without alpha.
+
+    Raises `lib.errors.FileHandlingError` with a descriptive string if
+    something went wrong.
+
+    """
+    quality = kwargs.pop('quality', 90)
+    subsampling = kwargs.pop('subsampling', mypaintlib.JPEG_SUBSAMPLING_420)
+    feedback_cb = kwargs.pop('feedback_cb', None)
+    single_tile_pattern = kwargs.pop("single_tile_pattern", False)
+    kwargs.pop('alpha', None)
+
+    if subsampling not in (mypaintlib.JPEG_SUBSAMPLING_444,
+                           mypaintlib.JPEG_SUBSAMPLING_422,
+                           mypaintlib.JPEG_SUBSAMPLING_420):
+        raise ValueError("Unknown chroma subsampling mode %r" % (subsampling,))
+    quality = int(max(1, min(100, quality)))
+
+    if not rect:
+        rect = surface.get_bbox()
+    x, y, w, h = rect
+    if w == 0 or h == 0:
+        x, y, w, h = (0, 0, 1, 1)
+        rect = (x, y, w, h)
+
+    try:
+        logger.debug(
+            "Writing %r (%dx%d) quality=%r subsampling=%r",
+            filename,
+            w, h,
+            quality,
+            subsampling,
+        )
+        with open(filename, "wb") as writer_fp:
+            jpegsave = mypaintlib.ProgressiveJPEGWriter(
+                writer_fp,
+                w, h,
+                quality,
+                subsampling,
+            )
+            feedback_counter = 0
+            scanline_strips = scanline_strips_iter(
+                surface, rect,
+                alpha=False,
+                single_tile_pattern=single_tile_pattern,
+                **kwargs
+            )
+            for scanline_strip in scanline_strips:
+                jpegsave.write(scanline_strip)
+                if feedback_cb and feedback_counter % TILES_PER_CALLBACK == 0:
+                    feedback_cb()
+                feedback_counter += 1
+            jpegsave.close()
+        logger.debug("Finished writing %r", filename)
+    except (IOError, OSError, RuntimeError) as err:
+        logger.exception(
+            "Caught %r from C++ jpeg-writer code, re-raising as a "
+            "FileHandlingError",
+            err,
+        )
+        raise FileHandlingError(C_(
+            "low-level JPEG writer failure report (dialog)",
+            u"Failed to write “{basename}”.\n\n"
+            u"Reason: {err}\n"
+            u"Target folder: “{dirname}”."
+        ).format(
+            err = err,
+            basename = os.path.basename(filename),
+            dirname = os.path.dirname(filename),
+        ))
@@ -8,6 +8,7 @@
  */
 
 #include <mypaint-tiled-surface.h>
+#include "tilesize.hpp"
 
 enum SymmetryType
 {
@@ -19,13 +20,15 @@ enum SymmetryType
         NumSymmetryTypes
 };
 
-static const int TILE_SIZE = MYPAINT_TILE_SIZE;
+static const int TILE_SIZE = MYPAINTLIB_TILE_SIZE;
 static const int MAX_MIPMAP_LEVEL = MYPAINT_MAX_MIPMAP_LEVEL;
 
 // Implementation of tiled surface backend
 #include "pythontiledsurface.cpp"
 
 #include <vector>
+#include <algorithm>
+#include <math.h>
 
 // Interface class, wrapping the backend the way MyPaint wants to use it
 class TiledSurface : public Surface {
@@ -49,12 +52,31 @@ public:
         (MyPaintSymmetryType)symmetry_type, rot_symmetry_lines);
   }
 
+  // The native storage for the surface's tiles. See tilestore.hpp.
+  void set_tile_store(TileStore *store) {
+      c_surface->store = store;
+  }
+
+  // The surface for the next mipmap level, or NULL. Used for sampling
+  // colors over large areas: see set_mipmap_sampling_radius().
+  void set_mipmap(TiledSurface *mipmap) {
+      c_surface->mipmap = mipmap ? mipmap->c_surface : NULL;
+  }
+
   void begin_atomic() {
       mypaint_surface_begin_atomic((MyPaintSurface *)c_surface);
   }
   std::vector<int> end_atomic() {
       MyPaintRectangle bbox_rect;
+      // Most of the dab rendering happens in here
+      set_gil_released(true);
+      Py_BEGIN_ALLOW_THREADS
       mypaint_surface_end_atomic((MyPaintSurface *)c_surface, &bbox_rect);
+      Py_END_ALLOW_THREADS
+      set_gil_released(false);
+      if (c_surface->store) {
+          c_surface->store->release_retired();
+      }
       std::vector<int> bbox = std::vector<int>(4, 0);
       bbox[0] = bbox_rect.x;     bbox[1] = bbox_rect.y;
       bbox[2] = bbox_rect.width; bbox[3] = bbox_rect.height;
@@ -67,17 +89,51 @@ public:
                  float radius, 
                  float color_r, float color_g, float color_b,
                  float opaque, float hardness = 0.5,
-                 float color_a = 1.0,
+                 float alpha_eraser = 1.0,
                  float aspect_ratio = 1.0, float angle = 0.0,
                  float lock_alpha = 0.0,
                  float colorize = 0.0
                  ) {
 
     return mypaint_surface_draw_dab((MyPaintSurface *)c_surface, x, y, radius, color_r, color_g, color_b,
-                             opaque, hardness, color_a, aspect_ratio, angle,
+                             opaque, hardness, alpha_eraser, aspect_ratio, angle,
                              lock_alpha, colorize);
   }
 
+  // Draws many dabs: dabs is a contiguous Nx13 float32 array whose rows
+  // are draw_dab()'s args, in order. lib/tiledsurface.py builds it from
+  // a structured array. Call between begin_atomic() and end_atomic():
+  // libmypaint queues the dabs per tile, and renders each tile's queue
+  // in one go when the atomic section ends.
+  // Returns the number of dabs which modified the surface.
+  PyObject *draw_dabs (PyObject *dabs) {
+    if (! PyArray_Check(dabs)) {
+      PyErr_SetString(PyExc_TypeError, "dabs must be a numpy array");
+      return NULL;
+    }
+    PyArrayObject *arr = (PyArrayObject *)dabs;
+    if (PyArray_NDIM(arr) != 2 || PyArray_DIM(arr, 1) != DAB_FIELDS
+        || PyArray_TYPE(arr) != NPY_FLOAT32 || ! PyArray_ISCARRAY_RO(arr))
+    {
+      PyErr_SetString(PyExc_ValueError,
+                      "dabs must be a contiguous Nx13 float32 array");
+      return NULL;
+    }
+    const npy_intp n = PyArray_DIM(arr, 0);
+    const float *d = (const float *)PyArray_DATA(arr);
+    MyPaintSurface *surface = (MyPaintSurface *)c_surface;
+    int modified = 0;
+    for (npy_intp i = 0; i < n; i++, d += DAB_FIELDS) {
+      if (mypaint_surface_draw_dab(surface, d[0], d[1], d[2],
+                                   d[3], d[4], d[5], d[6], d[7], d[8],
+                                   d[9], d[10], d[11], d[12]))
+      {
+        modified++;
+      }
+    }
+    return PyInt_FromLong(modified);
+  }
+
   std::vector<double> get_color (double x, double y, double radius) {
     std::vector<double> rgba = std::vector<double>(4, 0.0);
     float r,g,b,a;
@@ -91,16 +147,118 @@ public:
       return mypaint_surface_get_alpha((MyPaintSurface *)c_surface, x, y, radius);
   }
 
+  // Samples many places at once: samples is an Nx3 float64 array of
+  // (x, y, radius) rows. get_colors() returns an Nx4 float64 array of
+  // the colors get_color() would, and get_alphas() an array of N alphas.
+  // Samples are taken tile by tile, and each tile is only requested
+  // once per call.
+  PyObject *get_colors (PyObject *samples) {
+      return sample_many(samples, true);
+  }
+
+  PyObject *get_alphas (PyObject *samples) {
+      return sample_many(samples, false);
+  }
+
   MyPaintSurface *get_surface_interface() {
     return (MyPaintSurface*)c_surface;
   }
 
+  // Returns a dict of painting statistics, for benchmarks. See
+  // pythontiledsurface.cpp for what's counted.
+  PyObject *get_paint_stats() {
+      return python_tiled_surface_get_paint_stats(c_surface);
+  }
+
+  void reset_paint_stats() {
+      python_tiled_surface_reset_paint_stats(c_surface);
+  }
+
+  // Tile requests take the GIL back when they need Python. Tile memory
+  // handed out to libmypaint is left alone by the tile store's
+  // housekeeping until the GIL is back.
+  bool set_gil_released(bool released) {
+      c_surface->gil_released = released;
+      if (released) {
+          tile_painting_begin();
+      }
+      else {
+          tile_painting_end();
+      }
+      return true;
+  }
+
 private:
+    static const int DAB_FIELDS = 13;
+
+    PyObject *sample_many (PyObject *samples, bool colors) {
+      if (! PyArray_Check(samples)) {
+        PyErr_SetString(PyExc_TypeError, "samples must be a numpy array");
+        return NULL;
+      }
+      PyArrayObject *arr = (PyArrayObject *)samples;
+      if (PyArray_NDIM(arr) != 2 || PyArray_DIM(arr, 1) != 3
+          || PyArray_TYPE(arr) != NPY_FLOAT64 || ! PyArray_ISCARRAY_RO(arr))
+      {
+        PyErr_SetString(PyExc_ValueError,
+                        "samples must be a contiguous Nx3 float64 array");
+        return NULL;
+      }
+      const npy_intp n = PyArray_DIM(arr, 0);
+      const double *s = (const double *)PyArray_DATA(arr);
+
+      npy_intp dims[2] = {n, 4};
+      PyObject *result = PyArray_SimpleNew(colors ? 2 : 1, dims, NPY_FLOAT64);
+      if (! result) {
+        return NULL;
+      }
+      double *out = (double *)PyArray_DATA((PyArrayObject *)result);
+
+      // Visit the samples in tile order
+      std::vector<std::pair<std::pair<int, int>, npy_intp> > order(n);
+      for (npy_intp i = 0; i < n; i++) {
+          const int tx = (int)floor(s[3*i] / MYPAINTLIB_TILE_SIZE);
+          const int ty = (int)floor(s[3*i+1] / MYPAINTLIB_TILE_SIZE);
+          order[i] = std::make_pair(std::make_pair(ty, tx), i);
+      }
+      std::sort(order.begin(), order.end());
+
+      MyPaintSurface *surface = (MyPaintSurface *)c_surface;
+      const bool own_cache = python_tiled_surface_begin_reads(c_surface);
+      for (npy_intp k = 0; k < n; k++) {
+          const npy_intp i = order[k].second;
+          const double *si = s + 3*i;
+          if (colors) {
+              float r, g, b, a;
+              mypaint_surface_get_color(surface, si[0], si[1], si[2],
+                                        &r, &g, &b, &a);
+              double *o = out + 4*i;
+              o[0] = r; o[1] = g; o[2] = b; o[3] = a;
+          }
+          else {
+              out[i] = mypaint_surface_get_alpha(surface,
+                                                 si[0], si[1], si[2]);
+          }
+      }
+      if (own_cache) {
+          python_tiled_surface_end_reads(c_surface);
+      }
+      return result;
+    }
+
     MyPaintPythonTiledSurface *c_surface;
     MyPaintTileRequest tile_request;
     bool tile_request_in_progress;
 };
 
+// Colors sampled over at least this radius are taken from the mipmaps
+// set with TiledSurface::set_mipmap(). See pythontiledsurface.cpp for
+// the accuracy. 0 turns this off, which is the default.
+
+void set_mipmap_sampling_radius(float radius) {
+    mipmap_sampling_radius = radius > 0 ? radius : 0;
+}
+
 static PyObject *
 get_module(char *name)
 {
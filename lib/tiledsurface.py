@@ -16,6 +16,8 @@ import sys
 import os
 import contextlib
 import logging
+import struct
+import collections
 
 from gettext import gettext as _
 import numpy as np
@@ -29,6 +31,8 @@ from lib.surface import TileAccessible, TileBlittable, TileCompositable
 from errors import FileHandlingError
 import lib.fileutils
 import lib.modes
+import lib.tilefile
+import lib.paintingthread
 
 logger = logging.getLogger(__name__)
 
@@ -48,6 +52,19 @@ SYMMETRY_STRINGS = {
 for sym_type in SYMMETRY_TYPES:
     assert sym_type in SYMMETRY_STRINGS
 
+#: Structured array type of the dabs MyPaintSurface.draw_dabs() draws.
+#: Fields are draw_dab()'s args, in order. Note that "alpha_eraser" is
+#: not a color alpha: 1.0 paints normally, and 0.0 erases.
+DAB_DTYPE = np.dtype([
+    (name, np.float32) for name in (
+        "x", "y", "radius",
+        "color_r", "color_g", "color_b",
+        "opaque", "hardness", "alpha_eraser",
+        "aspect_ratio", "angle",
+        "lock_alpha", "colorize",
+    )
+])
+
 ## Tile class and marker tile constants
 
 class _Tile (object):
@@ -63,15 +80,94 @@ class _Tile (object):
     def __init__(self, copy_from=None):
         super(_Tile, self).__init__()
         if copy_from is None:
-            self.rgba = np.zeros((N, N, 4), 'uint16')
+            self.rgba = mypaintlib.tile_buffer_new_rgba16(None)
         else:
-            self.rgba = copy_from.rgba.copy()
+            self.rgba = mypaintlib.tile_buffer_new_rgba16(copy_from.rgba)
         self.readonly = False
 
+    @classmethod
+    def _new_for_rgba(cls, rgba, readonly):
+        """Internal: wraps a tile buffer from the native tile store"""
+        tile = cls.__new__(cls)
+        tile.rgba = rgba
+        tile.readonly = readonly
+        return tile
+
+    @property
+    def loaded_rgba(self):
+        """The pixels, or None if they haven't been loaded yet"""
+        return self.rgba
+
     def copy(self):
         return _Tile(copy_from=self)
 
 
+class _TileFileTile (_Tile):
+    """Read-only tile which is decoded from a tile file when first used
+
+    See lib.tilefile. Writing to one of these makes a copy, just like
+    writing to any other read-only tile.
+
+    """
+
+    def __init__(self, reader, tx, ty):
+        # No supercall: the pixels are decoded only when needed.
+        self._reader = reader
+        self._file_pos = (tx, ty)
+        self._rgba = None
+        self.readonly = True
+
+    @property
+    def rgba(self):
+        if self._rgba is None:
+            self._rgba = self._reader.read_tile(*self._file_pos)
+        return self._rgba
+
+    @property
+    def loaded_rgba(self):
+        return self._rgba
+
+    @property
+    def compressed_data(self):
+        """The tile's compressed data, as stored in its tile file"""
+        return self._reader.read_raw(*self._file_pos)
+
+
+class _Tile8 (_Tile):
+    """Internal tile storage with 8 bits per channel, for Surface8
+
+    Pixels are premultiplied like a _Tile's, but 255 means fully
+    opaque. These take half the memory of a _Tile, and the compositing
+    code reads them directly. The native tile store leaves them to
+    Python, so they're never compressed or swapped out.
+
+    """
+
+    def __init__(self, copy_from=None):
+        # No supercall: the pixels aren't a tile buffer.
+        if copy_from is None:
+            self.rgba = np.zeros((N, N, 4), 'uint8')
+        else:
+            self.rgba = copy_from.rgba.copy()
+        self.readonly = False
+
+    @classmethod
+    def new_from_rgba16(cls, rgba):
+        """Returns a new _Tile8 with 15-bit pixels narrowed to 8 bits"""
+        tile = cls()
+        mypaintlib.tile_convert_rgba16_to_prgba8(rgba, tile.rgba)
+        return tile
+
+    def copy(self):
+        return _Tile8(copy_from=self)
+
+    def widened(self):
+        """Returns a new _Tile with the pixels widened to 15 bits"""
+        tile = _Tile()
+        mypaintlib.tile_convert_prgba8_to_rgba16(self.rgba, tile.rgba)
+        return tile
+
+
 # tile for read-only operations on empty spots
 transparent_tile = _Tile()
 transparent_tile.readonly = True
@@ -81,10 +177,222 @@ mipmap_dirty_tile = _Tile()
 del mipmap_dirty_tile.rgba
 
 
+## Tile storage
+
+class _TileDict (collections.MutableMapping):
+    """Tile storage for a surface: a dict-like map from (tx, ty) to tiles
+
+    The tiles are held in a native TileStore (see lib/tilestore.hpp),
+    which the C++ half of the surface reads and writes directly when
+    painting, without calling into Python. Tiles created that way are
+    plain buffers until something here asks for them; then they are
+    wrapped in _Tile objects, whose `rgba` arrays share the store's
+    memory.
+
+        >>> d = _TileDict()
+        >>> t = _Tile()
+        >>> d[(1, -2)] = t
+        >>> d[(1, -2)] is t
+        True
+        >>> (1, -2) in d, (0, 0) in d, len(d)
+        (True, False, 1)
+        >>> d.keys()
+        [(1, -2)]
+        >>> d.copy() == {(1, -2): t}
+        True
+
+    Snapshots share tiles with the dict they were taken from, and
+    tiles are copied before anything writes to them. Tiles in the store
+    must only be made read-only by its freeze() method, so that the
+    native code knows to copy them before writing.
+
+        >>> sshot = d.snapshot()
+        >>> sshot[(1, -2)] is t
+        True
+        >>> d.changed_tiles(sshot)
+        []
+        >>> d.freeze()
+        >>> t.readonly
+        True
+        >>> d.pop((1, -2)) is t
+        True
+        >>> len(d), len(sshot)
+        (0, 1)
+        >>> d.changed_tiles(sshot)
+        [(1, -2)]
+
+    """
+
+    def __init__(self, store=None):
+        super(_TileDict, self).__init__()
+        if store is None:
+            store = mypaintlib.TileStore(
+                _Tile._new_for_rgba,
+                mipmap_dirty_tile,
+                transparent_tile.rgba,
+            )
+        self._store = store
+
+    @property
+    def store(self):
+        """The native TileStore"""
+        return self._store
+
+    def __getitem__(self, pos):
+        tile = self._store.get(pos[0], pos[1])
+        if tile is None:
+            raise KeyError(pos)
+        return tile
+
+    def get(self, pos, default=None):
+        tile = self._store.get(pos[0], pos[1])
+        if tile is None:
+            return default
+        return tile
+
+    def __setitem__(self, pos, tile):
+        if tile is mipmap_dirty_tile:
+            self._store.set(pos[0], pos[1], tile, None, False)
+        else:
+            self._store.set(pos[0], pos[1], tile, tile.loaded_rgba,
+                            tile.readonly)
+
+    def __delitem__(self, pos):
+        if not self._store.remove(pos[0], pos[1]):
+            raise KeyError(pos)
+
+    def __contains__(self, pos):
+        return self._store.contains(pos[0], pos[1])
+
+    def __len__(self):
+        return self._store.size()
+
+    def __iter__(self):
+        return iter(self._store.keys())
+
+    def keys(self):
+        return self._store.keys()
+
+    def items(self):
+        return self._store.items()
+
+    def values(self):
+        return [tile for (pos, tile) in self._store.items()]
+
+    def iterkeys(self):
+        return iter(self.keys())
+
+    def iteritems(self):
+        return iter(self.items())
+
+    def itervalues(self):
+        return iter(self.values())
+
+    def clear(self):
+        self._store.clear()
+
+    def copy(self):
+        """Returns a plain dict with the same tiles, made read-only"""
+        self._store.freeze_all()
+        return dict(self._store.items())
+
+    def snapshot(self):
+        """Returns a new _TileDict sharing this one's tiles
+
+        This is quick, and doesn't involve any Python objects per tile.
+        Tiles are copied when they're next written to in either dict.
+
+        """
+        return _TileDict(self._store.snapshot())
+
+    def changed_tiles(self, other):
+        """Returns the positions where another _TileDict's tiles differ
+
+        :param _TileDict other: The dict to compare with
+        :rtype: list
+
+        Tiles are compared by identity, not by content.
+
+        """
+        return self._store.diff(other._store)
+
+    def share(self, pos, src, src_pos):
+        """Set a tile to another _TileDict's tile, without copying it
+
+        :param tuple pos: Where to put the tile
+        :param _TileDict src: The dict to take the tile from
+        :param tuple src_pos: The tile to take; if src has no tile
+            there, the tile at pos is removed.
+
+        """
+        self._store.share(pos[0], pos[1], src._store, src_pos[0], src_pos[1])
+
+    def freeze(self, pos=None):
+        """Make one tile, or all of them, read-only
+
+        :param tuple pos: The tile to freeze, or None for all of them
+
+        """
+        if pos is None:
+            self._store.freeze_all()
+        else:
+            self._store.freeze(pos[0], pos[1])
+
+    def data_id(self, pos):
+        """Returns an id for a tile's data, or 0 if there's no tile
+
+        :param tuple pos: The tile to look up
+        :rtype: int
+
+        Ids stay the same while the data is shared, compressed or
+        swapped out, and change when the tile is replaced, or copied
+        before being written to. Freeze tiles before using their ids to
+        tell whether they changed.
+
+        """
+        return self._store.data_id(pos[0], pos[1])
+
+    def data_ids(self):
+        """Returns the data ids of all tiles, as a dict
+
+        See data_id(). No tiles are wrapped in Python objects.
+
+        """
+        return self._store.data_ids()
+
+
 ## Class defs: surfaces
 
 class _SurfaceSnapshot (object):
-    pass
+    """The saved tiles of a surface: see MyPaintSurface.save_snapshot()"""
+
+    def __init__(self, tiledict, tile_class=_Tile):
+        super(_SurfaceSnapshot, self).__init__()
+        #: The saved tiles, as a _TileDict sharing the surface's tiles
+        self.tiledict = tiledict
+        #: The TILE_CLASS of the surface they were saved from
+        self.tile_class = tile_class
+
+    def set_history_owner(self, owner):
+        """Tags the saved tiles as belonging to part of the undo history
+
+        :param int owner: Positive, and higher for more recent history.
+            Zero means the tiles aren't part of the history.
+
+        See lib.command.CommandStack.reduce_memory_use().
+
+        """
+        self.tiledict.store.set_owner(owner)
+
+
+class _DeferredLoad (object):
+    """A pending load of a surface's tile data, with its bbox"""
+
+    def __init__(self, load, bbox, filename):
+        super(_DeferredLoad, self).__init__()
+        self.load = load
+        self.bbox = tuple(bbox)
+        self.filename = filename
 
 
 # TODO:
@@ -95,13 +403,22 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
     The C++ part of this class is in tiledsurface.hpp
     """
 
+    #: Writes to more tiles than this between two calls to
+    #: take_tile_journal() overflow the tile journal.
+    TILE_JOURNAL_MAX_TILES = 1024
+
+    #: The kind of tile the surface keeps its pixels in.
+    TILE_CLASS = _Tile
+
     def __init__(self, mipmap_level=0, mipmap_surfaces=None,
                  looped=False, looped_size=(0, 0)):
         super(MyPaintSurface, self).__init__()
 
         # TODO: pass just what it needs access to, not all of self
         self._backend = mypaintlib.TiledSurface(self)
-        self.tiledict = {}
+        self._tiledict = _TileDict()
+        self._backend.set_tile_store(self._tiledict.store)
+        self._deferred_load = None
         self.observers = []
 
         # Used to implement repeating surfaces, like Background
@@ -109,11 +426,18 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
             raise ValueError('Looped size must be multiples of tile size')
         self.looped = looped
         self.looped_size = looped_size
+        if looped:
+            self._tiledict.store.set_looped(looped_size[0] // N,
+                                            looped_size[1] // N)
 
         self.mipmap_level = mipmap_level
         if mipmap_level == 0:
             assert mipmap_surfaces is None
             self._mipmaps = self._create_mipmap_surfaces()
+            # Large color samples can be taken from the mipmaps natively
+            if self._mipmaps and not looped:
+                for s, m in zip(self._mipmaps, self._mipmaps[1:]):
+                    s._backend.set_mipmap(m._backend)
         else:
             assert mipmap_surfaces is not None
             self._mipmaps = mipmap_surfaces
@@ -135,7 +459,7 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         assert self.mipmap_level == 0
         mipmaps = [self]
         for level in range(1, MAX_MIPMAP_LEVEL+1):
-            s = MyPaintSurface(mipmap_level=level, mipmap_surfaces=mipmaps)
+            s = self.__class__(mipmap_level=level, mipmap_surfaces=mipmaps)
             mipmaps.append(s)
 
         # for quick lookup
@@ -148,12 +472,234 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
                 s.mipmap = mipmaps[level+1]
             except IndexError:
                 s.mipmap = None
+            else:
+                s._tiledict.store.set_mipmap(s.mipmap._tiledict.store)
         return mipmaps
 
+    ## Tile storage, and deferred loading
+
+    @property
+    def tiledict(self):
+        """The tile storage, mapping (tx, ty) to _Tile objects
+
+        This is a dict-like _TileDict. Reading this completes any
+        pending deferred load first. Assigning a dict to it replaces
+        the tiles, and cancels the deferred load.
+
+        """
+        if self._deferred_load is not None:
+            self._complete_deferred_load()
+        return self._tiledict
+
+    @tiledict.setter
+    def tiledict(self, d):
+        if self._deferred_load is not None:
+            for s in (self._mipmaps or [self]):
+                s._deferred_load = None
+        if d is self._tiledict:
+            return
+        self._tiledict.clear()
+        self._tiledict.update(d)
+
+    @property
+    def _deferred_load(self):
+        """Internal: the pending _DeferredLoad, or None"""
+        return self._pending_load
+
+    @_deferred_load.setter
+    def _deferred_load(self, pending):
+        self._pending_load = pending
+        # Native tile requests must defer to Python until it's loaded.
+        self._tiledict.store.set_load_pending(pending is not None)
+
+    def load_from_png_deferred(self, filename, x, y, keepalive=None,
+                               **kwargs):
+        """Arrange for a PNG file to be loaded when its tiles are needed
+
+        :param unicode filename: The PNG file to load later
+        :param int x: X-coordinate at which to load the replacement data
+        :param int y: Y-coordinate at which to load the replacement data
+        :param keepalive: Object to hold a reference to until loaded
+        :param dict \*\*kwargs: Passed to load_from_png() at load time
+        :returns: the bbox of the image, (x,y,w,h), or None
+        :rtype: tuple
+
+        Only the PNG header is read now. The pixels are decoded by
+        load_from_png() the first time anything reads the tiledict, for
+        example a tile request, a snapshot, or a save. Until then, the
+        bbox is answered from the PNG header, so the surface can be
+        placed and sized in a layer stack without being decoded.
+
+        The `keepalive` object is typically a managed temporary copy of
+        the PNG file. It is released after the load has happened.
+
+        Returns None without changing anything if the file cannot be
+        loaded this way, in which case the caller should load it by
+        other means.
+
+        """
+        header = _read_png_header(filename)
+        if header is None:
+            return None
+        png_w, png_h, interlaced = header
+        if interlaced or png_w <= 0 or png_h <= 0:
+            return None
+        dirty_bbox = self.get_bbox()
+        for s in (self._mipmaps or [self]):
+            s.tiledict = {}
+
+        def _load():
+            self.load_from_png(filename, x, y, **kwargs)
+            return keepalive  # keeps it alive till here
+        bbox = (x, y, png_w, png_h)
+        pending = _DeferredLoad(_load, bbox, filename)
+        for s in (self._mipmaps or [self]):
+            s._deferred_load = pending
+        dirty_bbox.expandToIncludeRect(_get_tile_aligned_rect(bbox))
+        self.notify_observers(*dirty_bbox)
+        return bbox
+
+    @property
+    def load_deferred(self):
+        """True if the surface's tile data has not been loaded yet"""
+        return self._deferred_load is not None
+
+    @property
+    def deferred_load_source(self):
+        """The file a deferred load will read, and its bbox
+
+        :returns: (filename, (x, y, w, h)), or None if nothing is pending
+        :rtype: tuple
+
+        While a load is pending, the file is an exact copy of the
+        surface's content, so it can be copied instead of re-encoded.
+
+        """
+        pending = self._deferred_load
+        if pending is None:
+            return None
+        return (pending.filename, pending.bbox)
+
+    def _complete_deferred_load(self):
+        """Internal: performs any pending deferred load now
+
+        This is silent: the observers are not notified because the
+        surface's content doesn't change, as far as they're concerned.
+
+        """
+        pending = self._deferred_load
+        if pending is None:
+            return
+        surfaces = self._mipmaps or [self]
+        for s in surfaces:
+            s._deferred_load = None
+        base = surfaces[0]
+        observers = base.observers
+        base.observers = []
+        t0 = time.time()
+        try:
+            pending.load()
+        finally:
+            base.observers = observers
+        logger.debug("%.3fs deferred load", time.time() - t0)
+
+    def draw_dabs(self, dabs):
+        """Draws many dabs in one atomic section
+
+        :param numpy.ndarray dabs: structured array of `DAB_DTYPE`
+        :returns: how many of the dabs changed the surface
+        :rtype: int
+
+        This is much faster than calling `draw_dab()` in a loop, and
+        has the same result. Fields missing from a structured array of a
+        different type get draw_dab()'s defaults.
+
+        >>> s = MyPaintSurface()
+        >>> dabs = np.zeros(3, dtype=DAB_DTYPE)
+        >>> dabs["x"] = (10, 20, N * 2 + 10)
+        >>> dabs["y"] = 10
+        >>> dabs["radius"] = 5
+        >>> dabs["opaque"] = 1
+        >>> s.draw_dabs(dabs)
+        3
+        >>> sorted(s.get_tiles())
+        [(0, 0), (2, 0)]
+
+        """
+        dabs = np.asarray(dabs)
+        if dabs.dtype != DAB_DTYPE:
+            given = dabs
+            dabs = np.zeros(given.shape, dtype=DAB_DTYPE)
+            dabs["hardness"] = 0.5
+            dabs["alpha_eraser"] = 1.0
+            dabs["aspect_ratio"] = 1.0
+            for name in given.dtype.names or ():
+                dabs[name] = given[name]
+        rows = np.ascontiguousarray(dabs).view(np.float32)
+        rows = rows.reshape((len(dabs), len(DAB_DTYPE.names)))
+        self.begin_atomic()
+        try:
+            modified = self._backend.draw_dabs(rows)
+        finally:
+            self.end_atomic()
+        return modified
+
+    ## Sampling many places at once
+
+    def get_colors(self, samples):
+        """Samples the colors at many places
+
+        :param samples: (x, y, radius) triples, as an Nx3 array or a list
+        :returns: one row of what get_color() returns for each sample
+        :rtype: numpy.ndarray
+
+        Samples are taken exactly as get_color() takes them, including
+        the choice of mipmap level for big radii: see
+        lib.document.set_mipmap_sampling().
+
+        >>> s = MyPaintSurface()
+        >>> with s.tile_request(0, 0, readonly=False) as rgba:
+        ...     rgba[...] = (1 << 15, 0, 0, 1 << 15)
+        >>> colors = s.get_colors([(N // 2, N // 2, 2), (-N, -N, 2)])
+        >>> colors[0].round(3).tolist()
+        [1.0, 0.0, 0.0, 1.0]
+        >>> float(colors[1, 3])
+        0.0
+
+        """
+        return self._sample_many(samples, True)
+
+    def get_alphas(self, samples):
+        """Samples the alpha at many places
+
+        :param samples: (x, y, radius) triples, as an Nx3 array or a list
+        :returns: what get_alpha() returns for each sample
+        :rtype: numpy.ndarray
+
+        """
+        return self._sample_many(samples, False)
+
+    def _sample_many(self, samples, colors):
+        samples = np.array(samples, dtype='float64', ndmin=2).reshape((-1, 3))
+        # The native surface picks mipmap levels itself, per sample
+        return self._sample_backend(np.ascontiguousarray(samples), colors)
+
+    def _sample_backend(self, samples, colors):
+        """Internal: samples from the native surface, at this level"""
+        if colors:
+            return self._backend.get_colors(samples)
+        else:
+            return self._backend.get_alphas(samples)
+
     def end_atomic(self):
         bbox = self._backend.end_atomic()
         if (bbox[2] > 0 and bbox[3] > 0):
-            self.notify_observers(*bbox)
+            painter = lib.paintingthread.get_current()
+            if painter is not None:
+                # Observers redraw, which must happen on the UI thread
+                painter.post_notify(self, tuple(bbox))
+            else:
+                self.notify_observers(*bbox)
 
     @property
     def backend(self):
@@ -163,10 +709,46 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         for f in self.observers:
             f(*args)
 
+    ## Tile change journal
+
+    def take_tile_journal(self):
+        """Returns the tiles changed since the last call, and restarts
+
+        :returns: set of (tx, ty) tile positions, or None
+        :rtype: set
+
+        The journal is recorded by the tile store as tiles are written,
+        replaced or removed, so it covers every way of changing the
+        surface, whenever its observers get to hear about it. None is
+        returned the first time this is called, and whenever too many
+        tiles changed to be worth listing individually (see
+        TILE_JOURNAL_MAX_TILES). In those cases, the caller should
+        assume that any tile might have changed.
+
+            >>> surf = MyPaintSurface()
+            >>> surf.take_tile_journal() is None
+            True
+            >>> with surf.tile_request(1, 2, readonly=False) as a:
+            ...     a[...] = 1<<15
+            >>> surf.take_tile_journal()
+            set([(1, 2)])
+            >>> surf.take_tile_journal()
+            set([])
+
+        """
+        store = self._tiledict.store
+        journal = store.take_journal(self.TILE_JOURNAL_MAX_TILES)
+        if journal is None:
+            return None
+        return set(journal)
+
     def clear(self):
-        tiles = self.tiledict.keys()
+        if self._deferred_load is not None:
+            bbox = self.get_bbox()
+        else:
+            bbox = lib.surface.get_tiles_bbox(self._tiledict)
         self.tiledict = {}
-        self.notify_observers(*lib.surface.get_tiles_bbox(tiles))
+        self.notify_observers(*bbox)
         if self.mipmap:
             self.mipmap.clear()
 
@@ -240,9 +822,9 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
             >>> with surf.tile_request(666, 666, readonly=True) as tr:
             ...     assert tr is transparent_tile.rgba
 
-        Snapshotting a surface makes all its tiles read-only as a side
-        effect, so the next read/write tile request will yield a copy
-        for you to work on::
+        Snapshots share the surface's tiles, so the next read/write
+        tile request after snapshotting will yield a copy for you to
+        work on::
 
             >>> sshot = surf.save_snapshot()
             >>> with surf.tile_request(1, 2, readonly=True) as t3:
@@ -279,11 +861,14 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         return t
 
     def _get_tile_numpy(self, tx, ty, readonly):
-        # OPTIMIZE: do some profiling to check if this function is a bottleneck
-        #           yes it is
         # Note: we must return memory that stays valid for writing until the
         # last end_atomic(), because of the caching in tiledsurface.hpp.
 
+        # The native store handles the common cases.
+        rgba = self._tiledict.store.request_rgba(tx, ty, readonly)
+        if rgba is not None:
+            return rgba
+
         if self.looped:
             tx = tx % (self.looped_size[0] // N)
             ty = ty % (self.looped_size[1] // N)
@@ -304,23 +889,26 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         if not readonly:
             # assert self.mipmap_level == 0
             self._mark_mipmap_dirty(tx, ty)
+            self._tiledict.store.mark_written(tx, ty)
         return t.rgba
 
     def _set_tile_numpy(self, tx, ty, obj, readonly):
         pass  # Data can be modified directly, no action needed
 
+    def _get_tile_stored(self, tx, ty):
+        """Internal: a tile's pixels for reading, at their stored depth
+
+        This is a uint16 array here, but see Surface8. Used for
+        compositing and blitting, which can read either.
+
+        """
+        return self._get_tile_numpy(tx, ty, True)
+
     def _mark_mipmap_dirty(self, tx, ty):
         #assert self.mipmap_level == 0
         if not self._mipmaps:
             return
-        for level, mipmap in enumerate(self._mipmaps):
-            if level == 0:
-                continue
-            fac = 2**(level)
-            if mipmap.tiledict.get((tx // fac, ty // fac),
-                                   None) == mipmap_dirty_tile:
-                break
-            mipmap.tiledict[(tx // fac, ty // fac)] = mipmap_dirty_tile
+        self._mipmaps[0]._tiledict.store.mark_mipmap_dirty(tx, ty)
 
     def blit_tile_into(self, dst, dst_has_alpha, tx, ty, mipmap_level=0,
                        *args, **kwargs):
@@ -344,22 +932,31 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
             raise ValueError('Unsupported destination buffer type %r', dst.dtype)
         dst_is_uint16 = (dst.dtype == 'uint16')
 
-        with self.tile_request(tx, ty, readonly=True) as src:
-            if src is transparent_tile.rgba:
-                #dst[:] = 0 # <-- notably slower than memset()
-                if dst_is_uint16:
-                    mypaintlib.tile_clear_rgba16(dst)
-                else:
-                    mypaintlib.tile_clear_rgba8(dst)
+        src = self._get_tile_stored(tx, ty)
+        if src is transparent_tile.rgba:
+            #dst[:] = 0 # <-- notably slower than memset()
+            if dst_is_uint16:
+                mypaintlib.tile_clear_rgba16(dst)
             else:
-                if dst_is_uint16:
-                    # this will do memcpy, not worth to bother skipping the u channel
-                    mypaintlib.tile_copy_rgba16_into_rgba16(src, dst)
+                mypaintlib.tile_clear_rgba8(dst)
+        elif src.dtype == 'uint8':
+            # 8-bit tiles, see Surface8
+            if dst_is_uint16:
+                mypaintlib.tile_convert_prgba8_to_rgba16(src, dst)
+            elif dst_has_alpha:
+                mypaintlib.tile_convert_prgba8_to_rgba8(src, dst)
+            else:
+                dst[:, :, :3] = src[:, :, :3]
+                dst[:, :, 3] = 255
+        else:
+            if dst_is_uint16:
+                # this will do memcpy, not worth to bother skipping the u channel
+                mypaintlib.tile_copy_rgba16_into_rgba16(src, dst)
+            else:
+                if dst_has_alpha:
+                    mypaintlib.tile_convert_rgba16_to_rgba8(src, dst)
                 else:
-                    if dst_has_alpha:
-                        mypaintlib.tile_convert_rgba16_to_rgba8(src, dst)
-                    else:
-                        mypaintlib.tile_convert_rgbu16_to_rgbu8(src, dst)
+                    mypaintlib.tile_convert_rgbu16_to_rgbu8(src, dst)
 
     def composite_tile(self, dst, dst_has_alpha, tx, ty, mipmap_level=0,
                        opacity=1.0, mode=mypaintlib.CombineNormal,
@@ -393,49 +990,73 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
 
         # Tile request at the required level.
         # Try optimizations again if we got the special marker tile
-        with self.tile_request(tx, ty, readonly=True) as src:
-            if src is transparent_tile.rgba:
-                if dst_has_alpha:
-                    if mode in lib.modes.MODES_CLEARING_BACKDROP_AT_ZERO_ALPHA:
-                        mypaintlib.tile_clear_rgba16(dst)
-                        return
-                if mode not in lib.modes.MODES_EFFECTIVE_AT_ZERO_ALPHA:
+        src = self._get_tile_stored(tx, ty)
+        if src is transparent_tile.rgba:
+            if dst_has_alpha:
+                if mode in lib.modes.MODES_CLEARING_BACKDROP_AT_ZERO_ALPHA:
+                    mypaintlib.tile_clear_rgba16(dst)
                     return
-            mypaintlib.tile_combine(mode, src, dst, dst_has_alpha, opacity)
+            if mode not in lib.modes.MODES_EFFECTIVE_AT_ZERO_ALPHA:
+                return
+        # This reads 8-bit tiles directly too
+        mypaintlib.tile_combine(mode, src, dst, dst_has_alpha, opacity)
 
     ## Snapshotting
 
     def save_snapshot(self):
         """Creates and returns a snapshot of the surface
 
-        Snapshotting marks all the tiles of the surface as read-only,
-        then just shallow-copes the tiledict. It's quick. See
+        Snapshots share their tiles with the surface, and the native
+        tile store copies shared tiles before writing to them. Taking
+        one just copies the store's table, so it's quick. See
         tile_request() for how new read/write tiles can be unlocked.
 
         """
-        sshot = _SurfaceSnapshot()
-        for t in self.tiledict.itervalues():
-            t.readonly = True
-        sshot.tiledict = self.tiledict.copy()
-        return sshot
+        return _SurfaceSnapshot(self.tiledict.snapshot(), self.TILE_CLASS)
 
     def load_snapshot(self, sshot):
-        """Loads a saved snapshot, replacing the internal tiledict"""
-        self._load_tiledict(sshot.tiledict)
+        """Loads a saved snapshot, replacing the internal tiledict
+
+        Snapshots of a surface with another TILE_CLASS can be loaded
+        too, and their tiles are converted.
+
+        """
+        tiledict = self.tiledict
+        changed = tiledict.store.restore(sshot.tiledict.store)
+        if sshot.tile_class is not self.TILE_CLASS:
+            self._convert_tiles(changed)
+        self._tiles_replaced(changed)
+
+    def _convert_tiles(self, positions):
+        """Internal: converts tiles not of TILE_CLASS, after a load"""
+        tiledict = self._tiledict
+        for pos in positions:
+            t = tiledict.get(pos)
+            if isinstance(t, _Tile8):
+                tiledict[pos] = t.widened()
 
     def _load_tiledict(self, d):
-        """Efficiently loads a tiledict, and notifies the observers"""
-        if d == self.tiledict:
-            # common case optimization, called via stroke.redo()
-            # testcase: comparison above (if equal) takes 0.6ms, code below 30ms
+        """Efficiently loads a tiledict, and notifies the observers
+
+        Only positions are compared, so the store's tiles aren't wrapped
+        in Python objects just for this. Every tile of d counts as a
+        change, as does every removed tile.
+
+        """
+        tiledict = self.tiledict
+        if d is tiledict:
             return
-        old = set(self.tiledict.iteritems())
-        self.tiledict = d.copy()
-        new = set(self.tiledict.iteritems())
-        dirty = old.symmetric_difference(new)
-        for pos, tile in dirty:
+        dirty = set(tiledict.keys())
+        self.tiledict = d
+        dirty.update(d.keys())
+        self._tiles_replaced(dirty)
+
+    def _tiles_replaced(self, positions):
+        """Internal: mark mipmaps dirty and notify, after tiles changed"""
+        positions = set(positions)
+        for pos in positions:
             self._mark_mipmap_dirty(*pos)
-        bbox = lib.surface.get_tiles_bbox(pos for (pos, tile) in dirty)
+        bbox = lib.surface.get_tiles_bbox(positions)
         if not bbox.empty():
             self.notify_observers(*bbox)
 
@@ -564,6 +1185,55 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         # return the bbox of the loaded image
         return state['frame_size']
 
+    def load_from_tile_file(self, filename, x=0, y=0):
+        """Load from a tile file, decoding tiles only when they're used
+
+        :param unicode filename: The tile file to load (see lib.tilefile)
+        :param int x: X offset to apply to the file's data
+        :param int y: Y offset to apply to the file's data
+        :returns: the bbox of the loaded data, (x,y,w,h)
+        :rtype: lib.helpers.Rect
+
+        The file's index is read now, but each tile is only decompressed
+        the first time something reads its pixels. Offsets which aren't
+        whole numbers of tiles force every tile to be decoded now.
+
+            >>> import tempfile, shutil
+            >>> tmpdir = tempfile.mkdtemp()
+            >>> filename = os.path.join(tmpdir, "t" + lib.tilefile.SUFFIX)
+            >>> w = lib.tilefile.TileFileWriter(filename)
+            >>> w.write_tile(1, 2, np.ones((N, N, 4), 'uint16'))
+            >>> w.close()
+            >>> surf = MyPaintSurface()
+            >>> tuple(surf.load_from_tile_file(filename, -N, 0)) == (0, 2*N, N, N)
+            True
+            >>> tile = surf.tiledict[(0, 2)]
+            >>> tile._rgba is None
+            True
+            >>> with surf.tile_request(0, 2, readonly=True) as rgba:
+            ...     rgba.all()
+            True
+            >>> shutil.rmtree(tmpdir)
+
+        """
+        if x % N or y % N:
+            tmp = MyPaintSurface()
+            tmp.load_from_tile_file(filename)
+            move = tmp.get_move(0, 0, sort=False)
+            move.update(x, y)
+            move.process(n=-1)
+            move.cleanup()
+            self.load_from_surface(tmp)
+            return self.get_bbox()
+        reader = lib.tilefile.TileFileReader(filename)
+        dtx = x // N
+        dty = y // N
+        tiledict = {}
+        for tx, ty in reader.get_tile_coords():
+            tiledict[(tx + dtx, ty + dty)] = _TileFileTile(reader, tx, ty)
+        self._load_tiledict(tiledict)
+        return lib.surface.get_tiles_bbox(tiledict)
+
     def render_as_pixbuf(self, *args, **kwargs):
         if not self.tiledict:
             logger.warning('empty surface')
@@ -582,12 +1252,16 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         lib.surface.save_as_png(self, filename, *args, **kwargs)
 
     def get_bbox(self):
+        if self._deferred_load is not None:
+            return _get_tile_aligned_rect(self._deferred_load.bbox)
         return lib.surface.get_tiles_bbox(self.tiledict)
 
     def get_tiles(self):
         return self.tiledict
 
     def is_empty(self):
+        if self._deferred_load is not None:
+            return False
         return not self.tiledict
 
     def remove_empty_tiles(self):
@@ -812,7 +1486,11 @@ class _TiledSurfaceMove (object):
         is_integral = len(self.slices_x) == 1 and len(self.slices_y) == 1
         for src_t in self.chunks[self.chunks_i:self.chunks_i + n]:
             src_tx, src_ty = src_t
-            src_tile = self.snapshot.tiledict[src_t]
+            if not is_integral:
+                src_tile = self.snapshot.tiledict[src_t]
+                if not isinstance(src_tile, self.surface.TILE_CLASS):
+                    # A Surface8 can hold a few 15-bit tiles
+                    src_tile = _Tile8.new_from_rgba16(src_tile.rgba)
             for slice_x in self.slices_x:
                 (src_x0, src_x1), (targ_tdx, targ_x0, targ_x1) = slice_x
                 for slice_y in self.slices_y:
@@ -821,8 +1499,13 @@ class _TiledSurfaceMove (object):
                     targ_ty = src_ty + targ_tdy
                     targ_t = targ_tx, targ_ty
                     if is_integral:
-                        # We're lucky. Perform a straight data copy.
-                        self.surface.tiledict[targ_t] = src_tile.copy()
+                        # We're lucky. Share the tile: it'll be copied
+                        # when it's next written to.
+                        self.surface.tiledict.share(
+                            targ_t,
+                            self.snapshot.tiledict,
+                            src_t,
+                        )
                         updated.add(targ_t)
                         self.written.add(targ_t)
                         continue
@@ -835,7 +1518,7 @@ class _TiledSurfaceMove (object):
                     if targ_tile is None:
                         # Create and store a new blank target tile
                         # to avoid corruption
-                        targ_tile = _Tile()
+                        targ_tile = self.surface.TILE_CLASS()
                         self.surface.tiledict[targ_t] = targ_tile
                         self.written.add(targ_t)
                     # Copy this source slice to the destination
@@ -922,6 +1605,172 @@ def calc_translation_slices(dc):
 Surface = MyPaintSurface
 
 
+class Surface8 (MyPaintSurface):
+    """Tiled surface with 8 bits per channel, for layers never painted on
+
+    Imported images and the background don't need 15-bit precision, so
+    their surfaces keep _Tile8s instead, at half the memory. Compositing
+    and blitting read those directly.
+
+    The tile_request() interface still deals in 15-bit arrays: it
+    yields a widened copy of the tile, and narrows it back after writes.
+    The native half of the surface, used for picking colours and alpha,
+    reads widened copies too. Tiles it writes to are widened for good,
+    and narrowed again when Python next uses them.
+
+        >>> surf = Surface8()
+        >>> with surf.tile_request(0, 0, readonly=False) as rgba:
+        ...     rgba[...] = 1 << 15
+        >>> t = surf.tiledict[(0, 0)]
+        >>> isinstance(t, _Tile8), t.rgba.dtype.name, int(t.rgba.max())
+        (True, 'uint8', 255)
+
+    """
+
+    TILE_CLASS = _Tile8
+
+    def __init__(self, *args, **kwargs):
+        super(Surface8, self).__init__(*args, **kwargs)
+        # Widened copies of tiles, handed to the native half for
+        # reading. They must stay valid until its call returns, or
+        # until end_atomic() for painting.
+        self._widened = {}
+        self.get_color = self._get_color
+        self.get_alpha = self._get_alpha
+
+    def _get_color(self, *args):
+        try:
+            return self._backend.get_color(*args)
+        finally:
+            self._widened.clear()
+
+    def _get_alpha(self, *args):
+        try:
+            return self._backend.get_alpha(*args)
+        finally:
+            self._widened.clear()
+
+    def _sample_backend(self, samples, colors):
+        try:
+            return super(Surface8, self)._sample_backend(samples, colors)
+        finally:
+            self._widened.clear()
+
+    def end_atomic(self):
+        super(Surface8, self).end_atomic()
+        self._widened.clear()
+
+    def _get_tile8(self, tx, ty, readonly):
+        """Internal: fetches a _Tile8, or transparent_tile if readonly
+
+        :returns: the tile's position after wrapping, and the tile
+        :rtype: tuple
+
+        """
+        if self.looped:
+            tx = tx % (self.looped_size[0] // N)
+            ty = ty % (self.looped_size[1] // N)
+        pos = (tx, ty)
+        tiledict = self.tiledict
+        t = tiledict.get(pos)
+        if t is mipmap_dirty_tile:
+            t = self._regenerate_mipmap(t, tx, ty)
+        if t is None or t is transparent_tile:
+            if readonly:
+                return (pos, transparent_tile)
+            t = _Tile8()
+            tiledict[pos] = t
+        elif not isinstance(t, _Tile8):
+            # Widened by the native half, or loaded from 15-bit data
+            t = _Tile8.new_from_rgba16(t.rgba)
+            tiledict[pos] = t
+        elif t.readonly and not readonly:
+            t = t.copy()
+            tiledict[pos] = t
+        if not readonly:
+            self._widened.pop(pos, None)
+            self._mark_mipmap_dirty(tx, ty)
+            self._tiledict.store.mark_written(tx, ty)
+        return (pos, t)
+
+    @contextlib.contextmanager
+    def tile_request(self, tx, ty, readonly):
+        """Get a tile as a 15-bit NumPy array, then put it back
+
+        See MyPaintSurface.tile_request(). The array is a widened copy
+        of the tile, which is updated from it after read/write requests.
+
+        """
+        pos, t = self._get_tile8(tx, ty, readonly)
+        if t is transparent_tile:
+            yield t.rgba
+            return
+        rgba = t.widened().rgba
+        yield rgba
+        if not readonly:
+            mypaintlib.tile_convert_rgba16_to_prgba8(rgba, t.rgba)
+
+    def _get_tile_numpy(self, tx, ty, readonly):
+        # Called by the native half only, which needs 15-bit pixels.
+        pos, t = self._get_tile8(tx, ty, readonly)
+        if t is transparent_tile:
+            return t.rgba
+        if readonly:
+            widened = self._widened.get(pos)
+            if widened is None or widened[0] is not t:
+                widened = (t, t.widened().rgba)
+                self._widened[pos] = widened
+            return widened[1]
+        wide_tile = t.widened()
+        self.tiledict[pos] = wide_tile
+        return wide_tile.rgba
+
+    def _get_tile_stored(self, tx, ty):
+        pos, t = self._get_tile8(tx, ty, True)
+        return t.rgba
+
+    def _regenerate_mipmap(self, t, tx, ty):
+        t = _Tile8()
+        self.tiledict[(tx, ty)] = t
+        empty = True
+
+        for x in xrange(2):
+            for y in xrange(2):
+                pos, src = self.parent._get_tile8(tx*2 + x, ty*2 + y, True)
+                if src is transparent_tile:
+                    continue
+                mypaintlib.tile_downscale_prgba8(src.rgba, t.rgba,
+                                                 x * N // 2,
+                                                 y * N // 2)
+                empty = False
+        if empty:
+            del self.tiledict[(tx, ty)]
+            t = transparent_tile
+        return t
+
+    def _convert_tiles(self, positions):
+        tiledict = self._tiledict
+        for pos in positions:
+            t = tiledict.get(pos)
+            if t is None or t is mipmap_dirty_tile:
+                continue
+            if not isinstance(t, _Tile8):
+                tiledict[pos] = _Tile8.new_from_rgba16(t.rgba)
+
+    def _load_from_pixbufsurface(self, s):
+        # Like the superclass's, but with no 15-bit intermediate
+        dirty_tiles = set(self.tiledict.keys())
+        self.tiledict = {}
+
+        for tx, ty in s.get_tiles():
+            pos, t = self._get_tile8(tx, ty, readonly=False)
+            s.blit_tile_into(t.rgba, True, tx, ty)
+
+        dirty_tiles.update(self.tiledict.keys())
+        bbox = lib.surface.get_tiles_bbox(dirty_tiles)
+        self.notify_observers(*bbox)
+
+
 def _new_backend_surface():
     """Fetches a new backend surface object for C test code to use.
 
@@ -934,12 +1783,29 @@ def _new_backend_surface():
     return surface.backend
 
 
+def prefetch_tiles(bbox, mipmap_level=0):
+    """Prepares all surfaces' tiles in an area for imminent use
+
+    :param tuple bbox: Area of interest, (x, y, w, h) in model pixels
+    :param int mipmap_level: Only prefetch for this mipmap level
+
+    Tiles in the area won't be swapped out for a while, and any which
+    are already swapped out are paged back in in the background. This is
+    cheap, and does nothing if there's no swap file: see
+    lib.document.set_tile_swap().
+
+    """
+    x, y, w, h = [int(c) for c in bbox]
+    mipmap_level = max(0, min(MAX_MIPMAP_LEVEL, int(mipmap_level)))
+    mypaintlib.tile_swap_prefetch(x, y, w, h, mipmap_level)
+
+
 class BackgroundError(Exception):
     """Errors raised by Background during failed initiailizations"""
     pass
 
 
-class Background (Surface):
+class Background (Surface8):
     """A background layer surface, with a repeating image"""
 
     def __init__(self, obj, mipmap_level=0):
@@ -1086,7 +1952,7 @@ def flood_fill(src, x, y, color, bbox, tolerance, dst):
         with src.tile_request(tx, ty, readonly=True) as src_tile:
             dst_tile = filled.get((tx, ty), None)
             if dst_tile is None:
-                dst_tile = np.zeros((N, N, 4), 'uint16')
+                dst_tile = mypaintlib.tile_buffer_new_rgba16(None)
                 filled[(tx, ty)] = dst_tile
             overflows = mypaintlib.tile_flood_fill(
                 src_tile, dst_tile, seeds,
@@ -1120,6 +1986,46 @@ def flood_fill(src, x, y, color, bbox, tolerance, dst):
     dst.notify_observers(*bbox)
 
 
+def _get_tile_aligned_rect(rect):
+    """Expands a rectangle outwards to tile boundaries
+
+    >>> assert N == 64, "FIXME: test only valid for 64 pixel tiles"
+    >>> tuple(_get_tile_aligned_rect((-1, 10, 66, 54)))
+    (-64, 0, 192, 64)
+
+    """
+    x, y, w, h = rect
+    tx0 = x // N
+    ty0 = y // N
+    tx1 = (x + w - 1) // N
+    ty1 = (y + h - 1) // N
+    return helpers.Rect(tx0*N, ty0*N, (tx1-tx0+1)*N, (ty1-ty0+1)*N)
+
+
+def _read_png_header(filename):
+    """Reads the dimensions and interlacing of a PNG file, cheaply
+
+    :param unicode filename: The file to examine
+    :returns: (width, height, interlaced), or None if not a PNG
+    :rtype: tuple
+
+    Only the signature and the IHDR chunk are read.
+
+    """
+    try:
+        with open(filename, "rb") as fp:
+            head = fp.read(29)
+    except (IOError, OSError):
+        return None
+    if len(head) < 29 or head[0:8] != b"\x89PNG\r\n\x1a\n":
+        return None
+    if head[12:16] != b"IHDR":
+        return None
+    w, h = struct.unpack(">II", head[16:24])
+    interlaced = (ord(head[28:29]) != 0)
+    return (w, h, interlaced)
+
+
 class PNGFileUpdateTask (object):
     """Piecemeal callable: writes to or replaces a PNG file
 
@@ -1193,6 +2099,132 @@ class PNGFileUpdateTask (object):
                 os.unlink(self._tmp_filename)
             raise
 
+
+class TileFileUpdateTask (object):
+    """Piecemeal callable: writes a surface's changed tiles to a tile file
+
+    See lib.autosave.Autosaveable and lib.tilefile.
+
+    If the `written_tiles` of the task which last wrote the file is
+    passed in, only tiles which were replaced or removed since then are
+    written. Tiles are frozen before they're examined, so comparing the
+    native ids of their data is enough: see _TileDict.data_id().
+    Otherwise the whole file is rewritten.
+
+    If the surface's tile journal since that task is passed in too,
+    only the journalled tile positions are examined. This makes the
+    cost of an update proportional to the number of tiles which changed,
+    rather than to the size of the layer. See take_tile_journal().
+
+    """
+
+    #: Number of tiles written per call
+    TILES_PER_CALL = 64
+
+    def __init__(self, surface, filename, written_tiles=None,
+                 tile_journal=None):
+        super(TileFileUpdateTask, self).__init__()
+        self._final_filename = filename
+        append = (written_tiles is not None) and os.path.exists(filename)
+        journalled = append and (tile_journal is not None)
+        if journalled:
+            # Freeze just the journalled tiles, like a snapshot would.
+            src_tiledict = surface.tiledict
+            data_ids = {}
+            for pos in tile_journal:
+                src_tiledict.freeze(pos)
+                data_id = src_tiledict.data_id(pos)
+                if data_id:
+                    data_ids[pos] = data_id
+            candidates = tile_journal
+            written = dict(written_tiles)
+        else:
+            src_tiledict = surface.save_snapshot().tiledict
+            data_ids = src_tiledict.data_ids()
+            candidates = written_tiles or ()
+            written = {}
+        if append:
+            self._write_filename = filename
+            changed = [
+                pos for (pos, data_id) in data_ids.iteritems()
+                if written_tiles.get(pos) != data_id
+            ]
+            removed = [
+                pos for pos in candidates
+                if pos in written_tiles and pos not in data_ids
+            ]
+        else:
+            self._write_filename = filename + u".tmp"
+            changed = list(data_ids.iterkeys())
+            removed = []
+        for pos in removed:
+            written.pop(pos, None)
+        written.update(data_ids)
+        #: What the file will contain when the task is done, as a dict
+        #: of the data ids of the tiles written at each position.
+        self.written_tiles = written
+        if journalled:
+            # The surface moves on, but frozen tiles don't change.
+            self._tiledict = dict((pos, src_tiledict[pos]) for pos in changed)
+        else:
+            self._tiledict = src_tiledict
+        self._changed = changed
+        self._removed = removed
+        self._append = append
+        self._writer = None
+        logger.debug(
+            "autosave: scheduled update of %r (%d tiles, %d removed)",
+            self._final_filename, len(changed), len(removed),
+        )
+
+    def __call__(self, *args, **kwargs):
+        if self._changed is None:
+            raise RuntimeError("Called too many times")
+        try:
+            if self._writer is None:
+                self._writer = lib.tilefile.TileFileWriter(
+                    self._write_filename,
+                    append=self._append,
+                )
+            writer = self._writer
+            for pos in self._removed:
+                writer.remove_tile(*pos)
+            self._removed = []
+            batch = self._changed[:self.TILES_PER_CALL]
+            del self._changed[:self.TILES_PER_CALL]
+            for pos in batch:
+                tile = self._tiledict[pos]
+                if isinstance(tile, _TileFileTile):
+                    writer.write_raw(pos[0], pos[1], tile.compressed_data)
+                else:
+                    writer.write_tile(pos[0], pos[1], tile.rgba)
+            if self._changed:
+                return True
+            writer.close()
+            self._tiledict = None
+        except:
+            if self._writer is not None:
+                self._writer.close()
+            self._writer = None
+            self._changed = None
+            if not self._append and os.path.exists(self._write_filename):
+                os.unlink(self._write_filename)
+            raise
+        self._writer = None
+        self._changed = None
+        if not self._append:
+            lib.tilefile.release_readers(self._final_filename)
+            lib.fileutils.replace(self._write_filename, self._final_filename)
+        elif lib.tilefile.needs_compaction(self._final_filename):
+            try:
+                lib.tilefile.compact(self._final_filename)
+            except EnvironmentError:
+                # Not fatal: the file is still complete, just larger.
+                logger.exception("autosave: failed to compact %r",
+                                 self._final_filename)
+        logger.debug("autosave: updated %r", self._final_filename)
+        return False
+
 if __name__ == '__main__':
     import doctest
     doctest.testmod()
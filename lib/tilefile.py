@@ -0,0 +1,456 @@
+# This file is part of MyPaint.
+# Copyright (C) 2017 by the MyPaint Development Team.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+"""MyPaint-native container files for tile data
+
+Tile files hold the 16-bit premultiplied RGBA tiles of one surface,
+each compressed separately, plus an index. They are MyPaint's internal
+format for autosaved layers: unlike PNG, they can be read one tile at a
+time without decoding the rest, and updated by appending only the tiles
+which changed.
+
+File layout (all integers little-endian)::
+
+    header:  magic "MYPTILE\\0", version, tile size, 0, 0  (<8sHHHH)
+    blocks:  a sequence of tile records and index blocks
+    record:  "TILE", tx, ty, data length (<4siiI), LZ4 block data
+    index:   "INDX", entry count (<4sI),
+             entries of tx, ty, data offset, data length (<iiQI),
+             then the index's own offset, and "MYPTEND\\0" (<Q8s)
+
+Tile data is compressed as a single LZ4 block, using the same codec as
+the native tile store's cold tiles. A record with zero data length marks
+a tile which was removed. The
+newest record for a tile wins, and the index written last describes the
+live records. Writers only ever append to the file, so an interrupted
+write can be recovered by scanning the records in order.
+
+"""
+
+## Imports
+from __future__ import division, print_function
+
+import os
+import sys
+import mmap
+import struct
+import logging
+import weakref
+
+import numpy as np
+
+import lib.mypaintlib
+import lib.fileutils
+
+logger = logging.getLogger(__name__)
+
+
+## Constants
+
+#: File extension for tile files
+SUFFIX = u".mptiles"
+
+N = lib.mypaintlib.TILE_SIZE
+
+_VERSION = 2  # 1 used zlib
+_HEADER = struct.Struct("<8sHHHH")
+_HEADER_MAGIC = b"MYPTILE\0"
+_RECORD = struct.Struct("<4siiI")
+_RECORD_TAG = b"TILE"
+_INDEX = struct.Struct("<4sI")
+_INDEX_TAG = b"INDX"
+_INDEX_ENTRY = struct.Struct("<iiQI")
+_TRAILER = struct.Struct("<Q8s")
+_TRAILER_MAGIC = b"MYPTEND\0"
+
+_TILE_SHAPE = (N, N, 4)
+_TILE_BYTESWAP = (sys.byteorder != "little")
+
+#: Readers which still have their file mapped. See release_readers().
+_open_readers = weakref.WeakSet()
+
+
+## Exceptions
+
+class TileFileError (IOError):
+    """Raised when a tile file is unreadable"""
+
+
+## Class defs
+
+class TileFileReader (object):
+    """Random access to the tiles in a tile file, via mmap
+
+    >>> import tempfile, shutil
+    >>> tmpdir = tempfile.mkdtemp()
+    >>> filename = os.path.join(tmpdir, "test" + SUFFIX)
+    >>> tile = np.zeros((N, N, 4), 'uint16')
+    >>> tile[...] = 1 << 15
+    >>> w = TileFileWriter(filename)
+    >>> w.write_tile(-1, 2, tile)
+    >>> w.close()
+    >>> r = TileFileReader(filename)
+    >>> r.get_tile_coords()
+    [(-1, 2)]
+    >>> (r.read_tile(-1, 2) == tile).all()
+    True
+    >>> r.read_tile(0, 0) is None
+    True
+    >>> r.close()
+    >>> shutil.rmtree(tmpdir)
+
+    """
+
+    def __init__(self, filename):
+        """Open a tile file for reading
+
+        :param unicode filename: File to open
+        :raises TileFileError: if the file isn't a tile file
+
+        """
+        super(TileFileReader, self).__init__()
+        self.filename = filename
+        self._realpath = os.path.realpath(filename)
+        self._data = None
+        with open(filename, "rb") as fp:
+            size = os.fstat(fp.fileno()).st_size
+            if size < _HEADER.size:
+                raise TileFileError("%r: too short" % (filename,))
+            self._mmap = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, tile_size, _, _ = _HEADER.unpack_from(self._mmap, 0)
+        if magic != _HEADER_MAGIC:
+            self.close()
+            raise TileFileError("%r: not a tile file" % (filename,))
+        if version != _VERSION or tile_size != N:
+            self.close()
+            raise TileFileError(
+                "%r: unsupported version %d or tile size %d"
+                % (filename, version, tile_size),
+            )
+        #: True if the file's index was missing and had to be rebuilt
+        self.recovered = False
+        index = self._read_index()
+        if index is None:
+            index, end = self._scan_records()
+            self.recovered = True
+            logger.warning(
+                "%r: no valid index, recovered %d tiles by scanning",
+                filename, len(index),
+            )
+        else:
+            end = size
+        self._index = index
+        #: Offset just past the last complete block in the file
+        self.end_offset = end
+        _open_readers.add(self)
+
+    def _read_index(self):
+        """Internal: read the index named by the trailer, if valid"""
+        mm = self._mmap
+        size = len(mm)
+        if size < _HEADER.size + _INDEX.size + _TRAILER.size:
+            return None
+        index_offset, magic = _TRAILER.unpack_from(mm, size - _TRAILER.size)
+        if magic != _TRAILER_MAGIC:
+            return None
+        if index_offset < _HEADER.size:
+            return None
+        if index_offset + _INDEX.size > size - _TRAILER.size:
+            return None
+        tag, count = _INDEX.unpack_from(mm, index_offset)
+        entries_offset = index_offset + _INDEX.size
+        entries_end = entries_offset + count * _INDEX_ENTRY.size
+        if tag != _INDEX_TAG or entries_end != size - _TRAILER.size:
+            return None
+        index = {}
+        for i in xrange(count):
+            tx, ty, offset, length = _INDEX_ENTRY.unpack_from(
+                mm, entries_offset + i * _INDEX_ENTRY.size,
+            )
+            if offset + length > index_offset:
+                return None
+            index[(tx, ty)] = (offset, length)
+        return index
+
+    def _scan_records(self):
+        """Internal: rebuild the index by reading every block in order
+
+        :returns: the index, and the end of the last complete block
+
+        """
+        mm = self._mmap
+        size = len(mm)
+        index = {}
+        pos = _HEADER.size
+        while pos + 4 <= size:
+            tag = mm[pos:pos+4]
+            if tag == _RECORD_TAG and pos + _RECORD.size <= size:
+                _, tx, ty, length = _RECORD.unpack_from(mm, pos)
+                data_offset = pos + _RECORD.size
+                if data_offset + length > size:
+                    break
+                if length:
+                    index[(tx, ty)] = (data_offset, length)
+                else:
+                    index.pop((tx, ty), None)
+                pos = data_offset + length
+            elif tag == _INDEX_TAG and pos + _INDEX.size <= size:
+                _, count = _INDEX.unpack_from(mm, pos)
+                block_end = (pos + _INDEX.size + count * _INDEX_ENTRY.size
+                             + _TRAILER.size)
+                if block_end > size:
+                    break
+                pos = block_end
+            else:
+                break
+        return index, pos
+
+    def close(self):
+        """Close the file. Tiles can no longer be read afterwards."""
+        _open_readers.discard(self)
+        if self._mmap is not None:
+            self._mmap.close()
+            self._mmap = None
+
+    def detach(self):
+        """Copy the live tiles' data into memory, then close the file
+
+        Tiles can still be read afterwards, and the file is free to be
+        replaced or deleted, even where that isn't allowed while it is
+        mapped. The data stays compressed, as in the file.
+
+        """
+        mm = self._mmap
+        if mm is None:
+            return
+        self._data = dict(
+            (pos, mm[offset:offset+length])
+            for (pos, (offset, length)) in self._index.iteritems()
+        )
+        self.close()
+
+    def __len__(self):
+        return len(self._index)
+
+    def __contains__(self, pos):
+        return pos in self._index
+
+    def get_tile_coords(self):
+        """Returns the (tx, ty) coordinates of all tiles in the file"""
+        return list(self._index.iterkeys())
+
+    @property
+    def live_bytes(self):
+        """Total size of the compressed data of all live tiles"""
+        return sum(length for (offset, length) in self._index.itervalues())
+
+    def read_raw(self, tx, ty):
+        """Returns the compressed data for a tile, or None"""
+        if self._data is not None:
+            return self._data.get((tx, ty))
+        entry = self._index.get((tx, ty))
+        if entry is None:
+            return None
+        offset, length = entry
+        return self._mmap[offset:offset+length]
+
+    def read_tile(self, tx, ty):
+        """Decodes a tile
+
+        :returns: a new NxNx4 uint16 array, or None if there's no tile
+        :rtype: numpy.ndarray
+
+        """
+        data = self.read_raw(tx, ty)
+        if data is None:
+            return None
+        return decompress_tile(data)
+
+
+class TileFileWriter (object):
+    """Appends tiles to a tile file, new or existing
+
+    Changes become durable when commit() or close() is called, which
+    writes a new index after all the tile records written so far.
+
+    """
+
+    def __init__(self, filename, append=True):
+        """Open a tile file for writing
+
+        :param unicode filename: File to write
+        :param bool append: Add to an existing file rather than replace
+
+        If the existing file is not a usable tile file, it is replaced.
+
+        """
+        super(TileFileWriter, self).__init__()
+        self.filename = filename
+        self._index = {}
+        self._fp = None
+        if append and os.path.exists(filename):
+            try:
+                reader = TileFileReader(filename)
+            except (TileFileError, EnvironmentError, ValueError):
+                logger.warning("Replacing unreadable tile file %r", filename)
+            else:
+                self._index = reader._index
+                end = reader.end_offset
+                reader.close()
+                self._fp = open(filename, "r+b")
+                self._fp.seek(end)
+                self._fp.truncate()
+        self._dirty = False
+        if self._fp is None:
+            self._index = {}
+            self._fp = open(filename, "wb")
+            self._fp.write(_HEADER.pack(_HEADER_MAGIC, _VERSION, N, 0, 0))
+            self._dirty = True
+
+    def __len__(self):
+        return len(self._index)
+
+    @property
+    def size(self):
+        """Current size of the file, in bytes"""
+        return self._fp.tell()
+
+    @property
+    def live_bytes(self):
+        """Total size of the compressed data of all live tiles"""
+        return sum(length for (offset, length) in self._index.itervalues())
+
+    def write_tile(self, tx, ty, rgba):
+        """Compress and append one tile's data
+
+        :param int tx: Tile X coordinate
+        :param int ty: Tile Y coordinate
+        :param numpy.ndarray rgba: NxNx4 uint16 premultiplied tile data
+
+        """
+        self.write_raw(tx, ty, compress_tile(rgba))
+
+    def write_raw(self, tx, ty, data):
+        """Append one tile's already-compressed data"""
+        assert data
+        fp = self._fp
+        fp.write(_RECORD.pack(_RECORD_TAG, tx, ty, len(data)))
+        self._index[(tx, ty)] = (fp.tell(), len(data))
+        fp.write(data)
+        self._dirty = True
+
+    def remove_tile(self, tx, ty):
+        """Record that a tile has been removed"""
+        if self._index.pop((tx, ty), None) is None:
+            return
+        self._fp.write(_RECORD.pack(_RECORD_TAG, tx, ty, 0))
+        self._dirty = True
+
+    def commit(self):
+        """Write a new index and flush everything to disk"""
+        if not self._dirty:
+            return
+        fp = self._fp
+        index_offset = fp.tell()
+        fp.write(_INDEX.pack(_INDEX_TAG, len(self._index)))
+        for (tx, ty), (offset, length) in self._index.iteritems():
+            fp.write(_INDEX_ENTRY.pack(tx, ty, offset, length))
+        fp.write(_TRAILER.pack(index_offset, _TRAILER_MAGIC))
+        fp.flush()
+        os.fsync(fp.fileno())
+        self._dirty = False
+
+    def close(self):
+        """Commit any changes, and close the file"""
+        if self._fp is None:
+            return
+        self.commit()
+        self._fp.close()
+        self._fp = None
+
+
+## Module functions
+
+def compress_tile(rgba):
+    """Compress tile data for a tile file record"""
+    assert rgba.shape == _TILE_SHAPE
+    rgba = np.ascontiguousarray(rgba, dtype="uint16")
+    if _TILE_BYTESWAP:
+        rgba = rgba.byteswap()
+    return lib.mypaintlib.tile_record_compress(rgba)
+
+
+def decompress_tile(data):
+    """Decompress a tile file record's data into a new tile array"""
+    try:
+        rgba = lib.mypaintlib.tile_record_decompress(data)
+    except ValueError:
+        raise TileFileError("malformed tile record")
+    if _TILE_BYTESWAP:
+        rgba.byteswap(True)
+    return rgba
+
+
+def needs_compaction(filename, min_size=4*1024*1024):
+    """True if a tile file is mostly superseded records
+
+    :param unicode filename: Tile file to test
+    :param int min_size: Files smaller than this are left alone
+    :rtype: bool
+
+    """
+    try:
+        size = os.path.getsize(filename)
+        if size < min_size:
+            return False
+        reader = TileFileReader(filename)
+    except (TileFileError, EnvironmentError, ValueError):
+        return False
+    live = reader.live_bytes
+    reader.close()
+    return live * 2 < size
+
+
+def release_readers(filename):
+    """Detach every open reader of a tile file, before replacing it
+
+    :param unicode filename: Tile file about to be replaced
+
+    Readers keep their file mapped for as long as their tiles are in
+    use. Replacing a mapped file fails on Windows, and elsewhere leaves
+    the readers looking at the old file. Detached readers keep working
+    from memory instead. See TileFileReader.detach().
+
+    """
+    realpath = os.path.realpath(filename)
+    for reader in list(_open_readers):
+        if reader._realpath == realpath:
+            reader.detach()
+
+
+def compact(filename):
+    """Rewrite a tile file to contain only its live tiles
+
+    :param unicode filename: Tile file to compact
+
+    The compressed tile data is copied as-is, and the new file replaces
+    the old one atomically. Any other readers of the file are detached
+    first, see release_readers().
+
+    """
+    reader = TileFileReader(filename)
+    tmp_filename = filename + u".tmp"
+    try:
+        writer = TileFileWriter(tmp_filename, append=False)
+        for tx, ty in sorted(reader.get_tile_coords()):
+            writer.write_raw(tx, ty, reader.read_raw(tx, ty))
+        writer.close()
+    finally:
+        reader.close()
+    release_readers(filename)
+    lib.fileutils.replace(tmp_filename, filename)
@@ -0,0 +1,41 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2017 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TILESIZE_HPP
+#define TILESIZE_HPP
+
+#include <mypaint-tiled-surface.h>
+
+// Edge length of the square tiles, in pixels.
+//
+// The pixel kernels in pixops.cpp and fill.cpp are templates over the
+// tile size, and the Python-facing functions use the instances for this
+// one. Python's N follows it via mypaintlib.TILE_SIZE.
+//
+// It can be set at build time (scons tile_size=N, or setup.py build_ext
+// --tile-size=N), but libmypaint's brush engine is compiled for its own
+// MYPAINT_TILE_SIZE, so libmypaint must be built for the same size.
+// Released libmypaint headers define MYPAINT_TILE_SIZE as 64
+// unconditionally, so any other size needs the libmypaint patch
+// described in BUILDING.md. The build options define MYPAINT_TILE_SIZE
+// too, which a patched header respects.
+
+#ifndef MYPAINTLIB_TILE_SIZE
+#define MYPAINTLIB_TILE_SIZE MYPAINT_TILE_SIZE
+#endif
+
+#if MYPAINTLIB_TILE_SIZE != MYPAINT_TILE_SIZE
+#error "MYPAINTLIB_TILE_SIZE must match libmypaint's MYPAINT_TILE_SIZE (see BUILDING.md)"
+#endif
+
+#if MYPAINTLIB_TILE_SIZE < 2 || (MYPAINTLIB_TILE_SIZE & (MYPAINTLIB_TILE_SIZE-1))
+#error "MYPAINTLIB_TILE_SIZE must be a power of two"
+#endif
+
+#endif //TILESIZE_HPP
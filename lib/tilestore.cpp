@@ -0,0 +1,2379 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2017 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tilestore.hpp"
+
+#include "common.hpp"
+#include "tilesize.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <map>
+#include <utility>
+#if ! defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <lz4.h>
+
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#define NO_IMPORT_ARRAY
+#include <numpy/arrayobject.h>
+
+
+// Tile buffer pool
+//
+// Buffers are carved out of slabs which are kept for the lifetime of the
+// process, and recycled through free lists. Each thread keeps a small
+// free list of its own, so most allocations and frees don't need a lock.
+// Whole batches of buffers move between the per-thread lists and the
+// shared one when a thread runs out or has too many.
+
+static const size_t TILE_BUFFER_BYTES
+    = MYPAINTLIB_TILE_SIZE * MYPAINTLIB_TILE_SIZE * 4 * sizeof(uint16_t);
+static const size_t TILE_BUFFER_ALIGNMENT = 64;
+
+// Slabs are the size of an x86-64 huge page, and are aligned to it where
+// the platform allows, so the kernel can back each with a single page.
+static const size_t TILE_SLAB_BYTES = 2 * 1024 * 1024;
+static const int TILE_BUFFERS_PER_SLAB
+    = (TILE_SLAB_BYTES / TILE_BUFFER_BYTES) > 0
+    ? (TILE_SLAB_BYTES / TILE_BUFFER_BYTES) : 1;
+
+// Number of buffers moved between a thread's list and the shared one
+static const int TILE_BUFFER_BATCH = 32;
+
+static const char *TILE_BUFFER_CAPSULE_NAME = "mypaintlib.tile_buffer";
+
+// Free buffers are linked through their first bytes.
+struct TileBufferLink
+{
+    TileBufferLink *next;
+};
+
+struct TileBufferList
+{
+    TileBufferLink *head;
+    int count;
+};
+
+// Shared free list and statistics: guarded by the pool lock.
+static TileBufferList tile_buffer_shared = {NULL, 0};
+static long tile_buffer_slabs = 0;
+
+// Statistics, updated atomically
+static long tile_buffer_hits = 0;
+static long tile_buffer_misses = 0;
+static long tile_buffer_frees = 0;
+
+// Each thread's own free list
+static TileBufferList tile_buffer_local = {NULL, 0};
+#pragma omp threadprivate(tile_buffer_local)
+
+
+// Allocates a new slab's worth of buffers as a list.
+
+static bool
+tile_buffer_slab_new(TileBufferList *list)
+{
+    void *mem = NULL;
+    size_t bytes = TILE_BUFFER_BYTES * TILE_BUFFERS_PER_SLAB;
+#if defined(_WIN32)
+    mem = malloc(bytes + TILE_BUFFER_ALIGNMENT);
+#else
+    if (posix_memalign(&mem, TILE_SLAB_BYTES, bytes) != 0) {
+        mem = NULL;
+    }
+#endif
+    if (! mem) {
+        return false;
+    }
+#if defined(MADV_HUGEPAGE)
+    madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+    uintptr_t start = ((uintptr_t)mem + TILE_BUFFER_ALIGNMENT - 1)
+                      & ~(uintptr_t)(TILE_BUFFER_ALIGNMENT - 1);
+    for (int i = TILE_BUFFERS_PER_SLAB - 1; i >= 0; --i) {
+        TileBufferLink *link = (TileBufferLink *)(start + i*TILE_BUFFER_BYTES);
+        link->next = list->head;
+        list->head = link;
+    }
+    list->count += TILE_BUFFERS_PER_SLAB;
+    return true;
+}
+
+
+// Moves up to n buffers from the front of src to the front of dst.
+
+static void
+tile_buffer_list_move(TileBufferList *dst, TileBufferList *src, int n)
+{
+    while (n-- > 0 && src->head) {
+        TileBufferLink *link = src->head;
+        src->head = link->next;
+        src->count--;
+        link->next = dst->head;
+        dst->head = link;
+        dst->count++;
+    }
+}
+
+
+uint16_t *
+tile_buffer_alloc(bool zeroed)
+{
+    TileBufferList *local = &tile_buffer_local;
+    if (! local->head) {
+        bool hit = true;
+#pragma omp critical(tile_buffer_pool)
+        {
+            if (! tile_buffer_shared.head) {
+                hit = false;
+                if (tile_buffer_slab_new(&tile_buffer_shared)) {
+                    tile_buffer_slabs++;
+                }
+            }
+            tile_buffer_list_move(local, &tile_buffer_shared,
+                                  TILE_BUFFER_BATCH);
+        }
+        if (! local->head) {
+            return NULL;
+        }
+        if (! hit) {
+#pragma omp atomic
+            tile_buffer_misses++;
+        }
+        else {
+#pragma omp atomic
+            tile_buffer_hits++;
+        }
+    }
+    else {
+#pragma omp atomic
+        tile_buffer_hits++;
+    }
+    TileBufferLink *link = local->head;
+    local->head = link->next;
+    local->count--;
+    if (zeroed) {
+        memset(link, 0, TILE_BUFFER_BYTES);
+    }
+    return (uint16_t *)link;
+}
+
+
+void
+tile_buffer_free(uint16_t *buf)
+{
+    if (! buf) {
+        return;
+    }
+#pragma omp atomic
+    tile_buffer_frees++;
+    TileBufferList *local = &tile_buffer_local;
+    TileBufferLink *link = (TileBufferLink *)buf;
+    link->next = local->head;
+    local->head = link;
+    local->count++;
+    if (local->count >= 2 * TILE_BUFFER_BATCH) {
+#pragma omp critical(tile_buffer_pool)
+        {
+            tile_buffer_list_move(&tile_buffer_shared, local,
+                                  TILE_BUFFER_BATCH);
+        }
+    }
+}
+
+
+void
+tile_buffer_pool_release_thread()
+{
+    TileBufferList *local = &tile_buffer_local;
+    if (! local->head) {
+        return;
+    }
+#pragma omp critical(tile_buffer_pool)
+    {
+        tile_buffer_list_move(&tile_buffer_shared, local, local->count);
+    }
+}
+
+
+// Bytes of tile buffers currently handed out, for any purpose
+
+static size_t
+tile_buffer_bytes_in_use()
+{
+    long n = tile_buffer_hits + tile_buffer_misses - tile_buffer_frees;
+    return (n > 0) ? (size_t)n * TILE_BUFFER_BYTES : 0;
+}
+
+
+PyObject *
+tile_buffer_pool_stats()
+{
+    long slabs = 0;
+    long shared_free = 0;
+#pragma omp critical(tile_buffer_pool)
+    {
+        slabs = tile_buffer_slabs;
+        shared_free = tile_buffer_shared.count;
+    }
+    return Py_BuildValue(
+        "{s:l,s:l,s:l,s:l,s:l,s:n}",
+        "hits", tile_buffer_hits,
+        "misses", tile_buffer_misses,
+        "slabs", slabs,
+        "buffers", slabs * TILE_BUFFERS_PER_SLAB,
+        "shared_free", shared_free,
+        "bytes_in_use", (Py_ssize_t)tile_buffer_bytes_in_use()
+    );
+}
+
+
+static void
+tile_buffer_capsule_destroy(PyObject *capsule)
+{
+    void *buf = PyCapsule_GetPointer(capsule, TILE_BUFFER_CAPSULE_NAME);
+    tile_buffer_free((uint16_t *)buf);
+}
+
+
+// Wraps a tile buffer as a new numpy array, which takes ownership of it.
+// On failure, NULL is returned and the buffer still belongs to the caller.
+
+static PyObject *
+tile_buffer_wrap(uint16_t *buf)
+{
+    // The destructor is only attached once the array owns the capsule.
+    PyObject *capsule = PyCapsule_New(buf, TILE_BUFFER_CAPSULE_NAME, NULL);
+    if (! capsule) {
+        return NULL;
+    }
+    npy_intp dims[] = {MYPAINTLIB_TILE_SIZE, MYPAINTLIB_TILE_SIZE, 4};
+    PyObject *arr = PyArray_SimpleNewFromData(3, dims, NPY_UINT16, buf);
+    if (! arr) {
+        Py_DECREF(capsule);
+        return NULL;
+    }
+    if (PyArray_SetBaseObject((PyArrayObject *)arr, capsule) < 0) {
+        // The capsule reference was stolen and released.
+        Py_DECREF(arr);
+        return NULL;
+    }
+    PyCapsule_SetDestructor(capsule, tile_buffer_capsule_destroy);
+    return arr;
+}
+
+
+// Returns the pixel data of an NxNx4 uint16 C-contiguous array, or NULL.
+
+static uint16_t *
+tile_array_data(PyObject *obj, bool writeable)
+{
+    if (! obj || ! PyArray_Check(obj)) {
+        return NULL;
+    }
+    PyArrayObject *arr = (PyArrayObject *)obj;
+    if (PyArray_NDIM(arr) != 3
+        || PyArray_DIM(arr, 0) != MYPAINTLIB_TILE_SIZE
+        || PyArray_DIM(arr, 1) != MYPAINTLIB_TILE_SIZE
+        || PyArray_DIM(arr, 2) != 4
+        || PyArray_TYPE(arr) != NPY_UINT16
+        || ! PyArray_ISCARRAY_RO(arr)) {
+        return NULL;
+    }
+    if (writeable && ! PyArray_ISWRITEABLE(arr)) {
+        return NULL;
+    }
+    return (uint16_t *)PyArray_DATA(arr);
+}
+
+
+PyObject *
+tile_buffer_empty_rgba16()
+{
+    uint16_t *buf = tile_buffer_alloc(false);
+    if (! buf) {
+        return PyErr_NoMemory();
+    }
+    PyObject *arr = tile_buffer_wrap(buf);
+    if (! arr) {
+        tile_buffer_free(buf);
+    }
+    return arr;
+}
+
+
+PyObject *
+tile_buffer_new_rgba16(PyObject *copy_from)
+{
+    const uint16_t *src = tile_array_data(copy_from, false);
+    uint16_t *buf = tile_buffer_alloc(src == NULL);
+    if (! buf) {
+        return PyErr_NoMemory();
+    }
+    if (src) {
+        memcpy(buf, src, TILE_BUFFER_BYTES);
+    }
+    PyObject *arr = tile_buffer_wrap(buf);
+    if (! arr) {
+        tile_buffer_free(buf);
+    }
+    return arr;
+}
+
+
+// Tile data, shared between stores and their snapshots
+//
+// Each live entry of a TileStore refers to one TileData, which counts the
+// entries referring to it. Snapshots share tile data with the store they
+// were taken from, so only data with a single reference which hasn't been
+// frozen by Python may be written to. Anything else is copied first.
+//
+// Tile data which hasn't been used for a while may be compressed with
+// LZ4 to save memory, or written out to the swap file. It's brought back
+// into memory when it's next requested.
+
+enum {
+    TILE_READONLY = 1,          // frozen by Python: never written to
+    TILE_OWNS_BUFFER = 2,       // rgba is a tile buffer owned by the data
+    TILE_WRAPPER_READONLY = 4,  // the Python tile object says readonly
+    TILE_HASHED = 8,            // hash is valid
+    TILE_INDEXED = 16           // the dedup index's data for its hash
+};
+
+struct TileData
+{
+    int refs;            // number of store entries using this data
+    unsigned char flags;
+    uint16_t *rgba;      // pixels, or NULL if packed or Python has them
+    PyObject *tile;      // Python tile object, or NULL if not wrapped yet
+    PyObject *array;     // the numpy array owning rgba, or NULL
+    char *packed;        // compressed pixels, or NULL
+    int packed_size;     // also the size of swapped data, 0 if raw
+    int swap_slot;       // slot in the swap file, or -1
+    unsigned int last_use;   // tile_clock value when last used
+    uint64_t hash;       // content hash, if TILE_HASHED
+    uint64_t id;         // unique, see TileStore::data_id()
+};
+
+
+// Compression of cold tiles: settings and statistics. Only touched with
+// the GIL held, or from inside the tile request critical section.
+
+static unsigned int tile_clock = 0;
+static unsigned int tile_compression_idle_ticks = 0;  // 0: disabled
+static size_t tile_compression_budget = 0;
+static long tile_packed_count = 0;
+static size_t tile_packed_bytes = 0;
+static long tile_compressions = 0;
+static long tile_decompressions = 0;
+
+// Tile data holding raw pixels, whoever allocated them. This is what
+// compression and swapping can reclaim: scratch buffers and arrays which
+// no store refers to don't count. Updated atomically.
+static long tile_raw_count = 0;
+
+// Compression only keeps the result if it saves at least a quarter.
+static const int TILE_PACKED_MAX_BYTES = TILE_BUFFER_BYTES * 3 / 4;
+
+
+// Tile swap file: settings and statistics. Same locking as above.
+//
+// The file is mapped into memory, and divided into slots the size of a
+// tile buffer. Swapped out tile data is copied into a slot, compressed
+// if that helps, and the kernel writes it back to disk and drops it from
+// memory as it sees fit.
+
+static int tile_swap_fd = -1;
+static char *tile_swap_map = NULL;
+static int tile_swap_slots = 0;          // slots in the file
+static std::vector<int> tile_swap_free;  // unused slots
+static size_t tile_swap_budget = 0;      // 0: disabled
+static long tile_swapped_count = 0;
+static long tile_swap_outs = 0;
+static long tile_swap_ins = 0;
+
+// The swap file grows by at least this many slots at a time.
+static const int TILE_SWAP_MIN_GROWTH = 256;
+
+
+// Painting threads currently between tile_painting_begin() and
+// tile_painting_end(). Same locking as above.
+
+static int tile_painting_count = 0;
+
+// Prefetches asked for while painting, done once it ends. Only the most
+// recent few are kept, since they're only hints. Same locking as above.
+
+struct TileSwapPrefetch {
+    int x, y, w, h;
+    int mipmap_level;
+};
+
+static std::vector<TileSwapPrefetch> tile_swap_prefetch_pending;
+static const size_t TILE_SWAP_PREFETCH_MAX_PENDING = 16;
+
+
+// Deduplication: settings, index and statistics. Same locking as above.
+//
+// Tile data which can't be written to any more, because it's shared or
+// frozen, is hashed once. The first data seen with each hash goes into
+// the index. Entries whose data turns out to be identical to indexed
+// data are pointed at that instead, and copy-on-write does the rest.
+// Data leaves the index when it's freed or written to.
+
+static bool tile_dedup_enabled = false;
+static std::map<uint64_t, TileData *> tile_dedup_index;
+static long tile_dedup_hashed = 0;
+static long tile_dedup_hits = 0;
+static long tile_dedup_freed = 0;
+static long tile_dedup_collisions = 0;
+
+
+// Last id given to new tile data. Guarded by its own lock, since data
+// is created by painting threads as well as with the GIL held.
+
+static uint64_t tile_data_last_id = 0;
+
+
+static TileData *
+tile_data_new(uint16_t *rgba, unsigned char flags)
+{
+    TileData *d = (TileData *)malloc(sizeof(TileData));
+    if (! d) {
+        return NULL;
+    }
+    d->refs = 1;
+    d->flags = flags;
+    d->rgba = rgba;
+    if (rgba) {
+#pragma omp atomic
+        tile_raw_count++;
+    }
+    d->tile = NULL;
+    d->array = NULL;
+    d->packed = NULL;
+    d->packed_size = 0;
+    d->swap_slot = -1;
+    d->last_use = tile_clock;
+    d->hash = 0;
+#pragma omp critical(tile_data_id)
+    {
+        d->id = ++tile_data_last_id;
+    }
+    return d;
+}
+
+
+// Content hash for tile data. The mixing follows XXH64 with a seed of 0,
+// cut down for inputs which are a whole number of 32-byte stripes.
+
+static const uint64_t TILE_HASH_PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t TILE_HASH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t TILE_HASH_PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t TILE_HASH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+
+static inline uint64_t
+tile_hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+tile_hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * TILE_HASH_PRIME2;
+    acc = tile_hash_rotl(acc, 31);
+    return acc * TILE_HASH_PRIME1;
+}
+
+static inline uint64_t
+tile_hash_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= tile_hash_round(0, v);
+    return acc * TILE_HASH_PRIME1 + TILE_HASH_PRIME4;
+}
+
+static uint64_t
+tile_hash(const uint16_t *rgba)
+{
+    const uint64_t *p = (const uint64_t *)rgba;
+    const uint64_t *end = p + TILE_BUFFER_BYTES / sizeof(uint64_t);
+    uint64_t v1 = TILE_HASH_PRIME1 + TILE_HASH_PRIME2;
+    uint64_t v2 = TILE_HASH_PRIME2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -TILE_HASH_PRIME1;
+    for (; p < end; p += 4) {
+        v1 = tile_hash_round(v1, p[0]);
+        v2 = tile_hash_round(v2, p[1]);
+        v3 = tile_hash_round(v3, p[2]);
+        v4 = tile_hash_round(v4, p[3]);
+    }
+    uint64_t h = tile_hash_rotl(v1, 1) + tile_hash_rotl(v2, 7)
+               + tile_hash_rotl(v3, 12) + tile_hash_rotl(v4, 18);
+    h = tile_hash_merge(h, v1);
+    h = tile_hash_merge(h, v2);
+    h = tile_hash_merge(h, v3);
+    h = tile_hash_merge(h, v4);
+    h += TILE_BUFFER_BYTES;
+    h ^= h >> 33;
+    h *= TILE_HASH_PRIME2;
+    h ^= h >> 29;
+    h *= TILE_HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+// Forgets the hash of tile data which is about to be freed or changed.
+
+static void
+tile_dedup_forget(TileData *d)
+{
+    if (d->flags & TILE_INDEXED) {
+        tile_dedup_index.erase(d->hash);
+    }
+    d->flags &= ~(TILE_HASHED | TILE_INDEXED);
+}
+
+
+static inline char *
+tile_swap_slot_data(int slot)
+{
+    return tile_swap_map + (size_t)slot * TILE_BUFFER_BYTES;
+}
+
+
+static void
+tile_swap_slot_free(int slot)
+{
+    tile_swap_free.push_back(slot);
+    tile_swapped_count--;
+}
+
+
+// Makes sure there's a free slot, growing the swap file if needed.
+// Returns false if it can't be grown.
+
+static bool
+tile_swap_reserve()
+{
+#if defined(_WIN32)
+    return false;
+#else
+    if (! tile_swap_free.empty()) {
+        return true;
+    }
+    if (tile_swap_fd < 0) {
+        return false;
+    }
+    const int new_slots = tile_swap_slots
+                        + std::max(tile_swap_slots, TILE_SWAP_MIN_GROWTH);
+    const size_t old_bytes = (size_t)tile_swap_slots * TILE_BUFFER_BYTES;
+    const size_t new_bytes = (size_t)new_slots * TILE_BUFFER_BYTES;
+    if (ftruncate(tile_swap_fd, new_bytes) != 0) {
+        return false;
+    }
+    // Nothing holds on to pointers into the map, so it can just move.
+    void *map = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     tile_swap_fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (tile_swap_map) {
+        munmap(tile_swap_map, old_bytes);
+    }
+    tile_swap_map = (char *)map;
+    for (int slot = new_slots - 1; slot >= tile_swap_slots; --slot) {
+        tile_swap_free.push_back(slot);
+    }
+    tile_swap_slots = new_slots;
+    return true;
+#endif
+}
+
+
+// Reads swapped out tile data back into a new tile buffer.
+// Returns false if out of memory.
+
+static bool
+tile_data_swap_in(TileData *d)
+{
+    uint16_t *buf = tile_buffer_alloc(false);
+    if (! buf) {
+        return false;
+    }
+    const char *src = tile_swap_slot_data(d->swap_slot);
+    if (d->packed_size) {
+        int n = LZ4_decompress_safe(src, (char *)buf, d->packed_size,
+                                    TILE_BUFFER_BYTES);
+        if (n != (int)TILE_BUFFER_BYTES) {
+            tile_buffer_free(buf);
+            return false;
+        }
+    }
+    else {
+        memcpy(buf, src, TILE_BUFFER_BYTES);
+    }
+    tile_swap_slot_free(d->swap_slot);
+    tile_swap_ins++;
+    d->swap_slot = -1;
+    d->packed_size = 0;
+    d->rgba = buf;
+    d->flags |= TILE_OWNS_BUFFER;
+#pragma omp atomic
+    tile_raw_count++;
+    return true;
+}
+
+
+// Decompresses packed tile data into a new tile buffer.
+// Returns false if out of memory.
+
+static bool
+tile_data_unpack(TileData *d)
+{
+    if (d->swap_slot >= 0) {
+        return tile_data_swap_in(d);
+    }
+    if (! d->packed) {
+        return true;
+    }
+    uint16_t *buf = tile_buffer_alloc(false);
+    if (! buf) {
+        return false;
+    }
+    int n = LZ4_decompress_safe(d->packed, (char *)buf, d->packed_size,
+                                TILE_BUFFER_BYTES);
+    if (n != (int)TILE_BUFFER_BYTES) {
+        // Can't happen unless memory is corrupted. Don't make it worse.
+        tile_buffer_free(buf);
+        return false;
+    }
+    free(d->packed);
+    tile_packed_count--;
+    tile_packed_bytes -= d->packed_size;
+    tile_decompressions++;
+    d->packed = NULL;
+    d->packed_size = 0;
+    d->rgba = buf;
+    d->flags |= TILE_OWNS_BUFFER;
+#pragma omp atomic
+    tile_raw_count++;
+    return true;
+}
+
+
+// True if Python code other than the tile data itself can see the pixels
+
+static bool
+tile_data_in_use(const TileData *d)
+{
+    if (d->tile && Py_REFCNT(d->tile) > 1) {
+        return true;
+    }
+    if (d->array && Py_REFCNT(d->array) > (d->tile ? 2 : 1)) {
+        return true;
+    }
+    return false;
+}
+
+
+// Drops the pixels of tile data which has been packed or swapped out.
+
+static void
+tile_data_drop_pixels(TileData *d, std::vector<PyObject *> &retired)
+{
+    if (d->rgba) {
+#pragma omp atomic
+        tile_raw_count--;
+    }
+    if ((d->flags & TILE_OWNS_BUFFER) && d->rgba) {
+        tile_buffer_free(d->rgba);
+    }
+    if (d->tile) {
+        retired.push_back(d->tile);
+    }
+    if (d->array) {
+        retired.push_back(d->array);
+    }
+    d->flags &= ~(TILE_OWNS_BUFFER | TILE_WRAPPER_READONLY);
+    d->rgba = NULL;
+    d->tile = NULL;
+    d->array = NULL;
+}
+
+
+// Compresses tile data, if nothing else can see its pixels. Python tile
+// objects only referenced by the data are dropped. Returns true if the
+// data was compressed.
+
+static bool
+tile_data_pack(TileData *d, char *scratch, int scratch_size,
+               std::vector<PyObject *> &retired)
+{
+    if (d->packed || ! d->rgba || tile_data_in_use(d)) {
+        return false;
+    }
+    int n = LZ4_compress_default((const char *)d->rgba, scratch,
+                                 TILE_BUFFER_BYTES, scratch_size);
+    if (n <= 0 || n > TILE_PACKED_MAX_BYTES) {
+        // Doesn't compress well: leave it for a while
+        d->last_use = tile_clock;
+        return false;
+    }
+    char *packed = (char *)malloc(n);
+    if (! packed) {
+        return false;
+    }
+    memcpy(packed, scratch, n);
+    tile_data_drop_pixels(d, retired);
+    d->packed = packed;
+    d->packed_size = n;
+    tile_packed_count++;
+    tile_packed_bytes += n;
+    tile_compressions++;
+    return true;
+}
+
+
+// Moves tile data out to the swap file, if nothing else can see its
+// pixels. Data which isn't compressed yet is compressed on the way if
+// that helps. Returns true if the data was swapped out.
+
+static bool
+tile_data_swap_out(TileData *d, char *scratch, int scratch_size,
+                   std::vector<PyObject *> &retired)
+{
+    if (d->swap_slot >= 0 || ! (d->packed || d->rgba)) {
+        return false;
+    }
+    if (tile_data_in_use(d) || ! tile_swap_reserve()) {
+        return false;
+    }
+    const int slot = tile_swap_free.back();
+    tile_swap_free.pop_back();
+    tile_swapped_count++;
+    tile_swap_outs++;
+    char *dst = tile_swap_slot_data(slot);
+    if (d->packed) {
+        memcpy(dst, d->packed, d->packed_size);
+        free(d->packed);
+        tile_packed_count--;
+        tile_packed_bytes -= d->packed_size;
+        d->packed = NULL;
+    }
+    else {
+        int n = LZ4_compress_default((const char *)d->rgba, scratch,
+                                     TILE_BUFFER_BYTES, scratch_size);
+        if (n > 0 && n <= TILE_PACKED_MAX_BYTES) {
+            memcpy(dst, scratch, n);
+            d->packed_size = n;
+        }
+        else {
+            memcpy(dst, d->rgba, TILE_BUFFER_BYTES);
+            d->packed_size = 0;
+        }
+        tile_data_drop_pixels(d, retired);
+    }
+    d->swap_slot = slot;
+    return true;
+}
+
+
+// Drops a reference to tile data. Python objects are queued on retired
+// rather than released, so this is safe to call without the GIL.
+
+static void
+tile_data_unref(TileData *d, std::vector<PyObject *> &retired)
+{
+    if (--d->refs > 0) {
+        return;
+    }
+    tile_dedup_forget(d);
+    if (d->rgba) {
+#pragma omp atomic
+        tile_raw_count--;
+    }
+    if ((d->flags & TILE_OWNS_BUFFER) && d->rgba) {
+        tile_buffer_free(d->rgba);
+    }
+    if (d->packed) {
+        free(d->packed);
+        tile_packed_count--;
+        tile_packed_bytes -= d->packed_size;
+    }
+    if (d->swap_slot >= 0) {
+        tile_swap_slot_free(d->swap_slot);
+    }
+    if (d->tile) {
+        retired.push_back(d->tile);
+    }
+    if (d->array) {
+        retired.push_back(d->array);
+    }
+    free(d);
+}
+
+
+static inline bool
+tile_data_writable(const TileData *d)
+{
+    return d->refs == 1 && ! (d->flags & TILE_READONLY);
+}
+
+
+// Tile store
+
+enum {
+    ENTRY_EMPTY = 0,
+    ENTRY_USED,
+    ENTRY_DELETED
+};
+
+struct TileStore::Entry
+{
+    int tx;
+    int ty;
+    unsigned char state;
+    bool mipmap_dirty;   // mipmap tile which needs regenerating
+    TileData *data;      // NULL for dirty mipmap tiles
+};
+
+static const int TILE_STORE_MIN_CAPACITY = 64;
+
+// All live stores, for compressing cold tiles
+static TileStore *tile_store_list = NULL;
+
+
+static inline uint32_t
+tile_store_hash(int tx, int ty)
+{
+    uint32_t h = (uint32_t)tx * 0x9E3779B1u;
+    h ^= (uint32_t)ty + 0x7F4A7C15u + (h << 6) + (h >> 2);
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    return h;
+}
+
+
+// Integer division rounding towards negative infinity, like Python's //
+
+static inline int
+floor_div(int a, int b)
+{
+    int q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) {
+        --q;
+    }
+    return q;
+}
+
+
+static inline int
+floor_mod(int a, int b)
+{
+    return a - floor_div(a, b) * b;
+}
+
+
+TileStore::TileStore(PyObject *tile_factory,
+                     PyObject *mipmap_dirty_tile,
+                     PyObject *transparent_rgba)
+    : entries(NULL),
+      capacity(TILE_STORE_MIN_CAPACITY),
+      used(0),
+      filled(0),
+      tile_factory(tile_factory),
+      mipmap_dirty_tile(mipmap_dirty_tile),
+      transparent_rgba(transparent_rgba),
+      transparent_buf(NULL),
+      mipmap(NULL),
+      mipmap_level(0),
+      looped_tw(0),
+      looped_th(0),
+      load_pending(false),
+      is_snapshot(false),
+      owner(0),
+      journal_on(false),
+      journal_overflowed(false),
+      journal_max(0),
+      prev_store(NULL),
+      next_store(tile_store_list)
+{
+    if (tile_store_list) {
+        tile_store_list->prev_store = this;
+    }
+    tile_store_list = this;
+    entries = (Entry *)calloc(capacity, sizeof(Entry));
+    Py_INCREF(tile_factory);
+    Py_INCREF(mipmap_dirty_tile);
+    Py_INCREF(transparent_rgba);
+    transparent_buf = tile_array_data(transparent_rgba, false);
+}
+
+
+TileStore::~TileStore()
+{
+    if (prev_store) {
+        prev_store->next_store = next_store;
+    }
+    else {
+        tile_store_list = next_store;
+    }
+    if (next_store) {
+        next_store->prev_store = prev_store;
+    }
+    for (int i = 0; i < capacity; ++i) {
+        if (entries[i].state == ENTRY_USED) {
+            retire(&entries[i]);
+        }
+    }
+    free(entries);
+    entries = NULL;
+    // The mipmap store may already be gone.
+    release_own_retired();
+    Py_DECREF(tile_factory);
+    Py_DECREF(mipmap_dirty_tile);
+    Py_DECREF(transparent_rgba);
+}
+
+
+TileStore::Entry *
+TileStore::find(int tx, int ty)
+{
+    const uint32_t mask = capacity - 1;
+    uint32_t i = tile_store_hash(tx, ty) & mask;
+    while (true) {
+        Entry *e = &entries[i];
+        if (e->state == ENTRY_EMPTY) {
+            return NULL;
+        }
+        if (e->state == ENTRY_USED && e->tx == tx && e->ty == ty) {
+            return e;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+
+// Adds a new, blank entry. The caller must check that there's no existing
+// entry for the coordinates first. Existing entry pointers are invalidated.
+
+TileStore::Entry *
+TileStore::insert(int tx, int ty)
+{
+    if ((filled + 1) * 4 > capacity * 3) {
+        grow();
+    }
+    const uint32_t mask = capacity - 1;
+    uint32_t i = tile_store_hash(tx, ty) & mask;
+    while (entries[i].state == ENTRY_USED) {
+        i = (i + 1) & mask;
+    }
+    Entry *e = &entries[i];
+    if (e->state == ENTRY_EMPTY) {
+        ++filled;
+    }
+    ++used;
+    e->tx = tx;
+    e->ty = ty;
+    e->state = ENTRY_USED;
+    e->mipmap_dirty = false;
+    e->data = NULL;
+    return e;
+}
+
+
+// Removes an entry after its contents have been retired.
+
+void
+TileStore::erase(Entry *e)
+{
+    e->state = ENTRY_DELETED;
+    --used;
+}
+
+
+// Rehashes into a bigger table, or just clears out deleted entries if
+// the table isn't very full of live ones.
+
+void
+TileStore::grow()
+{
+    int new_capacity = capacity;
+    while ((used + 1) * 2 > new_capacity) {
+        new_capacity *= 2;
+    }
+    Entry *old_entries = entries;
+    int old_capacity = capacity;
+    Entry *new_entries = (Entry *)calloc(new_capacity, sizeof(Entry));
+    if (! new_entries) {
+        // Keep going at a higher load factor. Inserting still works
+        // while there's at least one free slot.
+        return;
+    }
+    const uint32_t mask = new_capacity - 1;
+    for (int j = 0; j < old_capacity; ++j) {
+        const Entry *src = &old_entries[j];
+        if (src->state != ENTRY_USED) {
+            continue;
+        }
+        uint32_t i = tile_store_hash(src->tx, src->ty) & mask;
+        while (new_entries[i].state != ENTRY_EMPTY) {
+            i = (i + 1) & mask;
+        }
+        new_entries[i] = *src;
+    }
+    free(old_entries);
+    entries = new_entries;
+    capacity = new_capacity;
+    filled = used;
+}
+
+
+// Drops an entry's tile data. Python objects are queued for release by
+// release_retired(), so this is safe to call without the GIL.
+
+void
+TileStore::retire(Entry *e)
+{
+    if (e->data) {
+        tile_data_unref(e->data, retired);
+    }
+    e->data = NULL;
+    e->mipmap_dirty = false;
+}
+
+
+void
+TileStore::release_own_retired()
+{
+    if (retired.empty()) {
+        return;
+    }
+    std::vector<PyObject *> objs;
+    objs.swap(retired);
+    for (size_t i = 0; i < objs.size(); ++i) {
+        Py_DECREF(objs[i]);
+    }
+}
+
+
+void
+TileStore::release_retired()
+{
+    for (TileStore *s = this; s; s = s->mipmap) {
+        s->release_own_retired();
+    }
+}
+
+
+// Makes sure tile data has a Python tile object, and that the object is
+// marked read-only if the data is shared. Tiles handed out by snapshots
+// are frozen, since Python may hold on to them after the snapshot is gone.
+
+bool
+TileStore::wrap(TileData *d)
+{
+    if (is_snapshot) {
+        d->flags |= TILE_READONLY;
+    }
+    d->last_use = tile_clock;
+    if (! tile_data_unpack(d)) {
+        PyErr_NoMemory();
+        return false;
+    }
+    const bool readonly = ! tile_data_writable(d);
+    if (! readonly) {
+        // Python may change the pixels now
+        tile_dedup_forget(d);
+    }
+    if (d->tile) {
+        if (readonly && ! (d->flags & TILE_WRAPPER_READONLY)) {
+            if (PyObject_SetAttrString(d->tile, "readonly", Py_True) < 0) {
+                return false;
+            }
+            d->flags |= TILE_WRAPPER_READONLY;
+        }
+        return true;
+    }
+    if (! d->array) {
+        assert(d->flags & TILE_OWNS_BUFFER);
+        PyObject *arr = tile_buffer_wrap(d->rgba);
+        if (! arr) {
+            return false;
+        }
+        d->flags &= ~TILE_OWNS_BUFFER;
+        d->array = arr;
+    }
+    PyObject *tile = PyObject_CallFunctionObjArgs(tile_factory, d->array,
+                                                  readonly ? Py_True : Py_False,
+                                                  NULL);
+    if (! tile) {
+        return false;
+    }
+    d->tile = tile;
+    if (readonly) {
+        d->flags |= TILE_WRAPPER_READONLY;
+    }
+    return true;
+}
+
+
+void
+TileStore::wrap_coords(int &tx, int &ty)
+{
+    if (looped_tw > 0 && looped_th > 0) {
+        tx = floor_mod(tx, looped_tw);
+        ty = floor_mod(ty, looped_th);
+    }
+}
+
+
+PyObject *
+TileStore::get(int tx, int ty)
+{
+    release_retired();
+    Entry *e = find(tx, ty);
+    if (! e) {
+        Py_RETURN_NONE;
+    }
+    if (e->mipmap_dirty) {
+        Py_INCREF(mipmap_dirty_tile);
+        return mipmap_dirty_tile;
+    }
+    if (! wrap(e->data)) {
+        return NULL;
+    }
+    Py_INCREF(e->data->tile);
+    return e->data->tile;
+}
+
+
+void
+TileStore::set(int tx, int ty, PyObject *tile,
+               PyObject *rgba, bool readonly)
+{
+    if (tile == mipmap_dirty_tile) {
+        set_mipmap_dirty(tx, ty);
+        release_retired();
+        return;
+    }
+    unsigned char flags = 0;
+    if (readonly) {
+        flags = TILE_READONLY | TILE_WRAPPER_READONLY;
+    }
+    TileData *d = tile_data_new(tile_array_data(rgba, !readonly), flags);
+    if (! d) {
+        PyErr_NoMemory();
+        return;
+    }
+    Py_INCREF(tile);
+    d->tile = tile;
+    if (d->rgba) {
+        Py_INCREF(rgba);
+        d->array = rgba;
+    }
+    Entry *e = find(tx, ty);
+    if (e) {
+        retire(e);
+    }
+    else {
+        e = insert(tx, ty);
+    }
+    e->data = d;
+    journal_add(tx, ty);
+    release_retired();
+}
+
+
+bool
+TileStore::remove(int tx, int ty)
+{
+    Entry *e = find(tx, ty);
+    if (! e) {
+        return false;
+    }
+    retire(e);
+    erase(e);
+    journal_add(tx, ty);
+    release_retired();
+    return true;
+}
+
+
+bool
+TileStore::contains(int tx, int ty)
+{
+    return find(tx, ty) != NULL;
+}
+
+
+int
+TileStore::size()
+{
+    return used;
+}
+
+
+void
+TileStore::clear()
+{
+    for (int i = 0; i < capacity; ++i) {
+        if (entries[i].state == ENTRY_USED) {
+            journal_add(entries[i].tx, entries[i].ty);
+            retire(&entries[i]);
+        }
+    }
+    if (capacity != TILE_STORE_MIN_CAPACITY) {
+        Entry *new_entries = (Entry *)calloc(TILE_STORE_MIN_CAPACITY,
+                                             sizeof(Entry));
+        if (new_entries) {
+            free(entries);
+            entries = new_entries;
+            capacity = TILE_STORE_MIN_CAPACITY;
+        }
+    }
+    memset(entries, 0, capacity * sizeof(Entry));
+    used = 0;
+    filled = 0;
+    release_retired();
+}
+
+
+PyObject *
+TileStore::keys()
+{
+    release_retired();
+    PyObject *result = PyList_New(used);
+    if (! result) {
+        return NULL;
+    }
+    int n = 0;
+    for (int i = 0; i < capacity; ++i) {
+        const Entry *e = &entries[i];
+        if (e->state != ENTRY_USED) {
+            continue;
+        }
+        PyObject *key = Py_BuildValue("(ii)", e->tx, e->ty);
+        if (! key) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, n++, key);
+    }
+    assert(n == used);
+    return result;
+}
+
+
+PyObject *
+TileStore::items()
+{
+    release_retired();
+    // Wrapping calls Python, so collect everything first.
+    for (int i = 0; i < capacity; ++i) {
+        Entry *e = &entries[i];
+        if (e->state != ENTRY_USED || e->mipmap_dirty) {
+            continue;
+        }
+        if (! wrap(e->data)) {
+            return NULL;
+        }
+    }
+    PyObject *result = PyList_New(used);
+    if (! result) {
+        return NULL;
+    }
+    int n = 0;
+    for (int i = 0; i < capacity; ++i) {
+        const Entry *e = &entries[i];
+        if (e->state != ENTRY_USED) {
+            continue;
+        }
+        PyObject *tile = e->mipmap_dirty ? mipmap_dirty_tile : e->data->tile;
+        PyObject *item = Py_BuildValue("((ii)O)", e->tx, e->ty, tile);
+        if (! item) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, n++, item);
+    }
+    assert(n == used);
+    return result;
+}
+
+
+void
+TileStore::freeze(int tx, int ty)
+{
+    Entry *e = find(tx, ty);
+    if (! e || e->mipmap_dirty) {
+        return;
+    }
+    TileData *d = e->data;
+    d->flags |= TILE_READONLY;
+    if (d->tile && ! (d->flags & TILE_WRAPPER_READONLY)) {
+        if (PyObject_SetAttrString(d->tile, "readonly", Py_True) < 0) {
+            PyErr_WriteUnraisable(d->tile);
+        }
+        d->flags |= TILE_WRAPPER_READONLY;
+    }
+    dedup(e);
+    release_retired();
+}
+
+
+void
+TileStore::freeze_all()
+{
+    for (int i = 0; i < capacity; ++i) {
+        Entry *e = &entries[i];
+        if (e->state == ENTRY_USED) {
+            freeze(e->tx, e->ty);
+        }
+    }
+}
+
+
+// Copies the entries of another store, sharing their tile data.
+// Returns false if out of memory.
+
+bool
+TileStore::copy_entries_from(const TileStore *src)
+{
+    Entry *new_entries = (Entry *)malloc(src->capacity * sizeof(Entry));
+    if (! new_entries) {
+        return false;
+    }
+    memcpy(new_entries, src->entries, src->capacity * sizeof(Entry));
+    for (int i = 0; i < src->capacity; ++i) {
+        if (new_entries[i].state == ENTRY_USED && new_entries[i].data) {
+            new_entries[i].data->refs++;
+        }
+    }
+    for (int i = 0; i < capacity; ++i) {
+        if (entries[i].state == ENTRY_USED) {
+            retire(&entries[i]);
+        }
+    }
+    free(entries);
+    entries = new_entries;
+    capacity = src->capacity;
+    used = src->used;
+    filled = src->filled;
+    return true;
+}
+
+
+TileStore *
+TileStore::snapshot()
+{
+    release_retired();
+    TileStore *sshot = new TileStore(tile_factory, mipmap_dirty_tile,
+                                     transparent_rgba);
+    if (! sshot->copy_entries_from(this)) {
+        delete sshot;
+        return NULL;
+    }
+    sshot->is_snapshot = true;
+    // Everything is shared now, so look for duplicates in both.
+    dedup_all();
+    sshot->dedup_all();
+    return sshot;
+}
+
+
+static inline bool
+tile_store_same_tile(const TileData *a, const TileData *b)
+{
+    if (a == b) {
+        return true;
+    }
+    if (! a || ! b) {
+        return false;
+    }
+    return a->tile && a->tile == b->tile;
+}
+
+
+PyObject *
+TileStore::diff(TileStore *other)
+{
+    PyObject *result = PyList_New(0);
+    if (! result) {
+        return NULL;
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        TileStore *a = pass ? other : this;
+        TileStore *b = pass ? this : other;
+        for (int i = 0; i < a->capacity; ++i) {
+            const Entry *e = &a->entries[i];
+            if (e->state != ENTRY_USED) {
+                continue;
+            }
+            const Entry *o = b->find(e->tx, e->ty);
+            if (o) {
+                // Only report mismatches once, in the first pass.
+                if (pass || tile_store_same_tile(e->data, o->data)) {
+                    continue;
+                }
+            }
+            PyObject *key = Py_BuildValue("(ii)", e->tx, e->ty);
+            if (! key || PyList_Append(result, key) < 0) {
+                Py_XDECREF(key);
+                Py_DECREF(result);
+                return NULL;
+            }
+            Py_DECREF(key);
+        }
+    }
+    return result;
+}
+
+
+PyObject *
+TileStore::restore(TileStore *sshot)
+{
+    release_retired();
+    PyObject *changed = diff(sshot);
+    if (! changed || PyList_GET_SIZE(changed) == 0) {
+        return changed;
+    }
+    if (! copy_entries_from(sshot)) {
+        Py_DECREF(changed);
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(changed); ++i) {
+        PyObject *pos = PyList_GET_ITEM(changed, i);
+        journal_add(PyInt_AsLong(PyTuple_GET_ITEM(pos, 0)),
+                    PyInt_AsLong(PyTuple_GET_ITEM(pos, 1)));
+    }
+    release_retired();
+    return changed;
+}
+
+
+void
+TileStore::share(int tx, int ty, TileStore *src, int src_tx, int src_ty)
+{
+    Entry *s = src->find(src_tx, src_ty);
+    TileData *d = NULL;
+    if (s && ! s->mipmap_dirty) {
+        d = s->data;
+        d->refs++;
+    }
+    Entry *e = find(tx, ty);
+    if (e) {
+        retire(e);
+        if (! d) {
+            erase(e);
+        }
+    }
+    else if (d) {
+        e = insert(tx, ty);
+    }
+    if (d) {
+        e->data = d;
+    }
+    journal_add(tx, ty);
+    release_retired();
+}
+
+
+PyObject *
+TileStore::data_id(int tx, int ty)
+{
+    wrap_coords(tx, ty);
+    const Entry *e = find(tx, ty);
+    if (! e || e->mipmap_dirty) {
+        return PyLong_FromLong(0);
+    }
+    return PyLong_FromUnsignedLongLong(e->data->id);
+}
+
+
+PyObject *
+TileStore::data_ids()
+{
+    PyObject *result = PyDict_New();
+    if (! result) {
+        return NULL;
+    }
+    for (int i = 0; i < capacity; ++i) {
+        const Entry *e = &entries[i];
+        if (e->state != ENTRY_USED || e->mipmap_dirty) {
+            continue;
+        }
+        PyObject *key = Py_BuildValue("(ii)", e->tx, e->ty);
+        PyObject *id = PyLong_FromUnsignedLongLong(e->data->id);
+        if (! key || ! id || PyDict_SetItem(result, key, id) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(id);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(id);
+    }
+    return result;
+}
+
+
+// Tile journal
+
+void
+TileStore::journal_add(int tx, int ty)
+{
+    if (! journal_on || journal_overflowed) {
+        return;
+    }
+    journal.insert(std::make_pair(tx, ty));
+    if ((int)journal.size() > journal_max) {
+        journal_overflowed = true;
+        journal.clear();
+    }
+}
+
+
+void
+TileStore::mark_written(int tx, int ty)
+{
+    wrap_coords(tx, ty);
+    journal_add(tx, ty);
+}
+
+
+PyObject *
+TileStore::take_journal(int max_tiles)
+{
+    PyObject *result = NULL;
+    if (journal_on && ! journal_overflowed) {
+        result = PyList_New(0);
+        if (! result) {
+            return NULL;
+        }
+        std::set<std::pair<int, int> >::const_iterator it;
+        for (it = journal.begin(); it != journal.end(); ++it) {
+            PyObject *key = Py_BuildValue("(ii)", it->first, it->second);
+            if (! key || PyList_Append(result, key) < 0) {
+                Py_XDECREF(key);
+                Py_DECREF(result);
+                return NULL;
+            }
+            Py_DECREF(key);
+        }
+    }
+    journal.clear();
+    journal_on = true;
+    journal_overflowed = false;
+    journal_max = max_tiles;
+    if (! result) {
+        Py_RETURN_NONE;
+    }
+    return result;
+}
+
+
+// Points an entry at identical indexed tile data, if there is any. Only
+// data which can't be written to is considered. Returns true if the
+// entry's data was replaced.
+
+bool
+TileStore::dedup(Entry *e)
+{
+    if (! tile_dedup_enabled || ! e->data) {
+        return false;
+    }
+    TileData *d = e->data;
+    if ((d->flags & TILE_INDEXED) || ! d->rgba) {
+        return false;
+    }
+    if (tile_data_writable(d) && ! is_snapshot) {
+        return false;
+    }
+    if (! (d->flags & TILE_HASHED)) {
+        if (tile_data_in_use(d)) {
+            // Python might still change it through an old reference
+            return false;
+        }
+        d->hash = tile_hash(d->rgba);
+        d->flags |= TILE_HASHED;
+        tile_dedup_hashed++;
+    }
+    std::map<uint64_t, TileData *>::iterator it
+        = tile_dedup_index.find(d->hash);
+    if (it == tile_dedup_index.end()) {
+        tile_dedup_index[d->hash] = d;
+        d->flags |= TILE_INDEXED;
+        return false;
+    }
+    TileData *c = it->second;
+    if (! c->rgba || tile_data_in_use(d)) {
+        return false;
+    }
+    if (memcmp(c->rgba, d->rgba, TILE_BUFFER_BYTES) != 0) {
+        tile_dedup_collisions++;
+        return false;
+    }
+    c->refs++;
+    c->flags |= (d->flags & TILE_READONLY);
+    c->last_use = std::max(c->last_use, d->last_use);
+    e->data = c;
+    if (d->refs == 1) {
+        tile_dedup_freed++;
+    }
+    tile_data_unref(d, retired);
+    tile_dedup_hits++;
+    return true;
+}
+
+
+void
+TileStore::dedup_all()
+{
+    if (! tile_dedup_enabled) {
+        return;
+    }
+    for (int i = 0; i < capacity; ++i) {
+        Entry *e = &entries[i];
+        if (e->state == ENTRY_USED && ! e->mipmap_dirty) {
+            dedup(e);
+        }
+    }
+    release_retired();
+}
+
+
+void
+TileStore::set_mipmap(TileStore *mipmap)
+{
+    this->mipmap = mipmap;
+    if (mipmap) {
+        mipmap->mipmap_level = mipmap_level + 1;
+    }
+}
+
+
+void
+TileStore::set_mipmap_dirty(int tx, int ty)
+{
+    Entry *e = find(tx, ty);
+    if (e) {
+        retire(e);
+    }
+    else {
+        e = insert(tx, ty);
+    }
+    e->mipmap_dirty = true;
+}
+
+
+// Flags the tiles covering (tx, ty) in all the lower resolution levels.
+
+void
+TileStore::mark_mipmap_dirty(int tx, int ty)
+{
+    int level = 1;
+    for (TileStore *m = mipmap; m; m = m->mipmap, ++level) {
+        const int mtx = floor_div(tx, 1 << level);
+        const int mty = floor_div(ty, 1 << level);
+        Entry *e = m->find(mtx, mty);
+        if (e && e->mipmap_dirty) {
+            break;
+        }
+        m->set_mipmap_dirty(mtx, mty);
+    }
+}
+
+
+void
+TileStore::set_looped(int looped_tw, int looped_th)
+{
+    this->looped_tw = looped_tw;
+    this->looped_th = looped_th;
+}
+
+
+void
+TileStore::set_owner(int owner)
+{
+    this->owner = (owner > 0) ? owner : 0;
+}
+
+
+void
+TileStore::set_load_pending(bool pending)
+{
+    load_pending = pending;
+}
+
+
+uint16_t *
+TileStore::request(int tx, int ty, bool readonly)
+{
+    if (load_pending) {
+        return NULL;
+    }
+    wrap_coords(tx, ty);
+    Entry *e = find(tx, ty);
+    if (e && ! e->mipmap_dirty) {
+        e->data->last_use = tile_clock;
+        if (! tile_data_unpack(e->data)) {
+            return NULL;
+        }
+    }
+    if (readonly) {
+        if (! e) {
+            return transparent_buf;
+        }
+        if (e->mipmap_dirty) {
+            return NULL;
+        }
+        return e->data->rgba;
+    }
+    if (! e) {
+        uint16_t *buf = tile_buffer_alloc(true);
+        if (! buf) {
+            return NULL;
+        }
+        TileData *d = tile_data_new(buf, TILE_OWNS_BUFFER);
+        if (! d) {
+            tile_buffer_free(buf);
+            return NULL;
+        }
+        e = insert(tx, ty);
+        e->data = d;
+    }
+    else if (e->mipmap_dirty || ! e->data->rgba) {
+        return NULL;
+    }
+    else if (! tile_data_writable(e->data)) {
+        // Shared with a snapshot, or frozen: write to a private copy
+        uint16_t *buf = tile_buffer_alloc(false);
+        if (! buf) {
+            return NULL;
+        }
+        TileData *d = tile_data_new(buf, TILE_OWNS_BUFFER);
+        if (! d) {
+            tile_buffer_free(buf);
+            return NULL;
+        }
+        memcpy(buf, e->data->rgba, TILE_BUFFER_BYTES);
+        retire(e);
+        e->data = d;
+    }
+    else {
+        tile_dedup_forget(e->data);
+    }
+    mark_mipmap_dirty(tx, ty);
+    journal_add(tx, ty);
+    return e->data->rgba;
+}
+
+
+PyObject *
+TileStore::request_rgba(int tx, int ty, bool readonly)
+{
+    release_retired();
+    if (! request(tx, ty, readonly)) {
+        Py_RETURN_NONE;
+    }
+    wrap_coords(tx, ty);
+    Entry *e = find(tx, ty);
+    if (! e) {
+        Py_INCREF(transparent_rgba);
+        return transparent_rgba;
+    }
+    if (! wrap(e->data)) {
+        return NULL;
+    }
+    Py_INCREF(e->data->array);
+    return e->data->array;
+}
+
+
+void
+TileStore::adopt_rgba(int tx, int ty, PyObject *rgba)
+{
+    wrap_coords(tx, ty);
+    Entry *e = find(tx, ty);
+    if (! e || e->mipmap_dirty) {
+        return;
+    }
+    PyObject *tile = e->data->tile;
+    if (e->data->rgba || ! tile) {
+        return;
+    }
+    // Only the tile's own pixels: 8-bit tiles hand out widened copies.
+    // Asking runs Python, which may let other threads change the store,
+    // so the entry is looked up again afterwards.
+    Py_INCREF(tile);
+    PyObject *loaded = PyObject_GetAttrString(tile, "loaded_rgba");
+    Py_XDECREF(loaded);
+    if (loaded != rgba) {
+        PyErr_Clear();
+        Py_DECREF(tile);
+        return;
+    }
+#pragma omp critical
+    {
+        e = find(tx, ty);
+        TileData *d = e ? e->data : NULL;
+        if (d && ! e->mipmap_dirty && d->tile == tile && ! d->rgba) {
+            d->rgba = tile_array_data(rgba, tile_data_writable(d));
+            if (d->rgba) {
+                Py_INCREF(rgba);
+                d->array = rgba;
+#pragma omp atomic
+                tile_raw_count++;
+            }
+        }
+    }
+    Py_DECREF(tile);
+}
+
+
+// Compression of cold tiles
+
+// Bytes of raw pixels held by tile data in stores
+
+static size_t
+tile_raw_bytes()
+{
+    long n = tile_raw_count;
+    return (n > 0) ? (size_t)n * TILE_BUFFER_BYTES : 0;
+}
+
+
+void
+tile_compression_configure(int idle_ticks, double budget_mib)
+{
+    tile_compression_idle_ticks = (idle_ticks > 0) ? idle_ticks : 0;
+    tile_compression_budget = (budget_mib > 0)
+        ? (size_t)(budget_mib * 1024 * 1024) : 0;
+}
+
+
+int
+TileStore::compress_cold(char *scratch, int scratch_size)
+{
+    int packed = 0;
+    // Count the freed memory here, as the budget is checked per tile.
+    size_t in_use = tile_raw_bytes();
+    for (int i = 0; i < capacity; ++i) {
+        if (in_use <= tile_compression_budget) {
+            break;
+        }
+        Entry *e = &entries[i];
+        if (e->state != ENTRY_USED || ! e->data) {
+            continue;
+        }
+        TileData *d = e->data;
+        if (tile_clock - d->last_use < tile_compression_idle_ticks) {
+            continue;
+        }
+        if (tile_data_pack(d, scratch, scratch_size, retired)) {
+            packed++;
+            in_use -= std::min(in_use, TILE_BUFFER_BYTES);
+        }
+    }
+    release_own_retired();
+    return packed;
+}
+
+
+int
+tile_compression_tick()
+{
+    tile_clock++;
+    if (! tile_compression_idle_ticks || tile_painting_count > 0) {
+        return 0;
+    }
+    if (tile_raw_bytes() <= tile_compression_budget) {
+        return 0;
+    }
+    const int scratch_size = LZ4_compressBound(TILE_BUFFER_BYTES);
+    char *scratch = (char *)malloc(scratch_size);
+    if (! scratch) {
+        return 0;
+    }
+    int packed = 0;
+    // Keep out tile requests from other threads while tiles are packed.
+#pragma omp critical
+    {
+        for (TileStore *s = tile_store_list; s; s = s->next_store) {
+            packed += s->compress_cold(scratch, scratch_size);
+        }
+    }
+    free(scratch);
+    return packed;
+}
+
+
+PyObject *
+tile_compression_stats()
+{
+    return Py_BuildValue(
+        "{s:n,s:l,s:n,s:n,s:l,s:l,s:I}",
+        "raw_bytes", (Py_ssize_t)tile_raw_bytes(),
+        "packed_tiles", tile_packed_count,
+        "packed_bytes", (Py_ssize_t)tile_packed_bytes,
+        "unpacked_bytes", (Py_ssize_t)(tile_packed_count * TILE_BUFFER_BYTES),
+        "compressions", tile_compressions,
+        "decompressions", tile_decompressions,
+        "clock", tile_clock
+    );
+}
+
+
+// Tile file records
+
+PyObject *
+tile_record_compress(PyObject *rgba)
+{
+    const uint16_t *src = tile_array_data(rgba, false);
+    if (! src) {
+        PyErr_SetString(PyExc_ValueError,
+                        "rgba must be a contiguous NxNx4 uint16 array");
+        return NULL;
+    }
+    const int scratch_size = LZ4_compressBound(TILE_BUFFER_BYTES);
+    char *scratch = (char *)malloc(scratch_size);
+    if (! scratch) {
+        return PyErr_NoMemory();
+    }
+    const int n = LZ4_compress_default((const char *)src, scratch,
+                                       TILE_BUFFER_BYTES, scratch_size);
+    PyObject *result = NULL;
+    if (n > 0) {
+        result = PyString_FromStringAndSize(scratch, n);
+    }
+    else {
+        PyErr_SetString(PyExc_RuntimeError, "LZ4 compression failed");
+    }
+    free(scratch);
+    return result;
+}
+
+
+PyObject *
+tile_record_decompress(PyObject *data)
+{
+    char *src = NULL;
+    Py_ssize_t size = 0;
+    if (PyString_AsStringAndSize(data, &src, &size) < 0) {
+        return NULL;
+    }
+    PyObject *arr = tile_buffer_empty_rgba16();
+    if (! arr) {
+        return NULL;
+    }
+    char *dst = (char *)PyArray_DATA((PyArrayObject *)arr);
+    const int n = LZ4_decompress_safe(src, dst, (int)size,
+                                      TILE_BUFFER_BYTES);
+    if (n != TILE_BUFFER_BYTES) {
+        Py_DECREF(arr);
+        PyErr_SetString(PyExc_ValueError, "malformed tile record");
+        return NULL;
+    }
+    return arr;
+}
+
+
+// Tile swap file
+
+bool
+tile_swap_open(const char *path)
+{
+#if defined(_WIN32)
+    return false;
+#else
+    if (tile_swap_fd >= 0) {
+        return true;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    // Nobody else needs to see the file, and it shouldn't outlive us.
+    unlink(path);
+    tile_swap_fd = fd;
+    return true;
+#endif
+}
+
+
+void
+tile_swap_configure(double budget_mib)
+{
+    tile_swap_budget = (budget_mib > 0)
+        ? (size_t)(budget_mib * 1024 * 1024) : 0;
+}
+
+
+// Memory used by tile data which could be swapped out
+
+static size_t
+tile_swap_bytes_in_memory()
+{
+    return tile_raw_bytes() + tile_packed_bytes;
+}
+
+
+// Orders swap candidates by age, oldest first
+
+struct TileSwapCandidateOlder
+{
+    bool operator()(const std::pair<unsigned int, TileData *> &a,
+                    const std::pair<unsigned int, TileData *> &b) const
+    {
+        return a.first > b.first;
+    }
+};
+
+
+int
+tile_swap_evict()
+{
+    if (! tile_swap_budget || tile_swap_fd < 0 || tile_painting_count > 0) {
+        return 0;
+    }
+    if (tile_swap_bytes_in_memory() <= tile_swap_budget) {
+        return 0;
+    }
+    const int scratch_size = LZ4_compressBound(TILE_BUFFER_BYTES);
+    char *scratch = (char *)malloc(scratch_size);
+    if (! scratch) {
+        return 0;
+    }
+    int evicted = 0;
+    std::vector<PyObject *> retired;
+    // Keep out tile requests from other threads while tiles are moved.
+#pragma omp critical
+    {
+        // Least recently used first. Data shared between stores shows
+        // up more than once, but is only swapped out the first time.
+        std::vector<std::pair<unsigned int, TileData *> > candidates;
+        for (TileStore *s = tile_store_list; s; s = s->next_store) {
+            for (int i = 0; i < s->capacity; ++i) {
+                const TileStore::Entry *e = &s->entries[i];
+                if (e->state != ENTRY_USED || ! e->data) {
+                    continue;
+                }
+                TileData *d = e->data;
+                if (d->swap_slot >= 0 || ! (d->packed || d->rgba)) {
+                    continue;
+                }
+                unsigned int age = tile_clock - d->last_use;
+                candidates.push_back(std::make_pair(age, d));
+            }
+        }
+        std::stable_sort(candidates.begin(), candidates.end(),
+                         TileSwapCandidateOlder());
+        // Buffers owned by Python arrays are only freed once the arrays
+        // are released, so count the freed memory here.
+        size_t in_memory = tile_swap_bytes_in_memory();
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            if (in_memory <= tile_swap_budget) {
+                break;
+            }
+            TileData *d = candidates[i].second;
+            const size_t size = d->packed ? d->packed_size : TILE_BUFFER_BYTES;
+            if (tile_data_swap_out(d, scratch, scratch_size, retired)) {
+                evicted++;
+                in_memory -= std::min(in_memory, size);
+            }
+        }
+    }
+    free(scratch);
+    for (size_t i = 0; i < retired.size(); ++i) {
+        Py_DECREF(retired[i]);
+    }
+    return evicted;
+}
+
+
+void
+TileStore::prefetch(int tx0, int ty0, int tx1, int ty1)
+{
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            int wtx = tx;
+            int wty = ty;
+            wrap_coords(wtx, wty);
+            Entry *e = find(wtx, wty);
+            if (! e || ! e->data) {
+                continue;
+            }
+            TileData *d = e->data;
+            d->last_use = tile_clock;
+#if defined(MADV_WILLNEED)
+            if (d->swap_slot >= 0) {
+                // Page it in now, without waiting for it
+                size_t n = d->packed_size ? d->packed_size : TILE_BUFFER_BYTES;
+                madvise(tile_swap_slot_data(d->swap_slot), n, MADV_WILLNEED);
+            }
+#endif
+        }
+    }
+}
+
+
+void
+tile_swap_prefetch(int x, int y, int w, int h, int mipmap_level)
+{
+    if (tile_swap_fd < 0 || w <= 0 || h <= 0) {
+        return;
+    }
+    // Painting threads use the critical section without the GIL, so
+    // don't wait for it while they're busy: tile_painting_end() will.
+    if (tile_painting_count > 0) {
+        std::vector<TileSwapPrefetch> &pending = tile_swap_prefetch_pending;
+        if (pending.size() >= TILE_SWAP_PREFETCH_MAX_PENDING) {
+            pending.erase(pending.begin());
+        }
+        const TileSwapPrefetch p = {x, y, w, h, mipmap_level};
+        pending.push_back(p);
+        return;
+    }
+    const int scale = 1 << mipmap_level;
+    const int tile_size = MYPAINTLIB_TILE_SIZE * scale;
+    const int tx0 = floor_div(x, tile_size);
+    const int ty0 = floor_div(y, tile_size);
+    const int tx1 = floor_div(x + w - 1, tile_size);
+    const int ty1 = floor_div(y + h - 1, tile_size);
+#pragma omp critical
+    {
+        for (TileStore *s = tile_store_list; s; s = s->next_store) {
+            if (s->mipmap_level == mipmap_level && ! s->is_snapshot) {
+                s->prefetch(tx0, ty0, tx1, ty1);
+            }
+        }
+    }
+}
+
+
+PyObject *
+tile_swap_stats()
+{
+    return Py_BuildValue(
+        "{s:O,s:l,s:n,s:l,s:l}",
+        "open", (tile_swap_fd >= 0) ? Py_True : Py_False,
+        "swapped_tiles", tile_swapped_count,
+        "file_bytes", (Py_ssize_t)(tile_swap_slots * TILE_BUFFER_BYTES),
+        "swap_outs", tile_swap_outs,
+        "swap_ins", tile_swap_ins
+    );
+}
+
+
+// Undo history
+
+// Orders (data, owner) pairs by data, newest owner first
+
+struct TileHistoryRefLess
+{
+    bool operator()(const std::pair<TileData *, int> &a,
+                    const std::pair<TileData *, int> &b) const
+    {
+        if (a.first != b.first) {
+            return a.first < b.first;
+        }
+        return a.second > b.second;
+    }
+};
+
+
+void
+TileStore::collect_history(std::vector<std::pair<TileData *, int> > &out)
+{
+    std::vector<std::pair<TileData *, int> > refs;
+    for (TileStore *s = tile_store_list; s; s = s->next_store) {
+        if (! s->owner) {
+            continue;
+        }
+        for (int i = 0; i < s->capacity; ++i) {
+            const Entry *e = &s->entries[i];
+            if (e->state == ENTRY_USED && e->data) {
+                refs.push_back(std::make_pair(e->data, s->owner));
+            }
+        }
+    }
+    std::sort(refs.begin(), refs.end(), TileHistoryRefLess());
+    // Data is only the history's if all its references were seen
+    size_t i = 0;
+    while (i < refs.size()) {
+        size_t j = i;
+        while (j < refs.size() && refs[j].first == refs[i].first) {
+            ++j;
+        }
+        if ((int)(j - i) == refs[i].first->refs) {
+            out.push_back(refs[i]);
+        }
+        i = j;
+    }
+}
+
+
+// Memory used by tile data, not counting the swap file
+
+static size_t
+tile_data_bytes_in_memory(const TileData *d)
+{
+    if (d->packed) {
+        return d->packed_size;
+    }
+    if (d->rgba && d->swap_slot < 0) {
+        return TILE_BUFFER_BYTES;
+    }
+    return 0;
+}
+
+
+PyObject *
+tile_history_usage()
+{
+    std::vector<std::pair<TileData *, int> > history;
+    TileStore::collect_history(history);
+    std::map<int, size_t> usage;
+    for (size_t i = 0; i < history.size(); ++i) {
+        usage[history[i].second] += tile_data_bytes_in_memory(history[i].first);
+    }
+    PyObject *result = PyDict_New();
+    if (! result) {
+        return NULL;
+    }
+    std::map<int, size_t>::const_iterator it;
+    for (it = usage.begin(); it != usage.end(); ++it) {
+        PyObject *key = PyInt_FromLong(it->first);
+        PyObject *val = PyLong_FromSize_t(it->second);
+        if (! key || ! val || PyDict_SetItem(result, key, val) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(val);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(val);
+    }
+    return result;
+}
+
+
+// Compresses or swaps out the history's tile data up to max_owner
+
+static int
+tile_history_shrink(int max_owner, bool spill)
+{
+    if ((spill && tile_swap_fd < 0) || tile_painting_count > 0) {
+        return 0;
+    }
+    const int scratch_size = LZ4_compressBound(TILE_BUFFER_BYTES);
+    char *scratch = (char *)malloc(scratch_size);
+    if (! scratch) {
+        return 0;
+    }
+    int n = 0;
+    std::vector<PyObject *> retired;
+#pragma omp critical
+    {
+        std::vector<std::pair<TileData *, int> > history;
+        TileStore::collect_history(history);
+        for (size_t i = 0; i < history.size(); ++i) {
+            if (history[i].second > max_owner) {
+                continue;
+            }
+            TileData *d = history[i].first;
+            bool done = spill
+                ? tile_data_swap_out(d, scratch, scratch_size, retired)
+                : tile_data_pack(d, scratch, scratch_size, retired);
+            if (done) {
+                n++;
+            }
+        }
+    }
+    free(scratch);
+    for (size_t i = 0; i < retired.size(); ++i) {
+        Py_DECREF(retired[i]);
+    }
+    return n;
+}
+
+
+int
+tile_history_compress(int max_owner)
+{
+    return tile_history_shrink(max_owner, false);
+}
+
+
+int
+tile_history_spill(int max_owner)
+{
+    return tile_history_shrink(max_owner, true);
+}
+
+
+// Painting threads
+
+void
+tile_painting_begin()
+{
+    tile_painting_count++;
+}
+
+
+void
+tile_painting_end()
+{
+    assert(tile_painting_count > 0);
+    tile_painting_count--;
+    if (tile_painting_count > 0 || tile_swap_prefetch_pending.empty()) {
+        return;
+    }
+    std::vector<TileSwapPrefetch> pending;
+    pending.swap(tile_swap_prefetch_pending);
+    for (size_t i = 0; i < pending.size(); ++i) {
+        const TileSwapPrefetch &p = pending[i];
+        tile_swap_prefetch(p.x, p.y, p.w, p.h, p.mipmap_level);
+    }
+}
+
+
+// Deduplication
+
+void
+tile_dedup_configure(bool enabled)
+{
+    tile_dedup_enabled = enabled;
+}
+
+
+PyObject *
+tile_dedup_stats()
+{
+    return Py_BuildValue(
+        "{s:O,s:l,s:l,s:n,s:l,s:n}",
+        "enabled", tile_dedup_enabled ? Py_True : Py_False,
+        "hashed", tile_dedup_hashed,
+        "hits", tile_dedup_hits,
+        "saved_bytes", (Py_ssize_t)(tile_dedup_freed * TILE_BUFFER_BYTES),
+        "collisions", tile_dedup_collisions,
+        "indexed", (Py_ssize_t)tile_dedup_index.size()
+    );
+}
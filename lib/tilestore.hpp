@@ -0,0 +1,337 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2017 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TILESTORE_HPP
+#define TILESTORE_HPP
+
+#include <Python.h>
+#include <stdint.h>
+#include <vector>
+#include <set>
+#include <utility>
+
+
+// Tile buffers: NxNx4 uint16 pixel memory, carved out of large slabs and
+// recycled through per-thread free lists. Buffers are aligned to 64 bytes.
+
+#ifndef SWIG
+
+uint16_t *tile_buffer_alloc(bool zeroed);
+void tile_buffer_free(uint16_t *buf);
+
+#endif // SWIG
+
+
+// Returns a new NxNx4 uint16 numpy array backed by a tile buffer, which
+// is returned to the pool when the array is deallocated. If copy_from is
+// an array of the same shape, its data is copied into the new array,
+// otherwise the new array is zeroed.
+
+PyObject *tile_buffer_new_rgba16(PyObject *copy_from);
+
+// Like tile_buffer_new_rgba16(), but the contents are left uninitialized.
+
+PyObject *tile_buffer_empty_rgba16();
+
+// Returns a dict of pool statistics. "hits" counts allocations which
+// reused a free buffer, and "misses" those which needed a new slab.
+
+PyObject *tile_buffer_pool_stats();
+
+// Returns the calling thread's free buffers to the shared list. Threads
+// which allocate tile buffers should call this before they exit, or
+// their free buffers are lost to the pool.
+
+void tile_buffer_pool_release_thread();
+
+
+#ifndef SWIG
+struct TileData;
+#endif
+
+
+// Compression of cold tiles.
+//
+// Tiles which haven't been used for idle_ticks calls to
+// tile_compression_tick() are compressed while the memory used by
+// uncompressed tile data in stores is over budget_mib. An idle_ticks of 0
+// turns compression off, which is the default.
+
+void tile_compression_configure(int idle_ticks, double budget_mib);
+
+// Advances the tile clock and compresses cold tiles in all stores.
+// Returns the number of tiles compressed.
+
+int tile_compression_tick();
+
+// Returns a dict of compression statistics. "raw_bytes" is the memory
+// used by uncompressed tile data in stores, which the budget applies to.
+
+PyObject *tile_compression_stats();
+
+
+// Tile file records (see lib/tilefile.py).
+//
+// tile_record_compress() compresses an NxNx4 uint16 tile array with
+// LZ4, like cold tiles are, and returns the result as a string.
+// tile_record_decompress() decodes one into a new array backed by a tile
+// buffer, and raises ValueError unless the data decodes to exactly one
+// tile. Pixels are in native byte order.
+
+PyObject *tile_record_compress(PyObject *rgba);
+PyObject *tile_record_decompress(PyObject *data);
+
+
+// Tile swap file, for documents bigger than memory.
+//
+// Once a swap file is open and a budget is set, tile_swap_evict() moves
+// the least recently used tile data out to the file while tiles use more
+// than budget_mib of memory. Swapped out tiles are read back in when
+// they're requested. A budget of 0 turns eviction off, which is the
+// default. Swapping isn't available on Windows.
+
+// Creates and opens the swap file. Only one is used per process: returns
+// true if one is open already. The file is unlinked straight away.
+
+bool tile_swap_open(const char *path);
+
+void tile_swap_configure(double budget_mib);
+
+// Swaps out tile data until memory use is within budget. Returns the
+// number of tiles swapped out.
+
+int tile_swap_evict();
+
+// Marks the tiles in a rectangle of model pixels as recently used, so
+// they won't be evicted, and asks for any swapped out ones to be paged
+// in ahead of time. Only stores for the given mipmap level are affected.
+// While a thread is painting, the request is kept until it finishes.
+
+void tile_swap_prefetch(int x, int y, int w, int h, int mipmap_level);
+
+// Returns a dict of swap file statistics.
+
+PyObject *tile_swap_stats();
+
+
+// Painting threads.
+//
+// A thread painting with the GIL released holds on to the tile memory it
+// asked for until its end_atomic() (see lib/paintingthread.py). Between
+// these calls, compression, swapping, and the undo history functions
+// below leave all tiles alone, and swap prefetches wait. Calls nest,
+// and must be balanced. Call both with the GIL held.
+
+void tile_painting_begin();
+void tile_painting_end();
+
+
+// Deduplication of tile data.
+//
+// When enabled, tile data which can't be written to any more is hashed,
+// once, when it's frozen or a snapshot shares it. Identical data is then
+// shared between entries, across all stores, as if by a snapshot. Off by
+// default.
+
+void tile_dedup_configure(bool enabled);
+
+// Returns a dict of deduplication statistics. "hits" counts entries that
+// were pointed at identical data, and "saved_bytes" the memory of the
+// duplicates this freed, in total since startup.
+
+PyObject *tile_dedup_stats();
+
+
+// Undo history.
+//
+// Stores holding snapshots for the undo history are tagged with a
+// positive owner number, which is higher for more recent history (see
+// TileStore::set_owner()). Tile data which is only used by tagged stores
+// belongs to the history, and is counted against the newest owner using
+// it: dropping that owner and all older ones would free it.
+
+// Returns a dict mapping owners to the memory used by the history's
+// tile data they're the newest owner of, in bytes.
+
+PyObject *tile_history_usage();
+
+// Compresses history tile data whose newest owner is max_owner or older.
+// Returns the number of tiles compressed.
+
+int tile_history_compress(int max_owner);
+
+// Moves history tile data whose newest owner is max_owner or older out to
+// the swap file, if one is open. Returns the number of tiles moved.
+
+int tile_history_spill(int max_owner);
+
+
+// Native storage for the tiles of one MyPaintSurface.
+//
+// This is an open-addressing hash map keyed by tile coordinates. Each
+// entry can hold a Python tile object (see lib/tiledsurface.py), but
+// tiles created by painting are plain tile buffers until Python asks for
+// them: then they are wrapped in Python tile objects using tile_factory.
+//
+// Tile data is reference counted, and shared with snapshots of the
+// store, or identical tiles elsewhere (see tile_dedup_configure()).
+// Taking a snapshot just copies the table, and writers copy any shared
+// tile before changing it. Cold tile data may be compressed: see
+// tile_compression_tick(), and cold tiles may be swapped out: see
+// tile_swap_evict().
+//
+// The request() method is used by the C++ half of the surface (see
+// pythontiledsurface.cpp) to implement tile requests for the brush
+// engine without calling into Python. It returns NULL for the rare cases
+// which Python has to handle, e.g. tiles whose pixels are loaded lazily.
+//
+// The other public methods are the backend of lib.tiledsurface._TileDict,
+// and must be called with the GIL held.
+
+class TileStore
+{
+public:
+    TileStore(PyObject *tile_factory,
+              PyObject *mipmap_dirty_tile,
+              PyObject *transparent_rgba);
+    ~TileStore();
+
+    // Mapping API, for _TileDict
+    PyObject *get(int tx, int ty);    // returns None if there's no tile
+    void set(int tx, int ty, PyObject *tile,
+             PyObject *rgba, bool readonly);
+    bool remove(int tx, int ty);
+    bool contains(int tx, int ty);
+    int size();
+    void clear();
+    PyObject *keys();
+    PyObject *items();
+
+    // Makes tiles read-only for good, even once they're no longer shared
+    void freeze(int tx, int ty);
+    void freeze_all();
+
+    // Snapshots: new stores sharing this store's tile data.
+    TileStore *snapshot();
+    // Replaces the contents with a snapshot's, returning changed positions
+    PyObject *restore(TileStore *sshot);
+    // Returns the positions whose tiles differ from another store's
+    PyObject *diff(TileStore *other);
+    // Shares a tile of another store at (tx, ty), or removes it there
+    void share(int tx, int ty, TileStore *src, int src_tx, int src_ty);
+
+    // Identity of a tile's data, as a positive integer, or 0 if there's no
+    // tile. It changes whenever the tile is replaced, or copied before a
+    // write, but not when the data is shared, wrapped, compressed or
+    // swapped out. Frozen data keeps its pixels for as long as its id.
+    PyObject *data_id(int tx, int ty);
+    // The data ids of all tiles, as a dict keyed by position
+    PyObject *data_ids();
+
+    // Journal of the positions written to, for incremental autosaves.
+    // Returns the positions written since the last call as a list, then
+    // starts over. None is returned by the first call, and if more than
+    // max_tiles positions were written: then any tile may have changed.
+    PyObject *take_journal(int max_tiles);
+    // Records a write Python made to a tile's pixels in place
+    void mark_written(int tx, int ty);
+
+    // Mipmaps
+    void set_mipmap(TileStore *mipmap);
+    void mark_mipmap_dirty(int tx, int ty);
+
+    // Tags the store as part of the undo history: see tile_history_usage().
+    // Owner 0, the default, means the store isn't part of the history.
+    void set_owner(int owner);
+
+    // Repeating surfaces wrap tile coordinates. Sizes are in tiles.
+    void set_looped(int looped_tw, int looped_th);
+
+    // While a deferred load is pending, requests are handled by Python.
+    void set_load_pending(bool pending);
+
+    // Tile request, returning a numpy array or None (Python must handle it)
+    PyObject *request_rgba(int tx, int ty, bool readonly);
+
+#ifndef SWIG
+    // Tile request, returning pixel memory or NULL (Python must handle it).
+    // Does not call Python. Callers serialize access to the store.
+    uint16_t *request(int tx, int ty, bool readonly);
+
+    // Records the array Python returned for a lazily loaded tile. Runs
+    // Python, so call it with the GIL, outside the request critical
+    // section: it takes that itself.
+    void adopt_rgba(int tx, int ty, PyObject *rgba);
+
+    // Releases Python objects left behind by request()
+    void release_retired();
+
+    // Compresses this store's cold tiles, for tile_compression_tick()
+    int compress_cold(char *scratch, int scratch_size);
+
+    // Marks a rectangle of tiles as used, for tile_swap_prefetch()
+    void prefetch(int tx0, int ty0, int tx1, int ty1);
+
+    // Lists the undo history's tile data with its newest owner
+    static void collect_history(std::vector<std::pair<TileData *, int> > &out);
+#endif // SWIG
+
+private:
+    struct Entry;
+
+    Entry *find(int tx, int ty);
+    Entry *insert(int tx, int ty);
+    void erase(Entry *e);
+    void grow();
+    void retire(Entry *e);
+    void release_own_retired();
+    bool wrap(TileData *d);
+    bool dedup(Entry *e);
+    void dedup_all();
+    bool copy_entries_from(const TileStore *src);
+    void set_mipmap_dirty(int tx, int ty);
+    void wrap_coords(int &tx, int &ty);
+    void journal_add(int tx, int ty);
+
+    Entry *entries;
+    int capacity;   // always a power of two
+    int used;       // live entries
+    int filled;     // live and deleted entries
+
+    std::vector<PyObject *> retired;
+
+    PyObject *tile_factory;
+    PyObject *mipmap_dirty_tile;
+    PyObject *transparent_rgba;
+    uint16_t *transparent_buf;
+
+    TileStore *mipmap;
+    int mipmap_level;
+    int looped_tw;
+    int looped_th;
+    bool load_pending;
+    bool is_snapshot;
+    int owner;
+
+    bool journal_on;
+    bool journal_overflowed;
+    int journal_max;
+    std::set<std::pair<int, int> > journal;
+
+    // All live stores are linked together, for compress_cold()
+    // and swapping
+    TileStore *prev_store;
+    TileStore *next_store;
+    friend int tile_compression_tick();
+    friend int tile_swap_evict();
+    friend void tile_swap_prefetch(int, int, int, int, int);
+};
+
+
+#endif //TILESTORE_HPP
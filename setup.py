@@ -95,12 +95,33 @@ class Build (build):
 
 
 class BuildExt (build_ext):
-    """Custom build_ext (extra --debug flags)."""
+    """Custom build_ext (extra --debug and --tile-size flags)."""
+
+    user_options = build_ext.user_options + [
+        ("tile-size=", None,
+         "tile edge length in pixels "
+         "(needs a patched libmypaint: see BUILDING.md)"),
+    ]
+
+    def initialize_options(self):
+        build_ext.initialize_options(self)
+        self.tile_size = None
+
+    def finalize_options(self):
+        build_ext.finalize_options(self)
+        if self.tile_size is not None:
+            self.tile_size = int(self.tile_size)
 
     def build_extension(self, ext):
         ccflags = ext.extra_compile_args
         linkflags = ext.extra_link_args
 
+        if self.tile_size:
+            ccflags.extend([
+                "-DMYPAINTLIB_TILE_SIZE=%d" % (self.tile_size,),
+                "-DMYPAINT_TILE_SIZE=%d" % (self.tile_size,),
+            ])
+
         if self.debug:
             for flag in ["-DNDEBUG"]:
                 if flag in ccflags:
@@ -497,6 +518,8 @@ def get_ext_modules():
             "pygobject-3.0",
             "glib-2.0",
             "libpng",
+            "libjpeg",
+            "liblz4",
             "lcms2",
             "gtk+-3.0",
             "libmypaint",
@@ -524,6 +547,10 @@ def get_ext_modules():
             'lib/gdkpixbuf2numpy.cpp',
             'lib/pixops.cpp',
             'lib/fastpng.cpp',
+            'lib/fastjpeg.cpp',
+            'lib/tilestore.cpp',
+            'lib/strokecodec.cpp',
+            'lib/motionqueue.cpp',
             'lib/brushsettings.cpp',
         ],
         swig_opts=mypaintlib_swig_opts,
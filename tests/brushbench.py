@@ -0,0 +1,196 @@
+#!/usr/bin/env python
+# This file is part of MyPaint.
+# Copyright (C) 2017 by the MyPaint Development Team.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+"""Brush engine throughput benchmark, over all the shipped brushes.
+
+Replays the recorded input in painting30sec.dat with each brush in
+brushes/, onto a fresh surface, the way interactive painting does: one
+atomic section per input event. No GUI is needed. Results are written
+as JSON, one entry per brush:
+
+* "ms": time taken to paint the whole stroke, in milliseconds
+* "max_event_ms": the slowest single event, in milliseconds
+* "dabs", "dabs_per_s": dabs drawn, and their rate
+* "tile_requests", "tile_misses": requests made by the brush engine,
+  and how many of those weren't answered by the request cache. All
+  painting here happens in atomic sections, where the cache is used.
+* "peak_tiles": the most tiles used in one atomic section
+* "tiles": tiles on the surface afterwards
+
+Times are the best of --repeat runs. Counts come from the last run.
+
+"""
+
+# Imports:
+
+from __future__ import division, print_function
+
+from os.path import join, relpath, splitext
+from optparse import OptionParser
+import fnmatch
+import json
+import os
+import sys
+import time
+
+import numpy as np
+
+import paths
+from lib import mypaintlib
+from lib import tiledsurface
+from lib import brush
+
+
+# Helpers:
+
+def load_events(scale=1.0):
+    """Loads the recorded input, as rows for PythonBrush.stroke_to()
+
+    :param float scale: scale factor for positions
+    :returns: Nx6 array of (dtime, x, y, pressure, xtilt, ytilt)
+    :rtype: numpy.ndarray
+
+    """
+    events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+    rows = np.zeros((len(events), 6), dtype='float64')
+    rows[1:, 0] = np.diff(events[:, 0])
+    rows[:, 1:3] = events[:, 1:3] * scale
+    rows[:, 3] = events[:, 3]
+    return rows
+
+
+def find_brushes(patterns=()):
+    """Lists the shipped brushes, optionally filtered
+
+    :param list patterns: shell wildcards, like "classic/*"
+    :returns: sorted list of brush names, relative to brushes/
+    :rtype: list
+
+    """
+    brushes_dir = join(paths.TOP_DIR, 'brushes')
+    names = []
+    for dirpath, dirnames, filenames in os.walk(brushes_dir):
+        for filename in filenames:
+            if not filename.endswith('.myb'):
+                continue
+            name = splitext(relpath(join(dirpath, filename), brushes_dir))
+            names.append(name[0])
+    if patterns:
+        names = [n for n in names
+                 if any(fnmatch.fnmatch(n, p) for p in patterns)]
+    return sorted(names)
+
+
+def paint(brushinfo, rows):
+    """Paints one stroke onto a new surface
+
+    :returns: the surface, total seconds, and slowest event in seconds
+    :rtype: tuple
+
+    """
+    surf = tiledsurface.Surface()
+    backend = surf.backend
+    b = brush.Brush(brushinfo)
+    total = 0.0
+    slowest = 0.0
+    for dtime, x, y, pressure, xtilt, ytilt in rows:
+        t0 = time.time()
+        surf.begin_atomic()
+        b.stroke_to(backend, x, y, pressure, xtilt, ytilt, dtime)
+        surf.end_atomic()
+        dt = time.time() - t0
+        total += dt
+        slowest = max(slowest, dt)
+    return surf, total, slowest
+
+
+def bench_brush(name, rows, repeat=1):
+    """Benchmarks one brush
+
+    :param str name: brush name, relative to brushes/
+    :param rows: input events, see load_events()
+    :param int repeat: number of runs to take the best time from
+    :returns: results for the brush
+    :rtype: dict
+
+    """
+    myb_path = join(paths.TOP_DIR, 'brushes', name + '.myb')
+    with open(myb_path, "r") as fp:
+        bi = brush.BrushInfo(fp.read())
+    bi.set_color_rgb((0.0, 0.9, 1.0))
+    best = None
+    for i in xrange(max(1, repeat)):
+        surf, total, slowest = paint(bi, rows)
+        if best is None or total < best[0]:
+            best = (total, slowest)
+    total, slowest = best
+    stats = surf.backend.get_paint_stats()
+    result = {
+        "ms": total * 1000,
+        "max_event_ms": slowest * 1000,
+        "dabs_per_s": stats["dabs"] / total if total > 0 else 0.0,
+        "tiles": len(surf.get_tiles()),
+    }
+    result.update(stats)
+    return result
+
+
+# Main:
+
+def main(argv):
+    parser = OptionParser('usage: %prog [options] [brush patterns ...]')
+    parser.add_option(
+        '-o',
+        '--output',
+        metavar='FILE',
+        help='write the JSON results to FILE, not stdout',
+    )
+    parser.add_option(
+        '-r',
+        '--repeat',
+        type='int',
+        default=1,
+        help='time each brush this many times, and keep the best',
+    )
+    parser.add_option(
+        '-s',
+        '--scale',
+        type='float',
+        default=1.0,
+        help='scale the recorded input by this factor',
+    )
+    options, patterns = parser.parse_args(argv[1:])
+
+    rows = load_events(options.scale)
+    results = {}
+    for name in find_brushes(patterns):
+        try:
+            results[name] = bench_brush(name, rows, options.repeat)
+        except Exception as e:
+            results[name] = {"error": str(e)}
+        print(name, file=sys.stderr)
+
+    report = {
+        "events": len(rows),
+        "scale": options.scale,
+        "repeat": options.repeat,
+        "tile_size": mypaintlib.TILE_SIZE,
+        "brushes": results,
+    }
+    if options.output:
+        with open(options.output, "w") as fp:
+            json.dump(report, fp, indent=2, sort_keys=True)
+    else:
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        print()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -10,6 +10,9 @@ import sys
 import os
 import tempfile
 import shutil
+import zipfile
+import threading
+import gc
 
 import numpy as np
 
@@ -17,7 +20,13 @@ import paths
 from lib import mypaintlib
 from lib import tiledsurface
 from lib import brush
+from lib import brushsettings
 from lib import document
+from lib import helpers
+import lib.command
+import lib.stroke
+import lib.tilefile
+import lib.pixbuf
 
 
 N = mypaintlib.TILE_SIZE
@@ -44,6 +53,68 @@ class TileConversions (unittest.TestCase):
         mypaintlib.tile_convert_rgba16_to_rgba8(src, dst)
         self.assertTrue((dst[:, :, 3] == 255).all(), msg="Not fully opaque")
 
+    def test_8bit_surface(self):
+        """8-bit surfaces composite like 15-bit ones, at half the size"""
+        arr = np.random.randint(0, 256, (2*N, 2*N, 4)).astype('uint8')
+        s16 = tiledsurface.Surface()
+        s8 = tiledsurface.Surface8()
+        for s in (s16, s8):
+            s.load_from_numpy(arr, 0, 0)
+        t8 = s8.tiledict[(1, 1)]
+        self.assertEqual(t8.rgba.dtype, np.uint8)
+        self.assertEqual(t8.rgba.nbytes, N * N * 4)
+        for mode in (mypaintlib.CombineNormal, mypaintlib.CombineMultiply):
+            for tx, ty in s16.get_tiles():
+                dst16 = np.zeros((N, N, 4), 'uint16')
+                dst8 = np.zeros((N, N, 4), 'uint16')
+                s16.composite_tile(dst16, True, tx, ty, mode=mode)
+                s8.composite_tile(dst8, True, tx, ty, mode=mode)
+                diff = np.abs(dst16.astype(int) - dst8).max()
+                self.assertLessEqual(diff, (1 << 15) // 255)
+
+        # Snapshots convert between the two kinds of surface
+        p16 = tiledsurface.Surface()
+        p16.load_snapshot(s8.save_snapshot())
+        self.assertEqual(p16.tiledict[(1, 1)].rgba.dtype, np.uint16)
+        with p16.tile_request(1, 1, readonly=True) as rgba:
+            with s8.tile_request(1, 1, readonly=True) as rgba8:
+                self.assertTrue((rgba == rgba8).all())
+
+
+class TileBuffers (unittest.TestCase):
+    """Test the tile buffer pool."""
+
+    def test_pool_reuse(self):
+        """Freed tile buffers are reused, zeroed if asked"""
+        tile = mypaintlib.tile_buffer_empty_rgba16()
+        self.assertEqual(tile.shape, (N, N, 4))
+        self.assertEqual(tile.dtype, np.uint16)
+        self.assertEqual(tile.ctypes.data % 64, 0)
+        tile[...] = 1
+        del tile
+        stats0 = mypaintlib.tile_buffer_pool_stats()
+        tiles = [mypaintlib.tile_buffer_new_rgba16(None) for i in range(8)]
+        self.assertFalse(any(t.any() for t in tiles))
+        stats1 = mypaintlib.tile_buffer_pool_stats()
+        allocs = ((stats1["hits"] + stats1["misses"]) -
+                  (stats0["hits"] + stats0["misses"]))
+        self.assertEqual(allocs, 8)
+        self.assertGreaterEqual(stats1["hits"] - stats0["hits"], 1)
+
+    def test_release_thread(self):
+        """Threads hand their free buffers back to the shared list"""
+        def work():
+            tiles = [mypaintlib.tile_buffer_new_rgba16(None)
+                     for i in range(40)]
+            del tiles[:]
+            mypaintlib.tile_buffer_pool_release_thread()
+        stats0 = mypaintlib.tile_buffer_pool_stats()
+        thread = threading.Thread(target=work)
+        thread.start()
+        thread.join()
+        stats1 = mypaintlib.tile_buffer_pool_stats()
+        self.assertGreaterEqual(stats1["shared_free"], stats0["shared_free"])
+
 
 class Painting (unittest.TestCase):
     """Tests basic painting functionality."""
@@ -74,6 +145,83 @@ class Painting (unittest.TestCase):
         s.save_as_png('test_directPaint.png')
         print('%0.4fs, ' % (time() - t0,), end="", file=sys.stderr)
 
+    def test_draw_dabs(self):
+        """Drawing a dab array matches drawing dab by dab"""
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        dabs = np.zeros(len(events), dtype=tiledsurface.DAB_DTYPE)
+        t, dabs["x"], dabs["y"], dabs["opaque"] = events.T
+        dabs["radius"] = 12
+        dabs["color_r"] = 0.4 * (1.0 + np.sin(t))
+        dabs["color_g"] = dabs["color_b"] = 0.5 * (1.0 + np.sin(t))
+        dabs["hardness"] = 0.6
+        dabs["alpha_eraser"] = dabs["aspect_ratio"] = 1.0
+
+        s1 = tiledsurface.Surface()
+        s1.begin_atomic()
+        for d in dabs:
+            s1.draw_dab(d["x"], d["y"], d["radius"],
+                        d["color_r"], d["color_g"], d["color_b"],
+                        d["opaque"], d["hardness"])
+        s1.end_atomic()
+
+        s2 = tiledsurface.Surface()
+        t0 = time()
+        self.assertGreater(s2.draw_dabs(dabs), 0)
+        print('%0.4fs, ' % (time() - t0,), end="", file=sys.stderr)
+
+        self.assertEqual(set(s1.get_tiles()), set(s2.get_tiles()))
+        for tx, ty in s1.get_tiles():
+            with s1.tile_request(tx, ty, readonly=True) as rgba1:
+                with s2.tile_request(tx, ty, readonly=True) as rgba2:
+                    self.assertTrue((rgba1 == rgba2).all())
+
+    def test_get_colors(self):
+        """Sampling many places matches sampling one by one"""
+        s = tiledsurface.Surface()
+        s.begin_atomic()
+        for i in xrange(4):
+            s.draw_dab(i * N, N, N // 2, i / 4, 0.5, 1.0, 1.0, 1.0)
+        s.end_atomic()
+        samples = [(x, y, r) for x in xrange(-N, 4 * N, N // 3)
+                   for y in (N // 2, N, 3 * N // 2) for r in (1, 4)]
+        colors = s.get_colors(samples)
+        alphas = s.get_alphas(samples)
+        self.assertEqual(colors.shape, (len(samples), 4))
+        for (x, y, r), rgba, alpha in zip(samples, colors, alphas):
+            self.assertTrue(np.allclose(rgba, s.get_color(x, y, r)))
+            self.assertAlmostEqual(alpha, s.get_alpha(x, y, r))
+        # Big radii pick mipmap levels by the same rule either way
+        big = [(N, N, 4 * N), (2 * N, N, N), (N, N // 2, N // 4)]
+        try:
+            document.set_mipmap_sampling(N // 4)
+            colors = s.get_colors(big)
+            for sample, rgba in zip(big, colors):
+                self.assertTrue(np.allclose(rgba, s.get_color(*sample)))
+        finally:
+            document.set_mipmap_sampling(0)
+
+    def test_mipmap_get_color(self):
+        """Large color samples from mipmaps are close to exact ones"""
+        s = tiledsurface.Surface()
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        s.begin_atomic()
+        for t, x, y, pressure in events:
+            r = g = b = 0.5 * (1.0 + np.sin(t))
+            s.draw_dab(x, y, 12, r * 0.8, g, b, pressure, 0.6)
+        s.end_atomic()
+        x0, y0, w, h = s.get_bbox()
+        samples = [(x0 + w * i / 4, y0 + h * j / 4, radius)
+                   for i in xrange(1, 4) for j in xrange(1, 4)
+                   for radius in (50, 100, 200)]
+        exact = [s.get_color(*sample) for sample in samples]
+        try:
+            document.set_mipmap_sampling(32)
+            approx = [s.get_color(*sample) for sample in samples]
+        finally:
+            document.set_mipmap_sampling(0)
+        for e, a in zip(exact, approx):
+            self.assertTrue(np.allclose(e, a, atol=0.05), (e, a))
+
     def test_brush_paint(self):
         """30s of painting at 4x with a charcoal brush"""
         s = tiledsurface.Surface()
@@ -101,6 +249,536 @@ class Painting (unittest.TestCase):
 
         s.save_as_png('test_brushPaint.png')
 
+    def test_paint_stats(self):
+        """Surfaces count the dabs and tile requests made painting"""
+        s = tiledsurface.Surface()
+        stats = s.backend.get_paint_stats()
+        self.assertEqual(stats["dabs"], 0)
+        self.assertEqual(stats["tile_requests"], 0)
+        s.begin_atomic()
+        s.draw_dab(10, 10, 5, 1, 0, 0, 1)
+        s.draw_dab(90, 10, 5, 1, 0, 0, 1)
+        s.end_atomic()
+        stats = s.backend.get_paint_stats()
+        self.assertEqual(stats["dabs"], 2)
+        self.assertGreaterEqual(stats["tile_requests"], 2)
+        self.assertLessEqual(stats["tile_misses"], stats["tile_requests"])
+        self.assertEqual(stats["peak_tiles"], len(s.get_tiles()))
+        s.backend.reset_paint_stats()
+        self.assertEqual(s.backend.get_paint_stats()["dabs"], 0)
+        # Requests outside atomic sections don't use the cache at all
+        s.get_color(10, 10, 2)
+        stats = s.backend.get_paint_stats()
+        self.assertGreaterEqual(stats["tile_requests"], 1)
+        self.assertEqual(stats["tile_misses"], 0)
+
+    def test_stroke_to_many(self):
+        """Painting an event array matches painting event by event"""
+        myb_path = join(paths.TESTS_DIR, 'brushes/charcoal.myb')
+        with open(myb_path, "r") as fp:
+            bi = brush.BrushInfo(fp.read())
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        rows = np.zeros((len(events), 6), dtype='float64')
+        rows[1:, 0] = np.diff(events[:, 0])
+        rows[:, 1:4] = events[:, 1:4]
+
+        def paint(batched):
+            s = tiledsurface.Surface()
+            b = brush.Brush(bi)
+            s.begin_atomic()
+            if batched:
+                n, split = b.stroke_to_many(s.backend, rows)
+                self.assertEqual(n, len(rows))
+            else:
+                for dtime, x, y, pressure, xtilt, ytilt in rows:
+                    b.stroke_to(s.backend, x, y, pressure,
+                                xtilt, ytilt, dtime)
+            s.end_atomic()
+            pixels = {}
+            for tx, ty in s.get_tiles():
+                with s.tile_request(tx, ty, readonly=True) as rgba:
+                    pixels[(tx, ty)] = rgba.copy()
+            return pixels
+
+        expected = paint(False)
+        pixels = paint(True)
+        self.assertEqual(set(pixels), set(expected))
+        for pos, rgba in pixels.iteritems():
+            self.assertTrue((rgba == expected[pos]).all())
+
+        s = tiledsurface.Surface()
+        b = brush.Brush(bi)
+        n, split = b.stroke_to_many(s.backend, rows, True)
+        if split:
+            self.assertLessEqual(n, len(rows))
+        else:
+            self.assertEqual(n, len(rows))
+        with self.assertRaises(ValueError):
+            b.stroke_to_many(s.backend, rows[:, :5].copy())
+
+    def test_mapping_lut(self):
+        """Compiled mappings match the piecewise linear curves"""
+        def curve(points, x):
+            (x0, y0), (x1, y1) = points[:2]
+            for p in points[2:]:
+                if x <= x1:
+                    break
+                (x0, y0), (x1, y1) = (x1, y1), p
+            if x0 == x1 or y0 == y1:
+                return y0
+            return (y1 * (x - x0) + y0 * (x1 - x)) / (x1 - x0)
+
+        pressure = [(0.0, 0.0), (0.1, 0.05), (0.35, 0.2), (0.5, 0.6),
+                    (0.5, 0.7), (1.0, 1.0)]
+        speed = [(-1.0, 2.0), (4.0, -3.0), (16.0, 0.5)]
+        m = mypaintlib.MappingWrapper(2)
+        for i, points in enumerate((pressure, speed)):
+            m.set_n(i, len(points))
+            for j, (x, y) in enumerate(points):
+                m.set_point(i, j, x, y)
+
+        data = np.random.RandomState(0).uniform(-2, 20, (10000, 2))
+        data[:1000, 0] = np.linspace(-0.5, 1.5, 1000)
+        expected = [curve(pressure, a) + curve(speed, b) for a, b in data]
+        self.assertTrue(np.allclose(m.calculate_many(data), expected,
+                                    rtol=1e-5, atol=1e-5))
+
+        # Changes are picked up
+        m.set_point(1, 2, 8.0, 0.5)
+        speed[2] = (8.0, 0.5)
+        expected = [curve(pressure, a) + curve(speed, b) for a, b in data]
+        self.assertTrue(np.allclose(m.calculate_many(data), expected,
+                                    rtol=1e-5, atol=1e-5))
+
+        m = mypaintlib.MappingWrapper(1)
+        m.set_n(0, len(pressure))
+        for j, (x, y) in enumerate(pressure):
+            m.set_point(0, j, x, y)
+        xs = np.linspace(0, 1, 101)
+        many = m.calculate_many(xs)
+        for x, y in zip(xs, many):
+            self.assertAlmostEqual(m.calculate_single_input(x), y, places=5)
+        with self.assertRaises(ValueError):
+            m.calculate_many(data)
+
+    def test_motion_queue(self):
+        """Motion queues interpolate, spread out, and batch events"""
+        nan = float("nan")
+        q = mypaintlib.MotionQueue()
+        q.queue_motion(10, 0.0, 0.0, 0.5, 0.0, 0.0)
+        q.queue_motion(20, 1.0, 0.0, nan, nan, nan)
+        q.queue_motion(20, 2.0, 0.0, nan, nan, nan)  # same timestamp
+        q.queue_motion(30, 3.0, 0.0, 0.5, 0.2, 0.0)
+        q.queue_motion(40, 4.0, 0.0, 0.5, 0.2, 0.0)
+        self.assertEqual(q.get_size(), 4)
+        # The first event has no previous one, so it's skipped
+        rows = q.take_stroke_events(0)
+        self.assertEqual(rows.shape, (3, 6))
+        self.assertTrue(np.allclose(rows[:, 0], [0.01, 0.005, 0.005]))
+        self.assertTrue(np.allclose(rows[:, 1], [1.0, 2.0, 3.0]))
+        self.assertTrue(np.allclose(rows[:, 3], 0.5))
+        self.assertTrue(np.all((rows[:2, 4] > 0) & (rows[:2, 4] < 0.2)))
+        self.assertEqual(q.get_size(), 0)
+
+        # Out-of-order times are corrected, and pressure is clamped
+        self.assertFalse(q.queue_motion(35, 5.0, 0.0, 1.5, 0.2, 0.0))
+        q.queue_motion(50, 6.0, 0.0, 0.5, 0.2, 0.0)
+        rows = q.take_stroke_events(1)
+        self.assertEqual(rows.shape, (1, 6))
+        self.assertTrue(np.allclose(rows[0, :4], (0.01, 4.0, 0.0, 0.5)))
+        rows = q.take_stroke_events(1)
+        self.assertTrue(np.allclose(rows[0, :4], (0.005, 5.0, 0.0, 1.0)))
+        q.queue_motion(60, 7.0, 0.0, 0.5, 0.2, 0.0)
+        self.assertEqual(q.get_size(), 1)
+        q.discard()
+        self.assertEqual(q.get_size(), 0)
+
+        # Smoothing trails behind, but doesn't move the pen-down event
+        raw = mypaintlib.MotionQueue()
+        smooth = mypaintlib.MotionQueue()
+        smooth.set_smoothing(20.0)
+        for i in range(10):
+            for qi in (raw, smooth):
+                qi.queue_motion(10 * (i + 1), 10.0 * i, 0.0, 0.5, 0.0, 0.0)
+        raw_rows = raw.take_stroke_events(0)
+        smooth_rows = smooth.take_stroke_events(0)
+        self.assertEqual(raw_rows.shape, smooth_rows.shape)
+        self.assertTrue(np.all(smooth_rows[:, 1] < raw_rows[:, 1]))
+        self.assertTrue(np.all(np.diff(smooth_rows[:, 1]) > 0))
+
+    def test_stroke_encoding(self):
+        """Compact stroke data round trips at float32 precision"""
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        rows = np.zeros((len(events), 6), dtype='float64')
+        rows[1:, 0] = np.diff(events[:, 0])
+        rows[:, 1:4] = events[:, 1:4]
+        rows[:, 4] = 0.3 * np.sin(events[:, 0])
+        data = mypaintlib.stroke_events_encode(rows)
+        self.assertLess(len(data), rows.nbytes // 2)
+        decoded = mypaintlib.stroke_events_decode(data)
+        expected = rows.astype('float32').astype('float64')
+        self.assertTrue((decoded == expected).all())
+        with self.assertRaises(ValueError):
+            mypaintlib.stroke_events_decode(data[:-1])
+
+        # Old strokes can still be read
+        bi = brush.BrushInfo()
+        bi.load_defaults()
+        stroke = lib.stroke.Stroke()
+        stroke.start_recording(brush.Brush(bi))
+        stroke.record_events(rows)
+        stroke.stop_recording()
+        self.assertTrue((stroke.get_events() == expected).all())
+        stroke.stroke_data = '2' + rows.tostring()
+        self.assertTrue((stroke.get_events() == rows).all())
+
+    def test_brush_settings_blob(self):
+        """Brush settings blobs apply all settings in one go"""
+        myb_path = join(paths.TESTS_DIR, 'brushes/charcoal.myb')
+        with open(myb_path, "r") as fp:
+            b1 = brush.Brush(brush.BrushInfo(fp.read()))
+        blob = b1.get_all_as_blob()
+        b2 = mypaintlib.PythonBrush()
+        b2.set_all_from_blob(blob)
+        self.assertEqual(b2.get_all_as_blob(), blob)
+        for setting in brushsettings.settings:
+            self.assertEqual(b1.get_base_value(setting.index),
+                             b2.get_base_value(setting.index))
+        with self.assertRaises(ValueError):
+            b2.set_all_from_blob(blob[:-1])
+        self.assertEqual(b2.get_all_as_blob(), blob)
+
+        # Mapping point counts libmypaint can't take are rejected too.
+        # The first input's count follows the counts and a base value.
+        blank = mypaintlib.PythonBrush().get_all_as_blob()
+        self.assertEqual(blank[8], b"\0")
+        for n in (1, 9):
+            bad = blank[:8] + chr(n) + b"\0" * (n * 8) + blank[9:]
+            with self.assertRaises(ValueError):
+                b2.set_all_from_blob(bad)
+            self.assertEqual(b2.get_all_as_blob(), blob)
+
+    def test_snapshot_copy_on_write(self):
+        """Painting after a snapshot leaves the snapshot's tiles alone"""
+        s = tiledsurface.Surface()
+        s.begin_atomic()
+        s.draw_dab(N // 2, N // 2, 12, 1.0, 0.0, 0.0, 1.0, 1.0)
+        s.end_atomic()
+        before = s.save_snapshot()
+        before_rgba = before.tiledict[(0, 0)].rgba.copy()
+
+        s.begin_atomic()
+        s.draw_dab(N // 2, N // 2, 12, 0.0, 0.0, 1.0, 1.0, 1.0)
+        s.draw_dab(N * 5 // 2, N // 2, 12, 0.0, 0.0, 1.0, 1.0, 1.0)
+        s.end_atomic()
+        after = s.save_snapshot()
+
+        self.assertTrue((before.tiledict[(0, 0)].rgba == before_rgba).all())
+        self.assertIsNot(before.tiledict[(0, 0)], after.tiledict[(0, 0)])
+        self.assertFalse((after.tiledict[(0, 0)].rgba == before_rgba).all())
+        self.assertEqual(set(after.tiledict), set([(0, 0), (2, 0)]))
+
+        # Unchanged tiles are shared between snapshots
+        again = s.save_snapshot()
+        for pos, tile in after.tiledict.iteritems():
+            self.assertIs(again.tiledict[pos], tile)
+
+        s.load_snapshot(before)
+        self.assertEqual(set(s.get_tiles()), set([(0, 0)]))
+        with s.tile_request(0, 0, readonly=True) as rgba:
+            self.assertTrue((rgba == before_rgba).all())
+
+    def test_cold_tile_compression(self):
+        """Cold tiles are compressed, and read back unchanged"""
+        s = tiledsurface.Surface()
+        s.begin_atomic()
+        for i in xrange(8):
+            s.draw_dab(i * N, i * N, 12, 0.9, 0.6, 0.3, 1.0, 1.0)
+        s.end_atomic()
+        expected = {}
+        for tx, ty in s.get_tiles():
+            with s.tile_request(tx, ty, readonly=True) as rgba:
+                expected[(tx, ty)] = rgba.copy()
+        stats0 = mypaintlib.tile_compression_stats()
+        mypaintlib.tile_compression_configure(1, 0.0)
+        try:
+            mypaintlib.tile_compression_tick()
+            mypaintlib.tile_compression_tick()
+        finally:
+            mypaintlib.tile_compression_configure(0, 0.0)
+        stats1 = mypaintlib.tile_compression_stats()
+        self.assertGreater(stats1["compressions"], stats0["compressions"])
+        for (tx, ty), pixels in expected.iteritems():
+            with s.tile_request(tx, ty, readonly=True) as rgba:
+                self.assertTrue((rgba == pixels).all())
+        stats2 = mypaintlib.tile_compression_stats()
+        self.assertGreater(stats2["decompressions"], stats1["decompressions"])
+
+    def test_compression_budget_counts_stored_tiles(self):
+        """Only tile data in stores counts against the memory budget"""
+        gc.collect()
+        stats0 = mypaintlib.tile_compression_stats()
+        scratch = [mypaintlib.tile_buffer_new_rgba16(None) for i in range(4)]
+        stats1 = mypaintlib.tile_compression_stats()
+        self.assertEqual(stats1["raw_bytes"], stats0["raw_bytes"])
+        s = tiledsurface.Surface()
+        with s.tile_request(0, 0, readonly=False) as rgba:
+            rgba[...] = scratch[0]
+        stats2 = mypaintlib.tile_compression_stats()
+        self.assertEqual(stats2["raw_bytes"] - stats0["raw_bytes"],
+                         N * N * 4 * 2)
+
+    @unittest.skipIf(sys.platform == "win32", "no tile swap on Windows")
+    def test_tile_swap(self):
+        """Tiles are swapped out, and read back unchanged"""
+        swap_path = join(self._temp_dir, "tiles.swap")
+        self.assertTrue(mypaintlib.tile_swap_open(swap_path))
+        s = tiledsurface.Surface()
+        s.begin_atomic()
+        for i in xrange(8):
+            s.draw_dab(i * N, 0, 12, 0.2, 0.4, 0.6, 1.0, 1.0)
+        s.end_atomic()
+        expected = {}
+        for tx, ty in s.get_tiles():
+            with s.tile_request(tx, ty, readonly=True) as rgba:
+                expected[(tx, ty)] = rgba.copy()
+        stats0 = mypaintlib.tile_swap_stats()
+        mypaintlib.tile_swap_configure(0.001)
+        try:
+            mypaintlib.tile_swap_evict()
+        finally:
+            mypaintlib.tile_swap_configure(0.0)
+        stats1 = mypaintlib.tile_swap_stats()
+        self.assertGreater(stats1["swap_outs"], stats0["swap_outs"])
+        tiledsurface.prefetch_tiles((0, 0, 8 * N, N))
+        for (tx, ty), pixels in expected.iteritems():
+            with s.tile_request(tx, ty, readonly=True) as rgba:
+                self.assertTrue((rgba == pixels).all())
+        stats2 = mypaintlib.tile_swap_stats()
+        self.assertGreater(stats2["swap_ins"], stats1["swap_ins"])
+
+    def test_tile_dedup(self):
+        """Identical tiles share data, and are copied before painting"""
+        mypaintlib.tile_dedup_configure(True)
+        try:
+            s1 = tiledsurface.Surface()
+            s2 = tiledsurface.Surface()
+            for s in (s1, s2):
+                s.begin_atomic()
+                for i in xrange(4):
+                    s.draw_dab(i * N + N // 2, N // 2, 12,
+                               0.5, 0.5, 0.5, 1.0, 1.0)
+                s.end_atomic()
+            stats0 = mypaintlib.tile_dedup_stats()
+            sshot1 = s1.save_snapshot()
+            sshot2 = s2.save_snapshot()
+            stats1 = mypaintlib.tile_dedup_stats()
+            self.assertGreater(stats1["hits"], stats0["hits"])
+            self.assertGreater(stats1["saved_bytes"], stats0["saved_bytes"])
+            for pos in s1.get_tiles():
+                self.assertIs(s1.tiledict[pos], s2.tiledict[pos])
+
+            # Copy-on-write still keeps the surfaces independent
+            with s2.tile_request(0, 0, readonly=True) as rgba:
+                before = rgba.copy()
+            s1.begin_atomic()
+            s1.draw_dab(N // 2, N // 2, 12, 1.0, 0.0, 0.0, 1.0, 1.0)
+            s1.end_atomic()
+            with s2.tile_request(0, 0, readonly=True) as rgba:
+                self.assertTrue((rgba == before).all())
+            with s1.tile_request(0, 0, readonly=True) as rgba:
+                self.assertFalse((rgba == before).all())
+            self.assertEqual(sshot2.tiledict.changed_tiles(sshot1.tiledict),
+                             [])
+        finally:
+            mypaintlib.tile_dedup_configure(False)
+
+    def test_undo_history_memory(self):
+        """Old history is compressed and spilled, and undo still works"""
+        b = brush.BrushInfo()
+        b.load_defaults()
+        doc = document.Document(b, painting_only=True)
+        stack = doc.command_stack
+
+        def layer_pixels():
+            surface = doc.layer_stack.current._surface
+            pixels = {}
+            for tx, ty in surface.get_tiles():
+                with surface.tile_request(tx, ty, readonly=True) as rgba:
+                    pixels[(tx, ty)] = rgba.copy()
+            return pixels
+
+        states = [layer_pixels()]
+        for k in xrange(8):
+            b.set_color_hsv((k / 8, 1.0, 1.0))
+            cmd = lib.command.Brushwork(doc, doc.layer_stack.current_path)
+            for i in xrange(40):
+                cmd.stroke_to(0.01, i * 4, 2 * N, 1.0, 0.0, 0.0)
+            self.assertTrue(cmd.stop_recording())
+            doc.do(cmd)
+            states.append(layer_pixels())
+
+        use = stack.get_memory_use()
+        self.assertEqual(len(use), 8)
+        self.assertGreater(sum(n for (c, n) in use), 0)
+        stats0 = mypaintlib.tile_compression_stats()
+        stack.reduce_memory_use()
+        stats1 = mypaintlib.tile_compression_stats()
+        self.assertGreater(stats1["compressions"], stats0["compressions"])
+
+        swap_path = join(self._temp_dir, "tiles.swap")
+        if mypaintlib.tile_swap_open(swap_path):
+            stats0 = mypaintlib.tile_swap_stats()
+            stack.memory_budget = 0.001
+            stack.reduce_memory_use()
+            stats1 = mypaintlib.tile_swap_stats()
+            self.assertGreater(stats1["swap_outs"], stats0["swap_outs"])
+
+        for expected in reversed(states[:-1]):
+            doc.undo()
+            pixels = layer_pixels()
+            self.assertEqual(set(pixels), set(expected))
+            for pos, rgba in pixels.iteritems():
+                self.assertTrue((rgba == expected[pos]).all())
+
+    def test_threaded_painting(self):
+        """Brushwork painted on the painting thread matches the UI's"""
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        half = len(events) // 2
+
+        def paint(threaded):
+            b = brush.BrushInfo()
+            b.load_defaults()
+            doc = document.Document(b, painting_only=True)
+            doc.threaded_painting = threaded
+            cmd = lib.command.Brushwork(doc, doc.layer_stack.current_path)
+            t_old = events[0][0]
+            for i, (t, x, y, pressure) in enumerate(events):
+                # Changes made by the UI while the painting thread is
+                # busy only affect what is submitted afterwards.
+                if i == half:
+                    b.set_color_rgb((0.9, 0.1, 0.1))
+                cmd.stroke_to(t - t_old, x, y, pressure, 0.0, 0.0)
+                t_old = t
+            self.assertTrue(cmd.stop_recording())
+            doc.do(cmd)
+            surface = doc.layer_stack.current._surface
+            pixels = {}
+            for tx, ty in surface.get_tiles():
+                with surface.tile_request(tx, ty, readonly=True) as rgba:
+                    pixels[(tx, ty)] = rgba.copy()
+            doc.threaded_painting = False
+            painting_time = cmd._stroke_seq.total_painting_time
+            states = doc.brush.get_states_as_array()
+            return pixels, painting_time, states
+
+        expected, expected_time, expected_states = paint(False)
+        pixels, painting_time, states = paint(True)
+        self.assertEqual(set(pixels), set(expected))
+        for pos, rgba in pixels.iteritems():
+            self.assertTrue((rgba == expected[pos]).all())
+        self.assertGreater(painting_time, 0)
+        self.assertEqual(painting_time, expected_time)
+        self.assertTrue((states == expected_states).all())
+
+    def test_paint_lazily_loaded(self):
+        """Brushwork on resumed and deferred layers, with OpenMP"""
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        src = tiledsurface.Surface()
+        src.begin_atomic()
+        for i in xrange(8):
+            src.draw_dab(i * N, i * N // 2, 40, 0.2, 0.4, 0.8, 1.0, 0.5)
+        src.end_atomic()
+        png_path = 'test_lazyPaint.png'
+        src.save_as_png(png_path)
+        tiles_path = 'test_lazyPaint' + lib.tilefile.SUFFIX
+        task = tiledsurface.TileFileUpdateTask(src, tiles_path)
+        while task():
+            pass
+
+        def paint(s):
+            # Big dabs cover many tiles, which libmypaint renders on
+            # several threads at the end of each atomic section. Their
+            # first requests for each tile need Python to load it.
+            bi = brush.BrushInfo()
+            bi.load_defaults()
+            bi.set_base_value('radius_logarithmic', 3.5)
+            b = brush.Brush(bi)
+            t_old = events[0][0]
+            for t, x, y, pressure in events:
+                s.begin_atomic()
+                b.stroke_to(s.backend, x, y, pressure, 0.0, 0.0, t - t_old)
+                s.end_atomic()
+                t_old = t
+            pixels = {}
+            for tx, ty in s.get_tiles():
+                with s.tile_request(tx, ty, readonly=True) as rgba:
+                    pixels[(tx, ty)] = rgba.copy()
+            return pixels
+
+        def assert_pixels_equal(pixels, expected):
+            self.assertEqual(set(pixels), set(expected))
+            for pos, rgba in pixels.iteritems():
+                self.assertTrue((rgba == expected[pos]).all())
+
+        deferred = tiledsurface.Surface()
+        deferred.load_from_png_deferred(png_path, 0, 0)
+        self.assertTrue(deferred.load_deferred)
+        loaded = tiledsurface.Surface()
+        loaded.load_from_png(png_path, 0, 0)
+        assert_pixels_equal(paint(deferred), paint(loaded))
+
+        resumed = tiledsurface.Surface()
+        resumed.load_from_tile_file(tiles_path)
+        assert_pixels_equal(paint(resumed), paint(src))
+
+    def test_threaded_painting_autosave(self):
+        """Autosaves don't see brushwork the painting thread is doing"""
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        half = len(events) // 2
+
+        def surface_pixels(surface):
+            pixels = {}
+            for tx, ty in surface.get_tiles():
+                with surface.tile_request(tx, ty, readonly=True) as rgba:
+                    pixels[(tx, ty)] = rgba.copy()
+            return pixels
+
+        doc = document.Document()
+        doc.threaded_painting = True
+        cmd = lib.command.Brushwork(doc, doc.layer_stack.current_path)
+        t_old = events[0][0]
+        for t, x, y, pressure in events[:half]:
+            cmd.stroke_to(t - t_old, x, y, pressure, 0.0, 0.0)
+            t_old = t
+
+        # Autosave with brushwork still queued, then keep painting
+        # while the autosave is being written.
+        doc._autosave_dirty = True
+        doc._queue_autosave_writes()
+        layer = doc.layer_stack.current
+        expected = surface_pixels(layer._surface)
+        self.assertTrue(expected)
+        for t, x, y, pressure in events[half:]:
+            cmd.stroke_to(t - t_old, x, y, pressure, 0.0, 0.0)
+            t_old = t
+        doc._autosave_processor.finish_all()
+        self.assertTrue(cmd.stop_recording())
+        doc.do(cmd)
+        doc.threaded_painting = False
+
+        tiles_path = join(
+            doc.cache_dir, document.CACHE_DOC_AUTOSAVE_SUBDIR, "data",
+            layer.autosave_uuid + lib.tilefile.SUFFIX,
+        )
+        loaded = tiledsurface.Surface()
+        loaded.load_from_tile_file(tiles_path)
+        pixels = surface_pixels(loaded)
+        self.assertEqual(set(pixels), set(expected))
+        for pos, rgba in pixels.iteritems():
+            self.assertTrue((rgba == expected[pos]).all())
+        doc.cleanup()
+
 
 class DocPaint (unittest.TestCase):
     """Test document equality after saving and loading."""
@@ -340,6 +1018,249 @@ class DocPaint (unittest.TestCase):
         )
 
 
+class DeferredLoading (unittest.TestCase):
+    """Test that layers loaded from .ora files are decoded on demand"""
+
+    def test_load_ora_deferred(self):
+        """Layers stay undecoded until their tiles are needed"""
+        doc = document.Document()
+        doc.load(join(paths.TESTS_DIR, 'bigimage.ora'))
+        layers = [l for (p, l) in doc.layer_stack.walk()
+                  if hasattr(l, "_surface")]
+        self.assertTrue(layers)
+        for layer in layers:
+            self.assertTrue(layer._surface.load_deferred)
+            self.assertFalse(layer.get_bbox().empty())
+
+        # Tile requests trigger a decode, and the bbox is refined.
+        layer = layers[0]
+        bbox_before = tuple(layer.get_bbox())
+        tiles = layer.get_tile_coords()
+        self.assertFalse(layer._surface.load_deferred)
+        self.assertTrue(tiles)
+        bbox_after = tuple(layer.get_bbox())
+        self.assertTrue(helpers.Rect(*bbox_before).contains(
+            helpers.Rect(*bbox_after)
+        ))
+        doc.cleanup()
+
+
+class IncrementalSave (unittest.TestCase):
+    """Test that unchanged layers are copied, not re-encoded, on save"""
+
+    @classmethod
+    def setUpClass(cls):
+        cls._temp_dir = tempfile.mkdtemp()
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls._temp_dir, ignore_errors=True)
+
+    def _read_member(self, member):
+        with zipfile.ZipFile(member.filename) as z:
+            return z.read(member.storepath)
+
+    def _read_member_raw(self, member):
+        with zipfile.ZipFile(member.filename) as z:
+            info, data = helpers.zipfile_read_raw(z, member.storepath)
+        return (info.compress_type, info.CRC, info.file_size, data)
+
+    def test_zipfile_copy_raw(self):
+        """Entries which would need Zip64 are recompressed instead"""
+        src_path = join(self._temp_dir, 'copy_src.zip')
+        dst_path = join(self._temp_dir, 'copy_dst.zip')
+        small = b"small entry " * 100
+        big = os.urandom(4096) * 4
+        with zipfile.ZipFile(src_path, 'w', zipfile.ZIP_DEFLATED,
+                             allowZip64=True) as z:
+            z.writestr('small', small)
+            z.writestr('big', big)
+        # Pretend the Zip64 limit is smaller than the big entry
+        old_limit = zipfile.ZIP64_LIMIT
+        zipfile.ZIP64_LIMIT = len(big) // 2
+        try:
+            with zipfile.ZipFile(src_path) as src:
+                with zipfile.ZipFile(dst_path, 'w', zipfile.ZIP_STORED,
+                                     allowZip64=True) as dst:
+                    writer = helpers._ZipRawWriter(dst)
+                    self.assertTrue(writer.can_write(src.getinfo('small')))
+                    self.assertFalse(writer.can_write(src.getinfo('big')))
+                    helpers.zipfile_copy_raw(src, 'small', dst, 'a/small')
+                    helpers.zipfile_copy_raw(src, 'big', dst, 'a/big')
+        finally:
+            zipfile.ZIP64_LIMIT = old_limit
+        with zipfile.ZipFile(src_path) as src:
+            with zipfile.ZipFile(dst_path) as dst:
+                self.assertIsNone(dst.testzip())
+                self.assertEqual(dst.read('a/small'), small)
+                self.assertEqual(dst.read('a/big'), big)
+                # Copied as stored, or written again with the same method
+                for name in ('small', 'big'):
+                    info = dst.getinfo('a/' + name)
+                    self.assertEqual(info.compress_type,
+                                     zipfile.ZIP_DEFLATED)
+                self.assertEqual(
+                    helpers.zipfile_read_raw(dst, 'a/small')[1],
+                    helpers.zipfile_read_raw(src, 'small')[1],
+                )
+
+    def test_save_ora_reuses_members(self):
+        """Unchanged layer PNGs are copied byte-for-byte"""
+        doc = document.Document()
+        doc.load(join(paths.TESTS_DIR, 'bigimage.ora'))
+        layers = [l for (p, l) in doc.layer_stack.walk()
+                  if getattr(l, "_orazip_member", None) is not None]
+        self.assertTrue(layers)
+        orig_data = [self._read_member(l._orazip_member) for l in layers]
+        orig_raw = [self._read_member_raw(l._orazip_member) for l in layers]
+
+        filename = join(self._temp_dir, 'incremental.ora')
+        doc.save(filename)
+        for layer, data, raw in zip(layers, orig_data, orig_raw):
+            member = layer._orazip_member
+            self.assertIsNotNone(member)
+            self.assertEqual(member.filename, os.path.realpath(filename))
+            self.assertEqual(self._read_member(member), data)
+            # Copied as stored, not recompressed
+            self.assertEqual(self._read_member_raw(member), raw)
+
+        # Changing a layer means it has to be encoded again
+        changed = layers[0]
+        changed.clear()
+        self.assertIsNone(changed._orazip_member)
+        doc.save(filename)
+        self.assertIsNotNone(changed._orazip_member)
+        for layer, data in zip(layers[1:], orig_data[1:]):
+            self.assertEqual(self._read_member(layer._orazip_member), data)
+        doc.cleanup()
+
+
+class TileFiles (unittest.TestCase):
+    """Test autosave tile files"""
+
+    @classmethod
+    def setUpClass(cls):
+        cls._temp_dir = tempfile.mkdtemp()
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls._temp_dir, ignore_errors=True)
+
+    def _run_task(self, task):
+        while task():
+            pass
+
+    def _assert_surfaces_equal(self, a, b):
+        self.assertEqual(set(a.get_tiles()), set(b.get_tiles()))
+        for tx, ty in a.get_tiles():
+            with a.tile_request(tx, ty, readonly=True) as ta:
+                with b.tile_request(tx, ty, readonly=True) as tb:
+                    self.assertTrue((ta == tb).all())
+
+    def test_incremental_update(self):
+        """Tile files are updated with just the changed tiles"""
+        filename = join(self._temp_dir, "test" + lib.tilefile.SUFFIX)
+        s = tiledsurface.Surface()
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        s.begin_atomic()
+        for t, x, y, pressure in events:
+            s.draw_dab(x, y, 12, 0.3, 0.6, 0.9, pressure, 0.6)
+        s.end_atomic()
+
+        task = tiledsurface.TileFileUpdateTask(s, filename)
+        self._run_task(task)
+        loaded = tiledsurface.Surface()
+        loaded.load_from_tile_file(filename)
+        self._assert_surfaces_equal(s, loaded)
+
+        # Change one tile, and remove another
+        tiles = sorted(s.get_tiles())
+        with s.tile_request(tiles[0][0], tiles[0][1], readonly=False) as t:
+            t[...] = 1 << 15
+        s.tiledict.pop(tiles[-1])
+        task = tiledsurface.TileFileUpdateTask(s, filename,
+                                               task.written_tiles)
+        self.assertEqual(len(task._changed), 1)
+        self.assertEqual(len(task._removed), 1)
+        self._run_task(task)
+        loaded = tiledsurface.Surface()
+        loaded.load_from_tile_file(filename)
+        # Nothing is decoded until it's used
+        for tile in loaded.tiledict.itervalues():
+            self.assertIsNone(tile._rgba)
+        self._assert_surfaces_equal(s, loaded)
+
+    def test_journalled_update(self):
+        """Journalled updates only look at the tiles which changed"""
+        filename = join(self._temp_dir, "journal" + lib.tilefile.SUFFIX)
+        s = tiledsurface.Surface()
+        s.begin_atomic()
+        for i in xrange(20):
+            s.draw_dab(i * N, i * N, 12, 0.9, 0.6, 0.3, 1.0, 1.0)
+        s.end_atomic()
+        self.assertIsNone(s.take_tile_journal())
+        task = tiledsurface.TileFileUpdateTask(s, filename)
+        self._run_task(task)
+
+        s.begin_atomic()
+        s.draw_dab(N/2, N/2, 4, 0.1, 0.2, 0.3, 1.0, 1.0)
+        s.end_atomic()
+        journal = s.take_tile_journal()
+        self.assertEqual(journal, set([(0, 0)]))
+        task = tiledsurface.TileFileUpdateTask(s, filename,
+                                               task.written_tiles,
+                                               journal)
+        self.assertEqual(task._changed, [(0, 0)])
+        self._run_task(task)
+        self.assertEqual(set(task.written_tiles), set(s.get_tiles()))
+        loaded = tiledsurface.Surface()
+        loaded.load_from_tile_file(filename)
+        self._assert_surfaces_equal(s, loaded)
+
+        # Compressing tiles and dropping their wrappers changes nothing
+        mypaintlib.tile_compression_configure(1, 0.0)
+        try:
+            mypaintlib.tile_compression_tick()
+            mypaintlib.tile_compression_tick()
+        finally:
+            mypaintlib.tile_compression_configure(0, 0.0)
+        journal = s.take_tile_journal()
+        self.assertEqual(journal, set())
+        task = tiledsurface.TileFileUpdateTask(s, filename,
+                                               task.written_tiles)
+        self.assertEqual(task._changed, [])
+        self.assertEqual(task._removed, [])
+
+    def test_compact_with_open_reader(self):
+        """Compacting detaches readers, which keep their old tiles"""
+        filename = join(self._temp_dir, "compact" + lib.tilefile.SUFFIX)
+        old = np.zeros((N, N, 4), 'uint16')
+        old[...] = 1 << 14
+        new = np.zeros((N, N, 4), 'uint16')
+        new[...] = 1 << 15
+        w = lib.tilefile.TileFileWriter(filename)
+        w.write_tile(0, 0, old)
+        w.write_tile(1, 0, old)
+        w.close()
+        loaded = tiledsurface.Surface()
+        loaded.load_from_tile_file(filename)
+        w = lib.tilefile.TileFileWriter(filename)
+        w.write_tile(0, 0, new)
+        w.close()
+        size = os.path.getsize(filename)
+        lib.tilefile.compact(filename)
+        self.assertLess(os.path.getsize(filename), size)
+        reader = loaded.tiledict[(0, 0)]._reader
+        self.assertIsNone(reader._mmap)
+        for tx in (0, 1):
+            with loaded.tile_request(tx, 0, readonly=True) as rgba:
+                self.assertTrue((rgba == old).all())
+        reader = lib.tilefile.TileFileReader(filename)
+        self.assertTrue((reader.read_tile(0, 0) == new).all())
+        self.assertTrue((reader.read_tile(1, 0) == old).all())
+        reader.close()
+
+
 class Frame (unittest.TestCase):
     """Test frame saving"""
 
@@ -386,6 +1307,21 @@ class Frame (unittest.TestCase):
             file=sys.stderr,
         )
 
+    def test_save_jpeg(self):
+        """JPEGs are written strip by strip at the frame's size"""
+        doc = document.Document()
+        doc.load(join(paths.TESTS_DIR, 'bigimage.ora'))
+        doc.set_frame_enabled(True)
+        w, h = N*3 + 7, N*2 + 1
+        doc.update_frame(x=-3, y=5, width=w, height=h)
+        for subsampling in (mypaintlib.JPEG_SUBSAMPLING_444,
+                            mypaintlib.JPEG_SUBSAMPLING_422,
+                            mypaintlib.JPEG_SUBSAMPLING_420):
+            doc.save('test_saveJPEG.jpg', quality=85, subsampling=subsampling)
+            pixbuf = lib.pixbuf.load_from_file('test_saveJPEG.jpg')
+            self.assertEqual((pixbuf.get_width(), pixbuf.get_height()),
+                             (w, h))
+
 
 if __name__ == "__main__":
     unittest.main()
@@ -123,6 +123,8 @@ fi
         mingw-w64-$ARCH-gtk3 \
         mingw-w64-$ARCH-json-c \
         mingw-w64-$ARCH-lcms2 \
+        mingw-w64-$ARCH-libjpeg-turbo \
+        mingw-w64-$ARCH-lz4 \
         mingw-w64-$ARCH-python2-cairo \
         mingw-w64-$ARCH-pygobject-devel \
         mingw-w64-$ARCH-python2-gobject \
@@ -50,6 +50,8 @@ install_dependencies() {
         ${PKG_PREFIX}-gtk3 \
         ${PKG_PREFIX}-json-c \
         ${PKG_PREFIX}-lcms2 \
+        ${PKG_PREFIX}-libjpeg-turbo \
+        ${PKG_PREFIX}-lz4 \
         ${PKG_PREFIX}-python2-cairo \
         ${PKG_PREFIX}-pygobject-devel \
         ${PKG_PREFIX}-python2-gobject \